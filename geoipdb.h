@@ -0,0 +1,255 @@
+//
+//  geoipdb.h
+//  geoimport
+//
+//  Reader for the lookup database written by geoimport --emit-db.
+//  Header only, for services that need an address's geoname_id and postal code
+//  without going to Postgres:
+//
+//		GeoipDb db;
+//		GeoipDbResult result;
+//		if( 0==GeoipDbOpen("geoip.bin", &db) ){
+//			if( 1==GeoipDbLookup(&db, "81.2.69.160", &result) ){ ... result.geonameId ... }
+//			GeoipDbClose(&db);
+//		}
+//
+//  The file is mapped read only and used in place, so opening it costs one mmap(),
+//  and it can be shared by every process on the host. Replace it by rename().
+//
+#ifndef GEOIPDB_H
+#define GEOIPDB_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ File layout, in the byte order of the host that wrote it (checked by byteOrder):
+	GeoipDbHeader
+	keys4[nRanges4+1]		first address of each IPv4 network, Eytzinger order (slot 0 unused)
+	entries4[nRanges4+1]	last address, geoname_id and postal code of the network in the same slot
+	keys6[nRanges6+1]		as keys4, for IPv6
+	entries6[nRanges6+1]
+	strings					NUL terminated, each once; offset 0 is the empty string
+ Each section starts on a 64 byte boundary. The Eytzinger (breadth first) order puts the
+ first levels of the binary search in the same few cache lines, and needs no pointers.
+ */
+#define GEOIPDB_MAGIC		"GEOIPDB"
+#define GEOIPDB_VERSION		1
+#define GEOIPDB_BYTE_ORDER	0x01020304
+
+typedef struct GEOIPDBHEADER {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;
+	uint32_t	nRanges4;
+	uint32_t	nRanges6;
+	uint64_t	keys4Offset;
+	uint64_t	entries4Offset;
+	uint64_t	keys6Offset;
+	uint64_t	entries6Offset;
+	uint64_t	stringsOffset;
+	uint64_t	stringsSize;
+} GeoipDbHeader;
+
+// an IPv6 address as two integers, so it compares in two steps.
+typedef struct GEOIPDBKEY6 {
+	uint64_t	hi;
+	uint64_t	lo;
+} GeoipDbKey6;
+
+typedef struct GEOIPDBENTRY4 {
+	uint32_t	last;
+	uint32_t	geonameId;
+	uint32_t	postalCode;		// offset in strings
+} GeoipDbEntry4;
+
+typedef struct GEOIPDBENTRY6 {
+	GeoipDbKey6	last;
+	uint32_t	geonameId;
+	uint32_t	postalCode;
+} GeoipDbEntry6;
+
+typedef struct GEOIPDB {
+	void*					pMapped;
+	size_t					nLength;
+	uint32_t				nRanges4;
+	uint32_t				nRanges6;
+	const uint32_t*			keys4;
+	const GeoipDbEntry4*	entries4;
+	const GeoipDbKey6*		keys6;
+	const GeoipDbEntry6*	entries6;
+	const char*				strings;
+} GeoipDb;
+
+typedef struct GEOIPDBRESULT {
+	uint32_t	geonameId;
+	const char*	postalCode;		// "" if the network has none; valid until GeoipDbClose()
+} GeoipDbResult;
+
+static inline GeoipDbKey6 GeoipDbKey6FromBytes(const unsigned char* pAddress)
+{
+	GeoipDbKey6 key = { 0, 0 };
+	for( int nByte=0; nByte<8; ++nByte )
+	{
+		key.hi = (key.hi << 8) | pAddress[nByte];
+		key.lo = (key.lo << 8) | pAddress[8+nByte];
+	}
+	return key;
+}
+
+static inline int GeoipDbKey6LessEqual(const GeoipDbKey6* pLeft, const GeoipDbKey6* pRight)
+{
+	return (pLeft->hi < pRight->hi) | ((pLeft->hi == pRight->hi) & (pLeft->lo <= pRight->lo));
+}
+
+/*
+ Checks a section of nCount records of nSize bytes lies inside the file.
+ */
+static inline int GeoipDbSectionFits(size_t nLength, uint64_t nOffset, uint64_t nCount, size_t nSize)
+{
+	return (nOffset <= nLength && nCount <= (nLength - nOffset) / nSize) ? 1 : 0;
+}
+
+static inline void GeoipDbClose(GeoipDb* pDb)
+{
+	if( NULL!=pDb->pMapped ){
+		munmap(pDb->pMapped, pDb->nLength);
+	}
+	memset(pDb, 0, sizeof(GeoipDb));
+}
+
+/*
+ Maps the file and checks its header.
+ - Returns 0 if opened, otherwise -1 (with errno set if the file could not be mapped).
+ */
+static inline int GeoipDbOpen(const char* strPath, GeoipDb* pDb)
+{
+	memset(pDb, 0, sizeof(GeoipDb));
+
+	int fdDb = open(strPath, O_RDONLY);
+	if( -1==fdDb ){ return -1; }
+
+	struct stat dbInfo;
+	if( 0!=fstat(fdDb, &dbInfo) || (size_t)dbInfo.st_size < sizeof(GeoipDbHeader) )
+	{
+		close(fdDb);
+		return -1;
+	}
+
+	void* pMapped = mmap(NULL, (size_t)dbInfo.st_size, PROT_READ, MAP_SHARED, fdDb, 0);
+	close(fdDb);
+	if( MAP_FAILED==pMapped ){ return -1; }
+	pDb->pMapped = pMapped;
+	pDb->nLength = (size_t)dbInfo.st_size;
+
+	const GeoipDbHeader* pHeader = (const GeoipDbHeader*)pMapped;
+	const char* pBase = (const char*)pMapped;
+	if( 0!=memcmp(pHeader->magic, GEOIPDB_MAGIC, sizeof(GEOIPDB_MAGIC)) ||
+		GEOIPDB_VERSION!=pHeader->version ||
+		GEOIPDB_BYTE_ORDER!=pHeader->byteOrder ||
+		0==GeoipDbSectionFits(pDb->nLength, pHeader->keys4Offset, (uint64_t)pHeader->nRanges4+1, sizeof(uint32_t)) ||
+		0==GeoipDbSectionFits(pDb->nLength, pHeader->entries4Offset, (uint64_t)pHeader->nRanges4+1, sizeof(GeoipDbEntry4)) ||
+		0==GeoipDbSectionFits(pDb->nLength, pHeader->keys6Offset, (uint64_t)pHeader->nRanges6+1, sizeof(GeoipDbKey6)) ||
+		0==GeoipDbSectionFits(pDb->nLength, pHeader->entries6Offset, (uint64_t)pHeader->nRanges6+1, sizeof(GeoipDbEntry6)) ||
+		0==GeoipDbSectionFits(pDb->nLength, pHeader->stringsOffset, pHeader->stringsSize, 1) ||
+		0==pHeader->stringsSize || '\0'!=pBase[pHeader->stringsOffset + pHeader->stringsSize - 1] )
+	{
+		GeoipDbClose(pDb);
+		return -1;
+	}
+
+	pDb->nRanges4 = pHeader->nRanges4;
+	pDb->nRanges6 = pHeader->nRanges6;
+	pDb->keys4 = (const uint32_t*)(pBase + pHeader->keys4Offset);
+	pDb->entries4 = (const GeoipDbEntry4*)(pBase + pHeader->entries4Offset);
+	pDb->keys6 = (const GeoipDbKey6*)(pBase + pHeader->keys6Offset);
+	pDb->entries6 = (const GeoipDbEntry6*)(pBase + pHeader->entries6Offset);
+	pDb->strings = pBase + pHeader->stringsOffset;
+	return 0;
+}
+
+/*
+ The networks do not overlap, so the one holding an address is the last one starting at
+ or before it. Descending the Eytzinger tree, each step goes right when the key is <= the
+ address; the last such step is found by dropping the trailing left turns (zero bits) and
+ the right turn itself from the final slot. 0 means every network starts after it.
+ */
+static inline size_t GeoipDbLastRightTurn(size_t nSlot)
+{
+	return nSlot >> __builtin_ffsll((long long)nSlot);
+}
+
+/*
+ - address : IPv4 address in host byte order.
+ - Returns 1 and fills pResult if a network holds the address, otherwise 0.
+ */
+static inline int GeoipDbLookup4(const GeoipDb* pDb, uint32_t address, GeoipDbResult* pResult)
+{
+	size_t nSlot = 1;
+	while( nSlot<=pDb->nRanges4 )
+	{
+		// the slots four levels down share a cache line.
+		__builtin_prefetch(pDb->keys4 + 16*nSlot);
+		nSlot = 2*nSlot + (pDb->keys4[nSlot] <= address);
+	}
+	nSlot = GeoipDbLastRightTurn(nSlot);
+	if( 0==nSlot || address > pDb->entries4[nSlot].last ){ return 0; }
+
+	pResult->geonameId = pDb->entries4[nSlot].geonameId;
+	pResult->postalCode = pDb->strings + pDb->entries4[nSlot].postalCode;
+	return 1;
+}
+
+/*
+ - pAddress : the 16 bytes of an IPv6 address, in network byte order.
+ - Returns 1 and fills pResult if a network holds the address, otherwise 0.
+ */
+static inline int GeoipDbLookup6(const GeoipDb* pDb, const unsigned char* pAddress, GeoipDbResult* pResult)
+{
+	GeoipDbKey6 address = GeoipDbKey6FromBytes(pAddress);
+
+	size_t nSlot = 1;
+	while( nSlot<=pDb->nRanges6 )
+	{
+		__builtin_prefetch(pDb->keys6 + 4*nSlot);
+		nSlot = 2*nSlot + GeoipDbKey6LessEqual(&pDb->keys6[nSlot], &address);
+	}
+	nSlot = GeoipDbLastRightTurn(nSlot);
+	if( 0==nSlot || 0==GeoipDbKey6LessEqual(&address, &pDb->entries6[nSlot].last) ){ return 0; }
+
+	pResult->geonameId = pDb->entries6[nSlot].geonameId;
+	pResult->postalCode = pDb->strings + pDb->entries6[nSlot].postalCode;
+	return 1;
+}
+
+/*
+ Looks up an address given as text. An IPv4 mapped IPv6 address (::ffff:a.b.c.d) not
+ in the IPv6 networks is looked up as IPv4, for a file built from the IPv4 Blocks only.
+ - Returns 1 and fills pResult if found, 0 if not, -1 if the text is not an address.
+ */
+static inline int GeoipDbLookup(const GeoipDb* pDb, const char* strAddress, GeoipDbResult* pResult)
+{
+	unsigned char address[16];
+	uint32_t ipv4;
+	if( 1==inet_pton(AF_INET, strAddress, address) )
+	{
+		memcpy(&ipv4, address, 4);
+		return GeoipDbLookup4(pDb, ntohl(ipv4), pResult);
+	}
+	if( 1!=inet_pton(AF_INET6, strAddress, address) ){ return -1; }
+	if( 1==GeoipDbLookup6(pDb, address, pResult) ){ return 1; }
+
+	static const unsigned char mappedPrefix[12] = { 0,0,0,0,0,0,0,0,0,0,0xFF,0xFF };
+	if( 0!=memcmp(address, mappedPrefix, sizeof(mappedPrefix)) ){ return 0; }
+
+	memcpy(&ipv4, address + 12, 4);
+	return GeoipDbLookup4(pDb, ntohl(ipv4), pResult);
+}
+
+#endif /* GEOIPDB_H */
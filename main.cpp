@@ -9,15 +9,38 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <math.h>
 #include <errno.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <new>
+#include <zlib.h>
 #include <dispatch/dispatch.h>
+#include "geoipdb.h"
+#if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+#endif
 #if defined(__linux__)
  #include <bsd/string.h>
+ #include <sys/epoll.h>
+#else
+ #include <poll.h>
 #endif
 
 typedef enum YESNO { NO=0,YES=1 } BOOL;
@@ -36,44 +59,243 @@ static int GetCommandlineOptions(int argc,
 								 const char** strDbName,
 								 const char** strFilename,
 								 const char** strConnxString );
-static char* ReadLine( char** ppCurPos, const char* endPos );
-static const char* AdjustEndPointer(int fdInputFile, const char* pBufferStart, const char* endPos);
 
-static uint32_t ProcessLocations(char* currentPos, const char* endPos, PGconn* PqConn, BOOL* didFail);
-static uint32_t ProcessBlocks(char* currentPos, const char* endPos, PGconn* PqConn, BOOL* didFail);
+class CopyBuffer;
+class LocationDimensions;
+class PostgresConnection;
+class RowBatch;
+typedef struct PARSEDCHUNK ParsedChunk;
+
+/*
+ A geoimport_progress row: the chunk's rows written (or rejected) so far, counted from its first.
+ */
+typedef struct CHUNKCHECKPOINT {
+	off_t		chunkStart;
+	off_t		chunkEnd;
+	uint32_t	nRowsDone;
+	BOOL		isComplete;
+} ChunkCheckpoint;
 
 static BOOL AddLocationToDatabase(const char* geoname_id, const char* continent_code, const char* city_name,
-								  const char* country_iso_code, const char* country_name,
-								  const char* subdivision_1_iso_code, const char* subdivision_1_name,
-								  const char* subdivision_2_iso_code, const char* subdivision_2_name,
-								  PGconn* PqConn);
+								  const char* country_iso_code,
+								  const char* subdivision_1_iso_code,
+								  const char* subdivision_2_iso_code,
+								  PostgresConnection& pgConnx);
 static BOOL AddIPBlockToDatabase(const char* network,
 								  const char* geoname_id,
 								  const char* postal_code,
-								  PGconn* PqConn);
+								  const char* const* extended_fields,
+								  PostgresConnection& pgConnx);
+static BOOL PrepareBulkCopy(FILETYPE fileMode, PGconn* PqConn);
+static BOOL CopyToDatabase(FILETYPE fileMode, const CopyBuffer& copyBuffer, int nPartition, const ChunkCheckpoint* pCheckpoint, PostgresConnection& pgConnx);
+static BOOL AddDimensionsToDatabase(const LocationDimensions& dimensions, PGconn* PqConn);
+static BOOL PrepareStatements(FILETYPE fileMode, PostgresConnection& pgConnx);
+static BOOL AddRowToDatabase(FILETYPE fileMode, const char* const* fields, PostgresConnection& pgConnx);
+static void ReportPipelineFailure(FILETYPE fileMode, const char* const* fields, const char* strError);
+static BOOL ExecuteSql(PGconn* PqConn, const char* strSql);
+static BOOL RunLoadStep(const char* strDbName, const char* strFunction, FILETYPE fileMode, int nWorkers);
+static void UseDeltaTables(void);
+static void UseExtendedBlocks(void);
+static BOOL OpenRelease(const char* strDirectory, FILETYPE* pFileMode);
+static BOOL OpenNextReleaseFile(void);
+static BOOL ValidateRelease(const char* strDbName);
+static BOOL LoadGeonameIds(const char* strDbName);
+static BOOL IsKnownGeonameId(const char* strGeonameId);
+static BOOL LoadGeoipPartitions(const char* strDbName);
+static int GeoipPartitionOf(const char* strNetwork);
+static void AssignPartitionLanes(void);
+static BOOL ApplyDelta(const char* strDbName, FILETYPE fileMode);
+static BOOL RejectRow(FILETYPE fileMode, const char* const* fields, int nFields, const char* strError);
+static BOOL WriteLookupDb(const char* strPath);
+static BOOL BeginCheckpoints(const char* strDbName, const char* strFilename);
+static int LookupInDb(const char* strDbPath, const char* strAddress);
 
 static int InputFile = 0;
+static FILETYPE InputFileMode = IPBLOCKS;
 
 const int OneKB = 1024;
 const int OneMB = OneKB * OneKB;
 
 static off_t	FileTotalSize = 0;
-static off_t	FileBytesRemaining = 0;
+static std::atomic<off_t>	FileBytesRemaining(0);
 
 static uint16_t	NumProcessors = 3;
 
+// -B : the bytes of the file in each chunk, the unit the stages hand on and a transaction's rows by default.
+static uint32_t ChunkSize = OneMB;
+const uint32_t CHUNK_MIN_KB = 64;
+const uint32_t CHUNK_MAX_KB = 65536;
+
+// --huge-pages : map the chunk buffers on huge pages (MAP_HUGETLB), else ask for transparent ones.
+static BOOL HugePagesMode = NO;
+static const char* ChunkBufferPages = "none";
+
+// --parsers : threads splitting the chunks into rows, while -P sets the writers (one connection each).
+// 0 is as many as -P, up to the processors online.
+static uint16_t	NumParsers = 0;
+static uint16_t	NumWriters = 0;
+
+// -P auto : the writers connected are tuned while importing, up to AUTO_MAX_WRITERS.
+// Those above ActiveWriters close their connections and park.
+static BOOL AutoTuneMode = NO;
+const uint16_t AUTO_MAX_WRITERS = 16;
+static std::atomic<uint16_t> ActiveWriters(0);
+
+// --async : this many connections written by one or two event loop threads, each connection
+// pipelining a chunk's statements without a thread waiting on it.
+static uint16_t AsyncConnections = 0;
+const uint16_t ASYNC_MAX_CONNECTIONS = 999;
+const uint16_t ASYNC_CONNECTIONS_PER_LOOP = 32;
+const uint32_t ASYNC_PIPELINE_DEPTH = 256;
+
+// -C : stream each chunk through COPY FROM STDIN instead of a function call per row.
+static BOOL BulkCopyMode = NO;
+
+// -M : map the file and split it into line aligned chunks up front, which the processors
+// claim in turn, rather than read() each chunk on the serial loadFromFileQ.
+static BOOL MappedFileMode = NO;
+
+// --swap : load UNLOGGED staging tables without indexes, then index them and swap them in.
+static BOOL StagedSwapMode = NO;
+
+// --delta : load the file into a delta table, then only apply the rows that differ.
+static BOOL DeltaMode = NO;
+
+// --extended : also write the Blocks columns the basic schema skips (coordinates, accuracy,
+// country ids and flags), parsed here and sent in binary.
+static BOOL ExtendedBlocks = NO;
+
+// --release : the file is a release directory; its Locations file (of --locale) and Blocks files
+// are read in turn by the one reader and written by the same connections, Blocks unchecked.
+static BOOL ReleaseMode = NO;
+static const char* ReleaseLocale = "en";
+
+// The locations' geoname_ids, sorted, loaded once before a Blocks import and only read while it
+// runs: each row's is checked as it is parsed, rather than by the server per row.
+static std::vector<int32_t> GeonameIds;
+static BOOL FilterGeonameIds = NO;
+
+// --partitioned : geoip is partitioned by address (partition_geoip()); each row is copied into its
+// partition, and each writer is given its own run of partitions of the sorted file to fill in order.
+static BOOL PartitionedMode = NO;
+
+/*
+ A leaf partition of geoip, as partition_geoip() recorded it in geoip_partition: it holds the
+ networks from its first address up to the next partition's of the same family.
+ */
+typedef struct GEOIPPARTITION {
+	std::string	strName;
+	BOOL		isIPv6;
+	unsigned char firstAddress[16];	// an IPv4 address in the first 4 bytes, the rest zero
+	std::string	strCopySql;			// COPYGEOIPColumns, into the partition rather than geoip
+	uint16_t	nLane;				// the writer it is copied by, from AssignPartitionLanes()
+} GeoipPartition;
+
+// IPv4 first, each family's in address order.
+static std::vector<GeoipPartition> GeoipPartitions;
+
+// --collapse : each run of contiguous Blocks networks storing the same values is written as the
+// fewest networks covering it. The runs at a chunk's edges are joined across chunks at the end.
+static BOOL CollapseMode = NO;
+static std::atomic<uint64_t> CollapseRowsIn(0);		// the rows parsed
+static std::atomic<uint64_t> CollapseRowsOut(0);	// and the networks they were written as
+
+// How far each chunk is written is recorded in geoimport_progress, in the transaction of its rows.
+// --resume : skip what an interrupted import of the same file (name, size and mtime) committed.
+static BOOL RecordCheckpoints = NO;
+static BOOL ResumeMode = NO;
+static char CheckpointFileName[256];
+static long long FileModifiedTime = 0;
+static off_t ResumedBytes = 0;
+
+// -T : only time the CSV tokenizer over the file, no database.
+static BOOL TokenizerBenchmarkMode = NO;
+
+// The file is a .zip or .gz, inflated as it is imported. --entry picks the .csv in a .zip.
+static BOOL CompressedInput = NO;
+static const char* ZipEntryName = NULL;
+
+// --emit-db : parse a Blocks file into a lookup database file (geoipdb.h), no database is used.
+static const char* EmitDbPath = NULL;
+
+// --sink : where the writers send the rows. Postgres by default; null drops them, to time reading and
+// parsing alone; csv and binary (COPY binary format) write them to --sink-file normalized, as they would be stored.
+typedef enum SINKTYPES { SINK_POSTGRES=0, SINK_NULL, SINK_CSV, SINK_BINARY, SINK_NUM_TYPES } SINKTYPE;
+static SINKTYPE SinkType = SINK_POSTGRES;
+static char SinkFilePath[1024];
+static int SinkFile = 0;
+
+// --lookup : look an address up in the lookup database file given in place of the .csv.
+static const char* LookupAddress = NULL;
+
+// --generate : write a synthetic Blocks or Locations file of n rows, to benchmark with.
+static const char* GenerateFileType = NULL;
+static uint64_t GenerateRows = 0;
+
+// --results : append each run's (or -T benchmark's) figures to this file as a JSON line.
+static char ResultsFilePath[1024];
+
+// --metrics : write the per stage timings to this file as JSON when the import ends.
+static const char* MetricsFilePath = NULL;
+const int PROGRESS_INTERVAL_SECS = 5;
+
+const uint64_t GENERATE_MAX_ROWS = 100000000;
+const uint32_t GENERATE_LOCATIONS_REFERENCED = 50000;
+
+// Statements are prepared once per connection with binary parameters, -S sends the SQL text each row.
+static BOOL UsePreparedStatements = YES;
+
+// -Q : statements each connection queues in pipeline mode before a sync, 0 when not pipelined.
+static uint32_t PipelineDepth = 0;
+
+// -R : rows written per transaction, 0 commits each chunk as one transaction.
+static uint32_t RowsPerCommit = 0;
+
+// --rejects : CSV file the rows the database refused are written to, with the error.
+// One per file type, as the Blocks and Locations rows have different columns (--release).
+static char RejectFilePaths[2][1024];
+static int RejectFiles[2] = { 0, 0 };
+static std::atomic<uint32_t> RejectedRows(0);
+
+// Rows written by all processors, for the rows/sec report.
+static std::atomic<uint64_t> TotalRowsProcessed(0);
+
+// Lines the tokenizer could not split, or with too few fields; these are skipped.
+static std::atomic<uint32_t> MalformedLines(0);
+
 // Used to terminate the worker blocks.
 static volatile BOOL AbortProgram = NO;
 
 static BOOL ReadHeader( int fdInputFile, FILETYPE* pFileMode, uint16_t* pHeaderSize );
+static BOOL MatchHeader( const char* strHeader, FILETYPE* pFileMode );
 static off_t LoadFileBlock( char* pWriteBuffer, const char* endPos, const char** ppOutEndPos, off_t* filePos);
-static uint32_t ProcessFile(FILETYPE fileMode,const char* strDbName,dispatch_queue_t loadFromFileQ,uint16_t procId);
+static BOOL MapInputFile( int fdInputFile, uint16_t nHeaderSize );
+static int RunBenchmarks(FILETYPE fileMode);
+static int GenerateFile(const char* strFilename);
+static void PrintProgress(double elapsedSecs, BOOL isFinal);
+static void WriteMetricsReport(const char* strFilename, double elapsedSecs);
+static void WriteResult(const char* strFormat, ...);
+static std::string JsonString(const char* strValue);
+static off_t ClaimMappedBlock( char** ppStartPos, const char** ppOutEndPos, off_t* filePos, uint16_t* pnLane );
+static BOOL IsCompressedFile( int fdInputFile );
+static BOOL OpenCompressedInput( int fdInputFile, FILETYPE* pFileMode );
+static void StartInflating( void );
+static off_t ClaimInflatedBlock( char** ppStartPos, const char** ppOutEndPos, off_t* filePos );
+static void ReleaseInflatedBlock( char* pBuffer );
 
 
 class PostgresConnection
 {
 	PGconn* m_connx = NULL;
 	
+	// Pipeline mode: statements sent since the last sync, and how many make a batch.
+	uint32_t m_nMaxQueued = 0;
+	uint32_t m_nQueued = 0;
+	uint32_t m_nFailedStatement = 0;	// of the last sync, counted from 1, 0 if none failed
+	
+	// why the last row added failed, for the reject file.
+	std::string m_rowError;
+	
 public:
 	PostgresConnection() {}
 	PostgresConnection(const PostgresConnection&) = delete;
@@ -84,15 +306,403 @@ public:
 	
 	BOOL Connect(const char* strDbName);
 	
-	~PostgresConnection()
+	BOOL Prepare(const char* strStmtName, const char* strSql, int nParams, const Oid* paramTypes);
+	
+	BOOL EnterPipelineMode(uint32_t nMaxQueued);
+	BOOL ExitPipelineMode();
+	BOOL IsPipelined() const { return (m_nMaxQueued>0) ? YES : NO; }
+	BOOL IsPipelineFull() const { return (m_nQueued>=m_nMaxQueued) ? YES : NO; }
+	BOOL QueueParams(const char* strSql, int nParams, const char* const* paramValues,
+					 const int* paramLengths, const int* paramFormats);
+	BOOL QueuePrepared(const char* strStmtName, int nParams, const char* const* paramValues,
+					   const int* paramLengths, const int* paramFormats);
+	BOOL SyncPipeline();
+	uint32_t FailedStatement() const { return m_nFailedStatement; }
+	
+	// the async writers collect each statement's result as it arrives, rather than in SyncPipeline().
+	uint32_t Queued() const { return m_nQueued; }
+	void ResultReceived() { if( m_nQueued>0 ){ --m_nQueued; } }
+	
+	void SetRowError(const char* strError);
+	const char* RowError() const { return m_rowError.c_str(); }
+	
+	BOOL IsOpen() const { return (NULL!=m_connx) ? YES : NO; }
+	
+	void Close()
 	{
 		if( NULL!=m_connx ){
 			::PQfinish(m_connx);
 			m_connx = NULL;
 		}
+		m_nMaxQueued = 0;
+		m_nQueued = 0;
+	}
+	
+	~PostgresConnection()
+	{
+		Close();
+	}
+};
+
+/*
+ Growable buffer holding the COPY text format rows of one file chunk.
+ Fields are tab separated, rows newline terminated and NULL is written as \N.
+ --extended Blocks rows are in the binary format instead: a column count per row,
+ then each value's length (-1 for NULL) and its bytes.
+ */
+class CopyBuffer
+{
+	char*	m_buffer = NULL;
+	size_t	m_used = 0;
+	size_t	m_capacity = 0;
+	
+	BOOL Reserve(size_t nBytes);
+	
+public:
+	CopyBuffer() {}
+	CopyBuffer(const CopyBuffer&) = delete;
+	
+	~CopyBuffer()
+	{
+		free(m_buffer);
+		m_buffer = NULL;
 	}
+	
+	void Reset() { m_used = 0; }
+	const char* Data() const { return m_buffer; }
+	size_t Size() const { return m_used; }
+	
+	BOOL AppendField(const char* value, BOOL isLastField);
+	BOOL AppendBinaryRow(int nColumns);
+	BOOL AppendBinaryField(const char* pValue, int nLength);
+};
+
+/*
+ Distinct countries and subdivisions seen in the Locations file.
+ Each entry is keyed by its joined iso codes and holds the row's column values,
+ so every dimension row is written once rather than checked for each location.
+ When rows disagree on a name the first in the file wins, whatever order the chunks are written in.
+ */
+typedef struct DIMENSIONROW
+{
+	off_t		filePos;	// of the chunk it was first seen in, once merged into Dimensions
+	std::vector<std::string> columns;
+} DimensionRow;
+
+typedef std::unordered_map< std::string, DimensionRow > DimensionSet;
+
+class LocationDimensions
+{
+	DimensionSet m_countries;
+	DimensionSet m_subdivisions1;
+	DimensionSet m_subdivisions2;
+	
+	static void Add(DimensionSet& dimSet, std::vector<std::string>&& columns);
+	static void Merge(DimensionSet& dimSet, const DimensionSet& other, off_t filePos);
+	
+public:
+	LocationDimensions() {}
+	LocationDimensions(const LocationDimensions&) = delete;
+	
+	void AddCountry(const char* iso2_code, const char* name);
+	void AddSubdivision1(const char* iso2_country_code, const char* iso_code, const char* name);
+	void AddSubdivision2(const char* iso2_country_code, const char* subdivision1_iso_code,
+						 const char* iso_code, const char* name);
+	
+	void Merge(const LocationDimensions& other, off_t filePos);
+	void Clear();
+	
+	const DimensionSet& Countries() const { return m_countries; }
+	const DimensionSet& Subdivisions1() const { return m_subdivisions1; }
+	const DimensionSet& Subdivisions2() const { return m_subdivisions2; }
+};
+
+// Dimensions of every Locations chunk committed so far, only touched on DimensionsQ.
+static LocationDimensions Dimensions;
+static dispatch_queue_t DimensionsQ = NULL;
+
+// Serialises writes to the reject file.
+static dispatch_queue_t RejectsQ = NULL;
+
+// Serialises the file sinks' writes, a chunk's rows at a time.
+static dispatch_queue_t SinkFileQ = NULL;
+
+// --collapse : guards the runs held back from the chunks' edges.
+static dispatch_queue_t CollapseQ = NULL;
+
+/*
+ The networks of a Blocks file for --emit-db, keyed by their first address, with the
+ postal codes interned in one string table (offset 0 is the empty string).
+ Each chunk collects its rows, then adds them under LookupDbQ.
+ */
+typedef struct LOOKUPROW {
+	BOOL		isIPv6;
+	GeoipDbKey6	first;		// IPv4 addresses are in lo
+	GeoipDbKey6	last;
+	uint32_t	geonameId;
+	const char*	postalCode;	// points into the chunk
+} LookupRow;
+
+class LookupDb
+{
+	std::vector< std::pair<uint32_t,GeoipDbEntry4> > m_ranges4;
+	std::vector< std::pair<GeoipDbKey6,GeoipDbEntry6> > m_ranges6;
+	std::string m_strings;
+	std::unordered_map<std::string,uint32_t> m_stringOffsets;
+	
+	uint32_t Intern(const char* strValue);
+	BOOL KeepOtherFamily(const char* strPath);
+	
+public:
+	LookupDb() : m_strings(1, '\0') {}
+	LookupDb(const LookupDb&) = delete;
+	
+	void Add(const std::vector<LookupRow>& rows);
+	BOOL Write(const char* strPath);
+};
+
+static LookupDb LookupDatabase;
+static dispatch_queue_t LookupDbQ = NULL;
+
+static BOOL ParseLookupRow(const char* const* fields, LookupRow* pRow);
+
+/*
+ The rows of one connection's open transaction, kept as their fields (pointing into
+ the chunk buffer) until it commits. A transaction ends every RowsPerCommit rows,
+ at each pipeline sync, or at the end of the chunk.
+ If it fails, the rows are replayed one at a time, each in a savepoint: the rows the
+ database refuses go to the reject file and the rest are committed.
+ Each transaction also records the chunk's rows done so far in geoimport_progress.
+ */
+class RowBatch
+{
+	FILETYPE	m_fileMode;
+	int			m_nFields;
+	PostgresConnection& m_pgConnx;
+	CopyBuffer*	m_pCopyBuffer;
+	const ParsedChunk* m_pChunk;
+	
+	std::vector<const char*> m_fields;
+	BOOL		m_inTransaction = NO;
+	uint32_t	m_nCommitted = 0;
+	uint32_t	m_nRowsDone = 0;		// the chunk's rows up to the last one added
+	uint32_t	m_nRowsRecorded = 0;	// and as far as geoimport_progress has them
+	int			m_nPartition = -1;		// --partitioned : the rows' partition, -1 copies into geoip
+	
+	size_t Count() const { return m_fields.size()/m_nFields; }
+	BOOL AddRow(const char* const* fields);
+	BOOL AddProgress();
+	BOOL Replay();
+	
+public:
+	RowBatch(FILETYPE fileMode, int nFields, PostgresConnection& pgConnx, CopyBuffer* pCopyBuffer, const ParsedChunk* pChunk)
+		: m_fileMode(fileMode), m_nFields(nFields), m_pgConnx(pgConnx), m_pCopyBuffer(pCopyBuffer), m_pChunk(pChunk) {}
+	RowBatch(const RowBatch&) = delete;
+	
+	BOOL Add(const char* const* fields);
+	BOOL Commit();
+	BOOL Finish();
+	void Abandon();
+	
+	uint32_t Committed() const { return m_nCommitted; }
+};
+
+/*
+ A chunk of the file as it moves through the stages: read into its buffer (or claimed from
+ the mapping or the inflate ring), split into rows by a parser, and written by a writer.
+ It is then recycled, with its buffer and vectors, for the reader to fill again.
+ */
+typedef struct PARSEDCHUNK {
+	char*		pBuffer;		// ChunkSize+1 bytes from ChunkBufferPool, only when the file is read()
+	char*		startPos;
+	const char*	endPos;
+	off_t		filePos;
+	off_t		nBytes;
+	FILETYPE	fileMode;		// the file it was read from, Blocks or Locations (--release reads both)
+	uint32_t	nFirstRow;		// --resume : the rows before it were written by the interrupted import
+	uint16_t	nLane;			// --partitioned : the writer its rows' partitions belong to
+	std::vector<const char*> fields;	// each row's fields, pointing into the chunk
+	LocationDimensions dimensions;		// a Locations chunk's countries and subdivisions
+	std::vector<char> collapsedText;	// --collapse : the text of the networks it writes in place of the file's
+} ParsedChunk;
+
+// --resume : the interrupted import's checkpoints by chunk start, read only once loaded.
+static std::unordered_map<off_t, ChunkCheckpoint> ResumeCheckpoints;
+
+static ChunkCheckpoint CheckpointOf(const ParsedChunk* pChunk, uint32_t nRowsDone, int nFields);
+static BOOL AddProgressToDatabase(const ChunkCheckpoint& checkpoint, PostgresConnection& pgConnx);
+static const ChunkCheckpoint* ResumedCheckpoint(const ParsedChunk* pChunk);
+static BOOL ResumeChunk(FILETYPE fileMode, ParsedChunk* pChunk, const ChunkCheckpoint& checkpoint);
+
+/*
+ Bounded queue of chunks between two stages. Each slot carries a sequence number, so the
+ threads on either side claim slots with a compare and swap and never take a lock
+ (D. Vyukov's bounded MPMC queue). The semaphores block a producer while it is full and
+ a consumer while it is empty. NULL is pushed to tell a consumer the stage before is done.
+ */
+class ChunkQueue
+{
+	typedef struct CHUNKSLOT {
+		std::atomic<size_t>	sequence;
+		ParsedChunk*		pChunk;
+	} ChunkSlot;
+	
+	ChunkSlot*	m_slots = NULL;
+	size_t		m_mask = 0;
+	std::atomic<size_t> m_pushPos;
+	std::atomic<size_t> m_popPos;
+	dispatch_semaphore_t m_filledSem = NULL;
+	dispatch_semaphore_t m_freeSem = NULL;
+	
+public:
+	ChunkQueue() : m_pushPos(0), m_popPos(0) {}
+	ChunkQueue(const ChunkQueue&) = delete;
+	
+	BOOL Create(size_t nCapacity);
+	void Push(ParsedChunk* pChunk);
+	ParsedChunk* Pop();
+	BOOL TryPop(ParsedChunk** ppChunk);
+	
+private:
+	ParsedChunk* TakeFilled();
+};
+
+// recycled chunks for the reader, chunks read for the parsers, and rows for the writers.
+static ChunkQueue FreeChunkQ;
+static ChunkQueue ReadChunkQ;
+static ChunkQueue ParsedChunkQ;
+static ChunkQueue* LaneChunkQs = NULL;	// --partitioned : each writer's, in place of ParsedChunkQ
+static uint32_t ChunkCount = 0;
+static std::atomic<uint16_t> ParsersRunning(0);
+
+// the chunks' buffers (and the inflate ring's), ChunkSize+1 bytes each, in one mapping.
+static char* ChunkBufferPool = NULL;
+static size_t ChunkBufferPoolLength = 0;
+static size_t ChunkBufferStride = 0;
+
+// each writer waits on its own semaphore while parked, main's thread starts them.
+static dispatch_semaphore_t* WriterResumeSems = NULL;
+static uint16_t WritersStarted = 0;
+static volatile BOOL WritersFinished = NO;
+
+/*
+ A writer's own state, whichever sink it writes to.
+ */
+typedef struct SINKWRITER {
+	PostgresConnection	pgConnx;
+	CopyBuffer			copyBuffer;		// -C, and the binary file sink's rows
+	std::string			strRows;		// the CSV file sink's rows
+	BOOL				isOpen = NO;
+} SinkWriter;
+
+/*
+ Where the writers send the parsed chunks (--sink), as a row batch in and a status out.
+	Open : connects or readies the writer - Returns YES if opened.
+	Write : writes the chunk's rows, didFail [out] YES if the writer cannot go on - Returns the rows written.
+	Close : ends the writer, as when it is parked by -P auto.
+ */
+typedef struct ROWSINK {
+	const char*	strName;
+	BOOL		(*Open)(FILETYPE fileMode, const char* strDbName, SinkWriter& writer);
+	uint32_t	(*Write)(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail);
+	void		(*Close)(SinkWriter& writer);
+} RowSink;
+
+static BOOL OpenPostgresSink(FILETYPE fileMode, const char* strDbName, SinkWriter& writer);
+static uint32_t WritePostgresSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail);
+static void ClosePostgresSink(SinkWriter& writer);
+static BOOL OpenNullSink(FILETYPE fileMode, const char* strDbName, SinkWriter& writer);
+static uint32_t WriteNullSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail);
+static void CloseNullSink(SinkWriter& writer);
+static uint32_t WriteCsvSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail);
+static uint32_t WriteBinarySink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail);
+static BOOL OpenSinkFile(FILETYPE fileMode);
+static BOOL FinishSinkFile(void);
+
+// in SINKTYPE order. The file sinks share the file main() opens, their writers open nothing.
+static const RowSink RowSinks[SINK_NUM_TYPES] = {
+	{ "postgres",	OpenPostgresSink,	WritePostgresSink,	ClosePostgresSink },
+	{ "null",		OpenNullSink,		WriteNullSink,		CloseNullSink },
+	{ "csv",		OpenNullSink,		WriteCsvSink,		CloseNullSink },
+	{ "binary",		OpenNullSink,		WriteBinarySink,	CloseNullSink } };
+
+static uint32_t ParseLocations(ParsedChunk* pChunk);
+static uint32_t ParseBlocks(ParsedChunk* pChunk);
+static uint32_t CollapseBlocks(ParsedChunk* pChunk);
+static void JoinEdgeRuns(std::vector<ParsedChunk*>& edgeChunks);
+static uint32_t WriteChunk(FILETYPE fileMode, ParsedChunk* pChunk, PostgresConnection& pgConnx, CopyBuffer* pCopyBuffer, BOOL* didFail);
+static char* MapChunkBuffers(size_t nBufferSize, uint32_t nCount, size_t* pStride, size_t* pLength, const char** pstrPages);
+static BOOL CreateChunks(void);
+static void RecycleChunk(ParsedChunk* pChunk);
+static void ReadChunks(void);
+static void ParseChunks(uint16_t nParser);
+static uint32_t WriteChunks(FILETYPE fileMode, const char* strDbName, uint16_t nWriter);
+static uint32_t AsyncWriteChunks(FILETYPE fileMode, const char* strDbName, uint16_t nLoop);
+static void SetWriterLevel(uint16_t nLevel, dispatch_group_t fileProcGrp, FILETYPE fileMode, const char* strDbName);
+static void TuneWriters(double elapsedSecs, dispatch_group_t fileProcGrp, FILETYPE fileMode, const char* strDbName);
+
+/*
+ Per stage timings of one stage thread. Only that thread writes them, with relaxed
+ atomics, so the progress line and the report read them while it runs, without locks.
+ Latencies are counted in a log2 histogram with 4 buckets per power of two (within 25%).
+ */
+typedef enum METRIC_STAGES {
+	STAGE_READ = 0,		// the reader reading or claiming a chunk (waiting for the inflater too)
+	STAGE_PARSE,		// a parser splitting a chunk into rows
+	STAGE_STATEMENT,	// sending a row's statement, and waiting for its result unless pipelined
+	STAGE_COMMIT,		// COMMIT, pipeline sync, or COPY and merge; a file sink's write
+	STAGE_COUNT } METRIC_STAGE;
+
+const int LATENCY_BUCKETS = 4*64;
+
+class StageMetrics
+{
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_totalNanos;
+	std::atomic<uint64_t> m_maxNanos;
+	std::atomic<uint64_t> m_buckets[LATENCY_BUCKETS];
+	
+public:
+	StageMetrics();
+	StageMetrics(const StageMetrics&) = delete;
+	
+	void Record(uint64_t nNanos);
+	
+	uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+	uint64_t TotalNanos() const { return m_totalNanos.load(std::memory_order_relaxed); }
+	uint64_t MaxNanos() const { return m_maxNanos.load(std::memory_order_relaxed); }
+	void AddHistogram(uint64_t* pBuckets) const;
+	
+	static int Bucket(uint64_t nNanos);
+	static uint64_t BucketLimit(int nBucket);
 };
 
+typedef struct WORKERMETRICS {
+	const char*				strRole;	// reader, parser or writer
+	StageMetrics			stages[STAGE_COUNT];
+	std::atomic<uint64_t>	rows;
+	std::atomic<uint64_t>	bytes;
+} WorkerMetrics;
+
+// one per stage thread (the reader, then the parsers, then the writers), and the one of the thread running.
+static WorkerMetrics* Metrics = NULL;
+static uint16_t MetricsCount = 0;
+static thread_local WorkerMetrics* ThreadMetrics = NULL;
+
+static inline uint64_t MonotonicNanos(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline void RecordStage(METRIC_STAGE stage, uint64_t nStartNanos)
+{
+	if( NULL!=ThreadMetrics ){
+		ThreadMetrics->stages[stage].Record(MonotonicNanos() - nStartNanos);
+	}
+}
+
 /*
  Usage
  
@@ -101,7 +711,7 @@ public:
 int main( int argc, const char* argv[] )
 {
 	// look at commandline options
-	if(argc < 4 ){ return Usage(); }
+	if(argc < 3 ){ return Usage(); }
 	
 	const char* strConnxString = NULL; // may be URI or connection string.
 	const char* strDbName = NULL;
@@ -109,6 +719,16 @@ int main( int argc, const char* argv[] )
 	int nStat = GetCommandlineOptions( argc-1, &argv[1], &strDbName,&strFilename,&strConnxString );
 	if( 0!=nStat ){ return Usage(); }
 	
+	// the file is a lookup database, not a .csv.
+	if( NULL!=LookupAddress ){
+		return LookupInDb(strFilename, LookupAddress);
+	}
+	
+	// the file is written, not imported.
+	if( NULL!=GenerateFileType ){
+		return GenerateFile(strFilename);
+	}
+	
 	// verify the filename
 	struct stat csvFileInfo = {0};
 	if( 0!=stat(strFilename, &csvFileInfo) )
@@ -119,814 +739,7569 @@ int main( int argc, const char* argv[] )
 	
 	atexit(ProgramCleanup);
 	
-	// Open the File
-	InputFile = open(strFilename, O_RDONLY);
-	if( -1==InputFile ){
-		perror("Error on opening .csv file.");
-		return PROGRAM_FAILED;
-	}
-	FileTotalSize = csvFileInfo.st_size;
-	
-	// Examine the header, will determine the contents of file (cities or netblocks).
 	FILETYPE fileMode;
 	uint16_t nHeaderSize = 0;
-	if( NO==ReadHeader( InputFile, &fileMode, &nHeaderSize )){
+	if( YES==ReleaseMode )
+	{
+		// the directory's files are opened in turn, starting with its Locations file.
+		if( NO==S_ISDIR(csvFileInfo.st_mode) ){
+			dprintf(STDOUT_FILENO, "--release needs a release directory.\n");
+			return PROGRAM_FAILED;
+		}
+		if( NO==OpenRelease(strFilename, &fileMode) ){
+			return PROGRAM_FAILED;
+		}
+	}
+	else
+	{
+		// Open the File
+		InputFile = open(strFilename, O_RDONLY);
+		if( -1==InputFile ){
+			perror("Error on opening .csv file.");
+			return PROGRAM_FAILED;
+		}
+		FileTotalSize = csvFileInfo.st_size;
+		
+		// Examine the header, will determine the contents of file (cities or netblocks).
+		CompressedInput = IsCompressedFile( InputFile );
+		if( YES==CompressedInput )
+		{
+			if( YES==MappedFileMode || YES==TokenizerBenchmarkMode ){
+				dprintf(STDOUT_FILENO, "Cannot use -M or -T with a compressed file.\n");
+				return PROGRAM_FAILED;
+			}
+			if( NO==OpenCompressedInput( InputFile, &fileMode ) ){
+				return PROGRAM_FAILED;
+			}
+		}
+		else
+		{
+			if( NO==ReadHeader( InputFile, &fileMode, &nHeaderSize )){
+				return PROGRAM_FAILED;
+			}
+			FileBytesRemaining = FileTotalSize - nHeaderSize;
+		}
+		InputFileMode = fileMode;
+	}
+	
+	if( YES==TokenizerBenchmarkMode ){
+		return RunBenchmarks(fileMode);
+	}
+	
+	if( NULL!=EmitDbPath && IPBLOCKS!=fileMode ){
+		dprintf(STDOUT_FILENO, "--emit-db needs a City-Blocks file.\n");
+		return PROGRAM_FAILED;
+	}
+	if( YES==PartitionedMode && IPBLOCKS!=fileMode ){
+		dprintf(STDOUT_FILENO, "--partitioned needs a City-Blocks file.\n");
+		return PROGRAM_FAILED;
+	}
+	if( YES==CollapseMode && IPBLOCKS!=fileMode && NO==ReleaseMode ){
+		dprintf(STDOUT_FILENO, "--collapse needs a City-Blocks file.\n");
 		return PROGRAM_FAILED;
 	}
 	
-	FileBytesRemaining = FileTotalSize - nHeaderSize;
+	if( YES==MappedFileMode && NO==MapInputFile( InputFile, nHeaderSize ) ){
+		return PROGRAM_FAILED;
+	}
 	
 	// adjust the number of processor based on input file size, if needed.
-	uint64_t nBlocksToProcess = (FileBytesRemaining/OneMB);
+	uint64_t nBlocksToProcess = (FileBytesRemaining/ChunkSize);
 	if( nBlocksToProcess<NumProcessors )
 	{
 		NumProcessors = nBlocksToProcess - 1;
 	}
 	if( (int16_t)NumProcessors<=0 ){ NumProcessors=1; }
-	dprintf(STDOUT_FILENO,"Processing File: %lld bytes (%lld MB) using %u processing threads.\n",
-		(long long)FileBytesRemaining, (long long)((FileTotalSize/OneMB)), NumProcessors);
+	
+	// --emit-db has no connections, -P sets its parsers. With --async the writers are its event loops.
+	long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+	NumWriters = (NULL==EmitDbPath) ? NumProcessors : 0;
+	if( AsyncConnections>0 )
+	{
+		if( nBlocksToProcess<AsyncConnections ){ AsyncConnections = (nBlocksToProcess>0) ? (uint16_t)nBlocksToProcess : 1; }
+		NumWriters = (AsyncConnections>ASYNC_CONNECTIONS_PER_LOOP) ? 2 : 1;
+	}
+	ActiveWriters = (YES==AutoTuneMode) ? 1 : NumWriters;
+	if( 0==NumParsers ){
+		NumParsers = (NULL==EmitDbPath && nOnline>0 && nOnline<NumProcessors) ? (uint16_t)nOnline : NumProcessors;
+	}
+	if( AsyncConnections>0 )
+	{
+		dprintf(STDOUT_FILENO,"Processing File: %lld bytes (%lld MB) using %u parsing threads and %u database connections on %u event loops.\n",
+			(long long)FileBytesRemaining, (long long)((FileTotalSize/OneMB)), NumParsers, AsyncConnections, NumWriters);
+	}
+	else if( SINK_POSTGRES!=SinkType )
+	{
+		dprintf(STDOUT_FILENO,"Processing File: %lld bytes (%lld MB) using %u parsing threads and %u writers to the %s sink.\n",
+			(long long)FileBytesRemaining, (long long)((FileTotalSize/OneMB)), NumParsers, NumWriters, RowSinks[SinkType].strName);
+	}
+	else
+	{
+		dprintf(STDOUT_FILENO,"Processing File: %lld bytes (%lld MB) using %u parsing threads and %s%u database connections.\n",
+			(long long)FileBytesRemaining, (long long)((FileTotalSize/OneMB)), NumParsers,
+			(YES==AutoTuneMode ? "up to " : ""), NumWriters);
+	}
+	
+	MetricsCount = 1 + NumParsers + NumWriters;
+	Metrics = new WorkerMetrics[MetricsCount]();
+	for( uint16_t nWorker=0; nWorker<MetricsCount; ++nWorker ){
+		Metrics[nWorker].strRole = (0==nWorker) ? "reader" : (nWorker<=NumParsers ? "parser" : (AsyncConnections>0 ? "event loop" : "writer"));
+	}
+	if( YES==CreateChunks() ){ return PROGRAM_FAILED; }
+	
+	// before staging, so the staged table is created with the extended columns.
+	if( YES==ExtendedBlocks && (IPBLOCKS==fileMode || YES==ReleaseMode) )
+	{
+		if( SINK_POSTGRES==SinkType && YES==RunLoadStep(strDbName, "begin_extended_load", IPBLOCKS, 0) ){ return PROGRAM_FAILED; }
+		UseExtendedBlocks();
+	}
+	
+	// the Blocks rows are written unchecked: their geoname_ids are checked as they are parsed, against
+	// the ids loaded here, or with --release by ValidateRelease() once the files are written.
+	if( IPBLOCKS==fileMode && NULL==EmitDbPath && NO==DeltaMode && NO==ReleaseMode && SINK_POSTGRES==SinkType )
+	{
+		if( YES==LoadGeonameIds(strDbName) ){ return PROGRAM_FAILED; }
+		FilterGeonameIds = YES;
+	}
+	
+	// once COPYGEOIPColumns are set, and before the reader claims the mapping's ranges.
+	if( YES==PartitionedMode )
+	{
+		if( YES==LoadGeoipPartitions(strDbName) ){ return PROGRAM_FAILED; }
+		AssignPartitionLanes();
+	}
+	
+	if( YES==StagedSwapMode && YES==RunLoadStep(strDbName, "begin_staged_load", fileMode, 0) ){
+		return PROGRAM_FAILED;
+	}
+	
+	if( YES==DeltaMode )
+	{
+		if( YES==RunLoadStep(strDbName, "begin_delta_load", fileMode, 0) ){ return PROGRAM_FAILED; }
+		UseDeltaTables();
+	}
+	
+	// a staged or delta load is all or nothing, so only a load into the live tables keeps checkpoints.
+	if( NULL==EmitDbPath && NO==StagedSwapMode && NO==DeltaMode && NO==ReleaseMode && SINK_POSTGRES==SinkType )
+	{
+		FileModifiedTime = (long long)csvFileInfo.st_mtime;
+		if( YES==BeginCheckpoints(strDbName, strFilename) ){ return PROGRAM_FAILED; }
+	}
+	
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
 
 	dispatch_group_t fileProcGrp = dispatch_group_create();
 	
 	// get normal priority queue
 	dispatch_queue_t dpQ = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT,0);
 	
-	// create the File reader sync queue
-	dispatch_queue_t loadFromFileQ = dispatch_queue_create("geoimp.fileload.syncq", DISPATCH_QUEUE_SERIAL);
+	// and the queue guarding the shared country and subdivision sets
+	DimensionsQ = dispatch_queue_create("geoimp.dimensions.syncq", DISPATCH_QUEUE_SERIAL);
+	RejectsQ = dispatch_queue_create("geoimp.rejects.syncq", DISPATCH_QUEUE_SERIAL);
+	LookupDbQ = dispatch_queue_create("geoimp.lookupdb.syncq", DISPATCH_QUEUE_SERIAL);
+	SinkFileQ = dispatch_queue_create("geoimp.sinkfile.syncq", DISPATCH_QUEUE_SERIAL);
+	CollapseQ = dispatch_queue_create("geoimp.collapse.syncq", DISPATCH_QUEUE_SERIAL);
 	
-	for(uint16_t nCount=1; nCount<=NumProcessors; ++nCount )
-	{
-		dispatch_group_async(fileProcGrp, dpQ,
-			 ^{
-				 dprintf(STDOUT_FILENO,"Processor id:%u has started-----\n",nCount);
-				 
-				 uint32_t nProcessed =
-					ProcessFile(fileMode,strDbName,loadFromFileQ,nCount);
-				 
-				 dprintf(STDOUT_FILENO,"Processor id:%u has completed. Rows inserted:%u----\n",nCount, nProcessed);
-			 });
+	if( (SINK_CSV==SinkType || SINK_BINARY==SinkType) && NO==OpenSinkFile(fileMode) ){
+		return PROGRAM_FAILED;
 	}
 	
-	dispatch_group_wait(fileProcGrp, DISPATCH_TIME_FOREVER);
+	// inflating runs ahead of the processors, on its own queue.
+	if( YES==CompressedInput ){
+		StartInflating();
+	}
 	
-    return PROGRAM_SUCCESS;
-}
-
-
-/* File Chunk processor - called by the dispatch group block to:
-  - repeatedly load a chunk of (upto) 1MB from file
-  - add the rows to db
- */
-uint32_t ProcessFile(FILETYPE fileMode,const char* strDbName,dispatch_queue_t loadFromFileQ, uint16_t procId)
-{
-	uint32_t totalProcessed = 0;
-	if( YES==AbortProgram ){ return totalProcessed; }
+	// one reader, then the parsers and the writers, each stage handing chunks to the next.
+	ParsersRunning = NumParsers;
+	dispatch_group_async(fileProcGrp, dpQ, ^{ ReadChunks(); });
 	
-	PostgresConnection pgConnx;
-	if( NO==pgConnx.Connect( strDbName) )
+	for(uint16_t nCount=1; nCount<=NumParsers; ++nCount )
 	{
-		AbortProgram = YES;
-		return totalProcessed;
+		dispatch_group_async(fileProcGrp, dpQ, ^{ ParseChunks(nCount); });
 	}
-	PQsetClientEncoding(pgConnx, "UTF8" );
 	
-	// Allocate buffer for this Processor
-	char* pWriteBuffer = (char*)malloc(OneMB+1);
-	if( NULL==pWriteBuffer ) {
-		AbortProgram = YES;
-		return totalProcessed;
+	uint16_t nStartWriters = ActiveWriters;
+	ActiveWriters = 0;
+	SetWriterLevel(nStartWriters, fileProcGrp, fileMode, strDbName);
+	
+	// a progress line every few seconds until the processors are done, -P auto tunes then.
+	while( 0!=dispatch_group_wait(fileProcGrp, dispatch_time(DISPATCH_TIME_NOW, PROGRESS_INTERVAL_SECS*NSEC_PER_SEC)) )
+	{
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
+		double progressSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+		PrintProgress(progressSecs, NO);
+		if( YES==AutoTuneMode ){
+			TuneWriters(progressSecs, fileProcGrp, fileMode, strDbName);
+		}
 	}
-	*(pWriteBuffer + OneMB) = '?';
 	
-	__block off_t nBytesRead;
-	__block const char* endPos;
-	__block off_t filePos; //start filepos
-	BOOL didFail;
+	// the level chosen stands for -P from here on (the --swap index workers, the results).
+	if( YES==AutoTuneMode )
+	{
+		NumProcessors = ActiveWriters;
+		dprintf(STDOUT_FILENO,"-P auto finished with %u database connections.\n", NumProcessors);
+	}
 	
-	while( NO==AbortProgram && FileBytesRemaining>0 )
+	// the locations written reference these, so they are added even if the import stopped early.
+	if( LOCATIONS==fileMode && SINK_POSTGRES==SinkType )
 	{
-		dispatch_sync(loadFromFileQ,
-					  ^{
-						  nBytesRead = LoadFileBlock(pWriteBuffer, pWriteBuffer + OneMB, &endPos,&filePos);
-					  });
-
-		if( nBytesRead <=0 ) { return totalProcessed; }
-		
-		/*dprintf(STDOUT_FILENO,"(%u) Starting to process file offset:: %lld \n",
-				procId, filePos);*/
+		dprintf(STDOUT_FILENO,"Adding %zu countries, %zu subdivision_1 and %zu subdivision_2 rows.\n",
+			Dimensions.Countries().size(), Dimensions.Subdivisions1().size(), Dimensions.Subdivisions2().size());
 		
-		switch(fileMode)
-		{
-			case IPBLOCKS:{
-				totalProcessed += ProcessBlocks(pWriteBuffer, endPos, pgConnx, &didFail);
-				break;
-			}
-			case LOCATIONS:{
-				totalProcessed += ProcessLocations(pWriteBuffer, endPos,pgConnx, &didFail);
-				break;
-			}
-			default:{
-				AbortProgram = YES;
-				return totalProcessed;
-			}
+		PostgresConnection pgConnx;
+		if( NO==pgConnx.Connect(strDbName) ){ return PROGRAM_FAILED; }
+		PQsetClientEncoding(pgConnx, "UTF8" );
+		if( YES==AddDimensionsToDatabase(Dimensions, pgConnx) ){ return PROGRAM_FAILED; }
+	}
+	
+	// as are the locations, so the Blocks rows written are validated against them too.
+	if( YES==ReleaseMode && YES==ValidateRelease(strDbName) ){
+		return PROGRAM_FAILED;
+	}
+	
+	if( NULL!=EmitDbPath )
+	{
+		if( YES==AbortProgram ){
+			dprintf(STDOUT_FILENO,"Import failed, %s has not been written.\n", EmitDbPath);
+			return PROGRAM_FAILED;
 		}
-		
-		if( 0==(totalProcessed%2) ){
-			dprintf(STDOUT_FILENO,"Processor:%u Total Processed:%u bytes remaining to process: %lld (%u MB)\n",
-				procId, totalProcessed, (long long)FileBytesRemaining, (uint32_t)(FileBytesRemaining/OneMB) );
+		if( YES==WriteLookupDb(EmitDbPath) ){ return PROGRAM_FAILED; }
+	}
+	
+	if( 0!=SinkFile )
+	{
+		if( YES==FinishSinkFile() ){ return PROGRAM_FAILED; }
+		if( YES==AbortProgram ){
+			dprintf(STDOUT_FILENO,"Import failed, %s is incomplete.\n", SinkFilePath);
+			return PROGRAM_FAILED;
 		}
-		if( YES==didFail )
-		{
-			AbortProgram = YES;
-			return totalProcessed;
-		}
-	};
-	
-	return totalProcessed;
-}
-
-static const char* BlocksHeader
-= "network,geoname_id,registered_country_geoname_id,represented_country_geoname_id,is_anonymous_proxy,is_satellite_provider,postal_code,latitude,longitude,accuracy_radius";
-
-static const char LocationsHeader[]
-= "geoname_id,locale_code,continent_code,continent_name,country_iso_code,country_name,subdivision_1_iso_code,subdivision_1_name,subdivision_2_iso_code,subdivision_2_name,city_name,metro_code,time_zone";
-
-/*
- - fdInputFile : Input file file descriptor.
- 
- - Returns : [IPBLOCKS|LOCATIONS]
- */
-BOOL ReadHeader( int fdInputFile, FILETYPE* pFileMode, uint16_t* pHeaderSize)
-{
-	// read and char scan the first line, up to n bytes looking for
-	// newline '\n ' char.
-	uint16_t nMaxChars = sizeof(LocationsHeader);
-	char buffer[ nMaxChars ];
-	char* pWritepos = buffer;
-	const char* strHeader = &buffer[0];
+	}
 	
-	uint16_t nCharsRead = 0;
-	off_t nBytesRead;
-	while( nCharsRead<nMaxChars )
+	// the staging tables are left for inspection if the load failed, public is untouched.
+	if( YES==StagedSwapMode )
 	{
-		nBytesRead = read(fdInputFile,pWritepos,1);
-		if(-1==nBytesRead ){
-			perror("Error on reading .csv file.");
-			return NO;
+		if( YES==AbortProgram ){
+			dprintf(STDOUT_FILENO,"Import failed, the staging tables have not been swapped in.\n");
+			return PROGRAM_FAILED;
 		}
-		
-		nCharsRead += nBytesRead;
-		if( '\n' == *pWritepos ){
-			break;
+		if( YES==RunLoadStep(strDbName, "index_staged_load", fileMode, NumProcessors) ||
+			YES==RunLoadStep(strDbName, "swap_staged_load", fileMode, 0) )
+		{
+			return PROGRAM_FAILED;
 		}
-		++pWritepos;
 	}
-	*pWritepos = '\0';
-	*pHeaderSize = nCharsRead;
 	
+	// a row missing from the delta table would be deleted, so every row must have loaded.
+	if( YES==DeltaMode )
+	{
+		if( YES==AbortProgram || RejectedRows>0 || MalformedLines>0 ){
+			dprintf(STDOUT_FILENO,"Import incomplete (%u rejected, %u malformed rows), the delta has not been applied.\n",
+				(uint32_t)RejectedRows, (uint32_t)MalformedLines);
+			return PROGRAM_FAILED;
+		}
+		if( YES==ApplyDelta(strDbName, fileMode) ){ return PROGRAM_FAILED; }
+	}
 	
-	if(0==strcmp(strHeader,BlocksHeader) ){
-		*pFileMode = IPBLOCKS;
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+	uint64_t nTotalRows = TotalRowsProcessed;
+	if( NULL!=EmitDbPath || SINK_CSV==SinkType || SINK_BINARY==SinkType )
+	{
+		dprintf(STDOUT_FILENO,"Rows written to %s:%llu in %.2f seconds, %.0f rows/sec.\n", (NULL!=EmitDbPath) ? EmitDbPath : SinkFilePath,
+			(unsigned long long)nTotalRows, elapsedSecs, (elapsedSecs>0 ? nTotalRows/elapsedSecs : 0.0));
 	}
-	else if( 0==strcmp(strHeader,LocationsHeader) ){
-		*pFileMode = LOCATIONS;
+	else if( SINK_NULL==SinkType )
+	{
+		dprintf(STDOUT_FILENO,"Rows parsed:%llu in %.2f seconds, %.0f rows/sec (null sink).\n",
+			(unsigned long long)nTotalRows, elapsedSecs, (elapsedSecs>0 ? nTotalRows/elapsedSecs : 0.0));
 	}
-	else{
-		dprintf( STDOUT_FILENO,
-				"geoimport - invalid .csv file, header not from a recognised source (Locations or IP Blocks).\n" );
-		return NO;
+	else
+	{
+		dprintf(STDOUT_FILENO,"Rows %s:%llu in %.2f seconds, %.0f rows/sec (%s%s).\n",
+			(YES==DeltaMode ? "compared" : "inserted"),
+			(unsigned long long)nTotalRows, elapsedSecs, (elapsedSecs>0 ? nTotalRows/elapsedSecs : 0.0),
+			(YES==BulkCopyMode ? "COPY bulk load" : (AsyncConnections>0 ? "async pipelined" : (PipelineDepth>0 ? "pipelined" : "per row"))),
+			(YES==BulkCopyMode ? "" : (YES==UsePreparedStatements ? ", prepared binary statements" : ", SQL text statements")) );
+	}
+	if( RejectedRows>0 )
+	{
+		dprintf(STDOUT_FILENO,"Rows rejected:%u, written to", (uint32_t)RejectedRows);
+		for( int nFileType=IPBLOCKS; nFileType<=LOCATIONS; ++nFileType ){
+			if( RejectFiles[nFileType]>0 ){ dprintf(STDOUT_FILENO," %s", RejectFilePaths[nFileType]); }
+		}
+		dprintf(STDOUT_FILENO,"\n");
 	}
 	
-	return YES; //;  //=0,
+	uint64_t nCollapseRowsIn = CollapseRowsIn;
+	uint64_t nCollapseRowsOut = CollapseRowsOut;
+	if( nCollapseRowsIn>0 && nCollapseRowsOut>0 )
+	{
+		dprintf(STDOUT_FILENO,"Collapsed %llu Blocks rows into %llu networks, %.1f%% fewer (%.2f to 1).\n",
+			(unsigned long long)nCollapseRowsIn, (unsigned long long)nCollapseRowsOut,
+			100.0*(double)(nCollapseRowsIn - nCollapseRowsOut)/nCollapseRowsIn, (double)nCollapseRowsIn/nCollapseRowsOut);
+	}
+	
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double userSecs = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6;
+	double systemSecs = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+	long nPeakRssKB = usage.ru_maxrss;
+#if defined(__APPLE__)
+	nPeakRssKB /= 1024;	// bytes on Mac OS X
+#endif
+	dprintf(STDOUT_FILENO,"CPU time %.2fs user, %.2fs system; peak RSS %ld MB.\n",
+		userSecs, systemSecs, nPeakRssKB/1024);
+	PrintProgress(elapsedSecs, YES);
+	if( NULL!=MetricsFilePath ){
+		WriteMetricsReport(strFilename, elapsedSecs);
+	}
+	
+	WriteResult("{\"run\":\"import\",\"file\":%s,\"file_type\":\"%s\",\"load\":\"%s\",\"path\":\"%s\","
+				"\"processors\":%u,\"parsers\":%u,\"async_connections\":%u,\"chunk_kb\":%u,\"huge_pages\":\"%s\",\"extended\":%s,\"collapse_ratio\":%.3f,\"bytes\":%lld,\"rows\":%llu,\"rejected\":%u,\"malformed\":%u,"
+				"\"seconds\":%.3f,\"rows_per_sec\":%.0f,\"cpu_user_secs\":%.3f,\"cpu_system_secs\":%.3f,\"peak_rss_kb\":%ld}",
+				JsonString(strFilename).c_str(), (YES==ReleaseMode ? "release" : (IPBLOCKS==fileMode ? "blocks" : "locations")),
+				(NULL!=EmitDbPath ? "emit-db" : (SINK_POSTGRES!=SinkType ? RowSinks[SinkType].strName :
+					(YES==DeltaMode ? "delta" : (YES==StagedSwapMode ? "swap" : "insert")))),
+				((NULL!=EmitDbPath || SINK_POSTGRES!=SinkType) ? "none" : (YES==BulkCopyMode ? "copy" : (AsyncConnections>0 ? "async" : (PipelineDepth>0 ? "pipelined" : (YES==UsePreparedStatements ? "prepared" : "text"))))),
+				NumProcessors, NumParsers, AsyncConnections, ChunkSize/OneKB, ChunkBufferPages,
+				(YES==ExtendedBlocks ? "true" : "false"), (nCollapseRowsOut>0 ? (double)nCollapseRowsIn/nCollapseRowsOut : 1.0), (long long)FileTotalSize, (unsigned long long)nTotalRows,
+				(uint32_t)RejectedRows, (uint32_t)MalformedLines,
+				elapsedSecs, (elapsedSecs>0 ? nTotalRows/elapsedSecs : 0.0), userSecs, systemSecs, nPeakRssKB);
+	
+    return PROGRAM_SUCCESS;
 }
 
 
+/*			Reader, parser and writer stages			*/
+
 /*
- Loads up to 1MB Chunk of file
- - pWriteBuffer : Pointer to the char buffer we can fill.
- - endPos : Pointer to the last character in the buffer (i.e. pWriteBuffer + OneMB)
- - pOutEndPos : out pointer that will point to the adjusted end position.
+ - nCapacity : chunks the queue holds before Push() blocks; the slots are rounded up to a power of two.
  
- - Returns : the bytes read from disk, or -1 if an error ocurred.
+ - Returns YES if created.
  */
-off_t LoadFileBlock( char* pWriteBuffer, const char* endPos, const char** ppOutEndPos, off_t* filePos)
+BOOL ChunkQueue::Create(size_t nCapacity)
 {
-	*filePos = lseek(InputFile, 0, SEEK_CUR); //for debug
-	
-	ptrdiff_t sizeBuff = (endPos-pWriteBuffer);
+	size_t nSlots = 2;
+	while( nSlots<nCapacity ){ nSlots *= 2; }
 	
-	off_t nBytesRead = read(InputFile,pWriteBuffer,sizeBuff);
-	if(-1==nBytesRead ){
-		perror("Error on reading .csv file.");
-		return nBytesRead;
+	m_slots = new(std::nothrow) ChunkSlot[nSlots];
+	if( NULL==m_slots ){ return NO; }
+	for( size_t nSlot=0; nSlot<nSlots; ++nSlot ){
+		m_slots[nSlot].sequence.store(nSlot, std::memory_order_relaxed);
 	}
-	if( 0==nBytesRead ){ return nBytesRead; }
-
-	endPos = (pWriteBuffer + nBytesRead);
-	
-	// Adjust the file pointer and buffer end ptr to backtrack to the
-	// end of a line - so buffer's read from file always start at a line beginning
-	*ppOutEndPos = AdjustEndPointer(InputFile,pWriteBuffer,endPos);
+	m_mask = nSlots - 1;
 	
-	sizeBuff = (*ppOutEndPos - pWriteBuffer);
-	
-	FileBytesRemaining -= sizeBuff;
-	return sizeBuff;
+	m_filledSem = dispatch_semaphore_create(0);
+	m_freeSem = dispatch_semaphore_create((long)nCapacity);
+	return YES;
 }
 
-
-const char* ScanWordUnquoted(char* currentPos, char** ppCurrentPos);
-const char* ScanWordMaybeQuoted(char* currentPos, char** ppCurrentPos);
-const char* ScanWordUntil(char* currentPos, char** ppCurrentPos, char until);
-
-static const char* country_unknown = "Unknown";
-static const char* country_code_unknown = "ZZ";
-static const char* strNoneProcessed = "Nobe Processed";
-
 /*
-	Reads all lines and proceses them as Location
-*/
-uint32_t ProcessLocations(char* currentPos, const char* endPos, PGconn* PqConn, BOOL* didFail)
+ A slot is free for the push at position n when its sequence is n, and filled for the
+ pop at n when it is n+1. The semaphore has reserved a slot, but the thread emptying it
+ may not have released it yet, so the loop waits for that.
+ */
+void ChunkQueue::Push(ParsedChunk* pChunk)
 {
-	*didFail = NO;
-	const char *geoname_id,*locale_code,*continent_code,*continent_name;
-	const char *country_iso_code,*country_name,*subdivision_1_iso_code,*subdivision_1_name;
-	const char *subdivision_2_iso_code,*subdivision_2_name,*city_name,*metro_code,*time_zone;
-	
-	const char* start_geoname_id = NULL;
-	
-	BOOL dbCallFailed;
-	geoname_id = strNoneProcessed;
-	uint32_t totalProcessed = 0;
+	dispatch_semaphore_wait(m_freeSem, DISPATCH_TIME_FOREVER);
 	
-	while(currentPos<endPos-1 )
+	size_t nPos = m_pushPos.load(std::memory_order_relaxed);
+	for( ;; )
 	{
-		char* lineStart = ReadLine(&currentPos,endPos);
-		char* linePos = lineStart; //track each field read from the line
-		
-		// extract the details
-		/*
-		 geoname_id,locale_code,continent_code,continent_name,country_iso_code,country_name    ,subdivision_1_iso_code,subdivision_1_name  ,subdivision_2_iso_code ,subdivision_2_name  ,city_name       ,metro_code ,time_zone
-		 88319,     en,         AF,            Africa,        LY,              Libya           ,BA                    ,"Sha'biyat Banghazi",                       ,                    ,Benghazi        ,           ,Africa/Tripoli
-		 90552     ,en         ,AS            ,Asia          ,IQ              ,Iraq            ,AN                    ,Anbar               ,                       ,                    ,Sulaymaniyah    ,           ,Asia/Baghdad
-		 105072    ,en         ,AS            ,Asia          ,SA              ,"Saudi Arabia"  ,14                    ,'Asir               ,                       ,                    ,"Khamis Mushait",           ,Asia/Riyadh
-		 3333231   ,en		   ,EU			  ,Europe        ,GB              ,"United Kingdom",SCT                   ,Scotland            ,GLG                    ,"Glasgow City"      ,                ,           ,Europe/London
-		 312394    ,en         ,AS            ,Asia          ,TR              ,Turkey          ,31                    ,Hatay               ,                       ,                    ,                ,           ,Europe/Istanbul
-		*/
-		
-		geoname_id = ScanWordUnquoted(linePos,&linePos);
-		locale_code = ScanWordUnquoted(linePos,&linePos);
-		continent_code = ScanWordUnquoted(linePos,&linePos);
-		continent_name = ScanWordMaybeQuoted(linePos,&linePos);
-		country_iso_code = ScanWordUnquoted(linePos,&linePos);
-		country_name = ScanWordMaybeQuoted(linePos,&linePos);
-		subdivision_1_iso_code = ScanWordUnquoted(linePos,&linePos);
-		subdivision_1_name = ScanWordMaybeQuoted(linePos,&linePos);
-		subdivision_2_iso_code = ScanWordUnquoted(linePos,&linePos);
-		subdivision_2_name = ScanWordMaybeQuoted(linePos,&linePos);
-		city_name = ScanWordMaybeQuoted(linePos,&linePos);
-		metro_code = ScanWordUnquoted(linePos,&linePos);
-		time_zone = ScanWordUntil(linePos,&linePos, '\0');
-		
-		if( NULL==start_geoname_id) { start_geoname_id=geoname_id; }
-		
-		// apease the compiler warnings.
-		locale_code = continent_name = metro_code = time_zone;
-		
-		if( NULL==country_iso_code ) { country_iso_code=country_code_unknown; }
-		if( NULL==country_name ) { country_name = country_unknown; }
-		
-		dbCallFailed =
-			AddLocationToDatabase( geoname_id, continent_code, city_name,
-								   country_iso_code, country_name,
-								   subdivision_1_iso_code, subdivision_1_name,
-								   subdivision_2_iso_code, subdivision_2_name,
-								   PqConn);
-		
-		if(YES==dbCallFailed){
-			*didFail = YES;
-			
-			dprintf( STDOUT_FILENO, "Block Complete on Error. nLocationsProcessed = %u; firs id:%s , last id:%s\n",
-					totalProcessed,start_geoname_id, geoname_id);
-			
-			return totalProcessed;
+		ChunkSlot& slot = m_slots[nPos & m_mask];
+		intptr_t nDiff = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)nPos;
+		if( 0==nDiff )
+		{
+			if( m_pushPos.compare_exchange_weak(nPos, nPos+1, std::memory_order_relaxed) )
+			{
+				slot.pChunk = pChunk;
+				slot.sequence.store(nPos+1, std::memory_order_release);
+				break;
+			}
+		}
+		else if( nDiff<0 ){
+			sched_yield();
+			nPos = m_pushPos.load(std::memory_order_relaxed);
+		}
+		else{
+			nPos = m_pushPos.load(std::memory_order_relaxed);
 		}
-		
-		++totalProcessed;
 	}
 	
-	/*dprintf( STDOUT_FILENO, "Block Complete, nLocationsProcessed = %u; firs id:%s , last id:%s\n",
-			nLocationsProcessed,start_geoname_id, geoname_id);*/
-	
-	return totalProcessed;
+	dispatch_semaphore_signal(m_filledSem);
 }
 
-uint32_t ProcessBlocks(char* currentPos, const char* endPos, PGconn* PqConn, BOOL* didFail)
+/*
+ - Returns the oldest chunk, waiting for one, or NULL when the stage before is done.
+ */
+ParsedChunk* ChunkQueue::Pop()
 {
-	*didFail = NO;
-	uint32_t totalProcessed = 0;
-	const char *network, *geoname_id,*registered_country_geoname_id;
-	const char *represented_country_geoname_id,*is_anonymous_proxy;
-	const char *is_satellite_provider,*postal_code;
-	const char *latitude,*longitude,*accuracy_radius;
-	
-	/*
-		network          ,geoname_id ,registered_country_geoname_id ,represented_country_geoname_id ,is_anonymous_proxy ,is_satellite_provider ,postal_code ,latitude ,longitude ,accuracy_radius
-		5.145.149.142/32 ,           ,2921044                       ,                               ,0                  ,1                     ,            ,         ,          ,
-		80.231.5.0/24    ,           ,                              ,                               ,0                  ,1                     ,            ,         ,          ,
-	*/
-	
-	geoname_id = strNoneProcessed;
-	BOOL dbCallFailed = NO;
-	while(currentPos<endPos-1 )
-	{
-		char* lineStart = ReadLine(&currentPos,endPos);
-		char* linePos = lineStart; //track each field read from the line
-		
-		network =  ScanWordUnquoted(linePos,&linePos);
-		geoname_id =  ScanWordUnquoted(linePos,&linePos);
-		registered_country_geoname_id =  ScanWordUnquoted(linePos,&linePos);
-		represented_country_geoname_id = ScanWordUnquoted(linePos,&linePos);
-		is_anonymous_proxy = ScanWordUnquoted(linePos,&linePos);
-		is_satellite_provider = ScanWordUnquoted(linePos,&linePos);
-		postal_code = ScanWordUnquoted(linePos,&linePos);
-		latitude = ScanWordUnquoted(linePos,&linePos);
-		longitude = ScanWordUnquoted(linePos,&linePos);
-		accuracy_radius = ScanWordUntil(linePos,&linePos, '\0');
-		
-		if( NULL==geoname_id ){
-			geoname_id = registered_country_geoname_id;
-			if( NULL==geoname_id ){
-				geoname_id = represented_country_geoname_id;
-			}
-			if( NULL==geoname_id ){
-				// Skip entries with no geoname id
-				continue;
+	dispatch_semaphore_wait(m_filledSem, DISPATCH_TIME_FOREVER);
+	return TakeFilled();
+}
+
+/*
+ As Pop(), for the async writers' event loops, which cannot wait.
+ - Returns YES and sets *ppChunk (NULL at the end) if one was waiting.
+ */
+BOOL ChunkQueue::TryPop(ParsedChunk** ppChunk)
+{
+	if( 0!=dispatch_semaphore_wait(m_filledSem, DISPATCH_TIME_NOW) ){ return NO; }
+	*ppChunk = TakeFilled();
+	return YES;
+}
+
+/*
+ Takes the oldest chunk, once the semaphore says it has been pushed.
+ */
+ParsedChunk* ChunkQueue::TakeFilled()
+{
+	ParsedChunk* pChunk;
+	size_t nPos = m_popPos.load(std::memory_order_relaxed);
+	for( ;; )
+	{
+		ChunkSlot& slot = m_slots[nPos & m_mask];
+		intptr_t nDiff = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)(nPos+1);
+		if( 0==nDiff )
+		{
+			if( m_popPos.compare_exchange_weak(nPos, nPos+1, std::memory_order_relaxed) )
+			{
+				pChunk = slot.pChunk;
+				slot.sequence.store(nPos + m_mask + 1, std::memory_order_release);
+				break;
 			}
 		}
-		
-		dbCallFailed = AddIPBlockToDatabase(network, geoname_id, postal_code, PqConn);
-		if(YES==dbCallFailed){
-			*didFail = YES;
-			return totalProcessed;
+		else if( nDiff<0 ){
+			sched_yield();
+			nPos = m_popPos.load(std::memory_order_relaxed);
+		}
+		else{
+			nPos = m_popPos.load(std::memory_order_relaxed);
 		}
-
-		++totalProcessed;
 	}
-	/*dprintf( STDOUT_FILENO, "GEOIP Block Complete, Number of rows: %u; last ip block:%s\n",
-			 totalProcessed,network );*/
 	
-	return totalProcessed;
+	dispatch_semaphore_signal(m_freeSem);
+	return pChunk;
 }
 
-const char* ScanWordUntil(char* currentPos, char** ppCurrentPos, char until)
+/*
+ Maps nCount buffers of nBufferSize bytes, each starting on a cache line, in one anonymous mapping
+ that is never freed until exit. The chunks keep their buffers as they go round, so nothing is
+ allocated once the import starts. With --huge-pages the mapping is on huge pages if the system
+ has them reserved (MAP_HUGETLB), otherwise madvise() asks for transparent huge pages, which
+ take fewer TLB entries for the parsers' passes over each chunk.
+ - pStride : [out] the bytes from one buffer to the next.
+ - pstrPages : [out] "hugetlb", "thp" or "none", for the results.
+ 
+ - Returns the first buffer, or NULL if the mapping failed.
+ */
+char* MapChunkBuffers(size_t nBufferSize, uint32_t nCount, size_t* pStride, size_t* pLength, const char** pstrPages)
 {
-	if( ','==*currentPos )
-	{
-		// this was an empty string
-		*ppCurrentPos = (currentPos+1);
-		return NULL;
-	}
+	const size_t nHugePageSize = 2*OneMB;
+	*pStride = (nBufferSize + 63) & ~(size_t)63;
+	*pLength = *pStride * nCount;
+	*pstrPages = "none";
 	
-	const char* startPos = currentPos;
-	while( until !=*currentPos )
+	void* pMapped = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+	if( YES==HugePagesMode )
 	{
-		++currentPos;
+		size_t nHugeLength = (*pLength + nHugePageSize - 1) & ~(nHugePageSize - 1);
+		pMapped = mmap(NULL, nHugeLength, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+		if( MAP_FAILED!=pMapped )
+		{
+			*pLength = nHugeLength;
+			*pstrPages = "hugetlb";
+			return (char*)pMapped;
+		}
 	}
+#endif
 	
-	*currentPos = '\0';
-	*ppCurrentPos = (currentPos+1);
-	return startPos;
+	pMapped = mmap(NULL, *pLength, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if( MAP_FAILED==pMapped ){
+		perror("Failed to map the chunk buffers");
+		return NULL;
+	}
+#if defined(MADV_HUGEPAGE)
+	if( YES==HugePagesMode && *pLength>=nHugePageSize && 0==madvise(pMapped, *pLength, MADV_HUGEPAGE) ){
+		*pstrPages = "thp";
+	}
+#endif
+	return (char*)pMapped;
 }
 
-const char* ScanWordMaybeQuoted(char* currentPos, char** ppCurrentPos)
+/*
+ Creates the queues and the chunks that go round them: enough for the reader, every
+ parser and every writer (or --async connection) to hold one while the queues between them are full.
+ - Returns YES if they could not be allocated.
+ */
+BOOL CreateChunks(void)
 {
-	if( ','==*currentPos )
+	WriterResumeSems = new dispatch_semaphore_t[(NumWriters>0) ? NumWriters : 1];
+	for( uint16_t nWriter=0; nWriter<NumWriters; ++nWriter ){
+		WriterResumeSems[nWriter] = dispatch_semaphore_create(0);
+	}
+	
+	uint32_t nWriterChunks = (AsyncConnections>0) ? AsyncConnections : NumWriters;
+	ChunkCount = 1 + 2*(uint32_t)NumParsers + 2*nWriterChunks;
+	if( NO==FreeChunkQ.Create(ChunkCount) ||
+		NO==ReadChunkQ.Create(NumParsers) ||
+		NO==ParsedChunkQ.Create((nWriterChunks>0) ? nWriterChunks : 1) )
 	{
-		// this was an empty string
-		*ppCurrentPos = (currentPos+1);
-		return NULL;
+		dprintf(STDOUT_FILENO, "Failed to allocate the chunk queues.\n");
+		return YES;
 	}
-	uint16_t nQuotes = 0;
-	char cTerminator = ',';
 	
-	const char* startPos = currentPos;
-	while( cTerminator !=*currentPos )
+	// --partitioned : the parsers hand each chunk to its lane's writer; the reader interleaves
+	// the lanes, so two chunks each are enough.
+	if( YES==PartitionedMode )
 	{
-		if( '"'==*currentPos )
+		LaneChunkQs = new ChunkQueue[NumWriters];
+		for( uint16_t nWriter=0; nWriter<NumWriters; ++nWriter )
 		{
-			if( startPos==currentPos){ //skip the first quote
-				startPos+=1;
-				cTerminator = '"';
+			if( NO==LaneChunkQs[nWriter].Create(2) ){
+				dprintf(STDOUT_FILENO, "Failed to allocate the chunk queues.\n");
+				return YES;
 			}
-			++nQuotes;
 		}
-		
-		++currentPos;
 	}
 	
-	// todo - error if quotes not balanced?
-	if( '"'==cTerminator ){
-		*currentPos = '\0'; // terminated at the closing "
-		currentPos++;		//skip the ,
+	// a mapped file is parsed in place, and an inflated one in the inflate ring's buffers,
+	// a buffer more than the chunks.
+	if( NO==MappedFileMode )
+	{
+		uint32_t nBuffers = (YES==CompressedInput) ? ChunkCount+1 : ChunkCount;
+		ChunkBufferPool = MapChunkBuffers(ChunkSize+1, nBuffers, &ChunkBufferStride, &ChunkBufferPoolLength, &ChunkBufferPages);
+		if( NULL==ChunkBufferPool ){
+			dprintf(STDOUT_FILENO, "Failed to allocate %u chunk buffers of %u KB.\n", nBuffers, ChunkSize/OneKB);
+			return YES;
+		}
+		if( YES==HugePagesMode ){
+			dprintf(STDOUT_FILENO, "%u chunk buffers of %u KB on %s pages.\n", nBuffers, ChunkSize/OneKB,
+					(0==strcmp(ChunkBufferPages, "hugetlb") ? "huge" : (0==strcmp(ChunkBufferPages, "thp") ? "transparent huge" : "normal")));
+		}
 	}
 	
-	*currentPos = '\0';
-	*ppCurrentPos = (currentPos+1);
-	return startPos;
+	for( uint32_t nChunk=0; nChunk<ChunkCount; ++nChunk )
+	{
+		ParsedChunk* pChunk = new ParsedChunk();
+		if( NO==MappedFileMode && NO==CompressedInput )
+		{
+			pChunk->pBuffer = ChunkBufferPool + nChunk*ChunkBufferStride;
+			*(pChunk->pBuffer + ChunkSize) = '?';
+		}
+		FreeChunkQ.Push(pChunk);
+	}
+	return NO;
 }
 
-/* Does NOT look for quotes.
- 
-	Scans the string up until the comma char, which is then replaced
-	with a '\0' and the currentPos returned as the following char.
- 
- ppCurrentPos = [out] the next character to be scanned
- 
- Returns the start of the string sequence.
+/*
+ Hands a chunk back to the reader once it is written (or skipped), keeping its buffer
+ and the capacity of its vectors.
  */
-const char* ScanWordUnquoted(char* currentPos, char** ppCurrentPos)
+void RecycleChunk(ParsedChunk* pChunk)
 {
-	if( ','==*currentPos )
-	{
-		// this was an empty string
-		*ppCurrentPos = (currentPos+1);
-		return NULL;
+	// --collapse : the chunk of joined edge runs has no block of the file.
+	if( YES==CompressedInput && NULL!=pChunk->startPos ){
+		ReleaseInflatedBlock(pChunk->startPos);
 	}
+	pChunk->fields.clear();
+	pChunk->dimensions.Clear();
+	pChunk->collapsedText.clear();
+	pChunk->nFirstRow = 0;
+	FreeChunkQ.Push(pChunk);
+}
+
+/*
+ The reader stage: fills recycled chunks from the file (or claims the ranges of the
+ mapping, or the inflated blocks) until it ends, then tells each parser.
+ */
+void ReadChunks(void)
+{
+	ThreadMetrics = &Metrics[0];
 	
-	const char* startPos = currentPos;
-	while( ',' !=*currentPos )
+	while( NO==AbortProgram )
 	{
-		++currentPos;
+		ParsedChunk* pChunk = FreeChunkQ.Pop();
+		
+		uint64_t nStartNanos = MonotonicNanos();
+		off_t nBytesRead;
+		if( YES==MappedFileMode )
+		{
+			nBytesRead = ClaimMappedBlock(&pChunk->startPos, &pChunk->endPos, &pChunk->filePos, &pChunk->nLane);
+		}
+		else if( YES==CompressedInput )
+		{
+			nBytesRead = ClaimInflatedBlock(&pChunk->startPos, &pChunk->endPos, &pChunk->filePos);
+		}
+		else
+		{
+			pChunk->startPos = pChunk->pBuffer;
+			nBytesRead = LoadFileBlock(pChunk->pBuffer, pChunk->pBuffer + ChunkSize, &pChunk->endPos, &pChunk->filePos);
+			
+			// --release : the next file is read when one ends.
+			while( 0==nBytesRead && YES==OpenNextReleaseFile() ){
+				nBytesRead = LoadFileBlock(pChunk->pBuffer, pChunk->pBuffer + ChunkSize, &pChunk->endPos, &pChunk->filePos);
+			}
+		}
+		
+		// nothing was claimed, so there is no inflated block to release.
+		if( nBytesRead <=0 )
+		{
+			if( nBytesRead<0 ){ AbortProgram = YES; }
+			FreeChunkQ.Push(pChunk);
+			break;
+		}
+		RecordStage(STAGE_READ, nStartNanos);
+		
+		pChunk->nBytes = nBytesRead;
+		pChunk->fileMode = InputFileMode;
+		ReadChunkQ.Push(pChunk);
 	}
 	
-	*currentPos = '\0';
-	*ppCurrentPos = (currentPos+1);
-	return startPos;
+	for( uint16_t nParser=0; nParser<NumParsers; ++nParser ){
+		ReadChunkQ.Push(NULL);
+	}
 }
 
-void ProgramCleanup(void)
+/*
+ A parser: splits each chunk read into its rows (as the file it came from) and passes it to the writers.
+ With --emit-db the rows are added to the lookup database here, and there are no writers.
+ The last parser to finish tells the writers.
+ */
+void ParseChunks(uint16_t nParser)
 {
-	if( InputFile>0 ){ close(InputFile); }
+	ThreadMetrics = &Metrics[nParser];
+	WorkerMetrics* pMetrics = ThreadMetrics;
 	
-	dprintf( STDOUT_FILENO,"geoimport - program end.\n" );
+	ParsedChunk* pChunk;
+	while( NULL!=(pChunk = ReadChunkQ.Pop()) )
+	{
+		// --resume : a chunk the interrupted import finished need not be parsed, except for
+		// a Locations chunk's dimensions.
+		const ChunkCheckpoint* pCheckpoint = (YES==ResumeMode) ? ResumedCheckpoint(pChunk) : NULL;
+		FILETYPE fileMode = pChunk->fileMode;
+		
+		// after a failure the chunks are only passed back, so every stage drains and ends.
+		if( YES==AbortProgram || (NULL!=pCheckpoint && YES==pCheckpoint->isComplete && IPBLOCKS==fileMode) )
+		{
+			RecycleChunk(pChunk);
+			continue;
+		}
+		
+		uint64_t nStartNanos = MonotonicNanos();
+		uint32_t nChunkRows = (IPBLOCKS==fileMode) ? ParseBlocks(pChunk) : ParseLocations(pChunk);
+		if( YES==CollapseMode && IPBLOCKS==fileMode ){
+			nChunkRows = CollapseBlocks(pChunk);
+		}
+		RecordStage(STAGE_PARSE, nStartNanos);
+		
+		if( NULL!=pCheckpoint && YES==ResumeChunk(fileMode, pChunk, *pCheckpoint) )
+		{
+			RecycleChunk(pChunk);
+			continue;
+		}
+		
+		if( NULL!=EmitDbPath )
+		{
+			pMetrics->rows.fetch_add(nChunkRows, std::memory_order_relaxed);
+			pMetrics->bytes.fetch_add((uint64_t)pChunk->nBytes, std::memory_order_relaxed);
+			TotalRowsProcessed += nChunkRows;
+			RecycleChunk(pChunk);
+			continue;
+		}
+		if( YES==PartitionedMode ){
+			LaneChunkQs[pChunk->nLane].Push(pChunk);
+		}
+		else{
+			ParsedChunkQ.Push(pChunk);
+		}
+	}
+	
+	// each writer passes the end on, so one is enough however many are running; with
+	// --partitioned each lane ends on its own.
+	if( 1==ParsersRunning.fetch_sub(1) && NumWriters>0 )
+	{
+		// --collapse : every chunk's edge runs are in, so the last parser joins them.
+		std::vector<ParsedChunk*> edgeChunks;
+		if( YES==CollapseMode && NO==AbortProgram ){
+			JoinEdgeRuns(edgeChunks);
+		}
+		for( ParsedChunk* pEdgeChunk : edgeChunks )
+		{
+			if( YES==PartitionedMode ){
+				LaneChunkQs[pEdgeChunk->nLane].Push(pEdgeChunk);
+			}
+			else{
+				ParsedChunkQ.Push(pEdgeChunk);
+			}
+		}
+		
+		if( YES==PartitionedMode )
+		{
+			for( uint16_t nWriter=0; nWriter<NumWriters; ++nWriter ){
+				LaneChunkQs[nWriter].Push(NULL);
+			}
+		}
+		else{
+			ParsedChunkQ.Push(NULL);
+		}
+	}
 }
 
-const char* AdjustEndPointer(int fdInputFile, const char* pBufferStart, const char* endPos)
+/*
+ Connects a writer, prepared for the file type and mode.
+ - Returns YES if connected.
+ */
+static BOOL OpenWriterConnection(FILETYPE fileMode, const char* strDbName, PostgresConnection& pgConnx)
 {
-	if( '\n'==*endPos ){ return endPos; } //no adjustment needed.
+	if( NO==pgConnx.Connect( strDbName) ){ return NO; }
+	PQsetClientEncoding(pgConnx, "UTF8" );
 	
-	char* endPtr = (char*)endPos;
+	// --release : the writers take both files' chunks, so are prepared for both.
+	FILETYPE otherMode = (IPBLOCKS==fileMode) ? LOCATIONS : IPBLOCKS;
 	
-	while( endPtr>pBufferStart )
+	// prepare before pipeline mode, PQprepare() waits for its result.
+	// COPY replays a failed chunk with them too.
+	if( YES==UsePreparedStatements &&
+		(YES==PrepareStatements(fileMode, pgConnx) || (YES==ReleaseMode && YES==PrepareStatements(otherMode, pgConnx))) )
 	{
-		if( '\n' == *endPtr ){ break; }
-		
-		*endPtr = 'X';
-		--endPtr;
+		return NO;
 	}
-	++endPtr; //skip forwards to pass the \n
-	off_t offset = (endPtr - endPos);
+	if( PipelineDepth>0 && NO==pgConnx.EnterPipelineMode(PipelineDepth) ){ return NO; }
+	if( AsyncConnections>0 && 0==PipelineDepth && NO==pgConnx.EnterPipelineMode(ASYNC_PIPELINE_DEPTH) ){ return NO; }
 	
-	// track current filepointer back so next read starts at the beginning of a line.
-	//off_t currOffset =
-	lseek(fdInputFile, offset, SEEK_CUR);
-	
-	return endPtr;
+	// In bulk mode each chunk is written with COPY, rather than row by row.
+	if( YES==BulkCopyMode &&
+		(YES==PrepareBulkCopy(fileMode, pgConnx) || (YES==ReleaseMode && YES==PrepareBulkCopy(otherMode, pgConnx))) )
+	{
+		return NO;
+	}
+	return YES;
 }
 
+/*
+ Starts a writer on the global queue, in the group main() waits for.
+ */
+static void StartWriter(dispatch_group_t fileProcGrp, FILETYPE fileMode, const char* strDbName, uint16_t nWriter)
+{
+	dispatch_queue_t dpQ = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT,0);
+	dispatch_group_async(fileProcGrp, dpQ,
+		 ^{
+			 dprintf(STDOUT_FILENO,"Writer id:%u has started-----\n",nWriter);
+			 
+			 uint32_t nProcessed = (AsyncConnections>0) ? AsyncWriteChunks(fileMode,strDbName,nWriter)
+														: WriteChunks(fileMode,strDbName,nWriter);
+			 
+			 dprintf(STDOUT_FILENO,"Writer id:%u has completed. Rows %s:%u----\n",nWriter,
+					 (SINK_POSTGRES==SinkType) ? "inserted" : "written", nProcessed);
+			 TotalRowsProcessed += nProcessed;
+		 });
+}
 
 /*
-	Reads the input until max chars reached, or newline.
- 
-	Sets the newline char to \0  and passes back pointer to start of null
-	terminated line.
- 
-	adjusts ppCurPos with the new position
-	decrements chars available.
+ Sets the writers connected: those up to nLevel not started yet are, parked ones are woken,
+ and those above it park after their current chunk. Called on main's thread.
  */
-char* ReadLine( char** ppCurPos, const char* endPos )
+void SetWriterLevel(uint16_t nLevel, dispatch_group_t fileProcGrp, FILETYPE fileMode, const char* strDbName)
 {
-	char* curPos = *ppCurPos;
-	char* lineStart = curPos;
-	
-	// scan forward looking for the \r\n (or just \n)
-	while( curPos<endPos )
+	uint16_t nPrevious = ActiveWriters;
+	ActiveWriters = nLevel;
+	for( uint16_t nWriter=nPrevious+1; nWriter<=nLevel; ++nWriter )
 	{
-		if( '\n'==*curPos ){
-			// null terminate the found line so we can str functions on it.
-			*curPos = '\0';
-			++curPos;
-			break;
+		if( nWriter>WritersStarted )
+		{
+			StartWriter(fileProcGrp, fileMode, strDbName, nWriter);
+			WritersStarted = nWriter;
+		}
+		else{
+			dispatch_semaphore_signal(WriterResumeSems[nWriter-1]);
 		}
-		++curPos;
 	}
-	
-	*ppCurPos = curPos;
-	return lineStart;
 }
 
-static char PGConnectionString[512];
-
-/*
- looks for the dbname and filename of .csv
+/* Writer - called by the dispatch group block to:
+  - open its sink: a connection, prepared for the file type and mode, unless --sink
+  - write the rows of each parsed chunk, committing each chunk (or -R rows)
+  - with -P auto, close the connection and park while above the level chosen
+  A row the database refuses is written to the reject file; only a lost
+  connection or similar stops the import.
+ 
+  - Returns the rows written.
+ */
+uint32_t WriteChunks(FILETYPE fileMode, const char* strDbName, uint16_t nWriter)
+{
+	uint32_t totalProcessed = 0;
+	ThreadMetrics = &Metrics[NumParsers + nWriter];
+	WorkerMetrics* pMetrics = ThreadMetrics;
+	
+	const RowSink& sink = RowSinks[SinkType];
+	SinkWriter writer;
+	BOOL didFail = NO;
+	ChunkQueue& chunkQ = (YES==PartitionedMode) ? LaneChunkQs[nWriter-1] : ParsedChunkQ;
+	
+	for( ;; )
+	{
+		if( nWriter>ActiveWriters && NO==WritersFinished )
+		{
+			sink.Close(writer);
+			writer.isOpen = NO;
+			dispatch_semaphore_wait(WriterResumeSems[nWriter-1], DISPATCH_TIME_FOREVER);
+			continue;
+		}
+		if( YES==WritersFinished ){ break; }
+		
+		if( NO==writer.isOpen && NO==AbortProgram )
+		{
+			writer.isOpen = sink.Open(fileMode, strDbName, writer);
+			if( NO==writer.isOpen ){ AbortProgram = YES; }
+		}
+		
+		// the end is passed on to the other writers, and wakes the parked ones to end too.
+		// A lane's is its writer's alone, the others still have their lanes to write.
+		ParsedChunk* pChunk = chunkQ.Pop();
+		if( NULL==pChunk && YES==PartitionedMode ){ break; }
+		if( NULL==pChunk )
+		{
+			ParsedChunkQ.Push(NULL);
+			WritersFinished = YES;
+			for( uint16_t nParked=0; nParked<NumWriters; ++nParked ){
+				dispatch_semaphore_signal(WriterResumeSems[nParked]);
+			}
+			break;
+		}
+		
+		if( NO==AbortProgram )
+		{
+			uint32_t nChunkRows = sink.Write(pChunk, writer, &didFail);
+			pMetrics->rows.fetch_add(nChunkRows, std::memory_order_relaxed);
+			pMetrics->bytes.fetch_add((uint64_t)pChunk->nBytes, std::memory_order_relaxed);
+			totalProcessed += nChunkRows;
+			
+			if( YES==didFail ){ AbortProgram = YES; }
+		}
+		RecycleChunk(pChunk);
+	}
+	
+	return totalProcessed;
+}
+
+
+static const char* BlocksHeader
+= "network,geoname_id,registered_country_geoname_id,represented_country_geoname_id,is_anonymous_proxy,is_satellite_provider,postal_code,latitude,longitude,accuracy_radius";
+
+static const char LocationsHeader[]
+= "geoname_id,locale_code,continent_code,continent_name,country_iso_code,country_name,subdivision_1_iso_code,subdivision_1_name,subdivision_2_iso_code,subdivision_2_name,city_name,metro_code,time_zone";
+
+/*
+ - fdInputFile : Input file file descriptor.
+ 
+ - Returns : [IPBLOCKS|LOCATIONS]
+ */
+BOOL ReadHeader( int fdInputFile, FILETYPE* pFileMode, uint16_t* pHeaderSize)
+{
+	// read and char scan the first line, up to n bytes looking for
+	// newline '\n ' char.
+	uint16_t nMaxChars = sizeof(LocationsHeader);
+	char buffer[ nMaxChars ];
+	char* pWritepos = buffer;
+	const char* strHeader = &buffer[0];
+	
+	uint16_t nCharsRead = 0;
+	off_t nBytesRead;
+	while( nCharsRead<nMaxChars )
+	{
+		nBytesRead = read(fdInputFile,pWritepos,1);
+		if(-1==nBytesRead ){
+			perror("Error on reading .csv file.");
+			return NO;
+		}
+		if( 0==nBytesRead ){ break; } // a file of one line, or none
+		
+		nCharsRead += nBytesRead;
+		if( '\n' == *pWritepos ){
+			break;
+		}
+		++pWritepos;
+	}
+	*pWritepos = '\0';
+	*pHeaderSize = nCharsRead;
+	
+	return MatchHeader(strHeader, pFileMode);
+}
+
+/*
+ - strHeader : the first line, without its newline.
+ 
+ - Returns YES if it is the header of a Locations or IP Blocks file, and which.
+ */
+static BOOL MatchHeader( const char* strHeader, FILETYPE* pFileMode )
+{
+	if(0==strcmp(strHeader,BlocksHeader) ){
+		*pFileMode = IPBLOCKS;
+	}
+	else if( 0==strcmp(strHeader,LocationsHeader) ){
+		*pFileMode = LOCATIONS;
+	}
+	else{
+		dprintf( STDOUT_FILENO,
+				"geoimport - invalid .csv file, header not from a recognised source (Locations or IP Blocks).\n" );
+		return NO;
+	}
+	
+	return YES; //;  //=0,
+}
+
+
+// The partial line after the last newline LoadFileBlock() read, which starts its next chunk.
+static std::vector<char> ReadCarry;
+
+/*
+ Loads up to a chunk (-B) of whole lines: the partial line the last call carried, then the
+ file after it. The chunk ends after its last newline and the rest is carried, as for the
+ inflated blocks. The end of the file ends the last line, which may have no newline.
+ - pWriteBuffer : Pointer to the char buffer we can fill, with a byte past endPos for a '\0'.
+ - endPos : Pointer to the end of the buffer (i.e. pWriteBuffer + ChunkSize)
+ - ppOutEndPos : [out] the end of the chunk's last line.
+ - filePos : [out] the file offset of the chunk's first line.
+ 
+ - Returns : the bytes in the chunk, 0 at the end of the file, or -1 if an error ocurred.
+ */
+off_t LoadFileBlock( char* pWriteBuffer, const char* endPos, const char** ppOutEndPos, off_t* filePos)
+{
+	size_t nUsed = ReadCarry.size();
+	*filePos = lseek(InputFile, 0, SEEK_CUR) - (off_t)nUsed;
+	memcpy(pWriteBuffer, ReadCarry.data(), nUsed);
+	ReadCarry.clear();
+	
+	size_t nCapacity = (size_t)(endPos-pWriteBuffer);
+	BOOL bAtEnd = NO;
+	while( nUsed<nCapacity )
+	{
+		ssize_t nBytesRead = read(InputFile, pWriteBuffer+nUsed, nCapacity-nUsed);
+		if( -1==nBytesRead ){
+			perror("Error on reading .csv file.");
+			return -1;
+		}
+		if( 0==nBytesRead )
+		{
+			bAtEnd = YES;
+			break;
+		}
+		nUsed += nBytesRead;
+	}
+	if( 0==nUsed ){ return 0; }
+	
+	const char* pLastNewline = pWriteBuffer + nUsed;
+	if( YES==bAtEnd )
+	{
+		// the tokenizer needs a '\0' after a last line with no newline.
+		pWriteBuffer[nUsed] = '\0';
+	}
+	else
+	{
+		while( pLastNewline>pWriteBuffer && '\n'!=*(pLastNewline-1) ){ --pLastNewline; }
+		if( pLastNewline==pWriteBuffer ){
+			dprintf(STDOUT_FILENO, "Line longer than %zu bytes in .csv file.\n", nCapacity);
+			return -1;
+		}
+		ReadCarry.assign(pLastNewline, (const char*)pWriteBuffer + nUsed);
+	}
+	
+	*ppOutEndPos = pLastNewline;
+	off_t sizeBuff = (pLastNewline - pWriteBuffer);
+	FileBytesRemaining -= sizeBuff;
+	return sizeBuff;
+}
+
+
+/*
+ Line aligned ranges of the mapped file (-M), claimed by the processors through NextMappedBlock.
+ With --partitioned, AssignPartitionLanes() reorders them so the writers' lanes take turns.
+ */
+typedef struct MAPPEDBLOCK { char* startPos; const char* endPos; uint16_t nLane; } MappedBlock;
+
+static char*	MappedFile = NULL;
+static size_t	MappedFileLength = 0;
+static std::vector<MappedBlock> MappedBlocks;
+static std::atomic<size_t> NextMappedBlock(0);
+
+/*
+ Maps the whole file copy-on-write (the parser terminates fields in place, so the kernel
+ copies each page it writes to) and splits the rows after the header into ranges of
+ about a chunk (-B), each ending after a newline.
+ The mapping is followed by a zero filled page, so the last line is always terminated.
+ 
+ - Returns YES if the file was mapped.
+ */
+BOOL MapInputFile( int fdInputFile, uint16_t nHeaderSize )
+{
+	size_t nPageSize = (size_t)sysconf(_SC_PAGESIZE);
+	MappedFileLength = (size_t)FileTotalSize + nPageSize;
+	
+	void* pReserved = mmap(NULL, MappedFileLength, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if( MAP_FAILED==pReserved ){
+		perror("Failed to reserve memory for .csv file.");
+		return NO;
+	}
+	MappedFile = (char*)pReserved;
+	
+	if( FileTotalSize>0 &&
+		MAP_FAILED==mmap(MappedFile, (size_t)FileTotalSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fdInputFile, 0) )
+	{
+		perror("Failed to map .csv file.");
+		return NO;
+	}
+	madvise(MappedFile, (size_t)FileTotalSize, MADV_SEQUENTIAL);
+	
+	char* startPos = MappedFile + nHeaderSize;
+	const char* fileEnd = MappedFile + FileTotalSize;
+	while( startPos<fileEnd )
+	{
+		char* endPos = startPos + ChunkSize;
+		if( endPos>=fileEnd ){
+			endPos = (char*)fileEnd;
+		}
+		else{
+			// extend to the end of the current line.
+			char* pNewline = (char*)memchr(endPos-1, '\n', fileEnd-(endPos-1));
+			endPos = (NULL!=pNewline) ? pNewline+1 : (char*)fileEnd;
+		}
+		
+		MappedBlock block = { startPos, endPos, 0 };
+		MappedBlocks.push_back(block);
+		startPos = endPos;
+	}
+	
+	return YES;
+}
+
+/*
+ Claims the next unprocessed range of the mapped file, no read() and no shared file offset.
+ The parser's writes still copy the range's pages, the mapping is private.
+ - ppStartPos, ppOutEndPos : [out] the range claimed.
+ - pnLane : [out] --partitioned : the writer of its partitions.
+ 
+ - Returns the bytes in the range, or 0 when every range has been claimed.
+ */
+off_t ClaimMappedBlock( char** ppStartPos, const char** ppOutEndPos, off_t* filePos, uint16_t* pnLane )
+{
+	size_t nBlock = NextMappedBlock++;
+	if( nBlock>=MappedBlocks.size() ){ return 0; }
+	
+	const MappedBlock& block = MappedBlocks[nBlock];
+	*ppStartPos = block.startPos;
+	*ppOutEndPos = block.endPos;
+	*filePos = (block.startPos - MappedFile);
+	*pnLane = block.nLane;
+	
+	off_t sizeBuff = (block.endPos - block.startPos);
+	FileBytesRemaining -= sizeBuff;
+	return sizeBuff;
+}
+
+/*			Compressed input (.zip / .gz)			*/
+
+/*
+ A single inflating block fills a ring of chunk (-B) buffers with whole lines, which the
+ processors claim in turn and hand back once written, so the .csv is never written
+ to disk and inflating overlaps parsing and the database.
+ */
+typedef struct INFLATEDBLOCK { char* startPos; const char* endPos; off_t filePos; } InflatedBlock;
+
+static z_stream	Inflater;
+static BOOL		InflaterIsGzip = NO;
+static BOOL		InflaterIsStored = NO;	// a .zip entry saved without compression
+static BOOL		InflaterAtStreamEnd = NO;
+static off_t	CompressedPos = 0;		// the compressed data still to read from the file
+static off_t	CompressedEnd = 0;
+static off_t	InflatedPos = 0;
+
+const int COMPRESSED_READ_SIZE = 256 * OneKB;
+static char*	CompressedBuffer = NULL;
+
+// the partial last line of a block, which starts the next block.
+static char*	CarryBuffer = NULL;
+static size_t	CarryBytes = 0;
+
+static std::deque<InflatedBlock> InflatedBlocks;
+static std::vector<char*> FreeInflateBuffers;
+static dispatch_queue_t InflateRingQ = NULL;
+static dispatch_semaphore_t InflatedBlocksSem = NULL;
+static dispatch_semaphore_t FreeInflateBuffersSem = NULL;
+
+static uint16_t ReadLE16(const unsigned char* p){ return (uint16_t)(p[0] | (p[1]<<8)); }
+static uint32_t ReadLE32(const unsigned char* p){
+	return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static BOOL EndsWith(const std::string& strValue, const char* strSuffix)
+{
+	size_t nSuffixLen = strlen(strSuffix);
+	return (strValue.size()>=nSuffixLen && 0==strValue.compare(strValue.size()-nSuffixLen, nSuffixLen, strSuffix)) ? YES : NO;
+}
+
+/*
+ - Returns YES if the file starts with the gzip or zip signature.
+ */
+BOOL IsCompressedFile( int fdInputFile )
+{
+	unsigned char signature[4] = {0};
+	if( (ssize_t)sizeof(signature)!=pread(fdInputFile, signature, sizeof(signature), 0) ){ return NO; }
+	
+	InflaterIsGzip = (0x1f==signature[0] && 0x8b==signature[1]) ? YES : NO;
+	return (YES==InflaterIsGzip || 0x04034b50==ReadLE32(signature)) ? YES : NO;
+}
+
+/*
+ Finds the .csv to import in the zip's central directory, and sets the compressed
+ range to its data. Zip64 archives are not supported.
+ - strEntryName : matched against the end of each entry's path, or NULL to take the only .csv.
+ 
+ - Returns YES if found.
+ */
+static BOOL FindZipEntry( int fdInputFile, const char* strEntryName )
+{
+	// the end of central directory record is within the last 64KB + 22 bytes.
+	const off_t nEocdSize = 22;
+	off_t nTailSize = (FileTotalSize < 65535 + nEocdSize) ? FileTotalSize : 65535 + nEocdSize;
+	std::vector<unsigned char> tail((size_t)nTailSize);
+	if( nTailSize<nEocdSize || nTailSize!=pread(fdInputFile, tail.data(), (size_t)nTailSize, FileTotalSize-nTailSize) ){
+		dprintf(STDOUT_FILENO, "Invalid .zip file, too short.\n");
+		return NO;
+	}
+	
+	const unsigned char* pEocd = NULL;
+	for( off_t nPos=nTailSize-nEocdSize; nPos>=0 && NULL==pEocd; --nPos ){
+		if( 0x06054b50==ReadLE32(&tail[nPos]) ){ pEocd = &tail[nPos]; }
+	}
+	if( NULL==pEocd ){
+		dprintf(STDOUT_FILENO, "Invalid .zip file, no central directory.\n");
+		return NO;
+	}
+	
+	uint16_t nEntries = ReadLE16(pEocd+10);
+	uint32_t nDirSize = ReadLE32(pEocd+12);
+	uint32_t nDirOffset = ReadLE32(pEocd+16);
+	if( 0xFFFF==nEntries || 0xFFFFFFFF==nDirOffset || (off_t)nDirOffset + nDirSize > FileTotalSize ){
+		dprintf(STDOUT_FILENO, "Unsupported .zip file (Zip64 or damaged).\n");
+		return NO;
+	}
+	
+	std::vector<unsigned char> dir(nDirSize);
+	if( (ssize_t)nDirSize!=pread(fdInputFile, dir.data(), nDirSize, nDirOffset) ){
+		perror("Error on reading .zip file.");
+		return NO;
+	}
+	
+	// central directory entries: method at 10, sizes at 20 and 24, name length at 28,
+	// extra and comment lengths at 30 and 32, local header offset at 42, name at 46.
+	std::vector<std::string> csvNames;
+	std::string strFound;
+	uint16_t nMethod = 0;
+	uint32_t nCompressedSize = 0, nInflatedSize = 0, nLocalOffset = 0;
+	int nMatches = 0;
+	
+	const unsigned char* pEntry = dir.data();
+	const unsigned char* pDirEnd = pEntry + nDirSize;
+	for( uint16_t nEntry=0; nEntry<nEntries; ++nEntry )
+	{
+		if( pEntry+46>pDirEnd || 0x02014b50!=ReadLE32(pEntry) ||
+			pEntry+46+ReadLE16(pEntry+28)>pDirEnd )
+		{
+			dprintf(STDOUT_FILENO, "Invalid .zip file, damaged central directory.\n");
+			return NO;
+		}
+		
+		std::string strName((const char*)pEntry+46, ReadLE16(pEntry+28));
+		if( YES==EndsWith(strName, ".csv") )
+		{
+			csvNames.push_back(strName);
+			if( NULL==strEntryName || YES==EndsWith(strName, strEntryName) )
+			{
+				++nMatches;
+				strFound = strName;
+				nMethod = ReadLE16(pEntry+10);
+				nCompressedSize = ReadLE32(pEntry+20);
+				nInflatedSize = ReadLE32(pEntry+24);
+				nLocalOffset = ReadLE32(pEntry+42);
+			}
+		}
+		pEntry += 46 + ReadLE16(pEntry+28) + ReadLE16(pEntry+30) + ReadLE16(pEntry+32);
+	}
+	
+	if( 1!=nMatches )
+	{
+		dprintf(STDOUT_FILENO, "%s .csv in the .zip matches%s%s, choose one with --entry:\n",
+				(0==nMatches ? "No" : "More than one"),
+				(NULL!=strEntryName ? " " : ""), (NULL!=strEntryName ? strEntryName : ""));
+		for( size_t nName=0; nName<csvNames.size(); ++nName ){
+			dprintf(STDOUT_FILENO, "\t%s\n", csvNames[nName].c_str());
+		}
+		return NO;
+	}
+	if( 0!=nMethod && Z_DEFLATED!=nMethod ){
+		dprintf(STDOUT_FILENO, "Unsupported .zip compression method %u for %s.\n", nMethod, strFound.c_str());
+		return NO;
+	}
+	
+	// the local header's name and extra lengths can differ from the central directory's.
+	unsigned char localHeader[30];
+	if( (ssize_t)sizeof(localHeader)!=pread(fdInputFile, localHeader, sizeof(localHeader), nLocalOffset) ||
+		0x04034b50!=ReadLE32(localHeader) )
+	{
+		dprintf(STDOUT_FILENO, "Invalid .zip file, damaged local header for %s.\n", strFound.c_str());
+		return NO;
+	}
+	
+	CompressedPos = (off_t)nLocalOffset + sizeof(localHeader) + ReadLE16(localHeader+26) + ReadLE16(localHeader+28);
+	CompressedEnd = CompressedPos + nCompressedSize;
+	InflaterIsStored = (0==nMethod) ? YES : NO;
+	
+	dprintf(STDOUT_FILENO, "Importing %s from the .zip (%u MB).\n", strFound.c_str(), nInflatedSize/OneMB);
+	return YES;
+}
+
+/*
+ Inflates (or for a stored entry copies) up to nSpace bytes of the .csv.
+ - pnWritten : [out] the bytes written.
+ - pAtEnd : [out] YES once the whole .csv has been inflated.
+ 
+ - Returns YES if the data is damaged or could not be read.
+ */
+static BOOL InflateInto( char* pWrite, size_t nSpace, size_t* pnWritten, BOOL* pAtEnd )
+{
+	Inflater.next_out = (Bytef*)pWrite;
+	Inflater.avail_out = (uInt)nSpace;
+	*pAtEnd = NO;
+	
+	while( Inflater.avail_out>0 && NO==InflaterAtStreamEnd )
+	{
+		if( 0==Inflater.avail_in && CompressedPos<CompressedEnd )
+		{
+			off_t nRead = CompressedEnd - CompressedPos;
+			if( nRead>COMPRESSED_READ_SIZE ){ nRead = COMPRESSED_READ_SIZE; }
+			nRead = pread(InputFile, CompressedBuffer, (size_t)nRead, CompressedPos);
+			if( nRead<=0 ){
+				perror("Error on reading compressed file.");
+				return YES;
+			}
+			CompressedPos += nRead;
+			FileBytesRemaining -= nRead;
+			Inflater.next_in = (Bytef*)CompressedBuffer;
+			Inflater.avail_in = (uInt)nRead;
+		}
+		
+		if( YES==InflaterIsStored )
+		{
+			if( 0==Inflater.avail_in )
+			{
+				InflaterAtStreamEnd = YES;
+				break;
+			}
+			uInt nCopy = (Inflater.avail_in<Inflater.avail_out) ? Inflater.avail_in : Inflater.avail_out;
+			memcpy(Inflater.next_out, Inflater.next_in, nCopy);
+			Inflater.next_in += nCopy; Inflater.avail_in -= nCopy;
+			Inflater.next_out += nCopy; Inflater.avail_out -= nCopy;
+			continue;
+		}
+		
+		// once the input is all read, zlib may still hold output, Z_FINISH drains it.
+		int nFlush = (0==Inflater.avail_in) ? Z_FINISH : Z_NO_FLUSH;
+		uInt nSpaceBefore = Inflater.avail_out;
+		int zResult = inflate(&Inflater, nFlush);
+		if( Z_STREAM_END==zResult )
+		{
+			// a .gz may hold several members, each a stream of its own.
+			if( YES==InflaterIsGzip && (Inflater.avail_in>0 || CompressedPos<CompressedEnd) ){
+				inflateReset(&Inflater);
+				continue;
+			}
+			InflaterAtStreamEnd = YES;
+		}
+		else if( Z_BUF_ERROR==zResult )
+		{
+			// no progress with input all read and space left: the stream stops short.
+			if( Inflater.avail_out>0 && Inflater.avail_out==nSpaceBefore ){
+				dprintf(STDOUT_FILENO, "Compressed file is truncated.\n");
+				return YES;
+			}
+		}
+		else if( Z_OK!=zResult )
+		{
+			dprintf(STDOUT_FILENO, "Failed to inflate - %s\n", (NULL!=Inflater.msg) ? Inflater.msg : "damaged data");
+			return YES;
+		}
+	}
+	
+	*pnWritten = nSpace - Inflater.avail_out;
+	*pAtEnd = InflaterAtStreamEnd;
+	return NO;
+}
+
+/*
+ Fills a buffer of ChunkSize+1 bytes with whole lines: the partial line left by the
+ previous block, then inflated data up to its last newline.
+ - ppEndPos : [out] the end of the lines, pBuffer when there are none left.
+ 
+ - Returns YES if inflating failed, or a line is longer than the buffer.
+ */
+static BOOL FillInflatedBlock( char* pBuffer, const char** ppEndPos, BOOL* pAtEnd )
+{
+	memcpy(pBuffer, CarryBuffer, CarryBytes);
+	size_t nUsed = CarryBytes;
+	CarryBytes = 0;
+	
+	size_t nWritten = 0;
+	if( YES==InflateInto(pBuffer + nUsed, ChunkSize - nUsed, &nWritten, pAtEnd) ){ return YES; }
+	nUsed += nWritten;
+	
+	// the last line may not end with a newline, the tokenizer needs a '\0' after it.
+	if( YES==*pAtEnd )
+	{
+		pBuffer[nUsed] = '\0';
+		*ppEndPos = pBuffer + nUsed;
+		return NO;
+	}
+	
+	const char* pLastNewline = pBuffer + nUsed;
+	while( pLastNewline>pBuffer && '\n'!=*(pLastNewline-1) ){ --pLastNewline; }
+	if( pLastNewline==pBuffer ){
+		dprintf(STDOUT_FILENO, "Line longer than %u bytes in compressed file.\n", ChunkSize);
+		return YES;
+	}
+	
+	CarryBytes = (pBuffer + nUsed) - pLastNewline;
+	memcpy(CarryBuffer, pLastNewline, CarryBytes);
+	*ppEndPos = pLastNewline;
+	return NO;
+}
+
+/*
+ Opens the .gz stream, or the .csv entry of a .zip, and inflates the first block to
+ read the header. The rest of that block is the first block the processors claim.
+ 
+ - Returns YES if the header was recognised.
+ */
+BOOL OpenCompressedInput( int fdInputFile, FILETYPE* pFileMode )
+{
+	if( YES==InflaterIsGzip )
+	{
+		CompressedPos = 0;
+		CompressedEnd = FileTotalSize;
+	}
+	else if( NO==FindZipEntry(fdInputFile, ZipEntryName) )
+	{
+		return NO;
+	}
+	FileBytesRemaining = CompressedEnd - CompressedPos;
+	
+	// gzip header (16+) or the raw deflate data of a zip entry (-).
+	memset(&Inflater, 0, sizeof(Inflater));
+	if( Z_OK!=inflateInit2(&Inflater, (YES==InflaterIsGzip) ? 16+MAX_WBITS : -MAX_WBITS) ){
+		dprintf(STDOUT_FILENO, "Failed to initialise zlib.\n");
+		return NO;
+	}
+	
+	CompressedBuffer = (char*)malloc(COMPRESSED_READ_SIZE);
+	CarryBuffer = (char*)malloc(ChunkSize);
+	char* pFirstBuffer = (char*)malloc(ChunkSize+1);
+	if( NULL==CompressedBuffer || NULL==CarryBuffer || NULL==pFirstBuffer ){
+		dprintf(STDOUT_FILENO, "Failed to allocate inflate buffers.\n");
+		return NO;
+	}
+	
+	BOOL bAtEnd;
+	const char* endPos;
+	if( YES==FillInflatedBlock(pFirstBuffer, &endPos, &bAtEnd) ){ return NO; }
+	
+	const char* pNewline = (const char*)memchr(pFirstBuffer, '\n', endPos - pFirstBuffer);
+	if( NULL==pNewline ){
+		dprintf(STDOUT_FILENO, "geoimport - invalid .csv file, no header line.\n");
+		return NO;
+	}
+	std::string strHeader(pFirstBuffer, pNewline - pFirstBuffer);
+	if( NO==MatchHeader(strHeader.c_str(), pFileMode) ){ return NO; }
+	
+	// the processors release a block by its start, so the rows are moved to the buffer start.
+	size_t nRows = endPos - (pNewline+1);
+	memmove(pFirstBuffer, pNewline+1, nRows);
+	pFirstBuffer[nRows] = '\0';
+	InflatedPos = (pNewline+1) - pFirstBuffer;
+	
+	InflatedBlock block = { pFirstBuffer, pFirstBuffer + nRows, InflatedPos };
+	InflatedBlocks.push_back(block);
+	InflatedPos += nRows;
+	
+	// an empty block marks the end.
+	if( YES==bAtEnd ){
+		InflatedBlock endBlock = { NULL, NULL, InflatedPos };
+		InflatedBlocks.push_back(endBlock);
+	}
+	return YES;
+}
+
+/*
+ Fills the ring from the chunk buffer pool (a buffer more than the chunks in the pipeline)
+ and starts inflating the rest of the file into it.
+ */
+void StartInflating( void )
+{
+	InflateRingQ = dispatch_queue_create("geoimp.inflate.syncq", DISPATCH_QUEUE_SERIAL);
+	InflatedBlocksSem = dispatch_semaphore_create((long)InflatedBlocks.size());
+	
+	for( uint32_t nBuffer=0; nBuffer<ChunkCount+1; ++nBuffer ){
+		FreeInflateBuffers.push_back(ChunkBufferPool + nBuffer*ChunkBufferStride);
+	}
+	FreeInflateBuffersSem = dispatch_semaphore_create((long)FreeInflateBuffers.size());
+	
+	// the file fitted in the first block, its end is already queued.
+	if( YES==InflaterAtStreamEnd ){ return; }
+	
+	dispatch_queue_t inflateQ = dispatch_queue_create("geoimp.inflate.q", DISPATCH_QUEUE_SERIAL);
+	dispatch_async(inflateQ,
+	   ^{
+		   BOOL bAtEnd = NO;
+		   while( NO==bAtEnd && NO==AbortProgram )
+		   {
+			   dispatch_semaphore_wait(FreeInflateBuffersSem, DISPATCH_TIME_FOREVER);
+			   __block char* pBuffer;
+			   dispatch_sync(InflateRingQ, ^{ pBuffer = FreeInflateBuffers.back(); FreeInflateBuffers.pop_back(); });
+			   
+			   const char* endPos;
+			   if( YES==FillInflatedBlock(pBuffer, &endPos, &bAtEnd) ){
+				   AbortProgram = YES;
+				   break;
+			   }
+			   
+			   InflatedBlock block = { pBuffer, endPos, InflatedPos };
+			   InflatedPos += (endPos - pBuffer);
+			   dispatch_sync(InflateRingQ, ^{ InflatedBlocks.push_back(block); });
+			   dispatch_semaphore_signal(InflatedBlocksSem);
+		   }
+		   
+		   InflatedBlock endBlock = { NULL, NULL, InflatedPos };
+		   dispatch_sync(InflateRingQ, ^{ InflatedBlocks.push_back(endBlock); });
+		   dispatch_semaphore_signal(InflatedBlocksSem);
+	   });
+}
+
+/*
+ Waits for the next inflated block. ReleaseInflatedBlock() must be called once it is written.
+ - ppStartPos, ppOutEndPos : [out] the lines claimed.
+ 
+ - Returns the bytes in the block, or 0 when the whole file has been claimed.
+ */
+off_t ClaimInflatedBlock( char** ppStartPos, const char** ppOutEndPos, off_t* filePos )
+{
+	__block InflatedBlock block;
+	do
+	{
+		dispatch_semaphore_wait(InflatedBlocksSem, DISPATCH_TIME_FOREVER);
+		dispatch_sync(InflateRingQ,
+					  ^{
+						  block = InflatedBlocks.front();
+						  // the end block is left for the other processors.
+						  if( NULL!=block.startPos ){ InflatedBlocks.pop_front(); }
+					  });
+		
+		if( NULL==block.startPos )
+		{
+			dispatch_semaphore_signal(InflatedBlocksSem);
+			return 0;
+		}
+		
+		// a block with no lines (a header only file, or the end of the data).
+		if( block.endPos==block.startPos ){
+			ReleaseInflatedBlock(block.startPos);
+		}
+	} while( block.endPos==block.startPos );
+	
+	*ppStartPos = block.startPos;
+	*ppOutEndPos = block.endPos;
+	*filePos = block.filePos;
+	return (block.endPos - block.startPos);
+}
+
+void ReleaseInflatedBlock( char* pBuffer )
+{
+	dispatch_sync(InflateRingQ, ^{ FreeInflateBuffers.push_back(pBuffer); });
+	dispatch_semaphore_signal(FreeInflateBuffersSem);
+}
+
+
+/*			CSV Tokenizer			*/
+
+/*
+ Returns a bit for each ',', '"' and '\n' in the 64 bytes at pos (bit 0 is pos[0]).
+ The widest implementation the cpu supports is chosen at startup.
+ */
+typedef uint64_t (*StructuralMaskFn)(const char* pos);
+
+static uint64_t StructuralMaskScalar(const char* pos)
+{
+	uint64_t mask = 0;
+	for( int nByte=0; nByte<64; ++nByte )
+	{
+		char c = pos[nByte];
+		if( ','==c || '"'==c || '\n'==c ){ mask |= (1ull<<nByte); }
+	}
+	return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint64_t StructuralMaskSSE2(const char* pos)
+{
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i newline = _mm_set1_epi8('\n');
+	
+	uint64_t mask = 0;
+	for( int nLane=0; nLane<4; ++nLane )
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(pos + 16*nLane));
+		__m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, quote)),
+									_mm_cmpeq_epi8(bytes, newline));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << (16*nLane);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t StructuralMaskAVX2(const char* pos)
+{
+	const __m256i comma = _mm256_set1_epi8(',');
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i newline = _mm256_set1_epi8('\n');
+	
+	uint64_t mask = 0;
+	for( int nLane=0; nLane<2; ++nLane )
+	{
+		__m256i bytes = _mm256_loadu_si256((const __m256i*)(pos + 32*nLane));
+		__m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, comma), _mm256_cmpeq_epi8(bytes, quote)),
+									   _mm256_cmpeq_epi8(bytes, newline));
+		mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hits) << (32*nLane);
+	}
+	return mask;
+}
+#endif
+
+typedef struct STRUCTURALMASKIMPL { const char* strName; StructuralMaskFn fnMask; } StructuralMaskImpl;
+
+/*
+ - pImpls : [out] the implementations this cpu can run, widest first.
+ - Returns the number of implementations.
+ */
+static int GetStructuralMaskImpls(StructuralMaskImpl* pImpls)
+{
+	int nImpls = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") ){
+		pImpls[nImpls].strName = "AVX2"; pImpls[nImpls++].fnMask = StructuralMaskAVX2;
+	}
+	if( __builtin_cpu_supports("sse2") ){
+		pImpls[nImpls].strName = "SSE2"; pImpls[nImpls++].fnMask = StructuralMaskSSE2;
+	}
+#endif
+	pImpls[nImpls].strName = "scalar"; pImpls[nImpls++].fnMask = StructuralMaskScalar;
+	return nImpls;
+}
+
+static StructuralMaskFn SelectStructuralMask(void)
+{
+	StructuralMaskImpl impls[3];
+	GetStructuralMaskImpls(impls);
+	return impls[0].fnMask;
+}
+
+static const StructuralMaskFn StructuralMask = SelectStructuralMask();
+
+/*
+ Splits the lines of a chunk into fields (RFC 4180), in place.
+ The structural characters of each 64 byte block are found at once as a bitmask and
+ consumed in order, so each byte is examined once whatever the field lengths.
+ 
+ Fields are null terminated in the buffer, which is never written at or past endPos, so a
+ last line without a newline must be followed by a '\0' at endPos.
+ An empty field is NULL; a quoted field has its quotes removed and "" unescaped to ".
+ */
+class CsvTokenizer
+{
+	char*		m_pos;			// start of the next line
+	const char*	m_end;
+	const char*	m_blockPos;		// block the mask describes
+	uint64_t	m_mask;			// structural characters of the block not yet consumed
+	StructuralMaskFn m_fnMask;
+	
+	void LoadMask();
+	const char* NextStructural();
+	
+public:
+	CsvTokenizer(char* startPos, const char* endPos, StructuralMaskFn fnMask = StructuralMask);
+	CsvTokenizer(const CsvTokenizer&) = delete;
+	
+	int NextLine(const char** fields, int nMaxFields);
+};
+
+CsvTokenizer::CsvTokenizer(char* startPos, const char* endPos, StructuralMaskFn fnMask)
+	: m_pos(startPos), m_end(endPos), m_blockPos(startPos), m_mask(0), m_fnMask(fnMask)
+{
+	LoadMask();
+}
+
+void CsvTokenizer::LoadMask()
+{
+	if( m_blockPos>=m_end )
+	{
+		m_mask = 0;
+		return;
+	}
+	if( m_end-m_blockPos>=64 )
+	{
+		m_mask = m_fnMask(m_blockPos);
+		return;
+	}
+	
+	// the final partial block, never read past endPos.
+	m_mask = 0;
+	for( int nByte=0; m_blockPos+nByte<m_end; ++nByte )
+	{
+		char c = m_blockPos[nByte];
+		if( ','==c || '"'==c || '\n'==c ){ m_mask |= (1ull<<nByte); }
+	}
+}
+
+/*
+ - Returns the next unconsumed ',', '"' or '\n', or endPos if there are none left.
+ */
+const char* CsvTokenizer::NextStructural()
+{
+	while( 0==m_mask )
+	{
+		if( m_end-m_blockPos<=64 ){ return m_end; }
+		
+		m_blockPos += 64;
+		LoadMask();
+	}
+	
+	const char* pos = m_blockPos + __builtin_ctzll(m_mask);
+	m_mask &= (m_mask-1);
+	return pos;
+}
+
+/*
+ Reads the next line, skipping blank lines.
+ - fields : [out] up to nMaxFields field pointers.
+ 
+ - Returns the number of fields (at most nMaxFields), 0 if the line was malformed
+   (an unterminated quote, text after a closing quote, or more than nMaxFields fields),
+   or -1 at the end of the chunk.
+ */
+int CsvTokenizer::NextLine(const char** fields, int nMaxFields)
+{
+	while( m_pos<m_end )
+	{
+		int nFields = 0;
+		BOOL isMalformed = NO;
+		BOOL isLineEnd = NO;
+		char* fieldPos = m_pos;
+		char* delimiter;
+		
+		for(;;)
+		{
+			const char* value;
+			if( fieldPos<m_end && '"'==*fieldPos )
+			{
+				NextStructural(); // the opening quote
+				
+				// unescape in place, writes never overtake the read position.
+				char* readPos = fieldPos+1;
+				char* writePos = fieldPos+1;
+				for(;;)
+				{
+					const char* quotePos = NextStructural();
+					if( quotePos>=m_end )
+					{
+						isMalformed = YES;
+						delimiter = (char*)m_end;
+						writePos = NULL; // unterminated, not a value
+						break;
+					}
+					if( '"'!=*quotePos ){ continue; } // , and newlines are part of the value
+					
+					size_t nLen = (quotePos - readPos);
+					memmove(writePos, readPos, nLen);
+					writePos += nLen;
+					
+					if( quotePos+1<m_end && '"'==quotePos[1] )
+					{
+						*writePos++ = '"';
+						NextStructural(); // the escaped quote
+						readPos = (char*)quotePos+2;
+						continue;
+					}
+					
+					*writePos = '\0';
+					delimiter = (char*)NextStructural();
+					if( delimiter!=quotePos+1 ){
+						isMalformed = YES;
+					}
+					break;
+				}
+				value = (NULL!=writePos) ? fieldPos+1 : NULL;
+			}
+			else
+			{
+				// a quote inside an unquoted value is taken literally.
+				do{
+					delimiter = (char*)NextStructural();
+				}while( delimiter<m_end && '"'==*delimiter );
+				
+				// drop the \r of a \r\n line end
+				char* valueEnd = delimiter;
+				if( valueEnd>fieldPos && '\r'==valueEnd[-1] && (delimiter>=m_end || '\n'==*delimiter) ){
+					--valueEnd;
+				}
+				if( valueEnd<delimiter ){ *valueEnd = '\0'; }
+				value = (valueEnd==fieldPos) ? NULL : fieldPos;
+			}
+			
+			// on error resynchronise at the next newline.
+			while( YES==isMalformed && delimiter<m_end && '\n'!=*delimiter ){
+				delimiter = (char*)NextStructural();
+			}
+			
+			if( nFields<nMaxFields ){ fields[nFields] = value; }
+			++nFields;
+			
+			// never write at endPos, under -M it is the next range's first byte.
+			isLineEnd = (delimiter>=m_end || '\n'==*delimiter) ? YES : NO;
+			if( delimiter<m_end ){ *delimiter = '\0'; }
+			if( YES==isLineEnd ){ break; }
+			fieldPos = delimiter+1;
+		}
+		
+		m_pos = (delimiter<m_end) ? delimiter+1 : (char*)m_end;
+		
+		if( YES==isMalformed ){ return 0; }
+		if( 1==nFields && NULL==fields[0] ){ continue; } // blank line
+		
+		if( nFields>nMaxFields ){ return 0; }
+		
+		return nFields;
+	}
+	
+	return -1;
+}
+
+
+static void ReportMalformedLine(const char* strFirstField)
+{
+	++MalformedLines;
+	dprintf( STDOUT_FILENO, "Skipping malformed line starting: %s\n",
+			 (NULL!=strFirstField) ? strFirstField : "(empty)" );
+}
+
+typedef enum LOCATIONS_FIELDS {
+	LOC_geoname_id = 0,
+	LOC_locale_code,
+	LOC_continent_code,
+	LOC_continent_name,
+	LOC_country_iso_code,
+	LOC_country_name,
+	LOC_subdivision_1_iso_code,
+	LOC_subdivision_1_name,
+	LOC_subdivision_2_iso_code,
+	LOC_subdivision_2_name,
+	LOC_city_name,
+	LOC_metro_code,
+	LOC_time_zone,
+	LOC_NUM_FIELDS } LOCATIONS_FIELD_ID;
+
+typedef enum BLOCKS_FIELDS {
+	BLK_network = 0,
+	BLK_geoname_id,
+	BLK_registered_country_geoname_id,
+	BLK_represented_country_geoname_id,
+	BLK_is_anonymous_proxy,
+	BLK_is_satellite_provider,
+	BLK_postal_code,
+	BLK_latitude,
+	BLK_longitude,
+	BLK_accuracy_radius,
+	BLK_NUM_FIELDS } BLOCKS_FIELD_ID;
+
+static const char* country_unknown = "Unknown";
+static const char* country_code_unknown = "ZZ";
+
+static const char* BlockGeonameId(const char* const* fields);
+static const char* LocationCountryCode(const char* const* fields);
+
+/*
+	Reads all lines of the chunk as Locations, keeping each row's fields for the writers.
+ 
+	Countries and subdivisions are collected with the chunk, and merged into the shared
+	Dimensions once it is written; main() adds them to the database at the end.
+	A row with a subdivision_2 but no subdivision_1 goes to the reject file instead.
+ 
+	- Returns the rows.
+*/
+uint32_t ParseLocations(ParsedChunk* pChunk)
+{
+	const char *country_iso_code,*country_name;
+	
+	const char* fields[LOC_NUM_FIELDS];
+	CsvTokenizer tokenizer(pChunk->startPos, pChunk->endPos);
+	int nFields;
+	
+	while( (nFields = tokenizer.NextLine(fields, LOC_NUM_FIELDS))>=0 )
+	{
+		if( nFields<LOC_NUM_FIELDS )
+		{
+			ReportMalformedLine( fields[0] ); // set for every line read
+			continue;
+		}
+		
+		// extract the details
+		/*
+		 geoname_id,locale_code,continent_code,continent_name,country_iso_code,country_name    ,subdivision_1_iso_code,subdivision_1_name  ,subdivision_2_iso_code ,subdivision_2_name  ,city_name       ,metro_code ,time_zone
+		 88319,     en,         AF,            Africa,        LY,              Libya           ,BA                    ,"Sha'biyat Banghazi",                       ,                    ,Benghazi        ,           ,Africa/Tripoli
+		 90552     ,en         ,AS            ,Asia          ,IQ              ,Iraq            ,AN                    ,Anbar               ,                       ,                    ,Sulaymaniyah    ,           ,Asia/Baghdad
+		 105072    ,en         ,AS            ,Asia          ,SA              ,"Saudi Arabia"  ,14                    ,'Asir               ,                       ,                    ,"Khamis Mushait",           ,Asia/Riyadh
+		 3333231   ,en		   ,EU			  ,Europe        ,GB              ,"United Kingdom",SCT                   ,Scotland            ,GLG                    ,"Glasgow City"      ,                ,           ,Europe/London
+		 312394    ,en         ,AS            ,Asia          ,TR              ,Turkey          ,31                    ,Hatay               ,                       ,                    ,                ,           ,Europe/Istanbul
+		*/
+		
+		// subdivision_2 is keyed by its subdivision_1, it has no row to hang from.
+		if( NULL!=fields[LOC_subdivision_2_iso_code] && NULL==fields[LOC_subdivision_1_iso_code] )
+		{
+			RejectRow(LOCATIONS, fields, LOC_NUM_FIELDS, "Subdivision 2 Without Subdivision 1");
+			continue;
+		}
+		
+		country_iso_code = LocationCountryCode(fields);
+		country_name = fields[LOC_country_name];
+		if( NULL==country_name ) { country_name = country_unknown; }
+		
+		pChunk->dimensions.AddCountry(country_iso_code, country_name);
+		if( NULL!=fields[LOC_subdivision_1_iso_code] ){
+			pChunk->dimensions.AddSubdivision1(country_iso_code, fields[LOC_subdivision_1_iso_code],
+											   fields[LOC_subdivision_1_name]);
+		}
+		if( NULL!=fields[LOC_subdivision_2_iso_code] ){
+			pChunk->dimensions.AddSubdivision2(country_iso_code, fields[LOC_subdivision_1_iso_code],
+											   fields[LOC_subdivision_2_iso_code], fields[LOC_subdivision_2_name]);
+		}
+		
+		pChunk->fields.insert(pChunk->fields.end(), fields, fields + LOC_NUM_FIELDS);
+	}
+	
+	return (uint32_t)(pChunk->fields.size()/LOC_NUM_FIELDS);
+}
+
+/*
+	Reads all lines of the chunk as IP Blocks, keeping each row's fields for the writers.
+	A row whose geoname_id is not a location's goes to the reject file instead.
+	With --emit-db the chunk's networks are added to the lookup database instead.
+ 
+	- Returns the rows.
+*/
+uint32_t ParseBlocks(ParsedChunk* pChunk)
+{
+	const char* fields[BLK_NUM_FIELDS];
+	CsvTokenizer tokenizer(pChunk->startPos, pChunk->endPos);
+	int nFields;
+	
+	/*
+		network          ,geoname_id ,registered_country_geoname_id ,represented_country_geoname_id ,is_anonymous_proxy ,is_satellite_provider ,postal_code ,latitude ,longitude ,accuracy_radius
+		5.145.149.142/32 ,           ,2921044                       ,                               ,0                  ,1                     ,            ,         ,          ,
+		80.231.5.0/24    ,           ,                              ,                               ,0                  ,1                     ,            ,         ,          ,
+	*/
+	
+	std::vector<LookupRow> lookupRows;
+	std::vector<LookupRow>* pLookupRows = &lookupRows; // blocks copy captured objects
+	LookupRow lookupRow;
+	
+	while( (nFields = tokenizer.NextLine(fields, BLK_NUM_FIELDS))>=0 )
+	{
+		if( nFields<BLK_NUM_FIELDS )
+		{
+			ReportMalformedLine( fields[0] ); // set for every line read
+			continue;
+		}
+		
+		// Skip entries with no geoname id
+		if( NULL==BlockGeonameId(fields) ){ continue; }
+		
+		if( YES==FilterGeonameIds && NO==IsKnownGeonameId(BlockGeonameId(fields)) )
+		{
+			RejectRow(IPBLOCKS, fields, BLK_NUM_FIELDS, "Geoname Id Not Found");
+			continue;
+		}
+		
+		if( NULL!=EmitDbPath )
+		{
+			if( YES==ParseLookupRow(fields, &lookupRow) ){
+				RejectRow(IPBLOCKS, fields, BLK_NUM_FIELDS, "Invalid network or geoname_id");
+				continue;
+			}
+			lookupRows.push_back(lookupRow);
+			continue;
+		}
+		
+		pChunk->fields.insert(pChunk->fields.end(), fields, fields + BLK_NUM_FIELDS);
+	}
+	
+	if( NULL!=EmitDbPath )
+	{
+		dispatch_sync(LookupDbQ, ^{ LookupDatabase.Add(*pLookupRows); });
+		return (uint32_t)lookupRows.size();
+	}
+	
+	return (uint32_t)(pChunk->fields.size()/BLK_NUM_FIELDS);
+}
+
+/*
+	Writes the rows of a parsed chunk: COPY when pCopyBuffer is not NULL, otherwise
+	a statement per row.
+	- didFail : [out] YES if the connection failed; the rows before it were written.
+ 
+	- Returns the rows written.
+*/
+uint32_t WriteChunk(FILETYPE fileMode, ParsedChunk* pChunk, PostgresConnection& pgConnx, CopyBuffer* pCopyBuffer, BOOL* didFail)
+{
+	*didFail = NO;
+	
+	int nFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	RowBatch batch(fileMode, nFields, pgConnx, pCopyBuffer, pChunk);
+	
+	for( size_t nField=0; nField<pChunk->fields.size(); nField+=nFields )
+	{
+		if( YES==batch.Add(&pChunk->fields[nField]) ){
+			*didFail = YES;
+			break;
+		}
+	}
+	
+	if( NO==*didFail ){
+		*didFail = batch.Finish();
+	}
+	
+	if( YES==*didFail ){
+		batch.Abandon();
+		dprintf( STDOUT_FILENO, "Chunk at file offset %lld failed after %u of %zu rows were written.\n",
+				(long long)pChunk->filePos, batch.Committed(), pChunk->fields.size()/nFields);
+	}
+	
+	// rows before a failure were written, so keep their dimensions.
+	if( LOCATIONS==fileMode && batch.Committed()>0 )
+	{
+		const LocationDimensions* pChunkDimensions = &pChunk->dimensions;
+		dispatch_sync(DimensionsQ, ^{ Dimensions.Merge(*pChunkDimensions, pChunk->filePos); });
+	}
+	
+	return batch.Committed();
+}
+
+/*
+ The geoname id a Blocks row is stored against: its own, else its registered
+ then represented country's. NULL if it has none.
+ */
+static const char* BlockGeonameId(const char* const* fields)
+{
+	const char* geoname_id = fields[BLK_geoname_id];
+	if( NULL==geoname_id ){
+		geoname_id = fields[BLK_registered_country_geoname_id];
+	}
+	if( NULL==geoname_id ){
+		geoname_id = fields[BLK_represented_country_geoname_id];
+	}
+	return geoname_id;
+}
+
+static const char* LocationCountryCode(const char* const* fields)
+{
+	return (NULL!=fields[LOC_country_iso_code]) ? fields[LOC_country_iso_code] : country_code_unknown;
+}
+
+
+/*			Async writers (--async)			*/
+
+#if defined(LIBPQ_HAS_PIPELINING)
+
+/*
+ Waits on many connections' sockets at once, epoll on Linux and poll() elsewhere.
+ Each socket is watched for reading, and for writing too while libpq has output it could not send.
+ */
+class SocketPoller
+{
+#if defined(__linux__)
+	int m_fdEpoll = -1;
+	std::vector<struct epoll_event> m_events;
+#else
+	std::vector<struct pollfd> m_pollFds;
+#endif
+	std::vector<int8_t> m_watching;	// -1 when not watched, else whether writing is
+	
+public:
+	SocketPoller() {}
+	SocketPoller(const SocketPoller&) = delete;
+	
+	BOOL Create(size_t nSlots);
+	BOOL Watch(size_t nSlot, int fdSocket, BOOL wantWrite);
+	int Wait(int nTimeoutMs, size_t* pReadySlots);
+	
+	~SocketPoller()
+	{
+#if defined(__linux__)
+		if( -1!=m_fdEpoll ){ close(m_fdEpoll); }
+#endif
+	}
+};
+
+/*
+ One of an event loop's connections, and the chunk it is writing.
+ A batch is the rows sent since the last sync: the whole chunk, or -R rows.
+ */
+typedef struct ASYNCCONNECTION {
+	PostgresConnection	pgConnx;
+	ParsedChunk*		pChunk;			// NULL while idle
+	size_t				nNextField;		// the first field of the next row to send
+	std::vector<const char* const*> batchRows;	// kept to replay the batch if it fails
+	uint32_t			nBatchResults;	// the batch's statement results read so far
+	BOOL				syncSent;
+	BOOL				batchFailed;
+	BOOL				wantWrite;
+	uint32_t			nCommitted;		// the chunk's rows committed
+	uint32_t			nSyncRows;		// the chunk's rows up to the last sync, counted from its first
+	uint32_t			nRowsRecorded;	// and as far as geoimport_progress has them
+	uint64_t			nBatchStartNanos;
+} AsyncConnection;
+
+/*
+ - nSlots : the connections, each watched in its own slot.
+ - Returns YES if created.
+ */
+BOOL SocketPoller::Create(size_t nSlots)
+{
+	m_watching.assign(nSlots, -1);
+#if defined(__linux__)
+	m_fdEpoll = epoll_create1(0);
+	if( -1==m_fdEpoll )
+	{
+		perror("epoll_create1 failed");
+		return NO;
+	}
+	m_events.resize(nSlots);
+#else
+	struct pollfd unwatched = { -1, 0, 0 };
+	m_pollFds.assign(nSlots, unwatched);
+#endif
+	return YES;
+}
+
+/*
+ Watches a socket, or changes what it is watched for.
+ - Returns YES if it is watched.
+ */
+BOOL SocketPoller::Watch(size_t nSlot, int fdSocket, BOOL wantWrite)
+{
+	if( m_watching[nSlot]==(int8_t)wantWrite ){ return YES; }
+	
+#if defined(__linux__)
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	if( YES==wantWrite ){ event.events |= EPOLLOUT; }
+	event.data.u64 = nSlot;
+	if( 0!=epoll_ctl(m_fdEpoll, (-1==m_watching[nSlot]) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fdSocket, &event) )
+	{
+		perror("epoll_ctl failed");
+		return NO;
+	}
+#else
+	m_pollFds[nSlot].fd = fdSocket;
+	m_pollFds[nSlot].events = POLLIN | ((YES==wantWrite) ? POLLOUT : 0);
+#endif
+	m_watching[nSlot] = (int8_t)wantWrite;
+	return YES;
+}
+
+/*
+ - pReadySlots : receives the slots of the sockets with something to read, room to write, or an error.
+ - Returns how many, 0 if the timeout passed first, or -1 if waiting failed.
+ */
+int SocketPoller::Wait(int nTimeoutMs, size_t* pReadySlots)
+{
+#if defined(__linux__)
+	int nEvents = epoll_wait(m_fdEpoll, m_events.data(), (int)m_events.size(), nTimeoutMs);
+	if( nEvents<0 ){ return (EINTR==errno) ? 0 : -1; }
+	
+	for( int nEvent=0; nEvent<nEvents; ++nEvent ){
+		pReadySlots[nEvent] = (size_t)m_events[nEvent].data.u64;
+	}
+	return nEvents;
+#else
+	int nEvents = poll(m_pollFds.data(), (nfds_t)m_pollFds.size(), nTimeoutMs);
+	if( nEvents<0 ){ return (EINTR==errno) ? 0 : -1; }
+	
+	int nReady = 0;
+	for( size_t nSlot=0; nSlot<m_pollFds.size() && nReady<nEvents; ++nSlot )
+	{
+		if( 0!=m_pollFds[nSlot].revents ){
+			pReadySlots[nReady++] = nSlot;
+		}
+	}
+	return nReady;
+#endif
+}
+
+/*
+ Sends the chunk's next rows until the pipeline holds its depth of statements, then a
+ sync once the batch is complete. Each sync is one implicit transaction. Until then a flush
+ request asks the server for the results so far, so the pipeline drains as it fills.
+ A row whose values could not be sent is rejected at once, as RowBatch does.
+ 
+ - Returns YES if the connection failed.
+ */
+static BOOL SendAsyncRows(FILETYPE fileMode, AsyncConnection& connx)
+{
+	PostgresConnection& pgConnx = connx.pgConnx;
+	const std::vector<const char*>& fields = connx.pChunk->fields;
+	int nFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	
+	BOOL bSent = NO;
+	while( NO==connx.syncSent && NO==pgConnx.IsPipelineFull() )
+	{
+		if( connx.nNextField>=fields.size() || (RowsPerCommit>0 && connx.batchRows.size()>=RowsPerCommit) )
+		{
+			// every row left may have been rejected, which only the progress records.
+			connx.nSyncRows = connx.pChunk->nFirstRow + (uint32_t)(connx.nNextField/nFields);
+			if( connx.batchRows.empty() )
+			{
+				if( NO==RecordCheckpoints || connx.nRowsRecorded>=connx.nSyncRows ){ break; }
+				connx.nBatchStartNanos = MonotonicNanos();
+			}
+			
+			if( YES==RecordCheckpoints &&
+				YES==AddProgressToDatabase(CheckpointOf(connx.pChunk, connx.nSyncRows, nFields), pgConnx) )
+			{
+				return YES;
+			}
+			if( 1!=PQpipelineSync(pgConnx) )
+			{
+				dprintf( STDOUT_FILENO, "Failed to sync pipeline: %s\n", PQerrorMessage(pgConnx) );
+				return YES;
+			}
+			connx.syncSent = YES;
+			bSent = YES;
+			break;
+		}
+		
+		const char* const* rowFields = &fields[connx.nNextField];
+		connx.nNextField += nFields;
+		if( connx.batchRows.empty() ){
+			connx.nBatchStartNanos = MonotonicNanos();
+		}
+		
+		if( YES==AddRowToDatabase(fileMode, rowFields, pgConnx) )
+		{
+			if( CONNECTION_OK!=PQstatus(pgConnx) ){ return YES; }
+			if( YES==RejectRow(fileMode, rowFields, nFields, pgConnx.RowError()) ){ return YES; }
+			continue;
+		}
+		connx.batchRows.push_back(rowFields);
+		bSent = YES;
+	}
+	
+	if( YES==bSent && NO==connx.syncSent && 1!=PQsendFlushRequest(pgConnx) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to send flush request: %s\n", PQerrorMessage(pgConnx) );
+		return YES;
+	}
+	
+	// what the socket would not take now is sent when it is writable.
+	if( YES==bSent || YES==connx.wantWrite )
+	{
+		int nFlushed = PQflush(pgConnx);
+		if( nFlushed<0 )
+		{
+			dprintf( STDOUT_FILENO, "Failed to send statements: %s\n", PQerrorMessage(pgConnx) );
+			return YES;
+		}
+		connx.wantWrite = (1==nFlushed) ? YES : NO;
+	}
+	return NO;
+}
+
+/*
+ A statement of the batch failed, which aborted the rest of it up to the sync. Its rows are
+ written again as a blocking RowBatch, outside pipeline mode, which replays them a row at a
+ time and rejects the rows the server refuses. The event loop's other connections wait meanwhile.
+ 
+ - Returns YES if the connection failed.
+ */
+static BOOL ReplayAsyncBatch(FILETYPE fileMode, AsyncConnection& connx)
+{
+	PostgresConnection& pgConnx = connx.pgConnx;
+	if( 0!=PQsetnonblocking(pgConnx, 0) || NO==pgConnx.ExitPipelineMode() ){ return YES; }
+	
+	int nFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	RowBatch batch(fileMode, nFields, pgConnx, NULL, connx.pChunk);
+	BOOL bDidFail = NO;
+	for( size_t nRow=0; NO==bDidFail && nRow<connx.batchRows.size(); ++nRow ){
+		bDidFail = batch.Add(connx.batchRows[nRow]);
+	}
+	if( NO==bDidFail ){
+		bDidFail = batch.Commit();
+	}
+	connx.nCommitted += batch.Committed();
+	if( YES==bDidFail )
+	{
+		batch.Abandon();
+		return YES;
+	}
+	
+	// the replay records the progress up to its last row, a final sync the rejected rows after it.
+	connx.nRowsRecorded = 0;
+	
+	uint32_t nDepth = (PipelineDepth>0) ? PipelineDepth : ASYNC_PIPELINE_DEPTH;
+	if( NO==pgConnx.EnterPipelineMode(nDepth) || 0!=PQsetnonblocking(pgConnx, 1) ){ return YES; }
+	return NO;
+}
+
+/*
+ Reads the results that have arrived, without waiting. At a batch's sync its rows have
+ committed, or if one failed they are replayed.
+ 
+ - Returns YES if the connection failed.
+ */
+static BOOL ReadAsyncResults(FILETYPE fileMode, AsyncConnection& connx)
+{
+	PostgresConnection& pgConnx = connx.pgConnx;
+	if( 1!=PQconsumeInput(pgConnx) )
+	{
+		dprintf( STDOUT_FILENO, "Connection failed: %s\n", PQerrorMessage(pgConnx) );
+		return YES;
+	}
+	
+	BOOL wasNull = NO;
+	while( 0==PQisBusy(pgConnx) )
+	{
+		// each statement's results end with a NULL, two in a row and none are waiting.
+		PGresult* pgRes = PQgetResult(pgConnx);
+		if( NULL==pgRes )
+		{
+			if( YES==wasNull ){ break; }
+			wasNull = YES;
+			continue;
+		}
+		wasNull = NO;
+		
+		ExecStatusType resStatus = PQresultStatus(pgRes);
+		if( PGRES_PIPELINE_SYNC==resStatus )
+		{
+			PQclear(pgRes);
+			connx.syncSent = NO;
+			if( YES==connx.batchFailed )
+			{
+				// a batch of only the progress has no rows to replay, the progress itself failed.
+				connx.batchFailed = NO;
+				if( connx.batchRows.empty() || YES==ReplayAsyncBatch(fileMode, connx) ){ return YES; }
+			}
+			else
+			{
+				connx.nCommitted += (uint32_t)connx.batchRows.size();
+				connx.nRowsRecorded = connx.nSyncRows;
+				RecordStage(STAGE_COMMIT, connx.nBatchStartNanos);
+			}
+			connx.batchRows.clear();
+			connx.nBatchResults = 0;
+			continue;
+		}
+		
+		// the rest of a failed batch come back as PGRES_PIPELINE_ABORTED.
+		// The rows were sent in order, then the progress.
+		if( (PGRES_FATAL_ERROR==resStatus || PGRES_BAD_RESPONSE==resStatus) && NO==connx.batchFailed )
+		{
+			pgConnx.SetRowError(PQresultErrorMessage(pgRes));
+			ReportPipelineFailure(fileMode, (connx.nBatchResults<connx.batchRows.size()) ? connx.batchRows[connx.nBatchResults] : NULL,
+								  pgConnx.RowError());
+			connx.batchFailed = YES;
+		}
+		++connx.nBatchResults;
+		pgConnx.ResultReceived();
+		PQclear(pgRes);
+	}
+	return NO;
+}
+
+/*
+ Counts a chunk's rows, keeps its dimensions if any were written, and hands it back.
+ */
+static void FinishAsyncChunk(FILETYPE fileMode, AsyncConnection& connx, uint32_t* pnProcessed)
+{
+	ParsedChunk* pChunk = connx.pChunk;
+	ThreadMetrics->rows.fetch_add(connx.nCommitted, std::memory_order_relaxed);
+	ThreadMetrics->bytes.fetch_add((uint64_t)pChunk->nBytes, std::memory_order_relaxed);
+	*pnProcessed += connx.nCommitted;
+	
+	if( LOCATIONS==fileMode && connx.nCommitted>0 )
+	{
+		const LocationDimensions* pChunkDimensions = &pChunk->dimensions;
+		dispatch_sync(DimensionsQ, ^{ Dimensions.Merge(*pChunkDimensions, pChunk->filePos); });
+	}
+	
+	RecycleChunk(pChunk);
+	connx.pChunk = NULL;
+	connx.batchRows.clear();
+	connx.nBatchResults = 0;
+	connx.syncSent = NO;
+	connx.batchFailed = NO;
+}
+
+/*
+ Sends what a connection can, finishes its chunk once every batch is in, and watches
+ its socket for what it waits on.
+ 
+ - Returns YES if the connection failed.
+ */
+static BOOL AdvanceAsyncConnection(FILETYPE fileMode, AsyncConnection& connx, SocketPoller& poller,
+								   size_t nSlot, uint32_t* pnProcessed)
+{
+	if( NULL!=connx.pChunk )
+	{
+		if( YES==SendAsyncRows(fileMode, connx) ){ return YES; }
+		
+		if( connx.nNextField>=connx.pChunk->fields.size() && connx.batchRows.empty() && NO==connx.syncSent ){
+			FinishAsyncChunk(fileMode, connx, pnProcessed);
+		}
+	}
+	return (YES==poller.Watch(nSlot, PQsocket(connx.pgConnx), connx.wantWrite)) ? NO : YES;
+}
+
+static BOOL StartAsyncChunk(FILETYPE fileMode, AsyncConnection& connx, ParsedChunk* pChunk,
+							SocketPoller& poller, size_t nSlot, uint32_t* pnProcessed)
+{
+	connx.pChunk = pChunk;
+	connx.nNextField = 0;
+	connx.nCommitted = 0;
+	connx.nSyncRows = 0;
+	connx.nRowsRecorded = 0;
+	return AdvanceAsyncConnection(fileMode, connx, poller, nSlot, pnProcessed);
+}
+
+/* Async writer - an event loop, called by the dispatch group block to:
+  - open its share of the --async connections, in pipeline and non-blocking mode
+  - hand each idle connection the next parsed chunk, without waiting for one
+  - send each connection's rows up to the pipeline depth, with a sync per chunk (or -R rows)
+  - wait on all the sockets at once, reading the results as they arrive and sending more
+  A row the database refuses is written to the reject file; only a lost
+  connection or similar stops the import.
+ 
+  - Returns the rows written.
+ */
+uint32_t AsyncWriteChunks(FILETYPE fileMode, const char* strDbName, uint16_t nLoop)
+{
+	uint32_t totalProcessed = 0;
+	ThreadMetrics = &Metrics[NumParsers + nLoop];
+	
+	// the connections are dealt out between the loops.
+	uint16_t nConnections = AsyncConnections/NumWriters + ((nLoop<=AsyncConnections%NumWriters) ? 1 : 0);
+	AsyncConnection* connections = new AsyncConnection[nConnections]();
+	size_t* readySlots = new size_t[nConnections];
+	SocketPoller poller;
+	if( NO==poller.Create(nConnections) ){ AbortProgram = YES; }
+	
+	for( uint16_t nConnx=0; nConnx<nConnections && NO==AbortProgram; ++nConnx )
+	{
+		PostgresConnection& pgConnx = connections[nConnx].pgConnx;
+		if( NO==OpenWriterConnection(fileMode, strDbName, pgConnx) || 0!=PQsetnonblocking(pgConnx, 1) ||
+			NO==poller.Watch(nConnx, PQsocket(pgConnx), NO) )
+		{
+			AbortProgram = YES;
+		}
+	}
+	
+	BOOL queueEnded = NO;
+	while( NO==AbortProgram )
+	{
+		uint16_t nBusy = 0;
+		for( uint16_t nConnx=0; nConnx<nConnections && NO==AbortProgram; ++nConnx )
+		{
+			AsyncConnection& connx = connections[nConnx];
+			ParsedChunk* pChunk;
+			if( NULL==connx.pChunk && NO==queueEnded && YES==ParsedChunkQ.TryPop(&pChunk) )
+			{
+				// the end is passed on to the other loop.
+				if( NULL==pChunk )
+				{
+					ParsedChunkQ.Push(NULL);
+					queueEnded = YES;
+				}
+				else if( YES==StartAsyncChunk(fileMode, connx, pChunk, poller, nConnx, &totalProcessed) ){
+					AbortProgram = YES;
+				}
+			}
+			if( NULL!=connx.pChunk ){ ++nBusy; }
+		}
+		if( YES==AbortProgram ){ break; }
+		
+		// with nothing in flight, wait for the parsers rather than the sockets.
+		if( 0==nBusy )
+		{
+			if( YES==queueEnded ){ break; }
+			
+			ParsedChunk* pChunk = ParsedChunkQ.Pop();
+			if( NULL==pChunk )
+			{
+				ParsedChunkQ.Push(NULL);
+				queueEnded = YES;
+				break;
+			}
+			if( YES==StartAsyncChunk(fileMode, connections[0], pChunk, poller, 0, &totalProcessed) ){
+				AbortProgram = YES;
+			}
+			continue;
+		}
+		
+		// an idle connection looks for a chunk again within a millisecond.
+		int nReady = poller.Wait((nBusy<nConnections && NO==queueEnded) ? 1 : 1000, readySlots);
+		if( nReady<0 )
+		{
+			perror("Waiting on the connections failed");
+			AbortProgram = YES;
+			break;
+		}
+		for( int nEvent=0; nEvent<nReady; ++nEvent )
+		{
+			size_t nSlot = readySlots[nEvent];
+			AsyncConnection& connx = connections[nSlot];
+			if( YES==ReadAsyncResults(fileMode, connx) ||
+				YES==AdvanceAsyncConnection(fileMode, connx, poller, nSlot, &totalProcessed) )
+			{
+				AbortProgram = YES;
+				break;
+			}
+		}
+	}
+	
+	// after a failure the chunks held are handed back, and those still coming until the end.
+	for( uint16_t nConnx=0; nConnx<nConnections; ++nConnx )
+	{
+		AsyncConnection& connx = connections[nConnx];
+		if( NULL==connx.pChunk ){ continue; }
+		
+		dprintf( STDOUT_FILENO, "Chunk at file offset %lld stopped after %u of %zu rows were written.\n",
+				(long long)connx.pChunk->filePos, connx.nCommitted,
+				connx.pChunk->fields.size()/((IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS));
+		FinishAsyncChunk(fileMode, connx, &totalProcessed);
+	}
+	if( NO==queueEnded )
+	{
+		ParsedChunk* pChunk;
+		while( NULL!=(pChunk = ParsedChunkQ.Pop()) ){
+			RecycleChunk(pChunk);
+		}
+		ParsedChunkQ.Push(NULL);
+	}
+	WritersFinished = YES;
+	
+	delete[] connections;
+	delete[] readySlots;
+	return totalProcessed;
+}
+
+#else
+
+// the options refuse --async without pipelining, so it is never called.
+uint32_t AsyncWriteChunks(FILETYPE, const char*, uint16_t)
+{
+	return 0;
+}
+
+#endif
+
+
+void ProgramCleanup(void)
+{
+	if( NULL!=MappedFile ){ munmap(MappedFile, MappedFileLength); }
+	if( NULL!=ChunkBufferPool ){ munmap(ChunkBufferPool, ChunkBufferPoolLength); }
+	if( InputFile>0 ){ close(InputFile); }
+	for( int nFileType=IPBLOCKS; nFileType<=LOCATIONS; ++nFileType ){
+		if( RejectFiles[nFileType]>0 ){ close(RejectFiles[nFileType]); }
+	}
+	
+	dprintf( STDOUT_FILENO,"geoimport - program end.\n" );
+}
+
+static char PGConnectionString[512];
+
+/*
+ looks for the dbname and filename of .csv
  
  geoimport -P4 -D [dbname] /file/to/import.csv
  -
  geoimport -P4 -U 'postgresql://user@localhost/mydb?connect_timeout=10&application_name=myapp' /file/to/import.csv
  
- returns: 0 if OK
- otherwise something else
+ returns: 0 if OK
+ otherwise something else
+ */
+int GetCommandlineOptions(int argc,
+						  const char* argv[],
+						  const char** strDbName,
+						  const char** strFilename,
+						  const char** strConnxString )
+{
+	int nIdx = 0;
+	*strDbName = NULL;
+	*strConnxString = NULL;
+	const char* strRejects = NULL;
+	const char* strSinkFile = NULL;
+	
+	// the last argument is always the file.
+	while( nIdx<argc-1 )
+	{
+		const char* strCmd = argv[nIdx++];
+		if( '-'!= *strCmd ){ return Usage(); }
+		++strCmd;
+		
+		switch( *strCmd )
+		{
+			case 'D':
+			{
+				if( NULL!=*strConnxString){
+					dprintf(STDOUT_FILENO, "Cannot combine -D with -U options.\n");
+					return Usage();
+				}
+				
+				// take the database name
+				if( nIdx>=argc-1 ){ return Usage(); }
+				*strDbName = argv[nIdx++]; //assign
+				snprintf( PGConnectionString, sizeof(PGConnectionString), "host=localhost dbname=%s", *strDbName );
+				continue;
+			}
+			case 'B':{
+				++strCmd;
+				
+				char* endptr;
+				long lChunkKB = strtol(strCmd,&endptr,10);
+				if( '\0'!=*endptr || lChunkKB<(long)CHUNK_MIN_KB || lChunkKB>(long)CHUNK_MAX_KB ){
+					dprintf(STDOUT_FILENO, "Invalid -B[%u-%u] chunk size in KB.\n", CHUNK_MIN_KB, CHUNK_MAX_KB);
+					return Usage();
+				}
+				ChunkSize = (uint32_t)lChunkKB*OneKB;
+				continue;
+			}
+			case 'C':{
+				BulkCopyMode = YES;
+				continue;
+			}
+			case 'M':{
+				MappedFileMode = YES;
+				continue;
+			}
+			case 'P':{
+				++strCmd;
+				if( 0==strcmp(strCmd, "auto") )
+				{
+					AutoTuneMode = YES;
+					NumProcessors = AUTO_MAX_WRITERS;
+					continue;
+				}
+				
+				char* endptr;
+				long lNumProcs = strtol(strCmd,&endptr,10);
+				if( lNumProcs>0 && lNumProcs<=999 ){
+					NumProcessors = lNumProcs;
+				}
+				continue;
+			}
+			case 'Q':{
+				++strCmd;
+				
+				char* endptr;
+				long lDepth = strtol(strCmd,&endptr,10);
+				if( lDepth<=0 || lDepth>9999 ){
+					dprintf(STDOUT_FILENO, "Invalid -Q[1-9999] pipeline depth.\n");
+					return Usage();
+				}
+				PipelineDepth = (uint32_t)lDepth;
+				continue;
+			}
+			case 'R':{
+				++strCmd;
+				
+				char* endptr;
+				long lRows = strtol(strCmd,&endptr,10);
+				if( lRows<=0 || lRows>9999999 ){
+					dprintf(STDOUT_FILENO, "Invalid -R[1-9999999] rows per commit.\n");
+					return Usage();
+				}
+				RowsPerCommit = (uint32_t)lRows;
+				continue;
+			}
+			case 'S':{
+				UsePreparedStatements = NO;
+				continue;
+			}
+			case 'T':{
+				TokenizerBenchmarkMode = YES;
+				continue;
+			}
+			case 'U':{
+				if( NULL!=*strDbName){
+					dprintf(STDOUT_FILENO, "Cannot combine -U with -D options.\n");
+					return Usage();
+				}
+				if( nIdx>=argc-1 ){ return Usage(); }
+				strCmd = argv[nIdx++];
+				
+				size_t nLen = strlen(strCmd);
+				if( nLen<=1 || nLen>=sizeof(PGConnectionString) ){
+					dprintf(STDOUT_FILENO, "Invalid -U [connection string] .\n");
+					return Usage();
+				}
+				nLen = strlcpy(&PGConnectionString[0], strCmd, nLen+1 );
+				
+				*strConnxString = &PGConnectionString[0];
+				continue;
+			}
+			case '-':{
+				if( 0==strcmp(strCmd, "-swap") ){
+					StagedSwapMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-delta") ){
+					DeltaMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-extended") ){
+					ExtendedBlocks = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-partitioned") ){
+					PartitionedMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-collapse") ){
+					CollapseMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-huge-pages") ){
+					HugePagesMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-resume") ){
+					ResumeMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-emit-db") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					EmitDbPath = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-generate") ){
+					if( nIdx>=argc-2 ){ return Usage(); }
+					GenerateFileType = argv[nIdx++];
+					
+					char* endptr;
+					GenerateRows = strtoull(argv[nIdx++], &endptr, 10);
+					if( (0!=strcmp(GenerateFileType, "blocks") && 0!=strcmp(GenerateFileType, "locations")) ||
+						'\0'!=*endptr || 0==GenerateRows || GenerateRows>GENERATE_MAX_ROWS )
+					{
+						dprintf(STDOUT_FILENO, "Invalid --generate [blocks|locations] [1-%llu rows].\n",
+								(unsigned long long)GENERATE_MAX_ROWS);
+						return Usage();
+					}
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-async") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					
+					char* endptr;
+					long lConnections = strtol(argv[nIdx++],&endptr,10);
+					if( '\0'!=*endptr || lConnections<=0 || lConnections>ASYNC_MAX_CONNECTIONS ){
+						dprintf(STDOUT_FILENO, "Invalid --async [1-%u] connections.\n", ASYNC_MAX_CONNECTIONS);
+						return Usage();
+					}
+					AsyncConnections = (uint16_t)lConnections;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-parsers") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					
+					char* endptr;
+					long lNumParsers = strtol(argv[nIdx++],&endptr,10);
+					if( '\0'!=*endptr || lNumParsers<=0 || lNumParsers>999 ){
+						dprintf(STDOUT_FILENO, "Invalid --parsers [1-999] threads.\n");
+						return Usage();
+					}
+					NumParsers = (uint16_t)lNumParsers;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-metrics") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					MetricsFilePath = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-results") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					strCmd = argv[nIdx++];
+					if( strlen(strCmd)>=sizeof(ResultsFilePath) ){
+						dprintf(STDOUT_FILENO, "Invalid --results [file] .\n");
+						return Usage();
+					}
+					strlcpy(ResultsFilePath, strCmd, sizeof(ResultsFilePath));
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-lookup") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					LookupAddress = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-entry") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					ZipEntryName = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-rejects") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					strRejects = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-sink") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					strCmd = argv[nIdx++];
+					
+					int nSink = 0;
+					while( nSink<SINK_NUM_TYPES && 0!=strcmp(strCmd, RowSinks[nSink].strName) ){ ++nSink; }
+					if( nSink>=SINK_NUM_TYPES ){
+						dprintf(STDOUT_FILENO, "Invalid --sink [postgres|null|csv|binary] .\n");
+						return Usage();
+					}
+					SinkType = (SINKTYPE)nSink;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-sink-file") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					strSinkFile = argv[nIdx++];
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-release") ){
+					ReleaseMode = YES;
+					continue;
+				}
+				if( 0==strcmp(strCmd, "-locale") ){
+					if( nIdx>=argc-1 ){ return Usage(); }
+					ReleaseLocale = argv[nIdx++];
+					continue;
+				}
+				dprintf( STDOUT_FILENO, "Error: Unrecognised option: %s\n\n", strCmd );
+				return Usage();
+			}
+			default:
+			{
+				dprintf( STDOUT_FILENO, "Error: Unrecognised option: %s\n\n", strCmd );
+				return Usage();
+			}
+		}
+	}
+	
+	*strFilename = argv[nIdx++]; //assign
+	
+	// --release : a reject file per file type, in the --rejects directory or the release's.
+	int nPathLength;
+	if( YES==ReleaseMode )
+	{
+		const char* strRejectsDir = (NULL!=strRejects) ? strRejects : *strFilename;
+		nPathLength = snprintf(RejectFilePaths[IPBLOCKS], sizeof(RejectFilePaths[IPBLOCKS]),
+							   "%s/geoimport-blocks.rejects.csv", strRejectsDir);
+		snprintf(RejectFilePaths[LOCATIONS], sizeof(RejectFilePaths[LOCATIONS]),
+				 "%s/geoimport-locations.rejects.csv", strRejectsDir);
+	}
+	else
+	{
+		nPathLength = (NULL!=strRejects)
+			? snprintf(RejectFilePaths[IPBLOCKS], sizeof(RejectFilePaths[IPBLOCKS]), "%s", strRejects)
+			: snprintf(RejectFilePaths[IPBLOCKS], sizeof(RejectFilePaths[IPBLOCKS]), "%s.rejects.csv", *strFilename);
+		strlcpy(RejectFilePaths[LOCATIONS], RejectFilePaths[IPBLOCKS], sizeof(RejectFilePaths[LOCATIONS]));
+	}
+	if( nPathLength<0 || nPathLength>=(int)sizeof(RejectFilePaths[IPBLOCKS]) ){
+		dprintf(STDOUT_FILENO, "Invalid --rejects [file] .\n");
+		return Usage();
+	}
+	
+	// --sink-file : default is the imported file's name + .normalized.csv (or .normalized.bin).
+	if( SINK_CSV==SinkType || SINK_BINARY==SinkType )
+	{
+		nPathLength = (NULL!=strSinkFile)
+			? snprintf(SinkFilePath, sizeof(SinkFilePath), "%s", strSinkFile)
+			: snprintf(SinkFilePath, sizeof(SinkFilePath), "%s.normalized.%s", *strFilename, (SINK_CSV==SinkType) ? "csv" : "bin");
+		if( nPathLength<0 || nPathLength>=(int)sizeof(SinkFilePath) ){
+			dprintf(STDOUT_FILENO, "Invalid --sink-file [file] .\n");
+			return Usage();
+		}
+	}
+	else if( NULL!=strSinkFile ){
+		dprintf(STDOUT_FILENO, "--sink-file needs --sink csv or binary.\n");
+		return Usage();
+	}
+	
+	if( SINK_POSTGRES!=SinkType &&
+		(YES==BulkCopyMode || PipelineDepth>0 || RowsPerCommit>0 || NO==UsePreparedStatements || YES==AutoTuneMode ||
+		 AsyncConnections>0 || YES==StagedSwapMode || YES==DeltaMode || YES==ResumeMode || YES==ReleaseMode || NULL!=EmitDbPath) )
+	{
+		dprintf(STDOUT_FILENO, "Cannot combine --sink %s with -C, -Q, -R, -S, -P auto, --async, --swap, --delta, --resume, --release or --emit-db options.\n",
+				RowSinks[SinkType].strName);
+		return Usage();
+	}
+	
+	if( YES==StagedSwapMode && YES==TokenizerBenchmarkMode ){
+		dprintf(STDOUT_FILENO, "Cannot combine -T with --swap options.\n");
+		return Usage();
+	}
+	
+	if( YES==DeltaMode && (YES==StagedSwapMode || YES==TokenizerBenchmarkMode) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --delta with --swap or -T options.\n");
+		return Usage();
+	}
+	
+	if( NULL!=EmitDbPath && (YES==StagedSwapMode || YES==DeltaMode || YES==AutoTuneMode) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --emit-db with --swap, --delta or -P auto options.\n");
+		return Usage();
+	}
+	
+	if( YES==ExtendedBlocks && (YES==DeltaMode || NULL!=EmitDbPath) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --extended with --delta or --emit-db options.\n");
+		return Usage();
+	}
+	
+	if( YES==ReleaseMode && (YES==MappedFileMode || YES==TokenizerBenchmarkMode || AsyncConnections>0 || NULL!=EmitDbPath ||
+							 YES==StagedSwapMode || YES==DeltaMode || YES==ResumeMode) )
+	{
+		dprintf(STDOUT_FILENO, "Cannot combine --release with -M, -T, --async, --emit-db, --swap, --delta or --resume options.\n");
+		return Usage();
+	}
+	
+	if( YES==ResumeMode && (YES==StagedSwapMode || YES==DeltaMode || NULL!=EmitDbPath || YES==TokenizerBenchmarkMode) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --resume with --swap, --delta, --emit-db or -T options.\n");
+		return Usage();
+	}
+	
+	if( YES==PartitionedMode && (NO==MappedFileMode || NO==BulkCopyMode) ){
+		dprintf(STDOUT_FILENO, "--partitioned needs -M and -C.\n");
+		return Usage();
+	}
+	
+	if( YES==PartitionedMode && (YES==AutoTuneMode || YES==StagedSwapMode || YES==DeltaMode || NULL!=EmitDbPath || YES==TokenizerBenchmarkMode) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --partitioned with -P auto, --swap, --delta, --emit-db or -T options.\n");
+		return Usage();
+	}
+	
+	if( YES==CollapseMode && (YES==ResumeMode || NULL!=EmitDbPath || YES==TokenizerBenchmarkMode) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --collapse with --resume, --emit-db or -T options.\n");
+		return Usage();
+	}
+	
+	if( NULL==*strDbName && NULL==*strConnxString && NO==TokenizerBenchmarkMode &&
+		NULL==EmitDbPath && NULL==LookupAddress && NULL==GenerateFileType && SINK_POSTGRES==SinkType )
+	{
+		dprintf(STDOUT_FILENO, "Specify the database with -D or -U.\n");
+		return Usage();
+	}
+	
+	if( YES==BulkCopyMode && PipelineDepth>0 ){
+		dprintf(STDOUT_FILENO, "Cannot combine -C with -Q options.\n");
+		return Usage();
+	}
+	
+	if( AsyncConnections>0 && (YES==BulkCopyMode || YES==AutoTuneMode || NULL!=EmitDbPath) ){
+		dprintf(STDOUT_FILENO, "Cannot combine --async with -C, -P auto or --emit-db options.\n");
+		return Usage();
+	}
+#if !defined(LIBPQ_HAS_PIPELINING)
+	if( AsyncConnections>0 ){
+		dprintf(STDOUT_FILENO, "--async requires libpq 14 or later.\n");
+		return Usage();
+	}
+#endif
+	
+	return 0;
+}
+
+int Usage()
+{
+	dprintf( STDOUT_FILENO,
+		"Max Mind GEO IP Data importer.\nPopulates Geo ip tables on Postgres from a .csv file.\n\n" );
+	
+	dprintf( STDOUT_FILENO,
+		"Options:\n\t-D Specify database name. Host will be localhost and user will be login of user executing the program.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tUse this to connect to your local database server as yourself.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--async [1-%u] Write through this many connections from one event loop thread (two above %u),\n",
+			ASYNC_MAX_CONNECTIONS, ASYNC_CONNECTIONS_PER_LOOP );
+	dprintf( STDOUT_FILENO,
+			"\teach pipelining its chunk's statements (-Q deep, default %u) without a thread waiting on it. -P is not used.\n",
+			ASYNC_PIPELINE_DEPTH );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-B[%u-%u] Chunk size in KB, default 1024. The file is read, parsed and written (one transaction\n",
+			CHUNK_MIN_KB, CHUNK_MAX_KB );
+	dprintf( STDOUT_FILENO,
+			"\tunless -R) a chunk at a time, through a fixed pool of 2 buffers per parser and connection. -T compares sizes.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-C Bulk load each chunk of the file with COPY rather than a function call per row.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--collapse Write each run of contiguous Blocks networks with the same geoname_id and postal code\n" );
+	dprintf( STDOUT_FILENO,
+			"\t(with --extended, the same values in every column) as the fewest networks covering it.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--delta Compare the file with the rows already imported, and only insert, update or delete\n" );
+	dprintf( STDOUT_FILENO,
+			"\tthe rows that differ, in one transaction. For importing a new release over the previous one.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--emit-db [file] Write the Blocks file's networks to a lookup database file for geoipdb.h, no database is used.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tIf the file holds the other address family's networks (IPv4 or IPv6), they are kept.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--entry [name] The .csv to import from a .zip, matched against the end of its path (e.g. Blocks-IPv4.csv).\n" );
+	dprintf( STDOUT_FILENO,
+			"\tNot needed if the .zip holds one .csv. A .zip or .csv.gz is inflated as it is imported.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--extended Also write a Blocks file's latitude, longitude, accuracy_radius, country ids and proxy/satellite\n" );
+	dprintf( STDOUT_FILENO,
+			"\tflags to geoip, adding the columns if missing. They are parsed here and sent in binary (COPY binary with -C).\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--generate [blocks|locations] [rows] Write a synthetic file of that many rows to the file path, to benchmark with.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tThe Blocks rows reference the geoname_ids of a generated Locations file of %u rows or more.\n", GENERATE_LOCATIONS_REFERENCED );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--huge-pages Map the chunk buffers on huge pages if the system has them reserved (vm.nr_hugepages),\n" );
+	dprintf( STDOUT_FILENO,
+			"\totherwise ask for transparent huge pages (Linux).\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--locale [code] With --release, the locale of the Locations file imported (e.g. de, pt-BR). Default is en.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--lookup [address] Look the address up in the lookup database file given in place of the .csv.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-M Map the .csv file into memory and let the parsing threads parse it in place, in parallel.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--metrics [file] Write each stage's time and latency percentiles (read, parse, statement, commit)\n" );
+	dprintf( STDOUT_FILENO,
+			"\tto the file as JSON when the import ends. A progress line is printed every %d seconds.\n", PROGRESS_INTERVAL_SECS );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-P[1-999] Specify number of database connections, each written by its own thread. Default will be up to 3 if not specified.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tWith --emit-db, the number of parsing threads.\n" );
+	dprintf( STDOUT_FILENO,
+			"\t-P auto starts with one connection and adds (or parks) connections while the rows/sec improve, up to %u.\n", AUTO_MAX_WRITERS );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--parsers [1-999] Threads splitting the file's chunks into rows for the connections.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tDefault is one per connection, up to the number of processors.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--partitioned With -M and -C, a City-Blocks file into a geoip partitioned by partition_geoip(): each row is\n" );
+	dprintf( STDOUT_FILENO,
+			"\tcopied into its partition, and each connection fills its own run of partitions, in the file's order.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-Q[1-9999] Pipeline mode, each connection queues up to n statements before waiting for results.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tFor servers or poolers where COPY (-C) is not permitted (cannot be used in conjunction with -C).\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-R[1-9999999] Rows written per transaction. Default is one transaction per chunk (-B) of the file.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tIf a transaction fails its rows are retried one at a time, and the failing rows are\n" );
+	dprintf( STDOUT_FILENO,
+			"\twritten to the reject file, with the error, while the import continues.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--rejects [file] The reject .csv file. Default is the imported file's name + .rejects.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"\tWith --release, the directory of its geoimport-blocks.rejects.csv and geoimport-locations.rejects.csv.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--release Import a release directory (e.g. GeoLite2-City-CSV_20240102) in one run: its Locations file\n" );
+	dprintf( STDOUT_FILENO,
+			"\t(of --locale) then its Blocks files, through the same connections, the Blocks rows parsed and written while\n" );
+	dprintf( STDOUT_FILENO,
+			"\tthe locations are. Their geoname_ids are checked once at the end, the rows without a location are rejected.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--resume Skip what an interrupted import of the same file (name, size and modification time) wrote,\n" );
+	dprintf( STDOUT_FILENO,
+			"\tas recorded chunk by chunk in geoimport_progress, and add to its reject file. Use the same options.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--results [file] Append the run's rows/sec, CPU time and peak RSS (or the -T figures) to the file as a JSON line.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-S Send each row's statement as SQL text, rather than a prepared statement with binary parameters.\n" );
+	dprintf( STDOUT_FILENO,
+			"\tFor poolers that do not support prepared statements, or to compare against the prepared path.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--sink [postgres|null|csv|binary] Where the rows go. Default is postgres. null drops them, to time reading and\n" );
+	dprintf( STDOUT_FILENO,
+			"\tparsing alone. csv and binary (COPY binary format) write them to a file, checked and normalized as they would be\n" );
+	dprintf( STDOUT_FILENO,
+			"\tinserted, with the network ranges and the geoname_id and country code chosen; no database is used.\n" );
+	dprintf( STDOUT_FILENO,
+			"\t--sink-file [file] The csv or binary file. Default is the imported file's name + .normalized.csv (or .bin)\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t--swap Load into UNLOGGED staging tables without indexes, then index them with parallel workers\n" );
+	dprintf( STDOUT_FILENO,
+			"\tand swap them in for the live tables in one transaction (Postgres 11 or later).\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-T Time the .csv tokenizer over the file with each instruction set available, then reading the file\n" );
+	dprintf( STDOUT_FILENO,
+			"\tin chunks and building its rows (COPY text and binary parameters); no database is used.\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\n\t-U Specify Postgres connection string OR URL (cannot be used in conjunction with -D).\n" );
+	dprintf( STDOUT_FILENO,
+			"\tConnection string: 'host=localhost port=5432 dbname=mydb connect_timeout=10' \n" );
+	dprintf( STDOUT_FILENO,
+			"\t  * For details see: https://www.postgresql.org/docs/current/static/libpq-connect.html#LIBPQ-PARAMKEYWORDS \n" );
+	
+	dprintf( STDOUT_FILENO,
+			"\tOR\n\tConnection URI: 'postgresql://[user[:password]@][netloc][:port][/dbname][?param1=value1&...]' \n\n" );
+	
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -P4 -D [dbname] /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -C -P4 -D [dbname] /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --swap -C -P4 -D [dbname] /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -C -P4 --entry Blocks-IPv4.csv -D [dbname] GeoLite2-City-CSV.zip\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --delta -C -P4 -D [dbname] /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --partitioned -M -C -P4 -D [dbname] /file/to/City-Blocks-IPv4.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --collapse -C -P4 -D [dbname] /file/to/City-Blocks-IPv4.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --release -C -P4 -D [dbname] /path/to/GeoLite2-City-CSV_20240102\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -R5000 --rejects /tmp/rejects.csv -P4 -D [dbname] /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -T --results bench.jsonl /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --generate blocks 5000000 /tmp/blocks.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -M -P4 --emit-db geoip.bin /file/to/City-Blocks-IPv4.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --lookup 81.2.69.160 geoip.bin\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --sink csv --sink-file blocks.csv -P4 /file/to/City-Blocks-IPv4.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -Q500 -P4 -U 'host=dbhost port=6432 dbname=mydb' /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport --async 64 -U 'host=dbhost port=6432 dbname=mydb' /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -P4 -U 'host=localhost port=5432 dbname=mydb connect_timeout=10' /file/to/import.csv\n" );
+	dprintf( STDOUT_FILENO,
+			"Usage:\tgeoimport -P4 -U 'postgresql://user@localhost/mydb?connect_timeout=10&application_name=myapp' /file/to/import.csv\n\n" );
+	
+	return 1;
+}
+
+
+const char* STAGINGSearchPathSql = "SET search_path TO geoimport_staging, public";
+
+BOOL PostgresConnection::Connect(const char* strDbName)
+{
+	
+	char* errMsg = NULL;
+	PQconninfoOption* cxnInfo = PQconninfoParse( PGConnectionString, &errMsg );
+	PQconninfoFree(cxnInfo);
+	if( NULL!=errMsg )
+	{
+		dprintf( STDOUT_FILENO,
+				 "Error parsing Connection String: %s\n", errMsg );
+		
+		PQfreemem(errMsg);
+		return NO;
+	}
+	
+	PGconn* PqConn = PQconnectdb( PGConnectionString );
+	switch( PQstatus(PqConn) )
+	{
+		case CONNECTION_OK:
+		case CONNECTION_MADE:
+		case CONNECTION_AUTH_OK:{
+			m_connx = PqConn;
+			
+			// unqualified table names then resolve to the staging tables.
+			if( YES==StagedSwapMode && YES==ExecuteSql(m_connx, STAGINGSearchPathSql) ){
+				return NO;
+			}
+			return YES;
+		}
+		default:
+		{
+			char errUnk[] = "Unknown error";
+			errMsg = PQerrorMessage( PqConn );
+			if( NULL==errMsg){
+				errMsg = errUnk;
+			}
+			dprintf( STDOUT_FILENO,
+				 "Connection failed: %s\n", errMsg );
+
+			PQfinish(PqConn);
+			PqConn = NULL;
+			return NO;
+		}
+	}
+}
+
+
+/*
+ Puts the connection into pipeline mode: QueueParams() sends statements without
+ waiting, and the caller syncs them with SyncPipeline() once IsPipelineFull().
+ Each sync is one implicit transaction, so a failing row rolls back its whole batch.
+ 
+ - Returns YES if pipeline mode was entered.
+ */
+BOOL PostgresConnection::EnterPipelineMode(uint32_t nMaxQueued)
+{
+#if defined(LIBPQ_HAS_PIPELINING)
+	if( 1!=PQenterPipelineMode(m_connx) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to enter pipeline mode: %s\n", PQerrorMessage(m_connx) );
+		return NO;
+	}
+	m_nMaxQueued = nMaxQueued;
+	return YES;
+#else
+	(void)nMaxQueued;
+	dprintf( STDOUT_FILENO, "Pipeline mode requires libpq 14 or later.\n" );
+	return NO;
+#endif
+}
+
+/*
+ Leaves pipeline mode, statements are then sent and waited for one at a time.
+ Nothing may be queued, call SyncPipeline() first.
+ 
+ - Returns YES if pipeline mode was left.
+ */
+BOOL PostgresConnection::ExitPipelineMode()
+{
+#if defined(LIBPQ_HAS_PIPELINING)
+	if( 1!=PQexitPipelineMode(m_connx) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to leave pipeline mode: %s\n", PQerrorMessage(m_connx) );
+		return NO;
+	}
+#endif
+	m_nMaxQueued = 0;
+	return YES;
+}
+
+/*
+ Sends a statement in pipeline mode.
+ - Returns YES if it could not be sent.
+ */
+BOOL PostgresConnection::QueueParams(const char* strSql, int nParams, const char* const* paramValues,
+									 const int* paramLengths, const int* paramFormats)
+{
+	if( 1!=PQsendQueryParams(m_connx, strSql, nParams, NULL, paramValues, paramLengths, paramFormats, 0) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to queue statement: %s\n", PQerrorMessage(m_connx) );
+		return YES;
+	}
+	++m_nQueued;
+	
+	return NO;
+}
+
+/*
+ As QueueParams() for a prepared statement.
+ */
+BOOL PostgresConnection::QueuePrepared(const char* strStmtName, int nParams, const char* const* paramValues,
+									   const int* paramLengths, const int* paramFormats)
+{
+	if( 1!=PQsendQueryPrepared(m_connx, strStmtName, nParams, paramValues, paramLengths, paramFormats, 0) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to queue statement: %s\n", PQerrorMessage(m_connx) );
+		return YES;
+	}
+	++m_nQueued;
+	
+	return NO;
+}
+
+/*
+ Prepares a named statement on this connection.
+ - Returns YES if prepared.
+ */
+BOOL PostgresConnection::Prepare(const char* strStmtName, const char* strSql, int nParams, const Oid* paramTypes)
+{
+	PGresult* pgRes = PQprepare(m_connx, strStmtName, strSql, nParams, paramTypes);
+	BOOL bPrepared = (PGRES_COMMAND_OK==PQresultStatus(pgRes)) ? YES : NO;
+	if( NO==bPrepared ){
+		dprintf( STDOUT_FILENO, "Failed to prepare %s: %s\n", strStmtName, PQresultErrorMessage(pgRes) );
+	}
+	PQclear(pgRes);
+	
+	return bPrepared;
+}
+
+/*
+ Syncs the pipeline and collects the result of every queued statement.
+ The first failing statement is kept, FailedStatement() and RowError(), for the caller
+ to report with the row it queued; the rest of its batch is aborted.
+ 
+ - Returns YES if any statement failed.
+ */
+BOOL PostgresConnection::SyncPipeline()
+{
+	m_nFailedStatement = 0;
+	if( 0==m_nQueued ){ return NO; }
+	
+	BOOL bDidFail = NO;
+#if defined(LIBPQ_HAS_PIPELINING)
+	BOOL bSyncSent = YES;
+	if( 1!=PQpipelineSync(m_connx) )
+	{
+		dprintf( STDOUT_FILENO, "Failed to sync pipeline: %s\n", PQerrorMessage(m_connx) );
+		bSyncSent = NO;
+		bDidFail = YES;
+	}
+	
+	for( uint32_t nRow=0; NO==bDidFail && nRow<m_nQueued; ++nRow )
+	{
+		// each statement's results end with a NULL.
+		PGresult* pgRes;
+		while( NULL!=(pgRes = PQgetResult(m_connx)) )
+		{
+			ExecStatusType resStatus = PQresultStatus(pgRes);
+			if( PGRES_FATAL_ERROR==resStatus || PGRES_BAD_RESPONSE==resStatus )
+			{
+				m_nFailedStatement = nRow+1;
+				SetRowError(PQresultErrorMessage(pgRes));
+				bDidFail = YES;
+			}
+			PQclear(pgRes);
+		}
+	}
+	
+	// the rest of a failed batch come back as PGRES_PIPELINE_ABORTED, each followed
+	// by a NULL, up to the sync result.
+	while( YES==bSyncSent )
+	{
+		PGresult* pgRes = PQgetResult(m_connx);
+		if( NULL==pgRes )
+		{
+			if( CONNECTION_OK!=PQstatus(m_connx) ){ break; }
+			continue;
+		}
+		ExecStatusType resStatus = PQresultStatus(pgRes);
+		PQclear(pgRes);
+		if( PGRES_PIPELINE_SYNC==resStatus ){ break; }
+	}
+#endif
+	
+	m_nQueued = 0;
+	
+	return bDidFail;
+}
+
+/*
+ Keeps why a row failed, without the trailing newline of server messages.
+ */
+void PostgresConnection::SetRowError(const char* strError)
+{
+	m_rowError = (NULL!=strError) ? strError : "";
+	while( !m_rowError.empty() && ('\n'==m_rowError.back() || ' '==m_rowError.back()) ){
+		m_rowError.pop_back();
+	}
+}
+
+/*			Postgres Database		*/
+const char* ADDLOCSql = "INSERT INTO geoname_location "
+	"(geoname_id,continent_code,city_name,country_iso_code,subdivision1_iso_code,subdivision2_iso_code) "
+	"VALUES ($1::INT4,$2,$3,$4,$5,$6) ON CONFLICT DO NOTHING";
+
+// the Blocks rows go straight into geoip: their geoname_ids are checked as they are parsed
+// (IsKnownGeonameId()), or with --release once the files are written (validate_release_load()).
+const char* ADDGEOIPSql = "INSERT INTO geoip (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end) "
+	"VALUES ($1::inet,$2::INT4,$3,$4::int8range,$5::bytea,$6::bytea)";
+
+// --delta: rows go into the delta tables, unchecked, apply_delta() validates them.
+const char* ADDLOCDeltaSql = "INSERT INTO geoname_location_delta "
+	"(geoname_id,continent_code,city_name,country_iso_code,subdivision_1_iso_code,subdivision_2_iso_code) "
+	"VALUES ($1::INT4,$2,$3,$4,$5,$6)";
+const char* ADDGEOIPDeltaSql = "INSERT INTO geoip_delta (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end) "
+	"VALUES ($1::inet,$2::INT4,$3,$4::int8range,$5::bytea,$6::bytea)";
+
+// --extended: the Blocks rows carry the extended columns as well (begin_extended_load()).
+const char* ADDGEOIPExtendedSql = "INSERT INTO geoip (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end,"
+	"registered_country_geoname_id,represented_country_geoname_id,is_anonymous_proxy,is_satellite_provider,"
+	"latitude,longitude,accuracy_radius) "
+	"VALUES ($1::inet,$2::INT4,$3,$4::int8range,$5::bytea,$6::bytea,"
+	"$7::INT4,$8::INT4,$9::BOOLEAN,$10::BOOLEAN,$11::FLOAT8,$12::FLOAT8,$13::INT4)";
+
+const char* ADDLOCStmt = "geoimport_add_location";
+const char* ADDGEOIPStmt = "geoimport_add_geoip";
+
+const int PGPARAM_FORMAT_BIN = 1;
+const int PGPARAM_FORMAT_STR = 0;
+
+// type oids (pg_type.h) of the binary parameters.
+const Oid PGTYPE_BOOL = 16;
+const Oid PGTYPE_BYTEA = 17;
+const Oid PGTYPE_INT4 = 23;
+const Oid PGTYPE_FLOAT8 = 701;
+const Oid PGTYPE_INET = 869;
+const Oid PGTYPE_UNKNOWN = 0;
+
+/*
+ Parses a whole field as a decimal integer, as std::from_chars does: no locale,
+ errno or leading white space, and nothing allocated.
+ - Returns YES if the text is not an integer in the int4 range.
+ */
+static BOOL ParseInt32(const char* strValue, int32_t* pValue)
+{
+	const char* pRead = strValue;
+	BOOL isNegative = ('-'==*pRead) ? YES : NO;
+	if( '-'==*pRead || '+'==*pRead ){ ++pRead; }
+	if( '\0'==*pRead ){ return YES; }
+	
+	uint64_t nValue = 0;
+	for( ; '\0'!=*pRead; ++pRead )
+	{
+		uint32_t nDigit = (uint32_t)(*pRead - '0');
+		if( nDigit>9 ){ return YES; }
+		nValue = nValue*10 + nDigit;
+		if( nValue>(uint64_t)INT32_MAX + 1 ){ return YES; }
+	}
+	if( NO==isNegative && nValue>(uint64_t)INT32_MAX ){ return YES; }
+	
+	*pValue = (int32_t)((YES==isNegative) ? -(int64_t)nValue : (int64_t)nValue);
+	return NO;
+}
+
+/*
+ Parses a whole field as a decimal number, e.g. "-33.4940". Up to 19 significant digits
+ are read as an integer and divided by a power of ten: while both are exact doubles
+ (up to 2^53 and 1e22) that one division is correctly rounded, the same value strtod
+ gives. An exponent or a longer number, which the Blocks files do not have, falls back
+ to strtod.
+ - Returns YES if the text is not a finite number.
+ */
+static BOOL ParseFloat8(const char* strValue, double* pValue)
+{
+	static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+										 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const int MAX_EXACT_POWER = 22;
+	const uint64_t MAX_EXACT_MANTISSA = (uint64_t)1 << 53;
+	
+	const char* pRead = strValue;
+	BOOL isNegative = ('-'==*pRead) ? YES : NO;
+	if( '-'==*pRead || '+'==*pRead ){ ++pRead; }
+	
+	uint64_t nMantissa = 0;
+	int nDigits = 0, nSignificant = 0, nScale = 0;
+	BOOL inFraction = NO;
+	for( ; '\0'!=*pRead; ++pRead )
+	{
+		if( '.'==*pRead && NO==inFraction )
+		{
+			inFraction = YES;
+			continue;
+		}
+		uint32_t nDigit = (uint32_t)(*pRead - '0');
+		if( nDigit>9 ){ break; }
+		
+		++nDigits;
+		if( 0==nMantissa && 0==nDigit )
+		{
+			// leading zeros are not significant, but move the point the same.
+			if( YES==inFraction ){ ++nScale; }
+			continue;
+		}
+		if( ++nSignificant>19 ){ break; }
+		nMantissa = nMantissa*10 + nDigit;
+		if( YES==inFraction ){ ++nScale; }
+	}
+	if( 0==nDigits ){ return YES; }
+	
+	if( '\0'==*pRead && nMantissa<=MAX_EXACT_MANTISSA && nScale<=MAX_EXACT_POWER )
+	{
+		double dValue = (double)nMantissa / powersOf10[nScale];
+		*pValue = (YES==isNegative) ? -dValue : dValue;
+		return NO;
+	}
+	if( '\0'!=*pRead && 'e'!=*pRead && 'E'!=*pRead && nSignificant<=19 ){ return YES; }
+	
+	char* endptr;
+	double dValue = strtod(strValue, &endptr);
+	if( '\0'!=*endptr || 0==isfinite(dValue) ){ return YES; }
+	*pValue = dValue;
+	return NO;
+}
+
+/*
+ Parses a 0 or 1 flag, as the Blocks files write them, into the binary bool format.
+ - Returns YES if the text is not a flag.
+ */
+static BOOL ParseFlag(const char* strValue, char* pBinary)
+{
+	if( ('0'!=strValue[0] && '1'!=strValue[0]) || '\0'!=strValue[1] ){ return YES; }
+	*pBinary = strValue[0] - '0';
+	return NO;
+}
+
+/*
+ Stores 8 bytes in network byte order, as int8 and float8 are sent.
+ */
+static void StoreNetworkInt64(uint64_t nValue, char* pBinary)
+{
+	for( int nByte=0; nByte<8; ++nByte ){
+		pBinary[nByte] = (char)(nValue >> (56 - 8*nByte));
+	}
+}
+
+/*
+ Parses a decimal geoname id into the binary int4 wire format (network byte order).
+ - Returns YES if the text is not a valid id.
+ */
+static BOOL TextToBinaryInt4(const char* strValue, uint32_t* pBinary)
+{
+	if( NULL==strValue ){ return YES; }
+	
+	int32_t nValue;
+	if( YES==ParseInt32(strValue, &nValue) ){ return YES; }
+	*pBinary = htonl((uint32_t)nValue);
+	return NO;
+}
+
+/*
+ The --extended columns of a Blocks row in the binary wire format, for the prepared
+ statement and the binary COPY. An empty field is NULL.
+ */
+typedef enum BLOCKEXTRA_COLUMNS {
+	EXT_registered_country_geoname_id = 0,
+	EXT_represented_country_geoname_id,
+	EXT_is_anonymous_proxy,
+	EXT_is_satellite_provider,
+	EXT_latitude,
+	EXT_longitude,
+	EXT_accuracy_radius,
+	EXT_NUM_COLUMNS } BLOCKEXTRA_COLUMN_ID;
+
+static const BLOCKS_FIELD_ID BlockExtraFields[EXT_NUM_COLUMNS] = {
+	BLK_registered_country_geoname_id, BLK_represented_country_geoname_id,
+	BLK_is_anonymous_proxy, BLK_is_satellite_provider,
+	BLK_latitude, BLK_longitude, BLK_accuracy_radius };
+static const Oid BlockExtraTypes[EXT_NUM_COLUMNS] = {
+	PGTYPE_INT4, PGTYPE_INT4, PGTYPE_BOOL, PGTYPE_BOOL, PGTYPE_FLOAT8, PGTYPE_FLOAT8, PGTYPE_INT4 };
+static const char* BlockExtraErrors[EXT_NUM_COLUMNS] = {
+	"Invalid registered_country_geoname_id", "Invalid represented_country_geoname_id",
+	"Invalid is_anonymous_proxy", "Invalid is_satellite_provider",
+	"Invalid latitude", "Invalid longitude", "Invalid accuracy_radius" };
+
+typedef struct BLOCKEXTRAS {
+	uint32_t	geonameId;						// the row's BlockGeonameId(), for the binary COPY
+	char		binary[EXT_NUM_COLUMNS][8];
+	const char*	values[EXT_NUM_COLUMNS];		// binary[n], or NULL
+	int			lengths[EXT_NUM_COLUMNS];
+} BlockExtras;
+
+/*
+ Parses the row's geoname id and extended columns.
+ - pstrError : [out] why the row is invalid.
+ 
+ - Returns YES if a value is not valid.
+ */
+static BOOL ParseBlockExtras(const char* const* fields, BlockExtras* pExtras, const char** pstrError)
+{
+	if( YES==TextToBinaryInt4(BlockGeonameId(fields), &pExtras->geonameId) )
+	{
+		*pstrError = "Invalid geoname_id";
+		return YES;
+	}
+	
+	for( int nColumn=0; nColumn<EXT_NUM_COLUMNS; ++nColumn )
+	{
+		const char* strValue = fields[BlockExtraFields[nColumn]];
+		pExtras->values[nColumn] = NULL;
+		pExtras->lengths[nColumn] = 0;
+		if( NULL==strValue ){ continue; }
+		
+		char* pBinary = pExtras->binary[nColumn];
+		BOOL bInvalid;
+		int nLength;
+		switch( BlockExtraTypes[nColumn] )
+		{
+			case PGTYPE_BOOL:{
+				bInvalid = ParseFlag(strValue, pBinary);
+				nLength = 1;
+				break;
+			}
+			case PGTYPE_FLOAT8:{
+				double dValue = 0;
+				uint64_t nBits;
+				bInvalid = ParseFloat8(strValue, &dValue);
+				memcpy(&nBits, &dValue, sizeof(nBits));
+				StoreNetworkInt64(nBits, pBinary);
+				nLength = 8;
+				break;
+			}
+			default:{
+				uint32_t nValue = 0;
+				bInvalid = TextToBinaryInt4(strValue, &nValue);
+				memcpy(pBinary, &nValue, sizeof(nValue));
+				nLength = 4;
+				break;
+			}
+		}
+		if( YES==bInvalid )
+		{
+			*pstrError = BlockExtraErrors[nColumn];
+			return YES;
+		}
+		pExtras->values[nColumn] = pBinary;
+		pExtras->lengths[nColumn] = nLength;
+	}
+	return NO;
+}
+
+// family, bits, is_cidr, address length then up to 16 address bytes.
+const int INET_BINARY_MAX = 4 + 16;
+const char PGSQL_AF_INET = AF_INET + 0;	// as utils/inet.h
+const char PGSQL_AF_INET6 = AF_INET + 1;
+
+/*
+ Converts 'address/bits' (or a bare address) into the binary inet wire format.
+ - pBinary : at least INET_BINARY_MAX bytes.
+ - Returns YES if the text is not a valid IPv4 or IPv6 network.
+ */
+static BOOL TextToBinaryInet(const char* strNetwork, char* pBinary, int* pnLength)
+{
+	if( NULL==strNetwork ){ return YES; }
+	
+	char strAddress[INET6_ADDRSTRLEN];
+	const char* pSlash = strchr(strNetwork, '/');
+	size_t nAddressLen = (NULL!=pSlash) ? (size_t)(pSlash - strNetwork) : strlen(strNetwork);
+	if( nAddressLen>=sizeof(strAddress) ){ return YES; }
+	memcpy(strAddress, strNetwork, nAddressLen);
+	strAddress[nAddressLen] = '\0';
+	
+	BOOL isIPv6 = (NULL!=strchr(strAddress, ':')) ? YES : NO;
+	int nAddrBytes = (YES==isIPv6) ? 16 : 4;
+	if( 1!=inet_pton((YES==isIPv6) ? AF_INET6 : AF_INET, strAddress, pBinary + 4) ){
+		return YES;
+	}
+	
+	long lBits = nAddrBytes*8;
+	if( NULL!=pSlash )
+	{
+		char* endptr;
+		lBits = strtol(pSlash+1, &endptr, 10);
+		if( endptr==pSlash+1 || '\0'!=*endptr || lBits<0 || lBits>nAddrBytes*8 ){ return YES; }
+	}
+	
+	pBinary[0] = (YES==isIPv6) ? PGSQL_AF_INET6 : PGSQL_AF_INET;
+	pBinary[1] = (char)lBits;
+	pBinary[2] = 0;	// is_cidr, ignored by inet_recv
+	pBinary[3] = (char)nAddrBytes;
+	*pnLength = 4 + nAddrBytes;
+	return NO;
+}
+
+/*
+ First and last address of a network, for the geoip range columns: an IPv4 network
+ is an int8range of its addresses as integers, an IPv6 one its 16 byte (big endian)
+ first and last address as bytea. The text forms are for the SQL text and COPY paths.
+ */
+typedef struct NETWORKRANGE {
+	BOOL	isIPv6;
+	uint32_t ipv4First;				// host byte order
+	uint32_t ipv4Last;
+	char	strIPv4Range[24];		// "[first,last]"
+	char	ipv6First[16];
+	char	ipv6Last[16];
+	char	strIPv6First[2+32+1];	// "\x" and hex digits
+	char	strIPv6Last[2+32+1];
+} NetworkRange;
+
+static void BytesToHexBytea(const unsigned char* pBytes, int nBytes, char* strHex)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+	*strHex++ = '\\';
+	*strHex++ = 'x';
+	for( int nByte=0; nByte<nBytes; ++nByte )
+	{
+		*strHex++ = hexDigits[pBytes[nByte] >> 4];
+		*strHex++ = hexDigits[pBytes[nByte] & 0x0F];
+	}
+	*strHex = '\0';
+}
+
+/*
+ - Returns YES if the text is not a valid IPv4 or IPv6 network.
+ */
+static BOOL NetworkToRange(const char* strNetwork, NetworkRange* pRange)
+{
+	char inetValue[INET_BINARY_MAX];
+	int nLength;
+	if( YES==TextToBinaryInet(strNetwork, inetValue, &nLength) ){ return YES; }
+	
+	int nBits = (unsigned char)inetValue[1];
+	int nAddrBytes = inetValue[3];
+	const unsigned char* pAddress = (const unsigned char*)&inetValue[4];
+	
+	unsigned char first[16], last[16];
+	for( int nByte=0; nByte<nAddrBytes; ++nByte )
+	{
+		// the bits of this byte inside the prefix are kept.
+		int nPrefixBits = nBits - nByte*8;
+		unsigned char mask = (nPrefixBits>=8) ? 0xFF : (nPrefixBits<=0) ? 0x00 : (unsigned char)(0xFF << (8-nPrefixBits));
+		first[nByte] = pAddress[nByte] & mask;
+		last[nByte] = first[nByte] | (unsigned char)~mask;
+	}
+	
+	pRange->isIPv6 = (16==nAddrBytes) ? YES : NO;
+	if( NO==pRange->isIPv6 )
+	{
+		uint32_t nFirst, nLast;
+		memcpy(&nFirst, first, 4);
+		memcpy(&nLast, last, 4);
+		pRange->ipv4First = ntohl(nFirst);
+		pRange->ipv4Last = ntohl(nLast);
+		snprintf(pRange->strIPv4Range, sizeof(pRange->strIPv4Range), "[%u,%u]", pRange->ipv4First, pRange->ipv4Last);
+	}
+	else
+	{
+		memcpy(pRange->ipv6First, first, 16);
+		memcpy(pRange->ipv6Last, last, 16);
+		BytesToHexBytea(first, 16, pRange->strIPv6First);
+		BytesToHexBytea(last, 16, pRange->strIPv6Last);
+	}
+	return NO;
+}
+
+typedef enum ADDLOC_PARAMS {
+	p_geoname_id = 0 ,
+	p_continent_code ,
+	p_city_name ,
+	p_iso2_country_code,
+	p_subdivision_1_iso_code,
+	p_subdivision_2_iso_code,
+	ADDLOC_NUM_PARAMS } ADDLOC_PARAM_ID;
+
+static int ADDLOCparamLengths[ADDLOC_NUM_PARAMS] = {0};
+static int ADDLOCparamFormats[ADDLOC_NUM_PARAMS] = {0};
+
+static const Oid ADDLOCpreparedTypes[ADDLOC_NUM_PARAMS] = { PGTYPE_INT4 };
+static const int ADDLOCpreparedFormats[ADDLOC_NUM_PARAMS] = { PGPARAM_FORMAT_BIN };
+
+typedef enum ADDGEOIP_PARAMS {
+	ADDGEOIP_p_network = 0,
+	ADDGEOIP_p_geoname_id,
+	ADDGEOIP_p_postal_code,
+	ADDGEOIP_p_ip_range,
+	ADDGEOIP_p_ip6_start,
+	ADDGEOIP_p_ip6_end,
+	ADDGEOIP_p_extended,	// --extended: the EXT_NUM_COLUMNS BlockExtras columns follow
+	ADDGEOIP_NUM_PARAMS = ADDGEOIP_p_extended + EXT_NUM_COLUMNS }ADDGEOIP_PARAM_ID;
+
+// the parameters sent, the extended ones only with --extended.
+static int ADDGEOIPnumParams = ADDGEOIP_p_extended;
+
+static int ADDGEOIPparamLengths[ADDGEOIP_NUM_PARAMS] = {0};
+static int ADDGEOIPparamFormats[ADDGEOIP_NUM_PARAMS] = {0};
+
+static const Oid ADDGEOIPpreparedTypes[ADDGEOIP_NUM_PARAMS] =
+	{ PGTYPE_INET, PGTYPE_INT4, PGTYPE_UNKNOWN, PGTYPE_UNKNOWN, PGTYPE_BYTEA, PGTYPE_BYTEA,
+	  PGTYPE_INT4, PGTYPE_INT4, PGTYPE_BOOL, PGTYPE_BOOL, PGTYPE_FLOAT8, PGTYPE_FLOAT8, PGTYPE_INT4 };
+static const int ADDGEOIPpreparedFormats[ADDGEOIP_NUM_PARAMS] =
+	{ PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_STR, PGPARAM_FORMAT_STR, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN,
+	  PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN, PGPARAM_FORMAT_BIN };
+
+/*
+ Prepares the statement for the file's rows on this connection.
+ - Returns YES if it failed.
+ */
+BOOL PrepareStatements(FILETYPE fileMode, PostgresConnection& pgConnx)
+{
+	BOOL bPrepared = (IPBLOCKS==fileMode)
+		? pgConnx.Prepare(ADDGEOIPStmt, ADDGEOIPSql, ADDGEOIPnumParams, ADDGEOIPpreparedTypes)
+		: pgConnx.Prepare(ADDLOCStmt, ADDLOCSql, ADDLOC_NUM_PARAMS, ADDLOCpreparedTypes);
+	
+	return (YES==bPrepared) ? NO : YES;
+}
+
+/*
+ - extended_fields : the row's fields with --extended, for the extended columns, otherwise NULL.
+ */
+BOOL AddIPBlockToDatabase(const char* network,
+						  const char* geoname_id,
+						  const char* postal_code,
+						  const char* const* extended_fields,
+						  PostgresConnection& pgConnx)
+{
+	// the range columns are worked out here, so the server only stores them.
+	NetworkRange range;
+	if( YES==NetworkToRange(network, &range) )
+	{
+		dprintf(STDOUT_FILENO, "Invalid Geo IP value (%s) for geoname_id:%s\n", network, geoname_id);
+		pgConnx.SetRowError("Invalid network");
+		return YES;
+	}
+	
+	const char* ADDGEOIPvalues[ADDGEOIP_NUM_PARAMS];
+	
+	ADDGEOIPvalues[ADDGEOIP_p_network] = network;
+	ADDGEOIPvalues[ADDGEOIP_p_geoname_id] = geoname_id;
+	ADDGEOIPvalues[ADDGEOIP_p_postal_code] = postal_code;
+	ADDGEOIPvalues[ADDGEOIP_p_ip_range] = (NO==range.isIPv6) ? range.strIPv4Range : NULL;
+	ADDGEOIPvalues[ADDGEOIP_p_ip6_start] = (YES==range.isIPv6) ? range.strIPv6First : NULL;
+	ADDGEOIPvalues[ADDGEOIP_p_ip6_end] = (YES==range.isIPv6) ? range.strIPv6Last : NULL;
+	if( NULL!=extended_fields )
+	{
+		for( int nColumn=0; nColumn<EXT_NUM_COLUMNS; ++nColumn ){
+			ADDGEOIPvalues[ADDGEOIP_p_extended + nColumn] = extended_fields[BlockExtraFields[nColumn]];
+		}
+	}
+	
+	BOOL bDidFail;
+	PGresult* pgRes;
+	if( YES==UsePreparedStatements )
+	{
+		// network, geoname_id and the IPv6 range go in binary so the server skips the text conversion.
+		char inetValue[INET_BINARY_MAX];
+		uint32_t geonameIdValue;
+		int paramLengths[ADDGEOIP_NUM_PARAMS] = { 0, sizeof(geonameIdValue), 0, 0, 16, 16 };
+		
+		if( YES==TextToBinaryInet(network, inetValue, &paramLengths[ADDGEOIP_p_network]) ||
+			YES==TextToBinaryInt4(geoname_id, &geonameIdValue) )
+		{
+			dprintf(STDOUT_FILENO, "Invalid Geo IP value (%s) for geoname_id:%s\n", network, geoname_id);
+			pgConnx.SetRowError("Invalid network or geoname_id");
+			return YES;
+		}
+		
+		const char* binaryValues[ADDGEOIP_NUM_PARAMS];
+		binaryValues[ADDGEOIP_p_network] = inetValue;
+		binaryValues[ADDGEOIP_p_geoname_id] = (const char*)&geonameIdValue;
+		binaryValues[ADDGEOIP_p_postal_code] = postal_code;
+		binaryValues[ADDGEOIP_p_ip_range] = ADDGEOIPvalues[ADDGEOIP_p_ip_range];
+		binaryValues[ADDGEOIP_p_ip6_start] = (YES==range.isIPv6) ? range.ipv6First : NULL;
+		binaryValues[ADDGEOIP_p_ip6_end] = (YES==range.isIPv6) ? range.ipv6Last : NULL;
+		
+		// the extended columns are converted here too, so the server parses no numbers.
+		BlockExtras extras;
+		if( NULL!=extended_fields )
+		{
+			const char* strError;
+			if( YES==ParseBlockExtras(extended_fields, &extras, &strError) )
+			{
+				dprintf(STDOUT_FILENO, "Invalid Geo IP value (%s) for geoname_id:%s - %s\n", network, geoname_id, strError);
+				pgConnx.SetRowError(strError);
+				return YES;
+			}
+			for( int nColumn=0; nColumn<EXT_NUM_COLUMNS; ++nColumn )
+			{
+				binaryValues[ADDGEOIP_p_extended + nColumn] = extras.values[nColumn];
+				paramLengths[ADDGEOIP_p_extended + nColumn] = extras.lengths[nColumn];
+			}
+		}
+		
+		if( YES==pgConnx.IsPipelined() ){
+			return pgConnx.QueuePrepared(ADDGEOIPStmt, ADDGEOIPnumParams, binaryValues,
+										 paramLengths, ADDGEOIPpreparedFormats);
+		}
+		
+		pgRes = PQexecPrepared(pgConnx,
+							   ADDGEOIPStmt,
+							   ADDGEOIPnumParams,
+							   binaryValues,
+							   paramLengths,
+							   ADDGEOIPpreparedFormats, 0);
+	}
+	else
+	{
+		if( YES==pgConnx.IsPipelined() ){
+			return pgConnx.QueueParams(ADDGEOIPSql, ADDGEOIPnumParams, ADDGEOIPvalues,
+									   ADDGEOIPparamLengths, ADDGEOIPparamFormats);
+		}
+		
+		pgRes = PQexecParams(pgConnx,
+							 ADDGEOIPSql,	//command,
+							 ADDGEOIPnumParams,
+							 NULL,
+							 ADDGEOIPvalues,
+							 ADDGEOIPparamLengths,
+							 ADDGEOIPparamFormats, 0);
+	}
+	
+	ExecStatusType resStatus = PQresultStatus( pgRes );
+	switch( resStatus )
+	{
+		case PGRES_EMPTY_QUERY:
+		case PGRES_COMMAND_OK:
+		case PGRES_TUPLES_OK:{
+			bDidFail = NO;
+			break;
+		}
+		case PGRES_BAD_RESPONSE:
+		case PGRES_FATAL_ERROR:{
+			bDidFail = YES;
+			break;
+		}
+		default:{
+			bDidFail = YES;
+			break;
+		}
+	}
+	
+	if( YES==bDidFail ){
+		const char* strErrMsg = PQresultErrorMessage(pgRes);
+		
+		dprintf(STDOUT_FILENO, "Failed to add Geo IP value (%s) for geoname_id:%s - %s\n",
+				network, geoname_id,strErrMsg);
+		pgConnx.SetRowError(strErrMsg);
+	}
+	PQclear(pgRes);
+	
+	return bDidFail;
+}
+
+
+BOOL AddLocationToDatabase(const char* geoname_id, const char* continent_code, const char* city_name,
+						   const char* country_iso_code,
+						   const char* subdivision_1_iso_code,
+						   const char* subdivision_2_iso_code,
+						   PostgresConnection& pgConnx)
+{
+	const char* ADDLOCvalues[ADDLOC_NUM_PARAMS];
+	ADDLOCvalues[p_geoname_id] = geoname_id;
+	ADDLOCvalues[p_continent_code] = continent_code;
+	ADDLOCvalues[p_city_name] = city_name;
+	ADDLOCvalues[p_iso2_country_code] = country_iso_code;
+	ADDLOCvalues[p_subdivision_1_iso_code] = subdivision_1_iso_code;
+	ADDLOCvalues[p_subdivision_2_iso_code] = subdivision_2_iso_code;
+	
+	BOOL bDidFail;
+	PGresult* pgRes;
+	if( YES==UsePreparedStatements )
+	{
+		uint32_t geonameIdValue;
+		if( YES==TextToBinaryInt4(geoname_id, &geonameIdValue) )
+		{
+			dprintf(STDOUT_FILENO, "Invalid geoname_id:%s\n", geoname_id);
+			pgConnx.SetRowError("Invalid geoname_id");
+			return YES;
+		}
+		
+		const char* binaryValues[ADDLOC_NUM_PARAMS];
+		memcpy(binaryValues, ADDLOCvalues, sizeof(binaryValues));
+		binaryValues[p_geoname_id] = (const char*)&geonameIdValue;
+		
+		int paramLengths[ADDLOC_NUM_PARAMS] = { sizeof(geonameIdValue) };
+		
+		if( YES==pgConnx.IsPipelined() ){
+			return pgConnx.QueuePrepared(ADDLOCStmt, ADDLOC_NUM_PARAMS, binaryValues,
+										 paramLengths, ADDLOCpreparedFormats);
+		}
+		
+		pgRes = PQexecPrepared(pgConnx,
+							   ADDLOCStmt,
+							   ADDLOC_NUM_PARAMS,
+							   binaryValues,
+							   paramLengths,
+							   ADDLOCpreparedFormats, 0);
+	}
+	else
+	{
+		if( YES==pgConnx.IsPipelined() ){
+			return pgConnx.QueueParams(ADDLOCSql, ADDLOC_NUM_PARAMS, ADDLOCvalues,
+									   ADDLOCparamLengths, ADDLOCparamFormats);
+		}
+		
+		pgRes = PQexecParams(pgConnx,
+							 ADDLOCSql,	//command,
+							 ADDLOC_NUM_PARAMS,
+							 NULL,
+							 ADDLOCvalues,
+							 ADDLOCparamLengths,
+							 ADDLOCparamFormats, 0);
+	}
+	
+	ExecStatusType resStatus = PQresultStatus( pgRes );
+	switch( resStatus )
+	{
+		case PGRES_EMPTY_QUERY:
+		case PGRES_COMMAND_OK:
+		case PGRES_TUPLES_OK:{
+			bDidFail = NO;
+			break;
+		}
+		case PGRES_BAD_RESPONSE:
+		case PGRES_FATAL_ERROR:{
+			bDidFail = YES;
+			break;
+		}
+		default:{
+			bDidFail = YES;
+			break;
+		}
+	}
+	
+	if( YES==bDidFail ){
+		const char* strErrMsg = PQresultErrorMessage(pgRes);
+		
+		dprintf(STDOUT_FILENO, "Failed to add Geoname Location value for geoname_id:%s - %s\n",
+				geoname_id,strErrMsg);
+		pgConnx.SetRowError(strErrMsg);
+		
+		dprintf(STDOUT_FILENO,"Values: '%s'\n'%s'\n'%s'\n'%s'\n'%s'\n",
+		continent_code, city_name,
+		 country_iso_code,
+		 subdivision_1_iso_code,
+				subdivision_2_iso_code );
+		
+	}
+	PQclear(pgRes);
+	
+	return bDidFail;
+}
+
+
+/*			Bulk COPY			*/
+
+/* Session load table, emptied by each chunk's COMMIT. Column order matches the COPY rows. */
+const char* CREATELOCLoadSql =
+	"CREATE TEMP TABLE IF NOT EXISTS geoname_location_load "
+	"(geoname_id INT4, continent_code CHAR(2), city_name VARCHAR(256), country_iso_code CHAR(2), "
+	"subdivision_1_iso_code VARCHAR(8), subdivision_2_iso_code VARCHAR(8)) ON COMMIT DELETE ROWS";
+
+// geoip's columns in the order of the COPY rows (and the file sinks'), then the --extended ones.
+#define GEOIP_COLUMNS "network,geoname_id,postal_code,ip_range,ip6_start,ip6_end"
+#define GEOIP_EXTENDED_COLUMNS ",registered_country_geoname_id,represented_country_geoname_id," \
+	"is_anonymous_proxy,is_satellite_provider,latitude,longitude,accuracy_radius"
+
+// what follows the table in a Blocks COPY, also into a --partitioned leaf.
+const char* COPYGEOIPColumns = " (" GEOIP_COLUMNS ") FROM STDIN";
+
+// the Blocks rows, checked as they are parsed, are copied straight into geoip.
+const char* COPYGEOIPSql = "COPY geoip (" GEOIP_COLUMNS ") FROM STDIN";
+const char* COPYLOCSql = "COPY geoname_location_load FROM STDIN";
+
+const char* MERGELOCSql = "SELECT merge_geoname_location_load()";
+
+const char* COPYGEOIPDeltaSql = "COPY geoip_delta (" GEOIP_COLUMNS ") FROM STDIN";
+const char* COPYLOCDeltaSql = "COPY geoname_location_delta FROM STDIN";
+
+// --extended: binary COPY, so the coordinates arrive as float8 rather than text to convert.
+const char* COPYGEOIPExtendedColumns = " (" GEOIP_COLUMNS GEOIP_EXTENDED_COLUMNS ") FROM STDIN (FORMAT binary)";
+const char* COPYGEOIPExtendedSql = "COPY geoip (" GEOIP_COLUMNS GEOIP_EXTENDED_COLUMNS ") FROM STDIN (FORMAT binary)";
+
+// binary COPY signature, flags and header extension length; a column count of -1 ends the rows.
+static const char COPYBinaryHeader[19] = { 'P','G','C','O','P','Y','\n','\377','\r','\n','\0', 0,0,0,0, 0,0,0,0 };
+static const char COPYBinaryTrailer[2] = { '\377','\377' };
+
+/*
+ Runs a statement with no parameters.
+ - Returns YES if the statement failed.
+ */
+static BOOL ExecuteSql(PGconn* PqConn, const char* strSql)
+{
+	BOOL bDidFail;
+	PGresult* pgRes = PQexec(PqConn, strSql);
+	switch( PQresultStatus(pgRes) )
+	{
+		case PGRES_EMPTY_QUERY:
+		case PGRES_COMMAND_OK:
+		case PGRES_TUPLES_OK:{
+			bDidFail = NO;
+			break;
+		}
+		default:{
+			bDidFail = YES;
+			dprintf(STDOUT_FILENO, "Failed to execute '%s' - %s\n", strSql, PQresultErrorMessage(pgRes));
+			break;
+		}
+	}
+	PQclear(pgRes);
+	
+	return bDidFail;
+}
+
+BOOL CopyBuffer::Reserve(size_t nBytes)
+{
+	if( m_used + nBytes <= m_capacity ){ return NO; }
+	
+	size_t nCapacity = (0==m_capacity) ? (size_t)ChunkSize : m_capacity;
+	while( nCapacity < m_used + nBytes ){ nCapacity *= 2; }
+	
+	char* pBuffer = (char*)realloc(m_buffer, nCapacity);
+	if( NULL==pBuffer ){
+		dprintf(STDOUT_FILENO, "Failed to allocate %zu bytes for COPY buffer.\n", nCapacity);
+		return YES;
+	}
+	m_buffer = pBuffer;
+	m_capacity = nCapacity;
+	return NO;
+}
+
+/*
+ Appends a field in COPY text format, escaping the characters COPY treats specially.
+ - value : field text, or NULL for a database NULL.
+ - isLastField : YES ends the row, otherwise a column delimiter follows.
+ 
+ - Returns YES if the buffer could not grow.
+ */
+BOOL CopyBuffer::AppendField(const char* value, BOOL isLastField)
+{
+	size_t nLen = (NULL==value) ? 2 : strlen(value);
+	
+	// worst case every character is escaped, plus the delimiter.
+	if( YES==Reserve(2*nLen + 1) ){ return YES; }
+	
+	char* pWrite = m_buffer + m_used;
+	if( NULL==value )
+	{
+		*pWrite++ = '\\';
+		*pWrite++ = 'N';
+	}
+	else
+	{
+		for( const char* pRead=value; '\0'!=*pRead; ++pRead )
+		{
+			switch( *pRead )
+			{
+				case '\\':{ *pWrite++ = '\\'; *pWrite++ = '\\'; break; }
+				case '\t':{ *pWrite++ = '\\'; *pWrite++ = 't'; break; }
+				case '\n':{ *pWrite++ = '\\'; *pWrite++ = 'n'; break; }
+				case '\r':{ *pWrite++ = '\\'; *pWrite++ = 'r'; break; }
+				default:{ *pWrite++ = *pRead; break; }
+			}
+		}
+	}
+	*pWrite++ = (YES==isLastField) ? '\n' : '\t';
+	
+	m_used = (pWrite - m_buffer);
+	return NO;
+}
+
+/*
+ Starts a binary format row of nColumns values.
+ - Returns YES if the buffer could not grow.
+ */
+BOOL CopyBuffer::AppendBinaryRow(int nColumns)
+{
+	if( YES==Reserve(2) ){ return YES; }
+	
+	uint16_t nCount = htons((uint16_t)nColumns);
+	memcpy(m_buffer + m_used, &nCount, sizeof(nCount));
+	m_used += sizeof(nCount);
+	return NO;
+}
+
+/*
+ Appends a binary format value.
+ - pValue : the value's bytes in its type's binary format, or NULL for a database NULL.
+ 
+ - Returns YES if the buffer could not grow.
+ */
+BOOL CopyBuffer::AppendBinaryField(const char* pValue, int nLength)
+{
+	if( NULL==pValue ){ nLength = 0; }
+	if( YES==Reserve(4 + (size_t)nLength) ){ return YES; }
+	
+	uint32_t nFieldLength = htonl((NULL==pValue) ? (uint32_t)-1 : (uint32_t)nLength);
+	memcpy(m_buffer + m_used, &nFieldLength, sizeof(nFieldLength));
+	m_used += sizeof(nFieldLength);
+	if( nLength>0 )
+	{
+		memcpy(m_buffer + m_used, pValue, (size_t)nLength);
+		m_used += (size_t)nLength;
+	}
+	return NO;
+}
+
+/*
+ Creates this connection's session load table for the Locations rows.
+ - Returns YES if it failed.
+ */
+BOOL PrepareBulkCopy(FILETYPE fileMode, PGconn* PqConn)
+{
+	// the Blocks rows go straight into geoip, and with --delta the Locations rows into their delta table.
+	if( IPBLOCKS==fileMode || NULL==MERGELOCSql ){ return NO; }
+	return ExecuteSql(PqConn, CREATELOCLoadSql);
+}
+
+/*
+ Writes the chunk's rows in one transaction: COPY into the session load table,
+ then merge_geoname_location_load() moves them into the real table. The Blocks rows,
+ checked as they were parsed (or by validate_release_load()), are copied into geoip
+ without a merge, as are the rows into the delta table with --delta.
+ - nPartition : --partitioned : the geoip partition the rows are copied into, -1 for geoip.
+ 
+ - Returns YES if it failed, the chunk is rolled back.
+ */
+BOOL CopyToDatabase(FILETYPE fileMode, const CopyBuffer& copyBuffer, int nPartition, const ChunkCheckpoint* pCheckpoint, PostgresConnection& pgConnx)
+{
+	PGconn* PqConn = pgConnx;
+	const char* strCopySql = (IPBLOCKS==fileMode) ? COPYGEOIPSql : COPYLOCSql;
+	if( IPBLOCKS==fileMode && nPartition>=0 ){
+		strCopySql = GeoipPartitions[nPartition].strCopySql.c_str();
+	}
+	const char* strMergeSql = (IPBLOCKS==fileMode) ? NULL : MERGELOCSql;
+	BOOL isBinary = (IPBLOCKS==fileMode && YES==ExtendedBlocks) ? YES : NO;
+	
+	if( YES==ExecuteSql(PqConn, "BEGIN") ){ return YES; }
+	
+	BOOL bDidFail = NO;
+	PGresult* pgRes = PQexec(PqConn, strCopySql);
+	if( PGRES_COPY_IN!=PQresultStatus(pgRes) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to start COPY - %s\n", PQresultErrorMessage(pgRes));
+		PQclear(pgRes);
+		ExecuteSql(PqConn, "ROLLBACK");
+		return YES;
+	}
+	PQclear(pgRes);
+	
+	if( YES==isBinary && 1!=PQputCopyData(PqConn, COPYBinaryHeader, sizeof(COPYBinaryHeader)) ){
+		bDidFail = YES;
+	}
+	if( NO==bDidFail && 1!=PQputCopyData(PqConn, copyBuffer.Data(), (int)copyBuffer.Size()) ){
+		bDidFail = YES;
+	}
+	if( NO==bDidFail && YES==isBinary && 1!=PQputCopyData(PqConn, COPYBinaryTrailer, sizeof(COPYBinaryTrailer)) ){
+		bDidFail = YES;
+	}
+	if( 1!=PQputCopyEnd(PqConn, (YES==bDidFail) ? "geoimport: COPY data not sent" : NULL) ){
+		bDidFail = YES;
+	}
+	if( YES==bDidFail ){
+		dprintf(STDOUT_FILENO, "Failed to send COPY data - %s\n", PQerrorMessage(PqConn));
+	}
+	
+	// collect the COPY result(s) until the connection is idle again.
+	while( NULL!=(pgRes = PQgetResult(PqConn)) )
+	{
+		if( PGRES_COMMAND_OK!=PQresultStatus(pgRes) && NO==bDidFail )
+		{
+			dprintf(STDOUT_FILENO, "COPY failed - %s\n", PQresultErrorMessage(pgRes));
+			bDidFail = YES;
+		}
+		PQclear(pgRes);
+	}
+	
+	if( NO==bDidFail && NULL!=strMergeSql ){
+		bDidFail = ExecuteSql(PqConn, strMergeSql);
+	}
+	if( NO==bDidFail && NULL!=pCheckpoint ){
+		bDidFail = AddProgressToDatabase(*pCheckpoint, pgConnx);
+	}
+	if( NO==bDidFail ){
+		bDidFail = ExecuteSql(PqConn, "COMMIT");
+	}
+	else{
+		ExecuteSql(PqConn, "ROLLBACK");
+	}
+	
+	return bDidFail;
+}
+
+
+/*			Chunk transactions			*/
+
+const char* ROWSavepointSql = "SAVEPOINT geoimport_row";
+const char* ROWReleaseSql = "RELEASE SAVEPOINT geoimport_row";
+const char* ROWRollbackSql = "ROLLBACK TO SAVEPOINT geoimport_row";
+
+/*
+ Sends (or queues, when pipelined) one row's statement.
+ - Returns YES if it failed, pgConnx.RowError() has why.
+ */
+BOOL AddRowToDatabase(FILETYPE fileMode, const char* const* fields, PostgresConnection& pgConnx)
+{
+	uint64_t nStartNanos = MonotonicNanos();
+	BOOL bDidFail = (IPBLOCKS==fileMode)
+		? AddIPBlockToDatabase(fields[BLK_network], BlockGeonameId(fields), fields[BLK_postal_code],
+							   (YES==ExtendedBlocks) ? fields : NULL, pgConnx)
+		: AddLocationToDatabase(fields[LOC_geoname_id], fields[LOC_continent_code], fields[LOC_city_name],
+								LocationCountryCode(fields),
+								fields[LOC_subdivision_1_iso_code],
+								fields[LOC_subdivision_2_iso_code],
+								pgConnx);
+	RecordStage(STAGE_STATEMENT, nStartNanos);
+	return bDidFail;
+}
+
+BOOL RowBatch::AddRow(const char* const* fields)
+{
+	return AddRowToDatabase(m_fileMode, fields, m_pgConnx);
+}
+
+/*
+ Reports the statement of a pipelined batch the server refused by its row, as the
+ statements sent one at a time are.
+ - fields : the row it was queued for, NULL for the progress queued after the rows.
+ */
+void ReportPipelineFailure(FILETYPE fileMode, const char* const* fields, const char* strError)
+{
+	if( NULL==fields ){
+		dprintf(STDOUT_FILENO, "Failed to record progress in pipeline - %s\n", strError);
+	}
+	else if( IPBLOCKS==fileMode ){
+		dprintf(STDOUT_FILENO, "Failed to add Geo IP value (%s) for geoname_id:%s in pipeline - %s\n",
+				fields[BLK_network], BlockGeonameId(fields), strError);
+	}
+	else{
+		dprintf(STDOUT_FILENO, "Failed to add Geoname Location value for geoname_id:%s in pipeline - %s\n",
+				fields[LOC_geoname_id], strError);
+	}
+}
+
+// int8range bound flags, as utils/rangetypes.h
+const char PGRANGE_LB_INC = 0x02;
+const char PGRANGE_UB_INC = 0x04;
+
+/*
+ Checks a Blocks row's network, geoname id and --extended values, converting them for COPY.
+ - Returns NULL if the row is valid, otherwise why not, for the reject file.
+ */
+static const char* CheckBlockRow(const char* const* fields, NetworkRange* pRange, BlockExtras* pExtras)
+{
+	const char* strError = NULL;
+	if( YES==NetworkToRange(fields[BLK_network], pRange) ){
+		strError = "Invalid network";
+	}
+	else if( YES==ExtendedBlocks ){
+		ParseBlockExtras(fields, pExtras, &strError);
+	}
+	else if( YES==TextToBinaryInt4(BlockGeonameId(fields), &pExtras->geonameId) ){
+		strError = "Invalid geoname_id";
+	}
+	return strError;
+}
+
+/*
+ Appends a Blocks row in COPY binary format, in the column order of COPYGEOIPExtendedSql,
+ which is that of the ADDGEOIPExtendedSql parameters.
+ - hasExtras : NO stops after the basic columns of COPYGEOIPSql (the binary file sink).
+ - Returns YES if the buffer could not grow.
+ */
+static BOOL AppendBinaryCopyRow(CopyBuffer& copyBuffer, const char* const* fields, const NetworkRange& range,
+								const BlockExtras& extras, BOOL hasExtras)
+{
+	// the network was checked by NetworkToRange().
+	char inetValue[INET_BINARY_MAX];
+	int nInetLength = 0;
+	TextToBinaryInet(fields[BLK_network], inetValue, &nInetLength);
+	
+	// flags, then the length and value of each bound.
+	char rangeValue[1 + 2*(4+8)];
+	if( NO==range.isIPv6 )
+	{
+		uint32_t nBoundLength = htonl(8);
+		rangeValue[0] = PGRANGE_LB_INC | PGRANGE_UB_INC;
+		memcpy(&rangeValue[1], &nBoundLength, 4);
+		StoreNetworkInt64(range.ipv4First, &rangeValue[5]);
+		memcpy(&rangeValue[13], &nBoundLength, 4);
+		StoreNetworkInt64(range.ipv4Last, &rangeValue[17]);
+	}
+	const char* postal_code = fields[BLK_postal_code];
+	
+	BOOL bDidFail = (BOOL)(copyBuffer.AppendBinaryRow((YES==hasExtras) ? ADDGEOIP_NUM_PARAMS : ADDGEOIP_p_extended) |
+						   copyBuffer.AppendBinaryField(inetValue, nInetLength) |
+						   copyBuffer.AppendBinaryField((const char*)&extras.geonameId, sizeof(extras.geonameId)) |
+						   copyBuffer.AppendBinaryField(postal_code, (NULL!=postal_code) ? (int)strlen(postal_code) : 0) |
+						   copyBuffer.AppendBinaryField((NO==range.isIPv6) ? rangeValue : NULL, sizeof(rangeValue)) |
+						   copyBuffer.AppendBinaryField((YES==range.isIPv6) ? range.ipv6First : NULL, 16) |
+						   copyBuffer.AppendBinaryField((YES==range.isIPv6) ? range.ipv6Last : NULL, 16) );
+	for( int nColumn=0; YES==hasExtras && nColumn<EXT_NUM_COLUMNS; ++nColumn ){
+		bDidFail = (BOOL)(bDidFail | copyBuffer.AppendBinaryField(extras.values[nColumn], extras.lengths[nColumn]));
+	}
+	return bDidFail;
+}
+
+/*
+ Appends a row's COPY text, in the column order of COPYGEOIPSql / the geoname_location_load table.
+ - range : the Blocks row's network, unused for Locations.
+ - pExtras : the --extended Blocks row's values, which are written in binary format instead, otherwise NULL.
+ 
+ - Returns YES if the buffer could not grow.
+ */
+static BOOL AppendCopyRow(CopyBuffer& copyBuffer, FILETYPE fileMode, const char* const* fields, const NetworkRange& range,
+						  const BlockExtras* pExtras)
+{
+	if( IPBLOCKS==fileMode && NULL!=pExtras ){
+		return AppendBinaryCopyRow(copyBuffer, fields, range, *pExtras, YES);
+	}
+	if( IPBLOCKS==fileMode )
+	{
+		return (BOOL)(copyBuffer.AppendField(fields[BLK_network], NO) |
+					  copyBuffer.AppendField(BlockGeonameId(fields), NO) |
+					  copyBuffer.AppendField(fields[BLK_postal_code], NO) |
+					  copyBuffer.AppendField((NO==range.isIPv6) ? range.strIPv4Range : NULL, NO) |
+					  copyBuffer.AppendField((YES==range.isIPv6) ? range.strIPv6First : NULL, NO) |
+					  copyBuffer.AppendField((YES==range.isIPv6) ? range.strIPv6Last : NULL, YES) );
+	}
+	return (BOOL)(copyBuffer.AppendField(fields[LOC_geoname_id], NO) |
+				  copyBuffer.AppendField(fields[LOC_continent_code], NO) |
+				  copyBuffer.AppendField(fields[LOC_city_name], NO) |
+				  copyBuffer.AppendField(LocationCountryCode(fields), NO) |
+				  copyBuffer.AppendField(fields[LOC_subdivision_1_iso_code], NO) |
+				  copyBuffer.AppendField(fields[LOC_subdivision_2_iso_code], YES) );
+}
+
+/*
+ Writes a row into the transaction, committing it once it holds RowsPerCommit rows
+ or the pipeline is full. A row whose values could not be sent is rejected at once;
+ one the server refuses rolls the transaction back and it is replayed.
+ 
+ - Returns YES if the connection failed.
+ */
+BOOL RowBatch::Add(const char* const* fields)
+{
+	uint32_t nRowsDone = m_pChunk->nFirstRow + (uint32_t)((fields - m_pChunk->fields.data())/m_nFields) + 1;
+	
+	if( NULL!=m_pCopyBuffer )
+	{
+		NetworkRange range;
+		BlockExtras extras;
+		const char* strError = (IPBLOCKS==m_fileMode) ? CheckBlockRow(fields, &range, &extras) : NULL;
+		if( NULL!=strError )
+		{
+			m_nRowsDone = nRowsDone;
+			return RejectRow(m_fileMode, fields, m_nFields, strError);
+		}
+		
+		// --partitioned : a partition's rows are copied into it on their own, so a chunk that
+		// crosses into the next partition (or to geoip, for a row of none) commits the rows before it first.
+		if( YES==PartitionedMode && IPBLOCKS==m_fileMode )
+		{
+			int nPartition = GeoipPartitionOf(fields[BLK_network]);
+			if( nPartition!=m_nPartition )
+			{
+				if( YES==Commit() ){ return YES; }
+				m_nPartition = nPartition;
+			}
+		}
+		m_nRowsDone = nRowsDone;
+		
+		if( YES==AppendCopyRow(*m_pCopyBuffer, m_fileMode, fields, range,
+							   (IPBLOCKS==m_fileMode && YES==ExtendedBlocks) ? &extras : NULL) )
+		{
+			return YES;
+		}
+	}
+	else
+	{
+		m_nRowsDone = nRowsDone;
+		if( NO==m_pgConnx.IsPipelined() && NO==m_inTransaction )
+		{
+			if( YES==ExecuteSql(m_pgConnx, "BEGIN") ){ return YES; }
+			m_inTransaction = YES;
+		}
+		
+		if( YES==AddRow(fields) )
+		{
+			if( CONNECTION_OK!=PQstatus(m_pgConnx) ){ return YES; }
+			
+			// not sent, the transaction is unaffected.
+			if( YES==m_pgConnx.IsPipelined() || PQTRANS_INTRANS==PQtransactionStatus(m_pgConnx) ){
+				return RejectRow(m_fileMode, fields, m_nFields, m_pgConnx.RowError());
+			}
+			
+			m_fields.insert(m_fields.end(), fields, fields + m_nFields);
+			ExecuteSql(m_pgConnx, "ROLLBACK");
+			m_inTransaction = NO;
+			return Replay();
+		}
+	}
+	m_fields.insert(m_fields.end(), fields, fields + m_nFields);
+	
+	if( (RowsPerCommit>0 && Count()>=RowsPerCommit) ||
+		(YES==m_pgConnx.IsPipelined() && YES==m_pgConnx.IsPipelineFull()) )
+	{
+		return Commit();
+	}
+	return NO;
+}
+
+/*
+ Commits the transaction: COPY and merge, pipeline sync or COMMIT.
+ If that fails the rows are replayed.
+ 
+ - Returns YES if the connection failed.
+ */
+BOOL RowBatch::Commit()
+{
+	BOOL bDidFail = NO;
+	uint64_t nStartNanos = MonotonicNanos();
+	if( NULL!=m_pCopyBuffer )
+	{
+		if( 0==Count() ){ return NO; }
+		ChunkCheckpoint checkpoint = CheckpointOf(m_pChunk, m_nRowsDone, m_nFields);
+		bDidFail = CopyToDatabase(m_fileMode, *m_pCopyBuffer, m_nPartition, (YES==RecordCheckpoints) ? &checkpoint : NULL, m_pgConnx);
+		m_pCopyBuffer->Reset();
+		RecordStage(STAGE_COMMIT, nStartNanos);
+	}
+	else if( YES==m_pgConnx.IsPipelined() )
+	{
+		if( 0==Count() ){ return NO; }
+		bDidFail = AddProgress();
+		if( NO==bDidFail ){
+			bDidFail = m_pgConnx.SyncPipeline();
+		}
+		
+		// the rows were queued in order, then the progress.
+		uint32_t nFailed = m_pgConnx.FailedStatement();
+		if( nFailed>0 ){
+			ReportPipelineFailure(m_fileMode, (nFailed<=Count()) ? &m_fields[(nFailed-1)*m_nFields] : NULL,
+								  m_pgConnx.RowError());
+		}
+		RecordStage(STAGE_COMMIT, nStartNanos);
+	}
+	else if( YES==m_inTransaction )
+	{
+		// a failed COMMIT has rolled back.
+		bDidFail = AddProgress();
+		if( YES==bDidFail ){
+			ExecuteSql(m_pgConnx, "ROLLBACK");
+		}
+		else{
+			bDidFail = ExecuteSql(m_pgConnx, "COMMIT");
+		}
+		m_inTransaction = NO;
+		RecordStage(STAGE_COMMIT, nStartNanos);
+	}
+	
+	if( YES==bDidFail ){ return Replay(); }
+	
+	if( Count()>0 ){
+		m_nRowsRecorded = m_nRowsDone;
+	}
+	m_nCommitted += (uint32_t)Count();
+	m_fields.clear();
+	return NO;
+}
+
+/*
+ Commits the chunk's last rows, then records any rejected after them as done too,
+ so a resumed import does not reject them again.
+ 
+ - Returns YES if the connection failed.
+ */
+BOOL RowBatch::Finish()
+{
+	if( YES==Commit() ){ return YES; }
+	if( NO==RecordCheckpoints || m_nRowsRecorded>=m_nRowsDone ){ return NO; }
+	
+	// on its own, pipelined or not, it is a transaction of one statement.
+	if( YES==AddProgress() ){ return YES; }
+	if( YES==m_pgConnx.IsPipelined() && YES==m_pgConnx.SyncPipeline() )
+	{
+		if( m_pgConnx.FailedStatement()>0 ){
+			ReportPipelineFailure(m_fileMode, NULL, m_pgConnx.RowError());
+		}
+		return YES;
+	}
+	m_nRowsRecorded = m_nRowsDone;
+	return NO;
+}
+
+/*
+ Called once Add(), Commit() or Finish() has failed: rolls back what the batch left open
+ on the connection, so it is idle again and none of the uncommitted rows are written.
+ */
+void RowBatch::Abandon()
+{
+	m_fields.clear();
+	if( NULL!=m_pCopyBuffer ){ m_pCopyBuffer->Reset(); }
+	m_inTransaction = NO;
+	if( CONNECTION_OK!=PQstatus(m_pgConnx) ){ return; }
+	
+	// a ROLLBACK queued before the sync aborts the statements queued with it.
+	if( YES==m_pgConnx.IsPipelined() )
+	{
+		if( m_pgConnx.Queued()>0 && NO==m_pgConnx.QueueParams("ROLLBACK", 0, NULL, NULL, NULL) ){
+			m_pgConnx.SyncPipeline();
+		}
+		return;
+	}
+	if( PQTRANS_INTRANS==PQtransactionStatus(m_pgConnx) || PQTRANS_INERROR==PQtransactionStatus(m_pgConnx) ){
+		ExecuteSql(m_pgConnx, "ROLLBACK");
+	}
+}
+
+/*
+ Records the chunk's rows up to the last one added in geoimport_progress, in the
+ transaction about to commit (queued when pipelined).
+ 
+ - Returns YES if it failed.
+ */
+BOOL RowBatch::AddProgress()
+{
+	if( NO==RecordCheckpoints ){ return NO; }
+	return AddProgressToDatabase(CheckpointOf(m_pChunk, m_nRowsDone, m_nFields), m_pgConnx);
+}
+
+/*
+ Re-sends the rolled back rows one at a time in a new transaction, each in a savepoint,
+ so a row the server refuses is rolled back alone and written to the reject file.
+ Pipeline mode is left meanwhile, as a failure aborts the rest of a pipeline.
+ 
+ - Returns YES if the connection failed.
+ */
+BOOL RowBatch::Replay()
+{
+	dprintf( STDOUT_FILENO, "Transaction of %zu rows failed, replaying each row.\n", Count() );
+	
+	BOOL wasPipelined = m_pgConnx.IsPipelined();
+	if( YES==wasPipelined && NO==m_pgConnx.ExitPipelineMode() ){ return YES; }
+	
+	if( YES==ExecuteSql(m_pgConnx, "BEGIN") ){ return YES; }
+	
+	uint32_t nCommitted = 0;
+	for( size_t nRow=0; nRow<Count(); ++nRow )
+	{
+		const char* const* rowFields = &m_fields[nRow*m_nFields];
+		
+		if( YES==ExecuteSql(m_pgConnx, ROWSavepointSql) ){ return YES; }
+		
+		if( YES==AddRow(rowFields) )
+		{
+			if( CONNECTION_OK!=PQstatus(m_pgConnx) ||
+				YES==ExecuteSql(m_pgConnx, ROWRollbackSql) ||
+				YES==RejectRow(m_fileMode, rowFields, m_nFields, m_pgConnx.RowError()) )
+			{
+				return YES;
+			}
+			continue;
+		}
+		
+		if( YES==ExecuteSql(m_pgConnx, ROWReleaseSql) ){ return YES; }
+		++nCommitted;
+	}
+	
+	if( YES==AddProgress() || YES==ExecuteSql(m_pgConnx, "COMMIT") ){ return YES; }
+	m_nCommitted += nCommitted;
+	m_nRowsRecorded = m_nRowsDone;
+	m_fields.clear();
+	
+	if( YES==wasPipelined && NO==m_pgConnx.EnterPipelineMode(PipelineDepth) ){ return YES; }
+	return NO;
+}
+
+
+/*			Rejected rows			*/
+
+/*
+ Appends a field in CSV format, quoted when it holds a delimiter, quote or line break.
+ NULL is written as an empty field.
+ */
+static void AppendCsvField(std::string& strLine, const char* value)
+{
+	if( NULL==value ){ return; }
+	
+	if( NULL==strpbrk(value, ",\"\r\n") )
+	{
+		strLine += value;
+		return;
+	}
+	
+	strLine += '"';
+	for( const char* pRead=value; '\0'!=*pRead; ++pRead )
+	{
+		if( '"'==*pRead ){ strLine += '"'; }
+		strLine += *pRead;
+	}
+	strLine += '"';
+}
+
+/*
+ Writes a row the database refused to the reject file, as the .csv row followed by
+ an error column. The file is created, with the header, on the first reject.
+ 
+ - Returns YES if it could not be written.
+ */
+BOOL RejectRow(FILETYPE fileMode, const char* const* fields, int nFields, const char* strError)
+{
+	std::string strLine;
+	for( int nField=0; nField<nFields; ++nField )
+	{
+		AppendCsvField(strLine, fields[nField]);
+		strLine += ',';
+	}
+	AppendCsvField(strLine, strError);
+	strLine += '\n';
+	
+	const std::string* pLine = &strLine; // blocks copy captured objects
+	__block BOOL bDidFail = NO;
+	dispatch_sync(RejectsQ,
+				  ^{
+					  int& rejectFile = RejectFiles[fileMode];
+					  if( 0==rejectFile )
+					  {
+						  // --resume adds to the interrupted import's rejects.
+						  rejectFile = open(RejectFilePaths[fileMode], O_WRONLY|O_CREAT|((YES==ResumeMode) ? O_APPEND : O_TRUNC), 0644);
+						  if( -1==rejectFile )
+						  {
+							  rejectFile = 0;
+							  dprintf(STDOUT_FILENO, "Failed to create reject file %s: %s\n",
+									  RejectFilePaths[fileMode], strerror(errno));
+							  bDidFail = YES;
+							  return;
+						  }
+						  if( 0==lseek(rejectFile, 0, SEEK_END) ){
+							  dprintf(rejectFile, "%s,error\n", (IPBLOCKS==fileMode) ? BlocksHeader : LocationsHeader);
+						  }
+					  }
+					  
+					  if( (ssize_t)pLine->size()!=write(rejectFile, pLine->data(), pLine->size()) )
+					  {
+						  dprintf(STDOUT_FILENO, "Failed to write reject file %s: %s\n",
+								  RejectFilePaths[fileMode], strerror(errno));
+						  bDidFail = YES;
+					  }
+				  });
+	
+	if( NO==bDidFail ){ ++RejectedRows; }
+	return bDidFail;
+}
+
+
+/*			Output sinks			*/
+
+/*
+ The Postgres sink: the writer's own connection, each chunk written as the options chose.
+ */
+BOOL OpenPostgresSink(FILETYPE fileMode, const char* strDbName, SinkWriter& writer)
+{
+	return OpenWriterConnection(fileMode, strDbName, writer.pgConnx);
+}
+
+uint32_t WritePostgresSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail)
+{
+	return WriteChunk(pChunk->fileMode, pChunk, writer.pgConnx, (YES==BulkCopyMode) ? &writer.copyBuffer : NULL, didFail);
+}
+
+void ClosePostgresSink(SinkWriter& writer)
+{
+	writer.pgConnx.Close();
+}
+
+/*
+ The null sink: the rows are counted and dropped, so the run times the reading and parsing alone.
+ */
+BOOL OpenNullSink(FILETYPE, const char*, SinkWriter&)
+{
+	return YES;
+}
+
+uint32_t WriteNullSink(ParsedChunk* pChunk, SinkWriter&, BOOL* didFail)
+{
+	*didFail = NO;
+	size_t nFields = (IPBLOCKS==pChunk->fileMode) ? (size_t)BLK_NUM_FIELDS : (size_t)LOC_NUM_FIELDS;
+	return (uint32_t)(pChunk->fields.size()/nFields);
+}
+
+void CloseNullSink(SinkWriter&)
+{
+}
+
+// the file sinks' columns, those of COPYGEOIPSql (then COPYGEOIPExtendedSql's) and geoname_location_load.
+static const char* SinkBlocksColumns = GEOIP_COLUMNS;
+static const char* SinkBlocksExtendedColumns = GEOIP_EXTENDED_COLUMNS;
+static const char* SinkLocationsColumns = "geoname_id,continent_code,city_name,country_iso_code,subdivision_1_iso_code,subdivision_2_iso_code";
+
+/*
+ Appends to the sink file, for one writer at a time.
+ - Returns YES if it could not be written.
+ */
+static BOOL WriteSinkFile(const char* pData, size_t nBytes)
+{
+	__block BOOL bDidFail = NO;
+	dispatch_sync(SinkFileQ,
+				  ^{
+					  size_t nWritten = 0;
+					  while( nWritten<nBytes )
+					  {
+						  ssize_t nCount = write(SinkFile, pData + nWritten, nBytes - nWritten);
+						  if( nCount<0 && EINTR==errno ){ continue; }
+						  if( nCount<=0 )
+						  {
+							  dprintf(STDOUT_FILENO, "Failed to write %s: %s\n", SinkFilePath, strerror(errno));
+							  bDidFail = YES;
+							  return;
+						  }
+						  nWritten += (size_t)nCount;
+					  }
+				  });
+	return bDidFail;
+}
+
+/*
+ Creates --sink-file and writes its header: the column names of the CSV, or the COPY binary signature.
+ - Returns YES if created.
+ */
+BOOL OpenSinkFile(FILETYPE fileMode)
+{
+	SinkFile = open(SinkFilePath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if( -1==SinkFile )
+	{
+		SinkFile = 0;
+		dprintf(STDOUT_FILENO, "Failed to create %s: %s\n", SinkFilePath, strerror(errno));
+		return NO;
+	}
+	
+	if( SINK_BINARY==SinkType ){
+		return (NO==WriteSinkFile(COPYBinaryHeader, sizeof(COPYBinaryHeader))) ? YES : NO;
+	}
+	std::string strHeader = (IPBLOCKS==fileMode) ? SinkBlocksColumns : SinkLocationsColumns;
+	if( IPBLOCKS==fileMode && YES==ExtendedBlocks ){
+		strHeader += SinkBlocksExtendedColumns;
+	}
+	strHeader += '\n';
+	return (NO==WriteSinkFile(strHeader.data(), strHeader.size())) ? YES : NO;
+}
+
+/*
+ Ends the binary sink file's rows and closes the file.
+ - Returns YES if it could not be written.
+ */
+BOOL FinishSinkFile(void)
+{
+	BOOL bDidFail = (SINK_BINARY==SinkType) ? WriteSinkFile(COPYBinaryTrailer, sizeof(COPYBinaryTrailer)) : NO;
+	if( 0!=close(SinkFile) && NO==bDidFail )
+	{
+		dprintf(STDOUT_FILENO, "Failed to write %s: %s\n", SinkFilePath, strerror(errno));
+		bDidFail = YES;
+	}
+	SinkFile = 0;
+	return bDidFail;
+}
+
+/*
+ Appends a row to the CSV sink's chunk, normalized: the Blocks geoname id chosen and the
+ network's range, the Locations country code chosen. An empty field is NULL.
+ */
+static void AppendCsvSinkRow(std::string& strRows, FILETYPE fileMode, const char* const* fields, const NetworkRange& range)
+{
+	if( IPBLOCKS==fileMode )
+	{
+		AppendCsvField(strRows, fields[BLK_network]);
+		strRows += ',';
+		AppendCsvField(strRows, BlockGeonameId(fields));
+		strRows += ',';
+		AppendCsvField(strRows, fields[BLK_postal_code]);
+		strRows += ',';
+		AppendCsvField(strRows, (NO==range.isIPv6) ? range.strIPv4Range : NULL);
+		strRows += ',';
+		AppendCsvField(strRows, (YES==range.isIPv6) ? range.strIPv6First : NULL);
+		strRows += ',';
+		AppendCsvField(strRows, (YES==range.isIPv6) ? range.strIPv6Last : NULL);
+		
+		// checked by ParseBlockExtras(), so they are numbers and 0/1 flags.
+		for( int nColumn=0; YES==ExtendedBlocks && nColumn<EXT_NUM_COLUMNS; ++nColumn )
+		{
+			strRows += ',';
+			AppendCsvField(strRows, fields[BlockExtraFields[nColumn]]);
+		}
+	}
+	else
+	{
+		AppendCsvField(strRows, fields[LOC_geoname_id]);
+		strRows += ',';
+		AppendCsvField(strRows, fields[LOC_continent_code]);
+		strRows += ',';
+		AppendCsvField(strRows, fields[LOC_city_name]);
+		strRows += ',';
+		AppendCsvField(strRows, LocationCountryCode(fields));
+		strRows += ',';
+		AppendCsvField(strRows, fields[LOC_subdivision_1_iso_code]);
+		strRows += ',';
+		AppendCsvField(strRows, fields[LOC_subdivision_2_iso_code]);
+	}
+	strRows += '\n';
+}
+
+/*
+ Appends a Locations row to the binary sink's chunk, in geoname_location_load's column order.
+ - Returns YES if the buffer could not grow.
+ */
+static BOOL AppendBinaryLocationRow(CopyBuffer& copyBuffer, const char* const* fields, uint32_t geonameId)
+{
+	const char* values[] = { fields[LOC_continent_code], fields[LOC_city_name], LocationCountryCode(fields),
+							 fields[LOC_subdivision_1_iso_code], fields[LOC_subdivision_2_iso_code] };
+	
+	BOOL bDidFail = (BOOL)(copyBuffer.AppendBinaryRow(1 + (int)(sizeof(values)/sizeof(values[0]))) |
+						   copyBuffer.AppendBinaryField((const char*)&geonameId, sizeof(geonameId)));
+	for( size_t nValue=0; nValue<sizeof(values)/sizeof(values[0]); ++nValue ){
+		bDidFail = (BOOL)(bDidFail | copyBuffer.AppendBinaryField(values[nValue], (NULL!=values[nValue]) ? (int)strlen(values[nValue]) : 0));
+	}
+	return bDidFail;
+}
+
+/*
+ The file sinks: a chunk's rows are checked as the Postgres sink checks them, those that
+ are not valid rejected, and the rest normalized and appended to --sink-file together.
+ The chunks follow each other in the order the writers finish them.
+ - isBinary : YES for the COPY binary format, otherwise CSV.
+ 
+ - Returns the rows written.
+ */
+static uint32_t WriteFileSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL isBinary, BOOL* didFail)
+{
+	*didFail = NO;
+	FILETYPE fileMode = pChunk->fileMode;
+	int nFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	writer.copyBuffer.Reset();
+	writer.strRows.clear();
+	
+	uint32_t nRows = 0;
+	for( size_t nField=0; nField<pChunk->fields.size(); nField+=nFields )
+	{
+		const char* const* fields = &pChunk->fields[nField];
+		NetworkRange range;
+		BlockExtras extras;
+		uint32_t locationId = 0;
+		const char* strError = NULL;
+		if( IPBLOCKS==fileMode ){
+			strError = CheckBlockRow(fields, &range, &extras);
+		}
+		else if( YES==TextToBinaryInt4(fields[LOC_geoname_id], &locationId) ){
+			strError = "Invalid geoname_id";
+		}
+		
+		if( NULL!=strError )
+		{
+			if( YES==RejectRow(fileMode, fields, nFields, strError) ){
+				*didFail = YES;
+				return 0;
+			}
+			continue;
+		}
+		
+		if( NO==isBinary ){
+			AppendCsvSinkRow(writer.strRows, fileMode, fields, range);
+		}
+		else if( YES==((IPBLOCKS==fileMode) ? AppendBinaryCopyRow(writer.copyBuffer, fields, range, extras, ExtendedBlocks)
+											 : AppendBinaryLocationRow(writer.copyBuffer, fields, locationId)) )
+		{
+			*didFail = YES;
+			return 0;
+		}
+		++nRows;
+	}
+	
+	uint64_t nStartNanos = MonotonicNanos();
+	*didFail = (YES==isBinary) ? WriteSinkFile(writer.copyBuffer.Data(), writer.copyBuffer.Size())
+							   : WriteSinkFile(writer.strRows.data(), writer.strRows.size());
+	RecordStage(STAGE_COMMIT, nStartNanos);
+	return (YES==*didFail) ? 0 : nRows;
+}
+
+uint32_t WriteCsvSink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail)
+{
+	return WriteFileSink(pChunk, writer, NO, didFail);
+}
+
+uint32_t WriteBinarySink(ParsedChunk* pChunk, SinkWriter& writer, BOOL* didFail)
+{
+	return WriteFileSink(pChunk, writer, YES, didFail);
+}
+
+
+/*			Country and Subdivisions			*/
+
+void LocationDimensions::Add(DimensionSet& dimSet, std::vector<std::string>&& columns)
+{
+	// the codes are every column but the last (name).
+	std::string strKey;
+	for( size_t nCol=0; nCol+1<columns.size(); ++nCol )
+	{
+		strKey += columns[nCol];
+		strKey += ',';
+	}
+	
+	// first name seen for a code wins, as add_country() etc. did, a chunk's rows are in file order.
+	if( dimSet.find(strKey)==dimSet.end() ){
+		dimSet.emplace(std::move(strKey), DimensionRow{ 0, std::move(columns) });
+	}
+}
+
+// A chunk's entry replaces one from a chunk further into the file.
+void LocationDimensions::Merge(DimensionSet& dimSet, const DimensionSet& other, off_t filePos)
+{
+	for( const DimensionSet::value_type& entry : other )
+	{
+		DimensionSet::iterator itFound = dimSet.find(entry.first);
+		if( itFound==dimSet.end() ){
+			dimSet.emplace(entry.first, DimensionRow{ filePos, entry.second.columns });
+		}
+		else if( itFound->second.filePos>filePos ){
+			itFound->second = DimensionRow{ filePos, entry.second.columns };
+		}
+	}
+}
+
+void LocationDimensions::AddCountry(const char* iso2_code, const char* name)
+{
+	Add(m_countries, { iso2_code, name } );
+}
+
+// A missing subdivision name falls back to its code, name is NOT NULL.
+void LocationDimensions::AddSubdivision1(const char* iso2_country_code, const char* iso_code, const char* name)
+{
+	Add(m_subdivisions1, { iso2_country_code, iso_code, (NULL!=name ? name : iso_code) } );
+}
+
+void LocationDimensions::AddSubdivision2(const char* iso2_country_code, const char* subdivision1_iso_code,
+										 const char* iso_code, const char* name)
+{
+	Add(m_subdivisions2, { iso2_country_code, subdivision1_iso_code, iso_code, (NULL!=name ? name : iso_code) } );
+}
+
+/*
+ Adds the dimensions of the chunk at filePos.
+ Chunks are merged as they are written, not in file order, so the chunk's position decides between names.
+ */
+void LocationDimensions::Merge(const LocationDimensions& other, off_t filePos)
+{
+	Merge(m_countries, other.m_countries, filePos);
+	Merge(m_subdivisions1, other.m_subdivisions1, filePos);
+	Merge(m_subdivisions2, other.m_subdivisions2, filePos);
+}
+
+void LocationDimensions::Clear()
+{
+	m_countries.clear();
+	m_subdivisions1.clear();
+	m_subdivisions2.clear();
+}
+
+/*
+ Inserts every row of the set with one multi row INSERT, skipping rows already present.
+ Very large sets are split to stay under the protocol's 65535 parameter limit.
+ 
+ - Returns YES if it failed.
+ */
+static BOOL AddDimensionSetToDatabase(const char* strTable, const char* strColumns, int nColumns,
+									  const DimensionSet& dimSet, PGconn* PqConn)
+{
+	const size_t nMaxRows = 65535/nColumns;
+	
+	DimensionSet::const_iterator itRow = dimSet.begin();
+	while( itRow!=dimSet.end() )
+	{
+		std::string strSql = std::string("INSERT INTO ") + strTable + " (" + strColumns + ") VALUES ";
+		std::vector<const char*> values;
+		
+		char strParam[16];
+		for( size_t nRows=0; nRows<nMaxRows && itRow!=dimSet.end(); ++nRows, ++itRow )
+		{
+			strSql += (0==nRows) ? "(" : ",(";
+			for( int nCol=0; nCol<nColumns; ++nCol )
+			{
+				values.push_back( itRow->second.columns[nCol].c_str() );
+				snprintf(strParam, sizeof(strParam), (0==nCol) ? "$%zu" : ",$%zu", values.size());
+				strSql += strParam;
+			}
+			strSql += ")";
+		}
+		strSql += " ON CONFLICT DO NOTHING";
+		
+		PGresult* pgRes = PQexecParams(PqConn, strSql.c_str(), (int)values.size(),
+									   NULL, values.data(), NULL, NULL, 0);
+		BOOL bDidFail = (PGRES_COMMAND_OK==PQresultStatus(pgRes)) ? NO : YES;
+		if( YES==bDidFail ){
+			dprintf(STDOUT_FILENO, "Failed to add %s rows - %s\n", strTable, PQresultErrorMessage(pgRes));
+		}
+		PQclear(pgRes);
+		
+		if( YES==bDidFail ){ return YES; }
+	}
+	
+	return NO;
+}
+
+/*
+ Writes the distinct countries and subdivisions in a single transaction.
+ - Returns YES if it failed.
+ */
+BOOL AddDimensionsToDatabase(const LocationDimensions& dimensions, PGconn* PqConn)
+{
+	if( YES==ExecuteSql(PqConn, "BEGIN") ){ return YES; }
+	
+	BOOL bDidFail =
+		AddDimensionSetToDatabase("country", "iso2_code,name", 2,
+								  dimensions.Countries(), PqConn);
+	if( NO==bDidFail ){
+		bDidFail = AddDimensionSetToDatabase("subdivision_1", "iso2_country_code,iso_code,name", 3,
+											 dimensions.Subdivisions1(), PqConn);
+	}
+	if( NO==bDidFail ){
+		bDidFail = AddDimensionSetToDatabase("subdivision_2", "iso2_country_code,subdivision1_iso_code,iso_code,name", 4,
+											 dimensions.Subdivisions2(), PqConn);
+	}
+	
+	if( NO==bDidFail ){
+		bDidFail = ExecuteSql(PqConn, "COMMIT");
+	}
+	else{
+		ExecuteSql(PqConn, "ROLLBACK");
+	}
+	
+	return bDidFail;
+}
+
+
+/*			Staged load (--swap)			*/
+
+/*
+ Runs one step of a staged or delta load on its own connection: begin_staged_load(),
+ index_staged_load(), swap_staged_load(), begin_delta_load() or begin_extended_load() in postgres.sql.
+ - nWorkers : parallel maintenance workers for the step, 0 if it takes none.
+ 
+ - Returns YES if it failed.
+ */
+BOOL RunLoadStep(const char* strDbName, const char* strFunction, FILETYPE fileMode, int nWorkers)
+{
+	const char* strFileType = (IPBLOCKS==fileMode) ? "blocks" : "locations";
+	
+	char strSql[128];
+	if( nWorkers>0 ){
+		snprintf(strSql, sizeof(strSql), "SELECT %s('%s',%d)", strFunction, strFileType, nWorkers);
+	}
+	else{
+		snprintf(strSql, sizeof(strSql), "SELECT %s('%s')", strFunction, strFileType);
+	}
+	
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	
+	BOOL bDidFail = ExecuteSql(pgConnx, strSql);
+	
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	dprintf(STDOUT_FILENO, "Load step: %s %s in %.2f seconds.\n", strSql,
+			(YES==bDidFail ? "failed" : "completed"),
+			(endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9);
+	
+	return bDidFail;
+}
+
+/*			Delta import (--delta)			*/
+
+/*
+ Points the row statements and COPY at the delta tables, and drops the per chunk merge.
+ */
+void UseDeltaTables(void)
+{
+	ADDGEOIPSql = ADDGEOIPDeltaSql;
+	ADDLOCSql = ADDLOCDeltaSql;
+	COPYGEOIPSql = COPYGEOIPDeltaSql;
+	COPYLOCSql = COPYLOCDeltaSql;
+	MERGELOCSql = NULL;
+}
+
+
+/*			Extended Blocks (--extended)			*/
+
+/*
+ Points the Blocks statement and COPY at their extended versions.
+ */
+void UseExtendedBlocks(void)
+{
+	ADDGEOIPSql = ADDGEOIPExtendedSql;
+	ADDGEOIPnumParams = ADDGEOIP_NUM_PARAMS;
+	COPYGEOIPSql = COPYGEOIPExtendedSql;
+	COPYGEOIPColumns = COPYGEOIPExtendedColumns;
+}
+
+/*
+ Runs apply_delta(), which compares the delta table with the live table and writes
+ only the rows added, changed or removed, in one transaction.
+ 
+ - Returns YES if it failed.
+ */
+BOOL ApplyDelta(const char* strDbName, FILETYPE fileMode)
+{
+	char strSql[128];
+	snprintf(strSql, sizeof(strSql), "SELECT added,changed,removed FROM apply_delta('%s')",
+			 (IPBLOCKS==fileMode) ? "blocks" : "locations");
+	
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	
+	PGresult* pgRes = PQexec(pgConnx, strSql);
+	BOOL bDidFail = (PGRES_TUPLES_OK==PQresultStatus(pgRes) && 1==PQntuples(pgRes)) ? NO : YES;
+	
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	if( YES==bDidFail ){
+		dprintf(STDOUT_FILENO, "Failed to apply the delta - %s\n", PQresultErrorMessage(pgRes));
+	}
+	else{
+		dprintf(STDOUT_FILENO, "Delta applied in %.2f seconds: %s rows added, %s changed, %s removed.\n",
+				(endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9,
+				PQgetvalue(pgRes, 0, 0), PQgetvalue(pgRes, 0, 1), PQgetvalue(pgRes, 0, 2));
+	}
+	PQclear(pgRes);
+	
+	return bDidFail;
+}
+
+
+/*			Release directory (--release)			*/
+
+/*
+ A .csv of the release directory, in the order the reader reads them.
+ */
+typedef struct RELEASEFILE {
+	std::string	strPath;
+	FILETYPE	fileMode;
+	uint16_t	nHeaderSize;
+	off_t		nSize;
+} ReleaseFile;
+
+static std::vector<ReleaseFile> ReleaseFiles;
+static size_t NextReleaseFile = 0;
+
+const char* VALIDATEReleaseSql = "SELECT network,geoname_id,postal_code FROM validate_release_load()";
+
+/*
+ Finds the release's Locations file of --locale and its Blocks files by their headers, and opens
+ the Locations file. The other locales' Locations files are skipped, as geoname_location holds
+ one locale's names. FileTotalSize and FileBytesRemaining are those of all the files read.
+ - pFileMode : set to the first file's, LOCATIONS.
+ 
+ - Returns YES if opened.
+ */
+BOOL OpenRelease(const char* strDirectory, FILETYPE* pFileMode)
+{
+	DIR* pDirectory = opendir(strDirectory);
+	if( NULL==pDirectory ){
+		perror("Failed to open the release directory.");
+		return NO;
+	}
+	
+	const char* strLocaleTag = "-Locations-";
+	std::vector<ReleaseFile> locationsFiles;
+	std::vector<ReleaseFile> blocksFiles;
+	
+	struct dirent* pEntry;
+	while( NULL!=(pEntry = readdir(pDirectory)) )
+	{
+		// the reject files are written here too.
+		std::string strName = pEntry->d_name;
+		if( NO==EndsWith(strName, ".csv") || YES==EndsWith(strName, ".rejects.csv") ){ continue; }
+		
+		ReleaseFile releaseFile;
+		releaseFile.strPath = std::string(strDirectory) + "/" + strName;
+		
+		struct stat fileInfo;
+		int fdFile = open(releaseFile.strPath.c_str(), O_RDONLY);
+		if( -1==fdFile || 0!=fstat(fdFile, &fileInfo) )
+		{
+			perror(releaseFile.strPath.c_str());
+			if( -1!=fdFile ){ close(fdFile); }
+			closedir(pDirectory);
+			return NO;
+		}
+		BOOL isRecognised = ReadHeader(fdFile, &releaseFile.fileMode, &releaseFile.nHeaderSize);
+		close(fdFile);
+		if( NO==isRecognised )
+		{
+			dprintf(STDOUT_FILENO, "Skipping %s.\n", strName.c_str());
+			continue;
+		}
+		releaseFile.nSize = fileInfo.st_size;
+		
+		if( IPBLOCKS==releaseFile.fileMode )
+		{
+			blocksFiles.push_back(releaseFile);
+			continue;
+		}
+		
+		// GeoLite2-City-Locations-pt-BR.csv, a file not named so is taken as the locale wanted.
+		size_t nTagPos = strName.rfind(strLocaleTag);
+		if( std::string::npos!=nTagPos )
+		{
+			size_t nLocalePos = nTagPos + strlen(strLocaleTag);
+			std::string strLocale = strName.substr(nLocalePos, strName.size() - strlen(".csv") - nLocalePos);
+			if( strLocale!=ReleaseLocale )
+			{
+				dprintf(STDOUT_FILENO, "Skipping %s, locale %s (--locale %s).\n", strName.c_str(), strLocale.c_str(), ReleaseLocale);
+				continue;
+			}
+		}
+		locationsFiles.push_back(releaseFile);
+	}
+	closedir(pDirectory);
+	
+	if( 1!=locationsFiles.size() || blocksFiles.empty() )
+	{
+		dprintf(STDOUT_FILENO, "The release needs one Locations file of locale %s and a Blocks file, it has %zu and %zu.\n",
+				ReleaseLocale, locationsFiles.size(), blocksFiles.size());
+		return NO;
+	}
+	
+	// the Locations first, then the Blocks files by name.
+	std::sort(blocksFiles.begin(), blocksFiles.end(),
+			  [](const ReleaseFile& left, const ReleaseFile& right){ return left.strPath < right.strPath; });
+	ReleaseFiles = locationsFiles;
+	ReleaseFiles.insert(ReleaseFiles.end(), blocksFiles.begin(), blocksFiles.end());
+	
+	FileTotalSize = 0;
+	FileBytesRemaining = 0;
+	for( const ReleaseFile& releaseFile : ReleaseFiles )
+	{
+		FileTotalSize += releaseFile.nSize;
+		FileBytesRemaining += releaseFile.nSize - releaseFile.nHeaderSize;
+		dprintf(STDOUT_FILENO, "Release file: %s (%s, %lld MB)\n", releaseFile.strPath.c_str(),
+				(IPBLOCKS==releaseFile.fileMode ? "Blocks" : "Locations"), (long long)(releaseFile.nSize/OneMB));
+	}
+	
+	if( NO==OpenNextReleaseFile() ){ return NO; }
+	*pFileMode = InputFileMode;
+	return YES;
+}
+
+/*
+ Opens the release's next file in place of the one read, past its header. Called by the reader.
+ - Returns YES if opened, NO if there are no more (or it failed, which aborts the import).
+ */
+BOOL OpenNextReleaseFile(void)
+{
+	if( NextReleaseFile>=ReleaseFiles.size() ){ return NO; }
+	const ReleaseFile& releaseFile = ReleaseFiles[NextReleaseFile++];
+	
+	int fdFile = open(releaseFile.strPath.c_str(), O_RDONLY);
+	if( -1==fdFile || (off_t)releaseFile.nHeaderSize!=lseek(fdFile, releaseFile.nHeaderSize, SEEK_SET) )
+	{
+		perror("Error on opening .csv file.");
+		if( -1!=fdFile ){ close(fdFile); }
+		AbortProgram = YES;
+		return NO;
+	}
+	
+	if( InputFile>0 ){ close(InputFile); }
+	InputFile = fdFile;
+	InputFileMode = releaseFile.fileMode;
+	dprintf(STDOUT_FILENO, "Reading %s\n", releaseFile.strPath.c_str());
+	return YES;
+}
+
+/*
+ Runs validate_release_load() once the files are written, which removes the geoip rows whose
+ geoname_id is not a location in one pass. Those rows are written to the Blocks reject file.
+ 
+ - Returns YES if it failed.
+ */
+BOOL ValidateRelease(const char* strDbName)
+{
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	PQsetClientEncoding(pgConnx, "UTF8" );
+	
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	
+	PGresult* pgRes = PQexec(pgConnx, VALIDATEReleaseSql);
+	if( PGRES_TUPLES_OK!=PQresultStatus(pgRes) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to validate the release - %s\n", PQresultErrorMessage(pgRes));
+		PQclear(pgRes);
+		return YES;
+	}
+	
+	// the rows are gone, so only the columns geoip kept can be written.
+	BOOL bDidFail = NO;
+	int nRemoved = PQntuples(pgRes);
+	for( int nRow=0; nRow<nRemoved && NO==bDidFail; ++nRow )
+	{
+		const char* fields[BLK_NUM_FIELDS] = { NULL };
+		fields[BLK_network] = PQgetvalue(pgRes, nRow, 0);
+		fields[BLK_geoname_id] = PQgetvalue(pgRes, nRow, 1);
+		fields[BLK_postal_code] = (1==PQgetisnull(pgRes, nRow, 2)) ? NULL : PQgetvalue(pgRes, nRow, 2);
+		bDidFail = RejectRow(IPBLOCKS, fields, BLK_NUM_FIELDS, "Geoname Id Not Found");
+	}
+	PQclear(pgRes);
+	TotalRowsProcessed -= nRemoved;
+	
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	dprintf(STDOUT_FILENO, "Release validated in %.2f seconds: %d Blocks rows had no location and were removed.\n",
+			(endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9, nRemoved);
+	
+	return bDidFail;
+}
+
+
+/*			Geoname id filter			*/
+
+// binary, so each id arrives as 4 bytes rather than text to parse.
+const char* GEONAMEIDSSql = "SELECT geoname_id FROM public.geoname_location ORDER BY geoname_id";
+
+/*
+ Loads the locations' geoname_ids, sorted, for the parsers to check the Blocks rows against:
+ an array of 4 bytes per location, a few hundred KB for a MaxMind release.
+ 
+ - Returns YES if it failed, or there are no locations to check against.
+ */
+BOOL LoadGeonameIds(const char* strDbName)
+{
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	
+	PGresult* pgRes = PQexecParams(pgConnx, GEONAMEIDSSql, 0, NULL, NULL, NULL, NULL, PGPARAM_FORMAT_BIN);
+	if( PGRES_TUPLES_OK!=PQresultStatus(pgRes) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to load the geoname_ids - %s\n", PQresultErrorMessage(pgRes));
+		PQclear(pgRes);
+		return YES;
+	}
+	
+	int nRows = PQntuples(pgRes);
+	GeonameIds.reserve(nRows);
+	for( int nRow=0; nRow<nRows; ++nRow )
+	{
+		uint32_t nGeonameId;
+		if( (int)sizeof(nGeonameId)!=PQgetlength(pgRes, nRow, 0) ){ continue; }
+		memcpy(&nGeonameId, PQgetvalue(pgRes, nRow, 0), sizeof(nGeonameId));
+		GeonameIds.push_back((int32_t)ntohl(nGeonameId));
+	}
+	PQclear(pgRes);
+	
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	dprintf(STDOUT_FILENO, "Loaded %zu geoname_ids (%zu KB) in %.2f seconds.\n", GeonameIds.size(),
+			GeonameIds.size()*sizeof(int32_t)/OneKB,
+			(endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9);
+	
+	// every row would be rejected.
+	if( GeonameIds.empty() )
+	{
+		dprintf(STDOUT_FILENO, "geoname_location is empty, import the Locations file first (or both with --release).\n");
+		return YES;
+	}
+	return NO;
+}
+
+/*
+ - Returns YES if the geoname_id is a location's.
+ */
+BOOL IsKnownGeonameId(const char* strGeonameId)
+{
+	int32_t nGeonameId;
+	if( YES==ParseInt32(strGeonameId, &nGeonameId) ){ return NO; }
+	return std::binary_search(GeonameIds.begin(), GeonameIds.end(), nGeonameId) ? YES : NO;
+}
+
+
+
+/*			Partitioned geoip (--partitioned)			*/
+
+const char* PARTITIONSSql = "SELECT partition_name, host(first_address) FROM public.geoip_partition "
+							"ORDER BY family(first_address), first_address";
+
+/*
+ - Returns YES if the left address (or partition's first) comes before the right one.
+ */
+static BOOL IsBeforePartition(const GeoipPartition& left, const GeoipPartition& right)
+{
+	if( left.isIPv6!=right.isIPv6 ){ return (NO==left.isIPv6) ? YES : NO; }
+	return (memcmp(left.firstAddress, right.firstAddress, sizeof(left.firstAddress))<0) ? YES : NO;
+}
+
+/*
+ - strNetwork : an address or network as text.
+ - pPartition : [out] its family and address, to compare with the partitions' first addresses.
+ - Returns YES if it is not an address.
+ */
+static BOOL PartitionKeyOf(const char* strNetwork, GeoipPartition* pPartition)
+{
+	char inetValue[4 + 16];
+	int nLength;
+	if( YES==TextToBinaryInet(strNetwork, inetValue, &nLength) ){ return YES; }
+	
+	pPartition->isIPv6 = (PGSQL_AF_INET6==inetValue[0]) ? YES : NO;
+	memset(pPartition->firstAddress, 0, sizeof(pPartition->firstAddress));
+	memcpy(pPartition->firstAddress, inetValue + 4, nLength - 4);
+	return NO;
+}
+
+/*
+ Loads geoip's partitions, each with the COPY into it, once COPYGEOIPColumns are the ones to use.
+ 
+ - Returns YES if it failed, or geoip is not partitioned.
+ */
+BOOL LoadGeoipPartitions(const char* strDbName)
+{
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	
+	PGresult* pgRes = PQexec(pgConnx, PARTITIONSSql);
+	if( PGRES_TUPLES_OK!=PQresultStatus(pgRes) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to load the geoip partitions - %s\n", PQresultErrorMessage(pgRes));
+		PQclear(pgRes);
+		return YES;
+	}
+	
+	int nRows = PQntuples(pgRes);
+	for( int nRow=0; nRow<nRows; ++nRow )
+	{
+		GeoipPartition partition;
+		if( YES==PartitionKeyOf(PQgetvalue(pgRes, nRow, 1), &partition) ){ continue; }
+		partition.strName = PQgetvalue(pgRes, nRow, 0);
+		
+		char* strIdentifier = PQescapeIdentifier(pgConnx, partition.strName.c_str(), partition.strName.length());
+		if( NULL==strIdentifier ){ continue; }
+		partition.strCopySql = std::string("COPY public.") + strIdentifier + COPYGEOIPColumns;
+		PQfreemem(strIdentifier);
+		
+		GeoipPartitions.push_back(partition);
+	}
+	PQclear(pgRes);
+	
+	if( GeoipPartitions.empty() )
+	{
+		dprintf(STDOUT_FILENO, "geoip is not partitioned, run SELECT partition_geoip(); first.\n");
+		return YES;
+	}
+	if( YES==GeoipPartitions.back().isIPv6 && NO==GeoipPartitions.front().isIPv6 ){ return NO; }
+	dprintf(STDOUT_FILENO, "geoip_partition lists no %s partitions, those rows are copied into geoip.\n",
+			(YES==GeoipPartitions.front().isIPv6) ? "IPv4" : "IPv6");
+	return NO;
+}
+
+/*
+ - address : an address in the partitions' form.
+ - Returns the index of its partition in GeoipPartitions, as GeoipPartitionOf().
+ */
+static int GeoipPartitionOfAddress(const GeoipPartition& address)
+{
+	// the last partition starting at or before it.
+	std::vector<GeoipPartition>::const_iterator pNext
+		= std::upper_bound(GeoipPartitions.begin(), GeoipPartitions.end(), address,
+						   [](const GeoipPartition& key, const GeoipPartition& partition){ return YES==IsBeforePartition(key, partition); });
+	if( pNext==GeoipPartitions.begin() || (pNext-1)->isIPv6!=address.isIPv6 ){ return -1; }
+	return (int)(pNext - GeoipPartitions.begin()) - 1;
+}
+
+/*
+ - strNetwork : a Blocks row's network.
+ - Returns the index of its partition in GeoipPartitions, or -1 if it is not a network
+   (the row is rejected) or none of its family's partitions starts at or before it. Such
+   a row is copied into geoip itself, which routes it, to its DEFAULT partition if need be.
+ */
+int GeoipPartitionOf(const char* strNetwork)
+{
+	GeoipPartition address;
+	if( YES==PartitionKeyOf(strNetwork, &address) ){ return -1; }
+	return GeoipPartitionOfAddress(address);
+}
+
+/*
+ Gives each writer a lane: a run of consecutive partitions holding about its share of the
+ file's bytes, so it fills its own partitions, each in the file's (network) order, and no two
+ writers insert into the same indexes. A range of the mapping goes to the partition of its
+ first row; the rows of one that crosses into the next partition are still copied into theirs.
+ The ranges are then reordered so the reader takes one of each lane in turn, and every
+ writer has rows to write all through the import.
+ */
+void AssignPartitionLanes(void)
+{
+	size_t nBlocks = MappedBlocks.size();
+	if( 0==nBlocks ){ return; }
+	
+	// the file is sorted, so the ranges' partitions only go up.
+	std::vector<int> blockPartitions(nBlocks);
+	std::vector<off_t> partitionBytes(GeoipPartitions.size(), 0);
+	off_t nTotalBytes = 0;
+	int nPartition = 0;
+	for( size_t nBlock=0; nBlock<nBlocks; ++nBlock )
+	{
+		const MappedBlock& block = MappedBlocks[nBlock];
+		char strNetwork[64];
+		size_t nLength = strcspn(block.startPos, ",\n");
+		if( nLength<sizeof(strNetwork) && block.startPos + nLength<block.endPos )
+		{
+			memcpy(strNetwork, block.startPos, nLength);
+			strNetwork[nLength] = '\0';
+			nPartition = std::max(nPartition, GeoipPartitionOf(strNetwork));
+		}
+		blockPartitions[nBlock] = nPartition;
+		partitionBytes[nPartition] += (block.endPos - block.startPos);
+		nTotalBytes += (block.endPos - block.startPos);
+	}
+	
+	// a partition goes to the lane its middle byte falls in.
+	std::vector<uint16_t> partitionLanes(GeoipPartitions.size());
+	off_t nBytesBefore = 0;
+	for( size_t nPart=0; nPart<GeoipPartitions.size(); ++nPart )
+	{
+		uint64_t nLane = (uint64_t)(nBytesBefore + partitionBytes[nPart]/2) * NumWriters / (uint64_t)nTotalBytes;
+		partitionLanes[nPart] = (uint16_t)std::min(nLane, (uint64_t)(NumWriters-1));
+		nBytesBefore += partitionBytes[nPart];
+	}
+	
+	for( size_t nPart=0; nPart<GeoipPartitions.size(); ++nPart ){
+		GeoipPartitions[nPart].nLane = partitionLanes[nPart];
+	}
+	
+	std::vector<std::vector<MappedBlock> > laneBlocks(NumWriters);
+	for( size_t nBlock=0; nBlock<nBlocks; ++nBlock )
+	{
+		MappedBlock block = MappedBlocks[nBlock];
+		block.nLane = partitionLanes[blockPartitions[nBlock]];
+		laneBlocks[block.nLane].push_back(block);
+	}
+	
+	MappedBlocks.clear();
+	for( size_t nTurn=0; MappedBlocks.size()<nBlocks; ++nTurn )
+	{
+		for( uint16_t nLane=0; nLane<NumWriters; ++nLane )
+		{
+			if( nTurn<laneBlocks[nLane].size() ){
+				MappedBlocks.push_back(laneBlocks[nLane][nTurn]);
+			}
+		}
+	}
+	
+	for( uint16_t nLane=0; nLane<NumWriters; ++nLane )
+	{
+		off_t nLaneBytes = 0;
+		size_t nFirst = GeoipPartitions.size(), nLast = 0;
+		for( size_t nPart=0; nPart<GeoipPartitions.size(); ++nPart )
+		{
+			if( nLane!=partitionLanes[nPart] || 0==partitionBytes[nPart] ){ continue; }
+			nFirst = std::min(nFirst, nPart);
+			nLast = nPart;
+			nLaneBytes += partitionBytes[nPart];
+		}
+		if( nFirst>=GeoipPartitions.size() ){
+			dprintf(STDOUT_FILENO, "Writer %u: no rows, geoip needs more partitions than connections.\n", nLane+1);
+		}
+		else if( nFirst==nLast ){
+			dprintf(STDOUT_FILENO, "Writer %u: %s, %lld KB.\n", nLane+1, GeoipPartitions[nFirst].strName.c_str(), (long long)(nLaneBytes/OneKB));
+		}
+		else{
+			dprintf(STDOUT_FILENO, "Writer %u: %s to %s, %lld KB.\n", nLane+1, GeoipPartitions[nFirst].strName.c_str(),
+					GeoipPartitions[nLast].strName.c_str(), (long long)(nLaneBytes/OneKB));
+		}
+	}
+}
+
+
+/*			Collapsing networks (--collapse)			*/
+
+typedef unsigned __int128 Address128;
+
+/*
+ A network, or a run of contiguous ones, as its first and last address.
+ An IPv4 address is held in the low 32 bits.
+ */
+typedef struct NETWORKBOUNDS {
+	BOOL		isIPv6;
+	int			nMaxBits;
+	Address128	first;
+	Address128	last;
+} NetworkBounds;
+
+/*
+ A run at a chunk's first or last row, held back until every chunk is parsed, as it may
+ continue in the chunk before or after: its bounds and the values of its first row (but
+ for the network, which its bounds replace).
+ */
+typedef struct EDGERUN {
+	NetworkBounds	bounds;
+	std::string		values[BLK_NUM_FIELDS];
+	uint16_t		nullFields;		// a bit per field that is NULL
+} EdgeRun;
+
+static std::vector<EdgeRun> EdgeRuns;	// only touched on CollapseQ, JoinEdgeRuns() takes them there
+
+// the longest network text, an IPv6 address and /128.
+#define COLLAPSED_NETWORK_SIZE (INET6_ADDRSTRLEN + 4)
+
+/*
+ - Returns YES if it is not a network, or has host bits set; the row is written as it is.
+ */
+static BOOL NetworkBoundsOf(const char* strNetwork, NetworkBounds* pBounds)
+{
+	char inetValue[4 + 16];
+	int nLength;
+	if( YES==TextToBinaryInet(strNetwork, inetValue, &nLength) ){ return YES; }
+	
+	pBounds->isIPv6 = (PGSQL_AF_INET6==inetValue[0]) ? YES : NO;
+	pBounds->nMaxBits = (nLength - 4)*8;
+	
+	Address128 address = 0;
+	for( int nByte=4; nByte<nLength; ++nByte ){
+		address = (address << 8) | (unsigned char)inetValue[nByte];
+	}
+	
+	// 2 << 127 wraps to 0, so a /0 has every bit in its host mask.
+	int nHostBits = pBounds->nMaxBits - (unsigned char)inetValue[1];
+	Address128 hostMask = (0==nHostBits) ? 0 : ((Address128)2 << (nHostBits-1)) - 1;
+	if( 0!=(address & hostMask) ){ return YES; }
+	
+	pBounds->first = address;
+	pBounds->last = address | hostMask;
+	return NO;
+}
+
+/*
+ - Returns YES if next starts right after run ends.
+ */
+static BOOL IsContiguous(const NetworkBounds& run, const NetworkBounds& next)
+{
+	return (run.isIPv6==next.isIPv6 && next.first>run.last && 1==next.first - run.last) ? YES : NO;
+}
+
+static BOOL IsSameField(const char* strLeft, const char* strRight)
+{
+	if( NULL==strLeft || NULL==strRight ){ return (strLeft==strRight) ? YES : NO; }
+	return (0==strcmp(strLeft, strRight)) ? YES : NO;
+}
+
+/*
+ - Returns YES if the two Blocks rows store the same values, but for the network:
+   the geoname_id and postal code, and with --extended the rest of the columns.
+ */
+static BOOL IsSamePayload(const char* const* left, const char* const* right)
+{
+	if( NO==IsSameField(BlockGeonameId(left), BlockGeonameId(right)) ||
+		NO==IsSameField(left[BLK_postal_code], right[BLK_postal_code]) )
+	{
+		return NO;
+	}
+	if( YES==ExtendedBlocks )
+	{
+		for( int nField=BLK_registered_country_geoname_id; nField<BLK_NUM_FIELDS; ++nField ){
+			if( NO==IsSameField(left[nField], right[nField]) ){ return NO; }
+		}
+	}
+	return YES;
+}
+
+/*
+ Appends a NUL terminated value to the chunk's text, whose capacity is reserved beforehand
+ so the values appended before stay where they are.
+ - Returns the value appended.
+ */
+static const char* AppendCollapsedText(std::vector<char>& text, const char* strValue)
+{
+	size_t nStart = text.size();
+	text.insert(text.end(), strValue, strValue + strlen(strValue) + 1);
+	return text.data() + nStart;
+}
+
+/*
+ Writes the fewest networks covering the run as rows of the chunk from *pnRow on, each
+ with the run's values: the largest aligned network starting at the first address left,
+ in turn. There are never more than the run's own networks, as they cover it too.
+ - values : the row values, values[BLK_network] is replaced.
+ */
+static void AppendCollapsedRun(const NetworkBounds& run, const char* const* values, ParsedChunk* pChunk, size_t* pnRow)
+{
+	Address128 first = run.first;
+	for( ;; )
+	{
+		int nHostBits = 0;
+		while( nHostBits<run.nMaxBits )
+		{
+			Address128 hostMask = ((Address128)2 << nHostBits) - 1;
+			if( 0!=(first & hostMask) || (first | hostMask)>run.last ){ break; }
+			++nHostBits;
+		}
+		
+		unsigned char address[16];
+		int nAddrBytes = run.nMaxBits/8;
+		for( int nByte=0; nByte<nAddrBytes; ++nByte ){
+			address[nByte] = (unsigned char)(first >> (8*(nAddrBytes - 1 - nByte)));
+		}
+		char strNetwork[COLLAPSED_NETWORK_SIZE];
+		inet_ntop((YES==run.isIPv6) ? AF_INET6 : AF_INET, address, strNetwork, INET6_ADDRSTRLEN);
+		snprintf(strNetwork + strlen(strNetwork), 5, "/%d", run.nMaxBits - nHostBits);
+		
+		size_t nField = (*pnRow)*BLK_NUM_FIELDS;
+		if( nField + BLK_NUM_FIELDS > pChunk->fields.size() ){
+			pChunk->fields.resize(nField + BLK_NUM_FIELDS);
+		}
+		std::copy(values, values + BLK_NUM_FIELDS, pChunk->fields.begin() + nField);
+		pChunk->fields[nField + BLK_network] = AppendCollapsedText(pChunk->collapsedText, strNetwork);
+		++(*pnRow);
+		
+		Address128 hostMask = (0==nHostBits) ? 0 : ((Address128)2 << (nHostBits-1)) - 1;
+		if( (first | hostMask)>=run.last ){ break; }
+		first = (first | hostMask) + 1;
+	}
+}
+
+/*
+ Collapses the chunk's rows in place: each run of contiguous networks with the same values
+ becomes the fewest networks covering it. A row whose network is not valid is left for the
+ writer to reject. The runs at the chunk's first and last row are held back in EdgeRuns, as
+ they may go on in the chunks either side, which another parser may have.
+ 
+ - Returns the rows left in the chunk.
+ */
+uint32_t CollapseBlocks(ParsedChunk* pChunk)
+{
+	typedef struct COLLAPSERUN { size_t nStart; size_t nEnd; NetworkBounds bounds; BOOL isValid; } CollapseRun;
+	
+	std::vector<const char*>& fields = pChunk->fields;
+	size_t nRows = fields.size()/BLK_NUM_FIELDS;
+	CollapseRowsIn += nRows;
+	
+	std::vector<CollapseRun> runs;
+	size_t nCollapsedRows = 0;
+	for( size_t nRow=0; nRow<nRows; )
+	{
+		CollapseRun run = { nRow, nRow+1, NetworkBounds(), NO };
+		run.isValid = (NO==NetworkBoundsOf(fields[nRow*BLK_NUM_FIELDS + BLK_network], &run.bounds)) ? YES : NO;
+		
+		NetworkBounds next;
+		while( YES==run.isValid && run.nEnd<nRows &&
+			   NO==NetworkBoundsOf(fields[run.nEnd*BLK_NUM_FIELDS + BLK_network], &next) &&
+			   YES==IsContiguous(run.bounds, next) &&
+			   YES==IsSamePayload(&fields[nRow*BLK_NUM_FIELDS], &fields[run.nEnd*BLK_NUM_FIELDS]) )
+		{
+			run.bounds.last = next.last;
+			++run.nEnd;
+		}
+		if( run.nEnd - run.nStart > 1 ){
+			nCollapsedRows += run.nEnd - run.nStart;
+		}
+		runs.push_back(run);
+		nRow = run.nEnd;
+	}
+	pChunk->collapsedText.reserve(nCollapsedRows*COLLAPSED_NETWORK_SIZE);
+	
+	// the rows are written back from the start, never past the run being read.
+	std::vector<EdgeRun> edgeRuns;
+	std::vector<EdgeRun>* pEdgeRuns = &edgeRuns; // blocks copy captured objects
+	size_t nOutRow = 0;
+	for( size_t nRun=0; nRun<runs.size(); ++nRun )
+	{
+		const CollapseRun& run = runs[nRun];
+		const char* values[BLK_NUM_FIELDS];
+		std::copy(&fields[run.nStart*BLK_NUM_FIELDS], &fields[run.nStart*BLK_NUM_FIELDS] + BLK_NUM_FIELDS, values);
+		
+		if( YES==run.isValid && (0==run.nStart || nRows==run.nEnd) )
+		{
+			EdgeRun edgeRun;
+			edgeRun.bounds = run.bounds;
+			edgeRun.nullFields = 0;
+			for( int nField=BLK_network+1; nField<BLK_NUM_FIELDS; ++nField )
+			{
+				if( NULL==values[nField] ){ edgeRun.nullFields |= (uint16_t)(1 << nField); }
+				else{ edgeRun.values[nField] = values[nField]; }
+			}
+			edgeRuns.push_back(edgeRun);
+		}
+		else if( run.nEnd - run.nStart > 1 ){
+			AppendCollapsedRun(run.bounds, values, pChunk, &nOutRow);
+		}
+		else
+		{
+			std::copy(values, values + BLK_NUM_FIELDS, fields.begin() + nOutRow*BLK_NUM_FIELDS);
+			++nOutRow;
+		}
+	}
+	fields.resize(nOutRow*BLK_NUM_FIELDS);
+	CollapseRowsOut += nOutRow;
+	
+	if( !edgeRuns.empty() ){
+		dispatch_sync(CollapseQ, ^{ EdgeRuns.insert(EdgeRuns.end(), pEdgeRuns->begin(), pEdgeRuns->end()); });
+	}
+	return (uint32_t)nOutRow;
+}
+
+/*
+ - fields : [out] the edge run's values, NULL for the fields it has none.
+ */
+static void EdgeRunFields(const EdgeRun& edgeRun, const char** fields)
+{
+	for( int nField=0; nField<BLK_NUM_FIELDS; ++nField ){
+		fields[nField] = (0!=(edgeRun.nullFields & (1 << nField))) ? NULL : edgeRun.values[nField].c_str();
+	}
+}
+
+static BOOL IsBeforeEdgeRun(const EdgeRun& left, const EdgeRun& right)
+{
+	if( left.bounds.isIPv6!=right.bounds.isIPv6 ){ return (NO==left.bounds.isIPv6) ? YES : NO; }
+	return (left.bounds.first<right.bounds.first) ? YES : NO;
+}
+
+/*
+ Joins the runs held back from the chunks' edges, once every chunk is parsed: in address
+ order, a run the next one continues (contiguous, the same values) is joined to it, so a run
+ across any number of chunks is collapsed as a whole. The joined runs' networks are the
+ rows of a chunk of their own, for the writers, its values in its collapsedText. With
+ --partitioned there is a chunk for each lane, holding the runs whose first network is in
+ one of its partitions.
+ - edgeChunks : [out] the chunks, none if there are no edge runs.
+ */
+void JoinEdgeRuns(std::vector<ParsedChunk*>& edgeChunks)
+{
+	std::vector<EdgeRun> edgeRuns;
+	std::vector<EdgeRun>* pEdgeRuns = &edgeRuns; // blocks copy captured objects
+	dispatch_sync(CollapseQ, ^{ pEdgeRuns->swap(EdgeRuns); });
+	if( edgeRuns.empty() ){ return; }
+	
+	std::sort(edgeRuns.begin(), edgeRuns.end(),
+			  [](const EdgeRun& left, const EdgeRun& right){ return YES==IsBeforeEdgeRun(left, right); });
+	
+	std::vector<EdgeRun> joinedRuns;
+	for( size_t nRun=0; nRun<edgeRuns.size(); ++nRun )
+	{
+		const EdgeRun& edgeRun = edgeRuns[nRun];
+		if( !joinedRuns.empty() )
+		{
+			EdgeRun& joinedRun = joinedRuns.back();
+			const char* joinedFields[BLK_NUM_FIELDS];
+			const char* edgeFields[BLK_NUM_FIELDS];
+			EdgeRunFields(joinedRun, joinedFields);
+			EdgeRunFields(edgeRun, edgeFields);
+			if( YES==IsContiguous(joinedRun.bounds, edgeRun.bounds) && YES==IsSamePayload(joinedFields, edgeFields) )
+			{
+				joinedRun.bounds.last = edgeRun.bounds.last;
+				continue;
+			}
+		}
+		joinedRuns.push_back(edgeRun);
+	}
+	
+	// each run's lane, and each lane's text: the runs' values, and at most two networks
+	// per bit of their addresses.
+	uint16_t nLanes = (YES==PartitionedMode) ? NumWriters : 1;
+	std::vector<uint16_t> runLanes(joinedRuns.size(), 0);
+	std::vector<size_t> laneTextSizes(nLanes, 0);
+	for( size_t nRun=0; nRun<joinedRuns.size(); ++nRun )
+	{
+		const EdgeRun& joinedRun = joinedRuns[nRun];
+		if( YES==PartitionedMode )
+		{
+			GeoipPartition address;
+			address.isIPv6 = joinedRun.bounds.isIPv6;
+			memset(address.firstAddress, 0, sizeof(address.firstAddress));
+			int nAddrBytes = joinedRun.bounds.nMaxBits/8;
+			for( int nByte=0; nByte<nAddrBytes; ++nByte ){
+				address.firstAddress[nByte] = (unsigned char)(joinedRun.bounds.first >> (8*(nAddrBytes - 1 - nByte)));
+			}
+			int nPartition = GeoipPartitionOfAddress(address);
+			runLanes[nRun] = (nPartition>=0) ? GeoipPartitions[nPartition].nLane : 0;
+		}
+		
+		size_t& nTextSize = laneTextSizes[runLanes[nRun]];
+		for( int nField=0; nField<BLK_NUM_FIELDS; ++nField ){
+			nTextSize += joinedRun.values[nField].length() + 1;
+		}
+		nTextSize += 2*joinedRun.bounds.nMaxBits*COLLAPSED_NETWORK_SIZE;
+	}
+	
+	// the text is reserved up front, the rows point into it.
+	std::vector<ParsedChunk*> laneChunks(nLanes, NULL);
+	std::vector<size_t> laneRows(nLanes, 0);
+	for( size_t nRun=0; nRun<joinedRuns.size(); ++nRun )
+	{
+		uint16_t nLane = runLanes[nRun];
+		ParsedChunk* pChunk = laneChunks[nLane];
+		if( NULL==pChunk )
+		{
+			pChunk = laneChunks[nLane] = FreeChunkQ.Pop();
+			pChunk->fileMode = IPBLOCKS;
+			pChunk->startPos = NULL;
+			pChunk->endPos = NULL;
+			pChunk->filePos = FileTotalSize;
+			pChunk->nBytes = 0;
+			pChunk->nLane = nLane;
+			pChunk->collapsedText.reserve(laneTextSizes[nLane]);
+		}
+		
+		const EdgeRun& joinedRun = joinedRuns[nRun];
+		const char* values[BLK_NUM_FIELDS];
+		for( int nField=0; nField<BLK_NUM_FIELDS; ++nField )
+		{
+			values[nField] = (0!=(joinedRun.nullFields & (1 << nField))) ? NULL
+								: AppendCollapsedText(pChunk->collapsedText, joinedRun.values[nField].c_str());
+		}
+		AppendCollapsedRun(joinedRun.bounds, values, pChunk, &laneRows[nLane]);
+	}
+	
+	for( uint16_t nLane=0; nLane<nLanes; ++nLane )
+	{
+		if( NULL==laneChunks[nLane] ){ continue; }
+		CollapseRowsOut += laneRows[nLane];
+		edgeChunks.push_back(laneChunks[nLane]);
+	}
+}
+
+/*			Resumable imports (--resume)			*/
+
+// one row per chunk written, keyed by the file's name and the chunk's first byte.
+const char* PROGRESSSql = "INSERT INTO geoimport_progress (file_name,file_size,file_mtime,chunk_start,chunk_end,rows_done,is_complete) "
+							"VALUES ($1,$2,$3,$4,$5,$6,$7) ON CONFLICT (file_name,chunk_start) "
+							"DO UPDATE SET rows_done=EXCLUDED.rows_done, is_complete=EXCLUDED.is_complete";
+const char* PROGRESSClearSql = "DELETE FROM geoimport_progress WHERE file_name=$1";
+const char* PROGRESSLoadSql = "SELECT file_size,file_mtime,chunk_start,chunk_end,rows_done,is_complete "
+								"FROM geoimport_progress WHERE file_name=$1";
+const int PROGRESS_NUM_PARAMS = 7;
+
+/*
+ - nRowsDone : the chunk's rows written or rejected, counted from its first.
+ */
+ChunkCheckpoint CheckpointOf(const ParsedChunk* pChunk, uint32_t nRowsDone, int nFields)
+{
+	ChunkCheckpoint checkpoint;
+	checkpoint.chunkStart = pChunk->filePos;
+	checkpoint.chunkEnd = pChunk->filePos + pChunk->nBytes;
+	checkpoint.nRowsDone = nRowsDone;
+	checkpoint.isComplete = (nRowsDone >= pChunk->nFirstRow + pChunk->fields.size()/nFields) ? YES : NO;
+	return checkpoint;
+}
+
+/*
+ Records a chunk's checkpoint, in the transaction open on the connection (queued when pipelined).
+ 
+ - Returns YES if it failed.
+ */
+BOOL AddProgressToDatabase(const ChunkCheckpoint& checkpoint, PostgresConnection& pgConnx)
+{
+	char strFileSize[24], strModified[24], strStart[24], strEnd[24], strRowsDone[12];
+	snprintf(strFileSize, sizeof(strFileSize), "%lld", (long long)FileTotalSize);
+	snprintf(strModified, sizeof(strModified), "%lld", FileModifiedTime);
+	snprintf(strStart, sizeof(strStart), "%lld", (long long)checkpoint.chunkStart);
+	snprintf(strEnd, sizeof(strEnd), "%lld", (long long)checkpoint.chunkEnd);
+	snprintf(strRowsDone, sizeof(strRowsDone), "%u", checkpoint.nRowsDone);
+	const char* paramValues[PROGRESS_NUM_PARAMS] = { CheckpointFileName, strFileSize, strModified, strStart, strEnd,
+													 strRowsDone, (YES==checkpoint.isComplete) ? "t" : "f" };
+	
+	if( YES==pgConnx.IsPipelined() ){
+		return pgConnx.QueueParams(PROGRESSSql, PROGRESS_NUM_PARAMS, paramValues, NULL, NULL);
+	}
+	
+	PGresult* pgRes = PQexecParams(pgConnx, PROGRESSSql, PROGRESS_NUM_PARAMS, NULL, paramValues, NULL, NULL, 0);
+	BOOL bDidFail = (PGRES_COMMAND_OK==PQresultStatus(pgRes)) ? NO : YES;
+	if( YES==bDidFail ){
+		dprintf(STDOUT_FILENO, "Failed to record the chunk's progress - %s", PQresultErrorMessage(pgRes));
+	}
+	PQclear(pgRes);
+	return bDidFail;
+}
+
+/*
+ Starts recording the file's checkpoints. Without --resume those of an earlier import of
+ the file are removed; with it they are loaded, once the file is checked to be the same
+ size and age. A database without the geoimport_progress table imports without them.
+ 
+ - Returns YES if the import cannot go on.
+ */
+BOOL BeginCheckpoints(const char* strDbName, const char* strFilename)
+{
+	const char* strBaseName = strrchr(strFilename, '/');
+	snprintf(CheckpointFileName, sizeof(CheckpointFileName), "%s", (NULL!=strBaseName) ? strBaseName+1 : strFilename);
+	
+	PostgresConnection pgConnx;
+	if( NO==pgConnx.Connect(strDbName) ){ return YES; }
+	
+	PGresult* pgRes = PQexec(pgConnx, "SELECT to_regclass('public.geoimport_progress') IS NOT NULL");
+	BOOL hasTable = (PGRES_TUPLES_OK==PQresultStatus(pgRes) && 1==PQntuples(pgRes) && 't'==*PQgetvalue(pgRes, 0, 0)) ? YES : NO;
+	PQclear(pgRes);
+	if( NO==hasTable )
+	{
+		if( YES==ResumeMode ){
+			dprintf(STDOUT_FILENO, "Cannot resume, the database has no geoimport_progress table (see postgres.sql).\n");
+			return YES;
+		}
+		dprintf(STDOUT_FILENO, "The database has no geoimport_progress table, this import cannot be resumed.\n");
+		return NO;
+	}
+	
+	const char* paramValues[1] = { CheckpointFileName };
+	if( NO==ResumeMode )
+	{
+		pgRes = PQexecParams(pgConnx, PROGRESSClearSql, 1, NULL, paramValues, NULL, NULL, 0);
+		BOOL bDidFail = (PGRES_COMMAND_OK==PQresultStatus(pgRes)) ? NO : YES;
+		if( YES==bDidFail ){
+			dprintf(STDOUT_FILENO, "Failed to clear the file's checkpoints - %s", PQresultErrorMessage(pgRes));
+		}
+		PQclear(pgRes);
+		RecordCheckpoints = YES;
+		return bDidFail;
+	}
+	
+	pgRes = PQexecParams(pgConnx, PROGRESSLoadSql, 1, NULL, paramValues, NULL, NULL, 0);
+	if( PGRES_TUPLES_OK!=PQresultStatus(pgRes) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to load the file's checkpoints - %s", PQresultErrorMessage(pgRes));
+		PQclear(pgRes);
+		return YES;
+	}
+	
+	uint32_t nComplete = 0, nPartial = 0;
+	unsigned long long nRowsDone = 0;
+	for( int nRow=0; nRow<PQntuples(pgRes); ++nRow )
+	{
+		if( FileTotalSize!=(off_t)strtoll(PQgetvalue(pgRes, nRow, 0), NULL, 10) ||
+			FileModifiedTime!=strtoll(PQgetvalue(pgRes, nRow, 1), NULL, 10) )
+		{
+			dprintf(STDOUT_FILENO, "%s has changed since the interrupted import, import it without --resume.\n", CheckpointFileName);
+			PQclear(pgRes);
+			return YES;
+		}
+		
+		ChunkCheckpoint checkpoint;
+		checkpoint.chunkStart = (off_t)strtoll(PQgetvalue(pgRes, nRow, 2), NULL, 10);
+		checkpoint.chunkEnd = (off_t)strtoll(PQgetvalue(pgRes, nRow, 3), NULL, 10);
+		checkpoint.nRowsDone = (uint32_t)strtoul(PQgetvalue(pgRes, nRow, 4), NULL, 10);
+		checkpoint.isComplete = ('t'==*PQgetvalue(pgRes, nRow, 5)) ? YES : NO;
+		ResumeCheckpoints[checkpoint.chunkStart] = checkpoint;
+		
+		nRowsDone += checkpoint.nRowsDone;
+		if( YES==checkpoint.isComplete )
+		{
+			++nComplete;
+			ResumedBytes += checkpoint.chunkEnd - checkpoint.chunkStart;
+		}
+		else{
+			++nPartial;
+		}
+	}
+	PQclear(pgRes);
+	
+	dprintf(STDOUT_FILENO, "Resuming %s: %u chunks complete, %u partly written, %llu rows (%lld MB) already done.\n",
+			CheckpointFileName, nComplete, nPartial, nRowsDone, (long long)(ResumedBytes/OneMB));
+	RecordCheckpoints = YES;
+	return NO;
+}
+
+/*
+ --resume : the checkpoint of the chunk's range, checked to end where the chunk does, as
+ the same file read another way (-M, or a different chunk size) splits differently.
+ 
+ - Returns NULL if the interrupted import wrote none of it, or the ranges differ (which stops the import).
+ */
+const ChunkCheckpoint* ResumedCheckpoint(const ParsedChunk* pChunk)
+{
+	std::unordered_map<off_t, ChunkCheckpoint>::const_iterator found = ResumeCheckpoints.find(pChunk->filePos);
+	if( ResumeCheckpoints.end()==found ){ return NULL; }
+	
+	if( found->second.chunkEnd!=pChunk->filePos + pChunk->nBytes )
+	{
+		dprintf(STDOUT_FILENO, "Chunk at file offset %lld does not end where the interrupted import's did, resume with the same options.\n",
+				(long long)pChunk->filePos);
+		AbortProgram = YES;
+		return NULL;
+	}
+	return &found->second;
+}
+
+/*
+ --resume : drops the rows of a parsed chunk that the interrupted import wrote (or rejected).
+ A Locations chunk's dimensions are kept either way, as the interrupted import never added them.
+ 
+ - Returns YES if no rows are left to write.
+ */
+BOOL ResumeChunk(FILETYPE fileMode, ParsedChunk* pChunk, const ChunkCheckpoint& checkpoint)
+{
+	if( LOCATIONS==fileMode )
+	{
+		const LocationDimensions* pChunkDimensions = &pChunk->dimensions;
+		dispatch_sync(DimensionsQ, ^{ Dimensions.Merge(*pChunkDimensions, pChunk->filePos); });
+	}
+	
+	int nFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	if( YES==checkpoint.isComplete || (size_t)checkpoint.nRowsDone*nFields>=pChunk->fields.size() ){ return YES; }
+	
+	pChunk->fields.erase(pChunk->fields.begin(), pChunk->fields.begin() + (size_t)checkpoint.nRowsDone*nFields);
+	pChunk->nFirstRow = checkpoint.nRowsDone;
+	return NO;
+}
+
+
+/*			Lookup database (--emit-db, --lookup)			*/
+
+/*
+ A Blocks row's network and values for the lookup database.
+ - Returns YES if the network or geoname_id is not valid.
+ */
+BOOL ParseLookupRow(const char* const* fields, LookupRow* pRow)
+{
+	NetworkRange range;
+	uint32_t geonameIdValue;
+	if( YES==NetworkToRange(fields[BLK_network], &range) ||
+		YES==TextToBinaryInt4(BlockGeonameId(fields), &geonameIdValue) )
+	{
+		return YES;
+	}
+	
+	pRow->isIPv6 = range.isIPv6;
+	if( NO==range.isIPv6 )
+	{
+		pRow->first.hi = pRow->last.hi = 0;
+		pRow->first.lo = range.ipv4First;
+		pRow->last.lo = range.ipv4Last;
+	}
+	else
+	{
+		pRow->first = GeoipDbKey6FromBytes((const unsigned char*)range.ipv6First);
+		pRow->last = GeoipDbKey6FromBytes((const unsigned char*)range.ipv6Last);
+	}
+	pRow->geonameId = ntohl(geonameIdValue);
+	pRow->postalCode = fields[BLK_postal_code];
+	return NO;
+}
+
+/*
+ - Returns the offset of the string in the string table, adding it if new.
+ */
+uint32_t LookupDb::Intern(const char* strValue)
+{
+	if( NULL==strValue || '\0'==*strValue ){ return 0; }
+	
+	auto inserted = m_stringOffsets.emplace(strValue, (uint32_t)m_strings.size());
+	if( true==inserted.second ){
+		m_strings.append(strValue, strlen(strValue) + 1);
+	}
+	return inserted.first->second;
+}
+
+/*
+ Adds a chunk's rows, interning their postal codes. Called on LookupDbQ.
+ */
+void LookupDb::Add(const std::vector<LookupRow>& rows)
+{
+	for( const LookupRow& row : rows )
+	{
+		if( NO==row.isIPv6 )
+		{
+			GeoipDbEntry4 entry = { (uint32_t)row.last.lo, row.geonameId, Intern(row.postalCode) };
+			m_ranges4.push_back( std::make_pair((uint32_t)row.first.lo, entry) );
+		}
+		else
+		{
+			GeoipDbEntry6 entry = { row.last, row.geonameId, Intern(row.postalCode) };
+			m_ranges6.push_back( std::make_pair(row.first, entry) );
+		}
+	}
+}
+
+/*
+ The IPv4 and IPv6 networks come in separate Blocks files. If the file being replaced
+ holds networks of the family this import has none of, they are kept, so both files
+ can be emitted into one database, one after the other.
+ 
+ - Returns YES if the existing file was read.
+ */
+BOOL LookupDb::KeepOtherFamily(const char* strPath)
+{
+	GeoipDb db;
+	if( 0!=GeoipDbOpen(strPath, &db) ){ return NO; }
+	
+	if( m_ranges4.empty() )
+	{
+		for( size_t nSlot=1; nSlot<=db.nRanges4; ++nSlot )
+		{
+			GeoipDbEntry4 entry = db.entries4[nSlot];
+			entry.postalCode = Intern(db.strings + entry.postalCode);
+			m_ranges4.push_back( std::make_pair(db.keys4[nSlot], entry) );
+		}
+	}
+	else if( m_ranges6.empty() )
+	{
+		for( size_t nSlot=1; nSlot<=db.nRanges6; ++nSlot )
+		{
+			GeoipDbEntry6 entry = db.entries6[nSlot];
+			entry.postalCode = Intern(db.strings + entry.postalCode);
+			m_ranges6.push_back( std::make_pair(db.keys6[nSlot], entry) );
+		}
+	}
+	GeoipDbClose(&db);
+	return YES;
+}
+
+/*
+ Fills rankOfSlot with the sorted position held by each slot of the Eytzinger
+ layout (slot k has children 2k and 2k+1), by walking the implicit tree in order.
+ */
+static size_t EytzingerRanks(std::vector<size_t>& rankOfSlot, size_t nSlot, size_t nRank)
+{
+	if( nSlot>=rankOfSlot.size() ){ return nRank; }
+	
+	nRank = EytzingerRanks(rankOfSlot, 2*nSlot, nRank);
+	rankOfSlot[nSlot] = nRank++;
+	return EytzingerRanks(rankOfSlot, 2*nSlot + 1, nRank);
+}
+
+static bool operator<(const GeoipDbKey6& left, const GeoipDbKey6& right)
+{
+	return (left.hi < right.hi) || (left.hi == right.hi && left.lo < right.lo);
+}
+
+static uint32_t PrevAddress(uint32_t address){ return address - 1; }
+static uint32_t NextAddress(uint32_t address){ return address + 1; }
+
+static GeoipDbKey6 PrevAddress(GeoipDbKey6 address)
+{
+	if( 0==address.lo ){ --address.hi; }
+	--address.lo;
+	return address;
+}
+
+static GeoipDbKey6 NextAddress(GeoipDbKey6 address)
+{
+	++address.lo;
+	if( 0==address.lo ){ ++address.hi; }
+	return address;
+}
+
+/*
+ A lookup takes the last range starting at or before the address, so a network nested in
+ another would leave the rest of the outer one unfound. Networks nest but never partly
+ overlap, so each is split around the networks inside it, and every address is left in
+ one range, the innermost network's (the later of two equal ones).
+ - ranges : sorted by first address, the outer of two with the same first address first.
+ 
+ - Returns the number of networks nested in another.
+ */
+template<typename KEY, typename ENTRY>
+static size_t SplitNestedRanges(std::vector< std::pair<KEY,ENTRY> >& ranges)
+{
+	// the networks holding the current one, outermost first: the next address not yet
+	// written, whether any is left, and the network.
+	typedef struct { KEY next; BOOL hasRest; ENTRY entry; } OpenRange;
+	std::vector<OpenRange> open;
+	std::vector< std::pair<KEY,ENTRY> > split;
+	split.reserve(ranges.size());
+	size_t nNested = 0;
+	
+	auto closeRange = [&]()
+	{
+		OpenRange closed = open.back();
+		open.pop_back();
+		if( YES==closed.hasRest ){ split.push_back( std::make_pair(closed.next, closed.entry) ); }
+		if( !open.empty() )
+		{
+			OpenRange& outer = open.back();
+			outer.hasRest = (BOOL)(YES==outer.hasRest && closed.entry.last < outer.entry.last);
+			if( YES==outer.hasRest ){ outer.next = NextAddress(closed.entry.last); }
+		}
+	};
+	
+	for( const std::pair<KEY,ENTRY>& range : ranges )
+	{
+		while( !open.empty() && open.back().entry.last < range.first ){ closeRange(); }
+		
+		if( !open.empty() )
+		{
+			// the part of the outer network before this one.
+			OpenRange& outer = open.back();
+			if( YES==outer.hasRest && outer.next < range.first )
+			{
+				ENTRY before = outer.entry;
+				before.last = PrevAddress(range.first);
+				split.push_back( std::make_pair(outer.next, before) );
+			}
+			++nNested;
+		}
+		OpenRange opened = { range.first, YES, range.second };
+		open.push_back(opened);
+	}
+	while( !open.empty() ){ closeRange(); }
+	
+	ranges.swap(split);
+	return nNested;
+}
+
+/*
+ Sorts the networks by first address, splits those with networks nested in them, and
+ returns the records in Eytzinger order with an unused slot 0, for keys and entries sections.
+ - Returns the number of networks nested in another.
+ */
+template<typename KEY, typename ENTRY>
+static size_t LayoutRanges(std::vector< std::pair<KEY,ENTRY> >& ranges, std::vector<KEY>& keys, std::vector<ENTRY>& entries)
+{
+	std::sort(ranges.begin(), ranges.end(),
+			  [](const std::pair<KEY,ENTRY>& left, const std::pair<KEY,ENTRY>& right){
+				  return left.first < right.first || (!(right.first < left.first) && right.second.last < left.second.last); });
+	
+	size_t nNested = SplitNestedRanges(ranges);
+	
+	std::vector<size_t> rankOfSlot(ranges.size() + 1, 0);
+	EytzingerRanks(rankOfSlot, 1, 0);
+	
+	keys.assign(ranges.size() + 1, KEY());
+	entries.assign(ranges.size() + 1, ENTRY());
+	for( size_t nSlot=1; nSlot<rankOfSlot.size(); ++nSlot )
+	{
+		keys[nSlot] = ranges[rankOfSlot[nSlot]].first;
+		entries[nSlot] = ranges[rankOfSlot[nSlot]].second;
+	}
+	return nNested;
+}
+
+/*
+ Writes a section at the next 64 byte boundary.
+ - Returns YES if the write failed.
+ */
+static BOOL WriteLookupDbSection(int fdDb, uint64_t* pnOffset, const void* pData, size_t nBytes)
+{
+	static const char padding[64] = {0};
+	size_t nPadding = (size_t)((64 - (*pnOffset % 64)) % 64);
+	if( nPadding>0 && (ssize_t)nPadding!=write(fdDb, padding, nPadding) ){ return YES; }
+	*pnOffset += nPadding;
+	
+	const char* pWrite = (const char*)pData;
+	size_t nRemaining = nBytes;
+	while( nRemaining>0 )
+	{
+		ssize_t nWritten = write(fdDb, pWrite, nRemaining);
+		if( nWritten<=0 ){ return YES; }
+		pWrite += nWritten;
+		nRemaining -= (size_t)nWritten;
+	}
+	*pnOffset += nBytes;
+	return NO;
+}
+
+/*
+ Lays the networks out for lookup and writes the file beside the target, then renames
+ it into place, so readers mapping the old file are not disturbed.
+ 
+ - Returns YES if it failed.
+ */
+BOOL LookupDb::Write(const char* strPath)
+{
+	// with neither family there is nothing to tell which one an existing file should keep.
+	if( m_ranges4.empty() && m_ranges6.empty() )
+	{
+		dprintf(STDOUT_FILENO, "No networks were imported, %s has not been written.\n", strPath);
+		return YES;
+	}
+	KeepOtherFamily(strPath);
+	
+	std::vector<uint32_t> keys4;
+	std::vector<GeoipDbEntry4> entries4;
+	std::vector<GeoipDbKey6> keys6;
+	std::vector<GeoipDbEntry6> entries6;
+	size_t nNested = LayoutRanges(m_ranges4, keys4, entries4) + LayoutRanges(m_ranges6, keys6, entries6);
+	if( nNested>0 ){
+		dprintf(STDOUT_FILENO, "Warning: %zu networks are nested in another, which is split around them.\n", nNested);
+	}
+	
+	char strTempPath[1024];
+	snprintf(strTempPath, sizeof(strTempPath), "%s.tmp", strPath);
+	int fdDb = open(strTempPath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if( -1==fdDb )
+	{
+		perror("Failed to create the lookup database");
+		return YES;
+	}
+	
+	GeoipDbHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GEOIPDB_MAGIC, sizeof(GEOIPDB_MAGIC));
+	header.version = GEOIPDB_VERSION;
+	header.byteOrder = GEOIPDB_BYTE_ORDER;
+	header.nRanges4 = (uint32_t)m_ranges4.size();
+	header.nRanges6 = (uint32_t)m_ranges6.size();
+	header.stringsSize = m_strings.size();
+	
+	// the offsets are worked out by writing the sections after the header, then it is rewritten.
+	uint64_t nOffset = 0;
+	BOOL bDidFail = WriteLookupDbSection(fdDb, &nOffset, &header, sizeof(header));
+	header.keys4Offset = (nOffset + 63) & ~63ULL;
+	bDidFail = (BOOL)(bDidFail | WriteLookupDbSection(fdDb, &nOffset, keys4.data(), keys4.size()*sizeof(uint32_t)));
+	header.entries4Offset = (nOffset + 63) & ~63ULL;
+	bDidFail = (BOOL)(bDidFail | WriteLookupDbSection(fdDb, &nOffset, entries4.data(), entries4.size()*sizeof(GeoipDbEntry4)));
+	header.keys6Offset = (nOffset + 63) & ~63ULL;
+	bDidFail = (BOOL)(bDidFail | WriteLookupDbSection(fdDb, &nOffset, keys6.data(), keys6.size()*sizeof(GeoipDbKey6)));
+	header.entries6Offset = (nOffset + 63) & ~63ULL;
+	bDidFail = (BOOL)(bDidFail | WriteLookupDbSection(fdDb, &nOffset, entries6.data(), entries6.size()*sizeof(GeoipDbEntry6)));
+	header.stringsOffset = (nOffset + 63) & ~63ULL;
+	bDidFail = (BOOL)(bDidFail | WriteLookupDbSection(fdDb, &nOffset, m_strings.data(), m_strings.size()));
+	
+	if( NO==bDidFail ){
+		bDidFail = ((ssize_t)sizeof(header)==pwrite(fdDb, &header, sizeof(header), 0)) ? NO : YES;
+	}
+	if( NO==bDidFail ){
+		bDidFail = (0==fsync(fdDb)) ? NO : YES;
+	}
+	close(fdDb);
+	
+	if( YES==bDidFail || 0!=rename(strTempPath, strPath) )
+	{
+		perror("Failed to write the lookup database");
+		unlink(strTempPath);
+		return YES;
+	}
+	
+	dprintf(STDOUT_FILENO, "Lookup database %s: %u IPv4 and %u IPv6 networks, %zu bytes of strings, %llu bytes.\n",
+			strPath, header.nRanges4, header.nRanges6, m_strings.size(), (unsigned long long)nOffset);
+	return NO;
+}
+
+BOOL WriteLookupDb(const char* strPath)
+{
+	return LookupDatabase.Write(strPath);
+}
+
+/*
+ --lookup : opens the lookup database, looks the address up and prints the result,
+ then times lookups of random IPv4 addresses.
+ */
+int LookupInDb(const char* strDbPath, const char* strAddress)
+{
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	
+	GeoipDb db;
+	if( 0!=GeoipDbOpen(strDbPath, &db) )
+	{
+		dprintf(STDOUT_FILENO, "Failed to open lookup database %s.\n", strDbPath);
+		return PROGRAM_FAILED;
+	}
+	
+	GeoipDbResult result;
+	int nFound = GeoipDbLookup(&db, strAddress, &result);
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	double openSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+	
+	if( -1==nFound ){
+		dprintf(STDOUT_FILENO, "Invalid address: %s\n", strAddress);
+	}
+	else if( 0==nFound ){
+		dprintf(STDOUT_FILENO, "%s: not found\n", strAddress);
+	}
+	else{
+		dprintf(STDOUT_FILENO, "%s: geoname_id %u, postal_code '%s'\n", strAddress, result.geonameId, result.postalCode);
+	}
+	dprintf(STDOUT_FILENO, "Opened (%u IPv4, %u IPv6 networks) and looked up in %.1f us.\n",
+			db.nRanges4, db.nRanges6, openSecs*1e6);
+	
+	// xorshift, so the addresses are spread over the whole tree and not served from cache.
+	const uint32_t nLookups = 1000000;
+	uint32_t address = 2463534242u;
+	uint32_t nMatched = 0;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	for( uint32_t nLookup=0; nLookup<nLookups; ++nLookup )
+	{
+		address ^= address << 13;
+		address ^= address >> 17;
+		address ^= address << 5;
+		nMatched += (uint32_t)GeoipDbLookup4(&db, address, &result);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	double lookupSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+	dprintf(STDOUT_FILENO, "%u random IPv4 lookups (%u found): %.0f ns each, %.0f lookups/sec.\n",
+			nLookups, nMatched, lookupSecs*1e9/nLookups, (lookupSecs>0 ? nLookups/lookupSecs : 0.0));
+	
+	GeoipDbClose(&db);
+	return (1==nFound) ? PROGRAM_SUCCESS : PROGRAM_FAILED;
+}
+
+
+/*			Benchmarks (-T, --generate, --results)			*/
+
+const int BENCHMARK_PASSES = 5;
+
+/*
+ Checks each structural mask implementation splits the awkward lines as expected: quoting,
+ "" escapes, \r\n, a blank line, a last line with no newline, too many fields, and an
+ unterminated quote, which must not write the byte at the end of its range.
+ 
+ - Returns YES if an implementation got a line wrong.
  */
-int GetCommandlineOptions(int argc,
-						  const char* argv[],
-						  const char** strDbName,
-						  const char** strFilename,
-						  const char** strConnxString )
+static BOOL CheckTokenizer(void)
 {
-	int nIdx = 0;
-	*strDbName = NULL;
-	*strConnxString = NULL;
+	// a long first field, so the mask function covers a whole 64 byte block.
+	static const char strRows[] =
+		"0123456789012345678901234567890123456789012345678901234567890123456789,\"a\"\"b\",c\r\n"
+		"\n"
+		"1,2,3,4\n"
+		"2,,x";
+	static const char* expected[][3] = {
+		{ "0123456789012345678901234567890123456789012345678901234567890123456789", "a\"b", "c" },
+		{ NULL, NULL, NULL }, // too many fields
+		{ "2", NULL, "x" } };
+	static const char strUnterminated[] = "1,\"ab\n2,c\n";
+	
+	StructuralMaskImpl impls[3];
+	int nImpls = GetStructuralMaskImpls(impls);
 	
-	while( --argc>1 )
+	BOOL bDidFail = NO;
+	for( int nImpl=0; nImpl<nImpls; ++nImpl )
 	{
-		const char* strCmd = argv[nIdx++];
-		if( '-'!= *strCmd ){ return Usage(); }
-		++strCmd;
+		char buffer[sizeof(strRows)];
+		memcpy(buffer, strRows, sizeof(strRows)); // with the '\0' after the last line
+		CsvTokenizer tokenizer(buffer, buffer + sizeof(strRows)-1, impls[nImpl].fnMask);
 		
-		switch( *strCmd )
+		const char* fields[3];
+		int nFields;
+		int nLine = 0;
+		while( (nFields = tokenizer.NextLine(fields, 3))>=0 && nLine<3 )
 		{
-			case 'D':
+			BOOL isMalformed = (NULL==expected[nLine][0]) ? YES : NO;
+			if( (YES==isMalformed) ? (0!=nFields) : (3!=nFields) ){ bDidFail = YES; }
+			for( int nField=0; NO==isMalformed && 3==nFields && nField<3; ++nField )
 			{
-				if( NULL!=*strConnxString){
-					dprintf(STDOUT_FILENO, "Cannot combine -D with -U options.\n");
-					return Usage();
+				const char* strExpected = expected[nLine][nField];
+				if( (NULL==strExpected) ? (NULL!=fields[nField]) : (NULL==fields[nField] || 0!=strcmp(fields[nField], strExpected)) ){
+					bDidFail = YES;
 				}
-				
-				// take the database name
-				*strDbName = argv[nIdx++]; //assign
-				snprintf( PGConnectionString, sizeof(PGConnectionString), "host=localhost dbname=%s", *strDbName );
-				continue;
 			}
-			case 'P':{
-				++strCmd;
-				
-				char* endptr;
-				long lNumProcs = strtol(strCmd,&endptr,10);
-				if( lNumProcs>0 && lNumProcs<=999 ){
-					NumProcessors = lNumProcs;
-				}
-				continue;
+			++nLine;
+		}
+		if( 3!=nLine || -1!=nFields ){ bDidFail = YES; }
+		
+		// the range ends after the unterminated quote's line, the next range follows.
+		memcpy(buffer, strUnterminated, sizeof(strUnterminated));
+		CsvTokenizer unterminated(buffer, buffer + 6, impls[nImpl].fnMask);
+		if( 0!=unterminated.NextLine(fields, 3) || -1!=unterminated.NextLine(fields, 3) || '2'!=buffer[6] ){
+			bDidFail = YES;
+		}
+		
+		if( YES==bDidFail )
+		{
+			dprintf(STDOUT_FILENO, "Tokenizer %s split the check lines wrongly.\n", impls[nImpl].strName);
+			return YES;
+		}
+	}
+	return NO;
+}
+
+/*
+ Checks LoadFileBlock() reads a file, with and without a newline after its last line, in
+ chunks of whole lines at their file offsets, the last line ending the last chunk.
+ - Returns YES if it read them wrongly.
+ */
+static BOOL CheckFileRead(void)
+{
+	static const char* strFiles[] = { "1.0.0.0/24,1\n2.0.0.0/24,22\n3.0.0.0/24,3", "1.0.0.0/24,1\n2.0.0.0/24,22\n" };
+	
+	int fdSaved = InputFile;
+	off_t nRemainingSaved = FileBytesRemaining;
+	BOOL bDidFail = NO;
+	for( size_t nFile=0; NO==bDidFail && nFile<sizeof(strFiles)/sizeof(strFiles[0]); ++nFile )
+	{
+		FILE* pFile = tmpfile();
+		size_t nLength = strlen(strFiles[nFile]);
+		if( NULL==pFile || nLength!=fwrite(strFiles[nFile], 1, nLength, pFile) || 0!=fflush(pFile) )
+		{
+			perror("Failed to write the read check file");
+			if( NULL!=pFile ){ fclose(pFile); }
+			return YES;
+		}
+		InputFile = fileno(pFile);
+		lseek(InputFile, 0, SEEK_SET);
+		ReadCarry.clear();
+		
+		// a buffer of 16 bytes holds one line, the rest is carried.
+		char buffer[16+1];
+		std::string strRead;
+		const char* endPos;
+		off_t filePos, nChunk;
+		while( (nChunk = LoadFileBlock(buffer, buffer + 16, &endPos, &filePos))>0 )
+		{
+			BOOL isLast = (filePos + nChunk==(off_t)nLength) ? YES : NO;
+			if( (off_t)strRead.size()!=filePos || (NO==isLast && '\n'!=buffer[nChunk-1]) || (YES==isLast && '\0'!=buffer[nChunk]) ){
+				bDidFail = YES;
 			}
-			case 'U':{
-				if( NULL!=*strDbName){
-					dprintf(STDOUT_FILENO, "Cannot combine -U with -D options.\n");
-					return Usage();
-				}
-				strCmd = argv[nIdx++];
-				
-				size_t nLen = strlen(strCmd);
-				if( nLen<=1 || nLen>=sizeof(PGConnectionString) ){
-					dprintf(STDOUT_FILENO, "Invalid -U [connection string] .\n");
-					return Usage();
-				}
-				nLen = strlcpy(&PGConnectionString[0], strCmd, nLen+1 );
-				
-				*strConnxString = &PGConnectionString[0];
-				continue;
+			strRead.append(buffer, nChunk);
+		}
+		if( 0!=nChunk || strRead!=strFiles[nFile] ){ bDidFail = YES; }
+		fclose(pFile);
+	}
+	InputFile = fdSaved;
+	FileBytesRemaining = nRemainingSaved;
+	ReadCarry.clear();
+	
+	if( YES==bDidFail ){
+		dprintf(STDOUT_FILENO, "LoadFileBlock read the check file's lines wrongly.\n");
+	}
+	return bDidFail;
+}
+
+/*
+ Tokenizer microbenchmark: parses the rows with each structural mask implementation,
+ restoring the buffer between passes, and reports GB/s.
+ */
+static void BenchmarkTokenizer(const char* pFileData, char* pParseBuffer, size_t nBytes)
+{
+	StructuralMaskImpl impls[3];
+	int nImpls = GetStructuralMaskImpls(impls);
+	
+	for( int nImpl=0; nImpl<nImpls; ++nImpl )
+	{
+		double bestSecs = 0;
+		uint64_t nLines = 0, nFieldsTotal = 0;
+		for( int nPass=0; nPass<BENCHMARK_PASSES; ++nPass )
+		{
+			memcpy(pParseBuffer, pFileData, nBytes+1);
+			nLines = nFieldsTotal = 0;
+			
+			struct timespec startTime, endTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+			
+			const char* fields[LOC_NUM_FIELDS];
+			CsvTokenizer tokenizer(pParseBuffer, pParseBuffer+nBytes, impls[nImpl].fnMask);
+			int nFields;
+			while( (nFields = tokenizer.NextLine(fields, LOC_NUM_FIELDS))>=0 )
+			{
+				++nLines;
+				nFieldsTotal += nFields;
+			}
+			
+			clock_gettime(CLOCK_MONOTONIC, &endTime);
+			double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+			if( 0==nPass || elapsedSecs<bestSecs ){ bestSecs = elapsedSecs; }
+		}
+		
+		dprintf(STDOUT_FILENO, "Tokenizer %-6s: %.2f GB/s (%.1f MB in %.2f ms, %llu lines, %llu fields), best of %d.\n",
+				impls[nImpl].strName, (bestSecs>0 ? nBytes/bestSecs/1e9 : 0.0), nBytes/(double)OneMB, bestSecs*1e3,
+				(unsigned long long)nLines, (unsigned long long)nFieldsTotal, BENCHMARK_PASSES);
+		WriteResult("{\"run\":\"benchmark\",\"name\":\"tokenizer\",\"impl\":\"%s\",\"bytes\":%zu,\"rows\":%llu,"
+					"\"seconds\":%.6f,\"gb_per_sec\":%.3f}",
+					impls[nImpl].strName, nBytes, (unsigned long long)nLines, bestSecs, (bestSecs>0 ? nBytes/bestSecs/1e9 : 0.0));
+	}
+}
+
+/*
+ Reads the file in line aligned chunks (-B) with LoadFileBlock(), as the reader does
+ without -M, from the page cache after the first pass.
+ */
+static void BenchmarkFileRead(off_t dataStart, size_t nBytes)
+{
+	char* pBuffer = (char*)malloc(ChunkSize+1);
+	if( NULL==pBuffer ){ return; }
+	
+	double bestSecs = 0;
+	uint32_t nChunks = 0;
+	for( int nPass=0; nPass<BENCHMARK_PASSES; ++nPass )
+	{
+		lseek(InputFile, dataStart, SEEK_SET);
+		ReadCarry.clear();
+		FileBytesRemaining = (off_t)nBytes;
+		nChunks = 0;
+		
+		struct timespec startTime, endTime;
+		clock_gettime(CLOCK_MONOTONIC, &startTime);
+		
+		const char* endPos;
+		off_t filePos;
+		while( LoadFileBlock(pBuffer, pBuffer + ChunkSize, &endPos, &filePos)>0 ){ ++nChunks; }
+		
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
+		double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+		if( 0==nPass || elapsedSecs<bestSecs ){ bestSecs = elapsedSecs; }
+	}
+	free(pBuffer);
+	
+	dprintf(STDOUT_FILENO, "LoadFileBlock   : %.2f GB/s (%u chunks of %u KB in %.2f ms), best of %d.\n",
+			(bestSecs>0 ? nBytes/bestSecs/1e9 : 0.0), nChunks, ChunkSize/OneKB, bestSecs*1e3, BENCHMARK_PASSES);
+	WriteResult("{\"run\":\"benchmark\",\"name\":\"load_file_block\",\"bytes\":%zu,\"chunks\":%u,\"chunk_kb\":%u,"
+				"\"seconds\":%.6f,\"gb_per_sec\":%.3f}",
+				nBytes, nChunks, ChunkSize/OneKB, bestSecs, (bestSecs>0 ? nBytes/bestSecs/1e9 : 0.0));
+}
+
+/*
+ Tokenizes the rows from pStart to pEnd and builds what a write path sends for them:
+ the COPY text of -C (nBuild 0, emptied every chunk, as a chunk's is), or the binary
+ parameters of the prepared statements (nBuild 1). With --extended both parse the
+ extended columns, and -C builds binary COPY rows.
+ - pnChecksum : [in/out] adds up what was built, so the conversions are not optimised away.
+ 
+ - Returns the rows built.
+ */
+static uint64_t BuildBenchmarkRows(FILETYPE fileMode, int nBuild, char* pStart, const char* pEnd,
+								   CopyBuffer& copyBuffer, uint64_t* pnChecksum)
+{
+	uint64_t nRows = 0;
+	const char* fields[LOC_NUM_FIELDS];
+	int nNumFields = (IPBLOCKS==fileMode) ? (int)BLK_NUM_FIELDS : (int)LOC_NUM_FIELDS;
+	CsvTokenizer tokenizer(pStart, pEnd);
+	while( tokenizer.NextLine(fields, nNumFields)==nNumFields )
+	{
+		NetworkRange range;
+		BlockExtras extras;
+		const char* strError;
+		char inetValue[INET_BINARY_MAX];
+		int nInetLength = 0;
+		uint32_t int4Value = 0;
+		if( IPBLOCKS==fileMode )
+		{
+			if( NULL==BlockGeonameId(fields) || YES==NetworkToRange(fields[BLK_network], &range) ){ continue; }
+			if( YES==ExtendedBlocks && YES==ParseBlockExtras(fields, &extras, &strError) ){ continue; }
+			if( 1==nBuild )
+			{
+				TextToBinaryInet(fields[BLK_network], inetValue, &nInetLength);
+				TextToBinaryInt4(BlockGeonameId(fields), &int4Value);
+			}
+		}
+		else if( 1==nBuild )
+		{
+			TextToBinaryInt4(fields[LOC_geoname_id], &int4Value);
+		}
+		
+		if( 0==nBuild )
+		{
+			AppendCopyRow(copyBuffer, fileMode, fields, range,
+						  (IPBLOCKS==fileMode && YES==ExtendedBlocks) ? &extras : NULL);
+			if( copyBuffer.Size()>=(size_t)ChunkSize ){
+				*pnChecksum += copyBuffer.Size();
+				copyBuffer.Reset();
+			}
+		}
+		*pnChecksum += int4Value + nInetLength;
+		++nRows;
+	}
+	return nRows;
+}
+
+/*
+ Tokenizes the whole file and builds each write path's rows for it.
+ */
+static void BenchmarkRowBuilding(FILETYPE fileMode, const char* pFileData, char* pParseBuffer, size_t nBytes)
+{
+	const char* strBuildNames[2] = { "copy_text", "binary_params" };
+	if( IPBLOCKS==fileMode && YES==ExtendedBlocks ){
+		strBuildNames[0] = "copy_binary";
+	}
+	
+	for( int nBuild=0; nBuild<2; ++nBuild )
+	{
+		double bestSecs = 0;
+		uint64_t nRows = 0;
+		for( int nPass=0; nPass<BENCHMARK_PASSES; ++nPass )
+		{
+			memcpy(pParseBuffer, pFileData, nBytes+1);
+			CopyBuffer copyBuffer;
+			uint64_t nChecksum = 0;
+			
+			struct timespec startTime, endTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+			
+			nRows = BuildBenchmarkRows(fileMode, nBuild, pParseBuffer, pParseBuffer+nBytes, copyBuffer, &nChecksum);
+			
+			clock_gettime(CLOCK_MONOTONIC, &endTime);
+			double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+			if( 0==nPass || elapsedSecs<bestSecs ){ bestSecs = elapsedSecs; }
+			if( 0==nChecksum ){ dprintf(STDOUT_FILENO, "(no rows built)\n"); }
+		}
+		
+		dprintf(STDOUT_FILENO, "Rows %-13s: %.0f rows/sec, with tokenizing (%llu rows in %.2f ms), best of %d.\n",
+				strBuildNames[nBuild], (bestSecs>0 ? nRows/bestSecs : 0.0), (unsigned long long)nRows, bestSecs*1e3, BENCHMARK_PASSES);
+		WriteResult("{\"run\":\"benchmark\",\"name\":\"rows_%s\",\"file_type\":\"%s\",\"bytes\":%zu,\"rows\":%llu,"
+					"\"seconds\":%.6f,\"rows_per_sec\":%.0f}",
+					strBuildNames[nBuild], (IPBLOCKS==fileMode ? "blocks" : "locations"), nBytes,
+					(unsigned long long)nRows, bestSecs, (bestSecs>0 ? nRows/bestSecs : 0.0));
+	}
+}
+
+/*
+ The chunk size sweep: reads the file with LoadFileBlock() into a pool buffer of each size
+ and builds the rows of each chunk as it is read, for the write path chosen (-C or not), as
+ a parser does with a chunk just handed on. Smaller chunks cost a read() and lseek() each,
+ larger ones outgrow the caches between reading and parsing, and leave the parsers idle
+ longer at the end of a file when their number does not divide the chunks evenly, which
+ is shown as the share of the last round of chunks that is idle.
+ */
+static void BenchmarkChunkSizes(FILETYPE fileMode, off_t dataStart, size_t nBytes)
+{
+	static const uint32_t sweepKB[] = { 256, 512, 1024, 2048, 4096, 8192, 16384 };
+	const int nSizes = (int)(sizeof(sweepKB)/sizeof(sweepKB[0]));
+	long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t nParsers = (NumParsers>0) ? NumParsers : ((nOnline>0) ? (uint32_t)nOnline : 1);
+	int nBuild = (YES==BulkCopyMode) ? 0 : 1;
+	
+	uint32_t nBestKB = 0;
+	double bestRate = 0;
+	for( int nSize=0; nSize<nSizes; ++nSize )
+	{
+		uint32_t nChunkSize = sweepKB[nSize]*OneKB;
+		size_t nStride, nLength;
+		const char* strPages;
+		char* pBuffer = MapChunkBuffers(nChunkSize+1, 1, &nStride, &nLength, &strPages);
+		if( NULL==pBuffer ){ return; }
+		
+		double bestSecs = 0;
+		uint32_t nChunks = 0;
+		uint64_t nRows = 0;
+		for( int nPass=0; nPass<BENCHMARK_PASSES; ++nPass )
+		{
+			lseek(InputFile, dataStart, SEEK_SET);
+			ReadCarry.clear();
+			FileBytesRemaining = (off_t)nBytes;
+			nChunks = 0;
+			nRows = 0;
+			CopyBuffer copyBuffer;
+			uint64_t nChecksum = 0;
+			
+			struct timespec startTime, endTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+			
+			const char* endPos;
+			off_t filePos;
+			while( LoadFileBlock(pBuffer, pBuffer + nChunkSize, &endPos, &filePos)>0 )
+			{
+				nRows += BuildBenchmarkRows(fileMode, nBuild, pBuffer, endPos, copyBuffer, &nChecksum);
+				++nChunks;
 			}
+			
+			clock_gettime(CLOCK_MONOTONIC, &endTime);
+			double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+			if( 0==nPass || elapsedSecs<bestSecs ){ bestSecs = elapsedSecs; }
+			if( 0==nChecksum ){ dprintf(STDOUT_FILENO, "(no rows built)\n"); }
+		}
+		munmap(pBuffer, nLength);
+		
+		uint32_t nRounds = (nChunks + nParsers - 1)/nParsers;
+		double idleShare = (nRounds>0) ? (double)(nRounds*nParsers - nChunks)/(nRounds*nParsers) : 0.0;
+		double rate = (bestSecs>0) ? nBytes/bestSecs : 0.0;
+		if( rate>bestRate )
+		{
+			bestRate = rate;
+			nBestKB = sweepKB[nSize];
+		}
+		
+		dprintf(STDOUT_FILENO, "Chunks of %5u KB: %.0f MB/s, %.0f rows/sec read and built (%u chunks, last round %.0f%% idle with %u parsers), best of %d.\n",
+				sweepKB[nSize], rate/OneMB, (bestSecs>0 ? nRows/bestSecs : 0.0), nChunks, 100.0*idleShare, nParsers, BENCHMARK_PASSES);
+		WriteResult("{\"run\":\"benchmark\",\"name\":\"chunk_size\",\"file_type\":\"%s\",\"path\":\"%s\",\"chunk_kb\":%u,"
+					"\"huge_pages\":\"%s\",\"bytes\":%zu,\"chunks\":%u,\"rows\":%llu,\"seconds\":%.6f,\"mb_per_sec\":%.1f,\"last_round_idle\":%.3f}",
+					(IPBLOCKS==fileMode ? "blocks" : "locations"), (0==nBuild ? "copy" : "prepared"), sweepKB[nSize], strPages,
+					nBytes, nChunks, (unsigned long long)nRows, bestSecs, rate/OneMB, idleShare);
+	}
+	dprintf(STDOUT_FILENO, "Fastest chunk size read and built on one thread: -B%u.\n", nBestKB);
+}
+
+/*
+ Reads the rows after the header into memory, followed by a '\0' as the last line may not end with a newline.
+ - Returns YES if they could not be read.
+ */
+static BOOL ReadBenchmarkData(char* pFileData, size_t nBytes)
+{
+	size_t nRead = 0;
+	while( nRead<nBytes )
+	{
+		ssize_t nChunk = read(InputFile, pFileData+nRead, nBytes-nRead);
+		if( nChunk<=0 ){
+			perror("Error on reading .csv file.");
+			return YES;
+		}
+		nRead += nChunk;
+	}
+	pFileData[nBytes] = '\0';
+	return NO;
+}
+
+/*
+ Microbenchmarks (-T), single threaded with no database, each the best of BENCHMARK_PASSES
+ over the rows after the header, which are read into memory first.
+ */
+int RunBenchmarks(FILETYPE fileMode)
+{
+	off_t dataStart = lseek(InputFile, 0, SEEK_CUR);
+	size_t nBytes = (size_t)FileBytesRemaining;
+	char* pFileData = (char*)malloc(nBytes+1);
+	char* pParseBuffer = (char*)malloc(nBytes+1);
+	int nResult = PROGRAM_FAILED;
+	if( NULL==pFileData || NULL==pParseBuffer ){
+		dprintf(STDOUT_FILENO, "Failed to allocate %zu bytes for the benchmarks.\n", nBytes);
+	}
+	else if( NO==ReadBenchmarkData(pFileData, nBytes) && NO==CheckTokenizer() && NO==CheckFileRead() )
+	{
+		BenchmarkTokenizer(pFileData, pParseBuffer, nBytes);
+		BenchmarkFileRead(dataStart, nBytes);
+		BenchmarkRowBuilding(fileMode, pFileData, pParseBuffer, nBytes);
+		BenchmarkChunkSizes(fileMode, dataStart, nBytes);
+		nResult = PROGRAM_SUCCESS;
+	}
+	
+	free(pParseBuffer);
+	free(pFileData);
+	return nResult;
+}
+
+/*
+ Appends a line to the --results file, if given. The line is written with one write(),
+ on a file opened for append, so runs writing to the same file do not interleave.
+ - strFormat : printf format of a JSON object; the time is added as its first member.
+ */
+void WriteResult(const char* strFormat, ...)
+{
+	if( '\0'==ResultsFilePath[0] ){ return; }
+	
+	char strLine[2048];
+	time_t now = time(NULL);
+	struct tm nowUtc;
+	gmtime_r(&now, &nowUtc);
+	int nLength = (int)strftime(strLine, sizeof(strLine), "{\"time\":\"%Y-%m-%dT%H:%M:%SZ\",", &nowUtc);
+	
+	// the format's own opening brace is dropped.
+	va_list args;
+	va_start(args, strFormat);
+	int nBody = vsnprintf(strLine + nLength, sizeof(strLine) - nLength, strFormat + 1, args);
+	va_end(args);
+	if( nBody<0 || nLength + nBody + 1>=(int)sizeof(strLine) ){ return; }
+	nLength += nBody;
+	strLine[nLength++] = '\n';
+	
+	int fdResults = open(ResultsFilePath, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if( -1==fdResults )
+	{
+		perror("Failed to open the results file");
+		return;
+	}
+	if( nLength!=write(fdResults, strLine, nLength) ){
+		perror("Failed to write the results file");
+	}
+	close(fdResults);
+}
+
+/*
+ - Returns the value as a quoted JSON string.
+ */
+std::string JsonString(const char* strValue)
+{
+	std::string strJson(1, '"');
+	for( const char* pRead=strValue; '\0'!=*pRead; ++pRead )
+	{
+		switch( *pRead )
+		{
+			case '"':{ strJson += "\\\""; break; }
+			case '\\':{ strJson += "\\\\"; break; }
 			default:
 			{
-				dprintf( STDOUT_FILENO, "Error: Unrecognised option: %s\n\n", strCmd );
-				return Usage();
+				if( (unsigned char)*pRead < 0x20 )
+				{
+					char strEscape[8];
+					snprintf(strEscape, sizeof(strEscape), "\\u%04x", (unsigned char)*pRead);
+					strJson += strEscape;
+				}
+				else{
+					strJson += *pRead;
+				}
+				break;
 			}
 		}
 	}
+	strJson += '"';
+	return strJson;
+}
+
+/*
+ Synthetic rows (--generate), made from the row number so every run writes the same file.
+ Quoted fields with commas and "" escapes, and empty fields, turn up at fixed intervals
+ as they do in the MaxMind files. Locations geoname_ids start at GENERATE_GEONAME_BASE,
+ and the Blocks rows reference the first GENERATE_LOCATIONS_REFERENCED of them.
+ */
+const uint32_t GENERATE_GEONAME_BASE = 1000000;
+
+typedef struct GENERATECOUNTRY {
+	const char* strContinentCode;
+	const char* strContinentName;
+	const char* strIsoCode;
+	const char* strName;		// as written in the file, quoted where it must be
+	const char* strTimeZone;
+} GenerateCountry;
+
+static const GenerateCountry GenerateCountries[] = {
+	{ "EU", "Europe", "GB", "\"United Kingdom\"", "Europe/London" },
+	{ "EU", "Europe", "DE", "Germany", "Europe/Berlin" },
+	{ "NA", "\"North America\"", "US", "\"United States\"", "America/Chicago" },
+	{ "NA", "\"North America\"", "BQ", "\"Bonaire, Sint Eustatius, and Saba\"", "America/Kralendijk" },
+	{ "AS", "Asia", "KR", "\"Korea, Republic of\"", "Asia/Seoul" },
+	{ "AS", "Asia", "SA", "\"Saudi Arabia\"", "Asia/Riyadh" },
+	{ "AF", "Africa", "LY", "Libya", "Africa/Tripoli" },
+	{ "AF", "Africa", "CI", "\"Côte d'Ivoire\"", "Africa/Abidjan" },
+	{ "OC", "Oceania", "AU", "Australia", "Australia/Sydney" },
+	{ "SA", "\"South America\"", "BR", "Brazil", "America/Sao_Paulo" },
+	{ "AF", "Africa", "SH", "\"Saint Helena, Ascension and Tristan da Cunha\"", "Atlantic/St_Helena" },
+};
+static const uint32_t GenerateCountryCount = sizeof(GenerateCountries)/sizeof(GenerateCountries[0]);
+
+static void GenerateLocationRow(uint64_t nRow, std::string& strOut)
+{
+	char strRow[512];
+	const GenerateCountry& country = GenerateCountries[nRow % GenerateCountryCount];
+	uint32_t nRegion = (uint32_t)(nRow % 50);
 	
-	*strFilename = argv[nIdx++]; //assign
+	char strSubdivision1[96] = "";
+	if( 0!=nRow % 4 )
+	{
+		if( 7==nRegion ){
+			snprintf(strSubdivision1, sizeof(strSubdivision1), "S%u,\"Sha'biyat \"\"Banghazi\"\" %u\"", nRegion, nRegion);
+		}else{
+			snprintf(strSubdivision1, sizeof(strSubdivision1), "S%u,Region %u", nRegion, nRegion);
+		}
+	}
+	else{
+		strlcpy(strSubdivision1, ",", sizeof(strSubdivision1));
+	}
 	
-	return 0;
+	char strSubdivision2[96] = ",";
+	if( 0==nRow % 5 && 0!=nRow % 4 ){
+		snprintf(strSubdivision2, sizeof(strSubdivision2), "T%u,\"District %u, North\"", (uint32_t)(nRow % 20), (uint32_t)(nRow % 20));
+	}
+	
+	char strCity[96] = "";
+	if( 0==nRow % 17 ){
+		snprintf(strCity, sizeof(strCity), "\"The \"\"Old\"\" Town %llu\"", (unsigned long long)nRow);
+	}else if( 0==nRow % 3 ){
+		snprintf(strCity, sizeof(strCity), "\"Town %llu, Upper\"", (unsigned long long)nRow);
+	}else if( 0!=nRow % 11 ){
+		snprintf(strCity, sizeof(strCity), "City %llu", (unsigned long long)nRow);
+	}
+	
+	// now and then a row without a country, which is stored against the unknown country.
+	BOOL hasCountry = (0!=nRow % 997) ? YES : NO;
+	snprintf(strRow, sizeof(strRow), "%llu,en,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
+			 (unsigned long long)(GENERATE_GEONAME_BASE + nRow), country.strContinentCode, country.strContinentName,
+			 (YES==hasCountry ? country.strIsoCode : ""), (YES==hasCountry ? country.strName : ""),
+			 strSubdivision1, strSubdivision2, strCity, (0==nRow % 7 ? "501" : ""), country.strTimeZone);
+	strOut += strRow;
+}
+
+/*
+ - nAddress : the network's first address.
+ - nPrefix : its prefix length.
+ */
+static void GenerateBlockRow(uint64_t nRow, uint32_t nAddress, int nPrefix, std::string& strOut)
+{
+	char strRow[256];
+	uint32_t geonameId = GENERATE_GEONAME_BASE + (uint32_t)((nRow * 7919) % GENERATE_LOCATIONS_REFERENCED);
+	uint32_t registeredId = GENERATE_GEONAME_BASE + (uint32_t)(nRow % GenerateCountryCount);
+	
+	// no geoname_id falls back to the registered country; with neither the row is skipped.
+	char strGeonameId[16] = "", strRegisteredId[16] = "", strRepresentedId[16] = "";
+	if( 0!=nRow % 29 ){ snprintf(strGeonameId, sizeof(strGeonameId), "%u", geonameId); }
+	if( 0!=nRow % 997 ){ snprintf(strRegisteredId, sizeof(strRegisteredId), "%u", registeredId); }
+	if( 0==nRow % 53 ){ snprintf(strRepresentedId, sizeof(strRepresentedId), "%u", registeredId); }
+	
+	char strPostalCode[24] = "";
+	if( 0==nRow % 101 ){
+		snprintf(strPostalCode, sizeof(strPostalCode), "\"%u,%03u\"", (uint32_t)(nRow % 100), (uint32_t)(nRow % 1000));
+	}else if( 0!=nRow % 4 ){
+		snprintf(strPostalCode, sizeof(strPostalCode), "AB%u %uCD", (uint32_t)(nRow % 99), (uint32_t)(nRow % 9));
+	}
+	
+	snprintf(strRow, sizeof(strRow), "%u.%u.%u.%u/%d,%s,%s,%s,%u,0,%s,%.4f,%.4f,%u\n",
+			 nAddress >> 24, (nAddress >> 16) & 0xFF, (nAddress >> 8) & 0xFF, nAddress & 0xFF, nPrefix,
+			 strGeonameId, strRegisteredId, strRepresentedId, (0==nRow % 211 ? 1u : 0u), strPostalCode,
+			 (double)(nRow % 18000)/100.0 - 90.0, (double)(nRow % 36000)/100.0 - 180.0, (uint32_t)(1 + nRow % 1000));
+	strOut += strRow;
 }
 
-int Usage()
+/*
+ --generate : writes GenerateRows rows of GenerateFileType, with its header, to the file.
+ The Blocks networks are IPv4, in order from 1.0.0.0, as large as fit (up to /24), with
+ a gap after every 11th.
+ */
+int GenerateFile(const char* strFilename)
 {
-	dprintf( STDOUT_FILENO,
-		"Max Mind GEO IP Data importer.\nPopulates Geo ip tables on Postgres from a .csv file.\n\n" );
+	BOOL isBlocks = (0==strcmp(GenerateFileType, "blocks")) ? YES : NO;
 	
-	dprintf( STDOUT_FILENO,
-		"Options:\n\t-D Specify database name. Host will be localhost and user will be login of user executing the program.\n" );
-	dprintf( STDOUT_FILENO,
-			"\tUse this to connect to your local database server as yourself.\n" );
+	int fdOutput = open(strFilename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if( -1==fdOutput )
+	{
+		perror("Failed to create the file to generate");
+		return PROGRAM_FAILED;
+	}
 	
-	dprintf( STDOUT_FILENO,
-			"\n\t-P[1-999] Specify number of processing threads. Default will be up to 3 if not specified.\n" );
+	uint64_t nFirstAddress = 1ULL << 24;
+	uint64_t nNetworkSize = 256;
+	while( nNetworkSize>1 && (GenerateRows + GenerateRows/11) * nNetworkSize > (1ULL << 32) - nFirstAddress ){
+		nNetworkSize /= 2;
+	}
+	int nPrefix = 32;
+	for( uint64_t nSize=nNetworkSize; nSize>1; nSize/=2 ){ --nPrefix; }
 	
-	dprintf( STDOUT_FILENO,
-			"\n\t-U Specify Postgres connection string OR URL (cannot be used in conjunction with -D).\n" );
-	dprintf( STDOUT_FILENO,
-			"\tConnection string: 'host=localhost port=5432 dbname=mydb connect_timeout=10' \n" );
-	dprintf( STDOUT_FILENO,
-			"\t  * For details see: https://www.postgresql.org/docs/current/static/libpq-connect.html#LIBPQ-PARAMKEYWORDS \n" );
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
 	
-	dprintf( STDOUT_FILENO,
-			"\tOR\n\tConnection URI: 'postgresql://[user[:password]@][netloc][:port][/dbname][?param1=value1&...]' \n\n" );
+	std::string strOut;
+	strOut.reserve(OneMB + 1024);
+	strOut += (YES==isBlocks) ? BlocksHeader : LocationsHeader;
+	strOut += '\n';
 	
-	dprintf( STDOUT_FILENO,
-			"Usage:\tgeoimport -P4 -D [dbname] /file/to/import.csv\n" );
-	dprintf( STDOUT_FILENO,
-			"Usage:\tgeoimport -P4 -U 'host=localhost port=5432 dbname=mydb connect_timeout=10' /file/to/import.csv\n" );
-	dprintf( STDOUT_FILENO,
-			"Usage:\tgeoimport -P4 -U 'postgresql://user@localhost/mydb?connect_timeout=10&application_name=myapp' /file/to/import.csv\n\n" );
+	off_t nTotalBytes = 0;
+	uint64_t nAddress = nFirstAddress;
+	BOOL bDidFail = NO;
+	for( uint64_t nRow=0; nRow<GenerateRows && NO==bDidFail; ++nRow )
+	{
+		if( YES==isBlocks )
+		{
+			GenerateBlockRow(nRow, (uint32_t)nAddress, nPrefix, strOut);
+			nAddress += (0==nRow % 11) ? 2*nNetworkSize : nNetworkSize;
+		}
+		else{
+			GenerateLocationRow(nRow, strOut);
+		}
+		
+		if( strOut.size()>=(size_t)OneMB || nRow+1==GenerateRows )
+		{
+			bDidFail = ((ssize_t)strOut.size()==write(fdOutput, strOut.data(), strOut.size())) ? NO : YES;
+			nTotalBytes += strOut.size();
+			strOut.clear();
+		}
+	}
+	close(fdOutput);
 	
-	return 1;
+	if( YES==bDidFail )
+	{
+		perror("Failed to write the generated file");
+		return PROGRAM_FAILED;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	double elapsedSecs = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec)/1e9;
+	dprintf(STDOUT_FILENO, "Generated %llu %s rows (%.1f MB) in %s in %.2f seconds.\n",
+			(unsigned long long)GenerateRows, GenerateFileType, nTotalBytes/(double)OneMB, strFilename, elapsedSecs);
+	return PROGRAM_SUCCESS;
 }
 
 
-BOOL PostgresConnection::Connect(const char* strDbName)
+/*			Stage metrics (progress line, --metrics)			*/
+
+StageMetrics::StageMetrics() : m_count(0), m_totalNanos(0), m_maxNanos(0)
 {
-	
-	char* errMsg = NULL;
-	PQconninfoOption* cxnInfo = PQconninfoParse( PGConnectionString, &errMsg );
-	PQconninfoFree(cxnInfo);
-	if( NULL!=errMsg )
-	{
-		dprintf( STDOUT_FILENO,
-				 "Error parsing Connection String: %s\n", errMsg );
-		
-		PQfreemem(errMsg);
-		return NO;
+	for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket ){
+		m_buckets[nBucket].store(0, std::memory_order_relaxed);
+	}
+}
+
+/*
+ Only the owning thread records, so the maximum needs no compare and swap.
+ */
+void StageMetrics::Record(uint64_t nNanos)
+{
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_totalNanos.fetch_add(nNanos, std::memory_order_relaxed);
+	if( nNanos > m_maxNanos.load(std::memory_order_relaxed) ){
+		m_maxNanos.store(nNanos, std::memory_order_relaxed);
+	}
+	m_buckets[Bucket(nNanos)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void StageMetrics::AddHistogram(uint64_t* pBuckets) const
+{
+	for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket ){
+		pBuckets[nBucket] += m_buckets[nBucket].load(std::memory_order_relaxed);
 	}
+}
+
+/*
+ - Returns the bucket of a latency: its power of two, and the next two bits for the quarter.
+ */
+int StageMetrics::Bucket(uint64_t nNanos)
+{
+	// below 4ns there are no two bits for the quarter, they share the first bucket.
+	if( nNanos<4 ){ nNanos = 4; }
+	int nMsb = 63 - __builtin_clzll(nNanos);
+	return nMsb*4 + (int)((nNanos >> (nMsb-2)) & 3);
+}
+
+/*
+ - Returns the upper bound of the latencies counted in a bucket.
+ */
+uint64_t StageMetrics::BucketLimit(int nBucket)
+{
+	int nMsb = nBucket/4;
+	if( nMsb>=63 ){ return UINT64_MAX; }
+	return (uint64_t)(5 + nBucket%4) << (nMsb-2);
+}
+
+/*
+ - Returns the latency below which the fraction of the counts fall, to the bucket's bound.
+ */
+static uint64_t HistogramPercentile(const uint64_t* pBuckets, double fraction)
+{
+	uint64_t nTotal = 0;
+	for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket ){ nTotal += pBuckets[nBucket]; }
+	if( 0==nTotal ){ return 0; }
 	
-	PGconn* PqConn = PQconnectdb( PGConnectionString );
-	switch( PQstatus(PqConn) )
+	uint64_t nRank = (uint64_t)(fraction*nTotal + 0.5);
+	if( nRank<1 ){ nRank = 1; }
+	uint64_t nSeen = 0;
+	for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket )
 	{
-		case CONNECTION_OK:
-		case CONNECTION_MADE:
-		case CONNECTION_AUTH_OK:{
-			m_connx = PqConn;
-			return YES;
-		}
-		default:
-		{
-			char errUnk[] = "Unknown error";
-			errMsg = PQerrorMessage( PqConn );
-			if( NULL==errMsg){
-				errMsg = errUnk;
-			}
-			dprintf( STDOUT_FILENO,
-				 "Connection failed: %s\n", errMsg );
-
-			PQfinish(PqConn);
-			PqConn = NULL;
-			return NO;
-		}
+		nSeen += pBuckets[nBucket];
+		if( nSeen>=nRank ){ return StageMetrics::BucketLimit(nBucket); }
 	}
+	return UINT64_MAX;
 }
 
+/*
+ The sum of every stage thread's metrics, read while they run.
+ */
+typedef struct METRICSTOTALS {
+	uint64_t	rows;
+	uint64_t	bytes;
+	uint64_t	count[STAGE_COUNT];
+	uint64_t	nanos[STAGE_COUNT];
+	uint64_t	maxNanos[STAGE_COUNT];
+	uint64_t	buckets[STAGE_COUNT][LATENCY_BUCKETS];
+} MetricsTotals;
 
-/*			Postgres Database		*/
-const char* ADDLOCSql = "SELECT add_geoname_location($1::INT4,$2,$3,$4,$5,$6,$7,$8,$9)";
-const char* ADDGEOIPSql = "SELECT add_geoip($1::inet,$2,$3)";
+static const char* const StageNames[STAGE_COUNT] = { "read", "parse", "statement", "commit" };
 
-/*const int PGPARAM_FORMAT_BIN = 1;
-const int PGPARAM_FORMAT_STR = 0;*/
+static void SumMetrics(MetricsTotals* pTotals)
+{
+	memset(pTotals, 0, sizeof(MetricsTotals));
+	for( uint32_t nWorker=0; nWorker<MetricsCount; ++nWorker )
+	{
+		const WorkerMetrics& worker = Metrics[nWorker];
+		pTotals->rows += worker.rows.load(std::memory_order_relaxed);
+		pTotals->bytes += worker.bytes.load(std::memory_order_relaxed);
+		for( int nStage=0; nStage<STAGE_COUNT; ++nStage )
+		{
+			pTotals->count[nStage] += worker.stages[nStage].Count();
+			pTotals->nanos[nStage] += worker.stages[nStage].TotalNanos();
+			pTotals->maxNanos[nStage] = std::max(pTotals->maxNanos[nStage], worker.stages[nStage].MaxNanos());
+			worker.stages[nStage].AddHistogram(pTotals->buckets[nStage]);
+		}
+	}
+}
 
-typedef enum ADDLOC_PARAMS {
-	p_geoname_id = 0 ,
-	p_continent_code ,
-	p_city_name ,
-	p_iso2_country_code,
-	p_country_name,
-	p_subdivision_1_iso_code,
-	p_subdivision_1_name,
-	p_subdivision_2_iso_code,
-	p_subdivision_2_name,
-	ADDLOC_NUM_PARAMS } ADDLOC_PARAM_ID;
+/*
+ - Returns the share of the time a stage's threads were busy, 0 to 1.
+ */
+static double StageBusy(uint64_t nNanos, uint16_t nThreads, double seconds)
+{
+	return (nThreads>0 && seconds>0) ? nNanos/(nThreads*seconds*1e9) : 0.0;
+}
 
-static int ADDLOCparamLengths[ADDLOC_NUM_PARAMS] = {0};
-static int ADDLOCparamFormats[ADDLOC_NUM_PARAMS] = {0};
+/*
+ - Returns the connections writing: an --async loop's connections each wait on the database
+   as a writer thread does.
+ */
+static uint16_t DatabaseConnections(void)
+{
+	return (AsyncConnections>0) ? AsyncConnections : (uint16_t)ActiveWriters;
+}
 
-typedef enum ADDGEOIP_PARAMS {
-	ADDGEOIP_p_network = 0,
-	ADDGEOIP_p_geoname_id,
-	ADDGEOIP_p_postal_code,
-	ADDGEOIP_NUM_PARAMS }ADDGEOIP_PARAM_ID;
+/*
+ - Returns the busiest stage, the reader, the parsers or the writers (the database),
+   which is the one holding the others back.
+ */
+static const char* BoundBy(const uint64_t* pNanos, double seconds)
+{
+	double readBusy = StageBusy(pNanos[STAGE_READ], 1, seconds);
+	double parseBusy = StageBusy(pNanos[STAGE_PARSE], NumParsers, seconds);
+	double databaseBusy = StageBusy(pNanos[STAGE_STATEMENT] + pNanos[STAGE_COMMIT], DatabaseConnections(), seconds);
+	if( databaseBusy>=readBusy && databaseBusy>=parseBusy ){ return "database"; }
+	return (readBusy>=parseBusy) ? "read" : "parse";
+}
 
-static int ADDGEOIPparamLengths[ADDLOC_NUM_PARAMS] = {0};
-static int ADDGEOIPparamFormats[ADDLOC_NUM_PARAMS] = {0};
+static std::string FormatNanos(uint64_t nNanos)
+{
+	char strTime[32];
+	if( nNanos<1000000 ){ snprintf(strTime, sizeof(strTime), "%.0fus", nNanos/1e3); }
+	else if( nNanos<1000000000 ){ snprintf(strTime, sizeof(strTime), "%.1fms", nNanos/1e6); }
+	else{ snprintf(strTime, sizeof(strTime), "%.2fs", nNanos/1e9); }
+	return std::string(strTime);
+}
 
-BOOL AddIPBlockToDatabase(const char* network,
-						  const char* geoname_id,
-						  const char* postal_code,
-						  PGconn* PqConn)
+/*
+ Prints one line with the rows/sec and MB/sec since the last line, the statement and commit
+ latency percentiles over the same interval, how busy each stage's threads were, and the ETA.
+ The final line is the totals for the whole import instead.
+ */
+void PrintProgress(double elapsedSecs, BOOL isFinal)
 {
-	const char* ADDGEOIPvalues[ADDLOC_NUM_PARAMS];
+	static MetricsTotals previous;
+	static double previousSecs = 0;
+	static MetricsTotals current;
+	static MetricsTotals interval;
+	if( NULL==Metrics ){ return; }
 	
-	ADDGEOIPvalues[ADDGEOIP_p_network] = network;
-	ADDGEOIPvalues[ADDGEOIP_p_geoname_id] = geoname_id;
-	ADDGEOIPvalues[ADDGEOIP_p_postal_code] = postal_code;
+	SumMetrics(&current);
+	const MetricsTotals& shown = (YES==isFinal) ? current : interval;
+	if( NO==isFinal )
+	{
+		interval.rows = current.rows - previous.rows;
+		interval.bytes = current.bytes - previous.bytes;
+		for( int nStage=0; nStage<STAGE_COUNT; ++nStage )
+		{
+			interval.count[nStage] = current.count[nStage] - previous.count[nStage];
+			interval.nanos[nStage] = current.nanos[nStage] - previous.nanos[nStage];
+			for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket ){
+				interval.buckets[nStage][nBucket] = current.buckets[nStage][nBucket] - previous.buckets[nStage][nBucket];
+			}
+		}
+	}
+	double intervalSecs = (YES==isFinal) ? elapsedSecs : elapsedSecs - previousSecs;
+	previous = current;
+	previousSecs = elapsedSecs;
 	
-	BOOL bDidFail;
-	PGresult* pgRes = PQexecParams(PqConn,
-								   ADDGEOIPSql,	//command,
-								   ADDGEOIP_NUM_PARAMS,
-								   NULL,
-								   ADDGEOIPvalues,
-								   ADDGEOIPparamLengths,
-								   ADDGEOIPparamFormats, 0);
+	std::string strLine;
+	char strPart[128];
+	snprintf(strPart, sizeof(strPart), "%s %u:%02u - %llu rows, %.0f rows/s, %.1f MB/s",
+			 (YES==isFinal ? "Total" : "Progress"), (uint32_t)elapsedSecs/60, (uint32_t)elapsedSecs%60,
+			 (unsigned long long)current.rows,
+			 (intervalSecs>0 ? shown.rows/intervalSecs : 0.0), (intervalSecs>0 ? shown.bytes/intervalSecs/OneMB : 0.0));
+	strLine += strPart;
 	
-	ExecStatusType resStatus = PQresultStatus( pgRes );
-	switch( resStatus )
+	for( int nStage=STAGE_STATEMENT; nStage<=STAGE_COMMIT; ++nStage )
 	{
-		case PGRES_EMPTY_QUERY:
-		case PGRES_COMMAND_OK:
-		case PGRES_TUPLES_OK:{
-			bDidFail = NO;
-			break;
-		}
-		case PGRES_BAD_RESPONSE:
-		case PGRES_FATAL_ERROR:{
-			bDidFail = YES;
-			break;
+		if( 0==shown.count[nStage] ){ continue; }
+		strLine += ", ";
+		strLine += StageNames[nStage];
+		strLine += " p50 " + FormatNanos(HistogramPercentile(shown.buckets[nStage], 0.50));
+		strLine += " p99 " + FormatNanos(HistogramPercentile(shown.buckets[nStage], 0.99));
+	}
+	
+	if( intervalSecs>0 )
+	{
+		snprintf(strPart, sizeof(strPart), ", busy read %.0f%% parse %.0f%% db %.0f%% (%s bound)",
+				 100.0*StageBusy(shown.nanos[STAGE_READ], 1, intervalSecs),
+				 100.0*StageBusy(shown.nanos[STAGE_PARSE], NumParsers, intervalSecs),
+				 100.0*StageBusy(shown.nanos[STAGE_STATEMENT] + shown.nanos[STAGE_COMMIT], DatabaseConnections(), intervalSecs),
+				 BoundBy(shown.nanos, intervalSecs));
+		strLine += strPart;
+	}
+	
+	// the size of a compressed file says nothing of how much is left to inflate.
+	// --resume : the chunks skipped are not counted as read.
+	if( NO==isFinal )
+	{
+		off_t nBytesLeft = FileTotalSize - ResumedBytes - (off_t)current.bytes;
+		if( NO==CompressedInput && shown.bytes>0 && nBytesLeft>0 )
+		{
+			uint32_t nEtaSecs = (uint32_t)(nBytesLeft / (shown.bytes/intervalSecs));
+			snprintf(strPart, sizeof(strPart), ", ETA %u:%02u", nEtaSecs/60, nEtaSecs%60);
+			strLine += strPart;
 		}
-		default:{
-			bDidFail = YES;
-			break;
+		else{
+			strLine += ", ETA -";
 		}
 	}
+	dprintf(STDOUT_FILENO, "%s\n", strLine.c_str());
+}
+
+/*
+ Writes the totals, and for each stage its count, time and latency percentiles, as one
+ JSON object, replacing the file.
+ */
+void WriteMetricsReport(const char* strFilename, double elapsedSecs)
+{
+	static MetricsTotals totals;
+	SumMetrics(&totals);
+	
+	std::string strJson;
+	char strPart[512];
+	snprintf(strPart, sizeof(strPart), "{\"file\":%s,\"seconds\":%.3f,\"parsers\":%u,\"writers\":%u,\"connections\":%u,\"rows\":%llu,\"bytes\":%llu,"
+			 "\"rows_per_sec\":%.0f,\"mb_per_sec\":%.2f,\"bound\":\"%s\",\"stages\":{",
+			 JsonString(strFilename).c_str(), elapsedSecs, NumParsers, (uint16_t)ActiveWriters, DatabaseConnections(),
+			 (unsigned long long)totals.rows, (unsigned long long)totals.bytes,
+			 (elapsedSecs>0 ? totals.rows/elapsedSecs : 0.0), (elapsedSecs>0 ? totals.bytes/elapsedSecs/OneMB : 0.0),
+			 BoundBy(totals.nanos, elapsedSecs));
+	strJson += strPart;
+	
+	for( int nStage=0; nStage<STAGE_COUNT; ++nStage )
+	{
+		uint64_t nCount = totals.count[nStage];
+		snprintf(strPart, sizeof(strPart), "%s\"%s\":{\"count\":%llu,\"total_secs\":%.3f,\"mean_us\":%.1f,"
+				 "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+				 (0==nStage ? "" : ","), StageNames[nStage], (unsigned long long)nCount, totals.nanos[nStage]/1e9,
+				 (nCount>0 ? totals.nanos[nStage]/1e3/nCount : 0.0),
+				 std::min(HistogramPercentile(totals.buckets[nStage], 0.50), totals.maxNanos[nStage])/1e3,
+				 std::min(HistogramPercentile(totals.buckets[nStage], 0.90), totals.maxNanos[nStage])/1e3,
+				 std::min(HistogramPercentile(totals.buckets[nStage], 0.99), totals.maxNanos[nStage])/1e3,
+				 totals.maxNanos[nStage]/1e3);
+		strJson += strPart;
+	}
 	
-	if( YES==bDidFail ){
-		const char* strErrMsg = PQresultErrorMessage(pgRes);
-		
-		dprintf(STDOUT_FILENO, "Failed to add Geo IP value (%s) for geoname_id:%s - %s\n",
-				network, geoname_id,strErrMsg);
+	strJson += "},\"workers\":[";
+	for( uint32_t nWorker=0; nWorker<MetricsCount; ++nWorker )
+	{
+		const WorkerMetrics& worker = Metrics[nWorker];
+		snprintf(strPart, sizeof(strPart), "%s{\"role\":\"%s\",\"rows\":%llu,\"bytes\":%llu,\"read_secs\":%.3f,\"parse_secs\":%.3f,\"db_secs\":%.3f}",
+				 (0==nWorker ? "" : ","), worker.strRole,
+				 (unsigned long long)worker.rows.load(std::memory_order_relaxed),
+				 (unsigned long long)worker.bytes.load(std::memory_order_relaxed),
+				 worker.stages[STAGE_READ].TotalNanos()/1e9, worker.stages[STAGE_PARSE].TotalNanos()/1e9,
+				 (worker.stages[STAGE_STATEMENT].TotalNanos() + worker.stages[STAGE_COMMIT].TotalNanos())/1e9);
+		strJson += strPart;
 	}
-	PQclear(pgRes);
+	strJson += "]}\n";
 	
-	return bDidFail;
+	int fdMetrics = open(MetricsFilePath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if( -1==fdMetrics )
+	{
+		perror("Failed to open the metrics file");
+		return;
+	}
+	if( (ssize_t)strJson.size()!=write(fdMetrics, strJson.data(), strJson.size()) ){
+		perror("Failed to write the metrics file");
+	}
+	close(fdMetrics);
 }
 
 
-BOOL AddLocationToDatabase(const char* geoname_id, const char* continent_code, const char* city_name,
-						   const char* country_iso_code, const char* country_name,
-						   const char* subdivision_1_iso_code, const char* subdivision_1_name,
-						   const char* subdivision_2_iso_code, const char* subdivision_2_name,
-						   PGconn* PqConn)
+/*			Connection auto tuning (-P auto)			*/
+
+/*
+ Hill climbing on the rows/sec of each progress interval. From one connection the level
+ doubles while each step raises the rate by AUTO_TUNE_GAIN; the first step that does not
+ is undone. Then one more connection is tried every few intervals (additive increase),
+ and if the rate falls while the database latency rises, as when other sessions contend
+ for locks or WAL, a quarter of the connections are parked (multiplicative decrease).
+ The interval after a change is not measured, the new connections connect and prepare in it.
+ */
+typedef enum AUTOTUNE_STATES { TUNE_MEASURE=0, TUNE_PROBE, TUNE_SETTLED } AUTOTUNE_STATE;
+
+const double AUTO_TUNE_GAIN = 1.05;
+const double AUTO_TUNE_DROP = 0.75;
+const double AUTO_TUNE_LATENCY_RISE = 1.5;
+const uint32_t AUTO_TUNE_PROBE_INTERVALS = 6;
+
+typedef struct AUTOTUNER {
+	AUTOTUNE_STATE	state;
+	BOOL		pastSlowStart;
+	BOOL		skipInterval;
+	uint16_t	baseLevel;		// the level baseRate and baseLatency were measured at
+	double		baseRate;
+	uint64_t	baseLatency;	// p99 of the statements, or the commits when they take longer
+	uint32_t	settledIntervals;
+	double		lastSecs;
+	MetricsTotals previous;
+} AutoTuner;
+
+static AutoTuner Tuner;
+
+/*
+ Called by main() after each progress line.
+ */
+void TuneWriters(double elapsedSecs, dispatch_group_t fileProcGrp, FILETYPE fileMode, const char* strDbName)
 {
-	const char* ADDLOCvalues[ADDLOC_NUM_PARAMS];
-	ADDLOCvalues[p_geoname_id] = geoname_id;
-	ADDLOCvalues[p_continent_code] = continent_code;
-	ADDLOCvalues[p_city_name] = city_name;
-	ADDLOCvalues[p_iso2_country_code] = country_iso_code;
-	ADDLOCvalues[p_country_name] = country_name;
-	ADDLOCvalues[p_subdivision_1_iso_code] = subdivision_1_iso_code;
-	ADDLOCvalues[p_subdivision_1_name] = subdivision_1_name;
-	ADDLOCvalues[p_subdivision_2_iso_code] = subdivision_2_iso_code;
-	ADDLOCvalues[p_subdivision_2_name] = subdivision_2_name;
+	static MetricsTotals current;
+	static uint64_t latencyBuckets[LATENCY_BUCKETS];
+	SumMetrics(&current);
 	
-	BOOL bDidFail;
-	PGresult* pgRes = PQexecParams(PqConn,
-								   ADDLOCSql,	//command,
-								   ADDLOC_NUM_PARAMS,
-								   NULL,
-								   ADDLOCvalues,
-								   ADDLOCparamLengths,
-								   ADDLOCparamFormats, 0);
+	// the writers wait mostly on each statement, or on the COPYs, syncs or commits.
+	int nStage = (current.nanos[STAGE_COMMIT] - Tuner.previous.nanos[STAGE_COMMIT] >=
+				  current.nanos[STAGE_STATEMENT] - Tuner.previous.nanos[STAGE_STATEMENT]) ? STAGE_COMMIT : STAGE_STATEMENT;
+	for( int nBucket=0; nBucket<LATENCY_BUCKETS; ++nBucket ){
+		latencyBuckets[nBucket] = current.buckets[nStage][nBucket] - Tuner.previous.buckets[nStage][nBucket];
+	}
+	uint64_t nLatency = HistogramPercentile(latencyBuckets, 0.99);
+	double intervalSecs = elapsedSecs - Tuner.lastSecs;
+	double rate = (intervalSecs>0) ? (current.rows - Tuner.previous.rows)/intervalSecs : 0.0;
+	Tuner.previous = current;
+	Tuner.lastSecs = elapsedSecs;
 	
-	ExecStatusType resStatus = PQresultStatus( pgRes );
-	switch( resStatus )
+	// the end of the file, or a failure, says nothing of the connections.
+	if( 0==ParsersRunning || YES==AbortProgram || YES==WritersFinished || intervalSecs<=0 ){ return; }
+	if( YES==Tuner.skipInterval )
 	{
-		case PGRES_EMPTY_QUERY:
-		case PGRES_COMMAND_OK:
-		case PGRES_TUPLES_OK:{
-			bDidFail = NO;
-			break;
-		}
-		case PGRES_BAD_RESPONSE:
-		case PGRES_FATAL_ERROR:{
-			bDidFail = YES;
+		Tuner.skipInterval = NO;
+		return;
+	}
+	
+	uint16_t nLevel = ActiveWriters;
+	uint16_t nNewLevel = nLevel;
+	switch( Tuner.state )
+	{
+		case TUNE_MEASURE:
+		case TUNE_PROBE:
+		{
+			if( TUNE_PROBE==Tuner.state && rate < Tuner.baseRate*AUTO_TUNE_GAIN )
+			{
+				nNewLevel = Tuner.baseLevel;
+				Tuner.pastSlowStart = YES;
+				Tuner.state = TUNE_SETTLED;
+				Tuner.settledIntervals = 0;
+				dprintf(STDOUT_FILENO, "-P auto: %u connections gave %.0f rows/s, keeping %u (%.0f rows/s).\n",
+						nLevel, rate, nNewLevel, Tuner.baseRate);
+				break;
+			}
+			
+			if( TUNE_PROBE==Tuner.state ){
+				dprintf(STDOUT_FILENO, "-P auto: %u connections gave %.0f rows/s (%.0f with %u).\n",
+						nLevel, rate, Tuner.baseRate, Tuner.baseLevel);
+			}
+			Tuner.baseLevel = nLevel;
+			Tuner.baseRate = rate;
+			Tuner.baseLatency = nLatency;
+			
+			// after parking some, the level is kept until the next probe.
+			if( NO==Tuner.pastSlowStart ){ nNewLevel = 2*nLevel; }
+			else if( TUNE_PROBE==Tuner.state ){ nNewLevel = nLevel+1; }
+			if( nNewLevel>NumWriters ){ nNewLevel = NumWriters; }
+			Tuner.state = (nNewLevel>nLevel) ? TUNE_PROBE : TUNE_SETTLED;
+			Tuner.settledIntervals = 0;
+			if( TUNE_SETTLED==Tuner.state ){
+				dprintf(STDOUT_FILENO, "-P auto: keeping %u connections (%.0f rows/s).\n", nLevel, rate);
+			}
 			break;
 		}
-		default:{
-			bDidFail = YES;
+		case TUNE_SETTLED:
+		{
+			if( rate < Tuner.baseRate*AUTO_TUNE_DROP && nLatency > Tuner.baseLatency*AUTO_TUNE_LATENCY_RISE )
+			{
+				nNewLevel = nLevel - ((nLevel/4>1) ? nLevel/4 : 1);
+				if( nNewLevel<1 ){ nNewLevel = 1; }
+				Tuner.pastSlowStart = YES;
+				Tuner.state = TUNE_MEASURE;
+				dprintf(STDOUT_FILENO, "-P auto: rows/s fell to %.0f and p99 latency rose to %s, parking %u of %u connections.\n",
+						rate, FormatNanos(nLatency).c_str(), nLevel - nNewLevel, nLevel);
+				break;
+			}
+			
+			if( ++Tuner.settledIntervals>=AUTO_TUNE_PROBE_INTERVALS && nLevel<NumWriters )
+			{
+				Tuner.baseLevel = nLevel;
+				Tuner.baseRate = rate;
+				Tuner.baseLatency = nLatency;
+				nNewLevel = nLevel + 1;
+				Tuner.state = TUNE_PROBE;
+			}
 			break;
 		}
 	}
 	
-	if( YES==bDidFail ){
-		const char* strErrMsg = PQresultErrorMessage(pgRes);
-		
-		dprintf(STDOUT_FILENO, "Failed to add Geoname Location value for geoname_id:%s - %s\n",
-				geoname_id,strErrMsg);
-		
-		dprintf(STDOUT_FILENO,"Values: '%s'\n'%s'\n'%s'\n'%s'\n'%s'\n'%s'\n'%s'\n'%s'\n",
-		continent_code, city_name,
-		 country_iso_code,  country_name,
-		 subdivision_1_iso_code,  subdivision_1_name,
-				subdivision_2_iso_code,  subdivision_2_name );
-		
+	if( nNewLevel!=nLevel )
+	{
+		SetWriterLevel(nNewLevel, fileProcGrp, fileMode, strDbName);
+		Tuner.skipInterval = YES;
 	}
-	PQclear(pgRes);
-	
-	return bDidFail;
 }
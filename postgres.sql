@@ -72,48 +72,116 @@ CREATE TABLE public.geoip
 (
 	network		inet PRIMARY KEY,
 	geoname_id	INT4 NOT NULL,
-	postal_code	VARCHAR(16) NULL
+	postal_code	VARCHAR(16) NULL,
+	ip_range	int8range NULL,		-- IPv4: first and last address as integers
+	ip6_start	bytea NULL,			-- IPv6: first and last address, 16 bytes big endian
+	ip6_end		bytea NULL
 );
 CREATE UNIQUE INDEX idx_netgeo ON geoip(geoname_id,network);
 
+/*	The networks do not overlap, so the network holding an address is the one with the
+	greatest first address <= the address: a btree on the first address finds it with one
+	descent (see geoip_lookup()), where a GiST index on the range would be larger, slower
+	to build and scans more pages per probe.
+*/
+CREATE INDEX idx_geoip_ipv4_start ON geoip(lower(ip_range));
+CREATE INDEX idx_geoip_ipv6_start ON geoip(ip6_start);
+
+/*	geoip's leaf partitions once partition_geoip() has partitioned it, none until then.	*/
+DROP TABLE IF EXISTS public.geoip_partition;
+
+CREATE TABLE public.geoip_partition
+(
+	partition_name	TEXT PRIMARY KEY,
+	first_address	inet NOT NULL		-- up to the next partition's of the same family
+);
+
+/*			-= Import progress =-		*/
+/*	A row per chunk of the file written, updated in the transaction of the chunk's rows:
+	geoimport --resume skips what an interrupted import committed. rows_done counts the
+	rows written or rejected from the chunk's first, for a chunk split by -R or -Q.
+*/
+DROP TABLE IF EXISTS public.geoimport_progress;
+
+CREATE TABLE public.geoimport_progress
+(
+	file_name	TEXT NOT NULL,
+	file_size	INT8 NOT NULL,		-- with file_mtime, checks a resumed file is the same one
+	file_mtime	INT8 NOT NULL,
+	chunk_start	INT8 NOT NULL,		-- the chunk's byte range in the file (inflated, for a .zip or .gz)
+	chunk_end	INT8 NOT NULL,
+	rows_done	INT4 NOT NULL,
+	is_complete	BOOLEAN NOT NULL,
+
+	PRIMARY KEY(file_name,chunk_start)
+);
+
+/*			-= Delta import =-		*/
+/*	The locations a Locations --delta removed while geoip still referenced them. They are
+	deleted by the next Blocks --delta, once the networks referencing them are gone.
+*/
+DROP TABLE IF EXISTS public.geoname_location_retired;
+
+CREATE TABLE public.geoname_location_retired
+(
+	geoname_id	INT4 PRIMARY KEY
+);
+
 /*		Views			*/
 
-DROP VIEW IF EXISTS public.GeonameLocation;
-
-CREATE VIEW GeonameLocation AS		
-SELECT	loc.geoname_id, 
-		loc.continent_code, 
-		loc.country_iso_code, 
-		cc.name, 
-		sub1.iso_code as subdivision1_code, 
-		sub1.name as subdivision1,
-		sub2.iso_code as subdivision2_code, 
-		sub2.name as subdivision2, 
-		loc.city_name 
-FROM geoname_location loc 
- INNER JOIN country cc
-  ON loc.country_iso_code = cc.iso2_code
- LEFT OUTER JOIN subdivision_1 sub1
-  ON loc.country_iso_code = sub1.iso2_country_code
-  AND loc.subdivision1_iso_code = sub1.iso_code
- LEFT OUTER JOIN subdivision_2 sub2
-  ON sub1.iso2_country_code = sub2.iso2_country_code
-	AND sub1.iso_code = sub2.subdivision1_iso_code
-	AND loc.subdivision2_iso_code = sub2.iso_code;
-
-DROP VIEW IF EXISTS public.GeoipNetwork;
-
-CREATE VIEW public.GeoipNetwork AS
-SELECT ip.network,ip.postal_code, loc.* 
-FROM geoip ip
- INNER JOIN GeonameLocation loc
-  ON ip.geoname_id = loc.geoname_id;
+/*	Recreated by swap_staged_load(), as views follow the table they were created on.	*/
+CREATE OR REPLACE
+FUNCTION create_geoip_views()
+RETURNS INT4 AS $$
+BEGIN
+	DROP VIEW IF EXISTS public.GeoipNetwork;
+	DROP VIEW IF EXISTS public.GeonameLocation;
+	
+	CREATE VIEW public.GeonameLocation AS		
+	SELECT	loc.geoname_id, 
+			loc.continent_code, 
+			loc.country_iso_code, 
+			cc.name, 
+			sub1.iso_code as subdivision1_code, 
+			sub1.name as subdivision1,
+			sub2.iso_code as subdivision2_code, 
+			sub2.name as subdivision2, 
+			loc.city_name 
+	FROM public.geoname_location loc 
+	 INNER JOIN public.country cc
+	  ON loc.country_iso_code = cc.iso2_code
+	 LEFT OUTER JOIN public.subdivision_1 sub1
+	  ON loc.country_iso_code = sub1.iso2_country_code
+	  AND loc.subdivision1_iso_code = sub1.iso_code
+	 LEFT OUTER JOIN public.subdivision_2 sub2
+	  ON sub1.iso2_country_code = sub2.iso2_country_code
+		AND sub1.iso_code = sub2.subdivision1_iso_code
+		AND loc.subdivision2_iso_code = sub2.iso_code;
+	
+	CREATE VIEW public.GeoipNetwork AS
+	SELECT ip.network,ip.postal_code, loc.* 
+	FROM public.geoip ip
+	 INNER JOIN public.GeonameLocation loc
+	  ON ip.geoname_id = loc.geoname_id;
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+SELECT create_geoip_views();
 
 /*		Functions		*/
+DROP FUNCTION IF EXISTS add_geoip(inet, INT4, VARCHAR);
+
+-- For loading rows by hand: geoimport checks the geoname_ids itself and inserts into geoip.
+
 CREATE OR REPLACE
 FUNCTION add_geoip( p_network		inet,
 					p_geoname_id	INT4,
-					p_postal_code	VARCHAR(16) )
+					p_postal_code	VARCHAR(16),
+					p_ip_range		int8range,
+					p_ip6_start		bytea,
+					p_ip6_end		bytea )
 RETURNS INT4 AS $$
 DECLARE
 	p_current inet;
@@ -132,8 +200,8 @@ BEGIN
 		RAISE EXCEPTION 'Geoname Id Not Found';
 	END IF;
 
-	INSERT INTO geoip (network,geoname_id,postal_code) 
-	VALUES (p_network,p_geoname_id,p_postal_code);
+	INSERT INTO geoip (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end) 
+	VALUES (p_network,p_geoname_id,p_postal_code,p_ip_range,p_ip6_start,p_ip6_end);
 
 RETURN 0;
 END
@@ -260,3 +328,568 @@ END
 $$ LANGUAGE plpgsql;
 
 
+/*	-- Bulk load (geoimport -C)
+	Each geoimport connection COPYs a chunk of Locations rows into its own session temp
+	table (geoname_location_load) and then calls the merge function in the same transaction.
+	Blocks rows are copied straight into geoip: geoimport loads the geoname_ids once and
+	rejects the rows whose id is not a location as it parses them.
+*/
+DROP FUNCTION IF EXISTS merge_geoip_load();
+
+CREATE OR REPLACE
+FUNCTION merge_geoname_location_load()
+RETURNS INT4 AS $$
+DECLARE
+	p_count INT4;
+BEGIN
+	-- geoimport adds the distinct country and subdivision rows itself, once per import.
+	INSERT INTO geoname_location (
+		geoname_id,
+		continent_code,
+		country_iso_code,
+		subdivision1_iso_code,
+		subdivision2_iso_code,
+		city_name )
+	SELECT	DISTINCT ON (geoname_id)
+			geoname_id,
+			continent_code,
+			country_iso_code,
+			subdivision_1_iso_code,
+			subdivision_2_iso_code,
+			city_name
+	FROM	geoname_location_load
+	ORDER BY geoname_id
+	ON CONFLICT DO NOTHING;
+	GET DIAGNOSTICS p_count = ROW_COUNT;
+
+RETURN p_count;
+END
+$$ LANGUAGE plpgsql;
+
+
+/*	-- Staged load (geoimport --swap)
+	geoimport loads UNLOGGED copies of the tables, with no indexes, in the
+	geoimport_staging schema (first on its connections' search_path). Then
+	index_staged_load() makes them LOGGED and builds their indexes with parallel
+	maintenance workers, and swap_staged_load() replaces the public tables in one
+	transaction; readers see the old tables until it commits.
+	Requires Postgres 11 or later.
+*/
+CREATE SCHEMA IF NOT EXISTS geoimport_staging;
+
+CREATE OR REPLACE
+FUNCTION staged_load_tables( p_file_type VARCHAR(16) )
+RETURNS TEXT[] AS $$
+BEGIN
+	IF p_file_type = 'blocks' THEN
+		RETURN ARRAY['geoip'];
+	END IF;
+	
+	RETURN ARRAY['geoname_location','country','subdivision_1','subdivision_2'];
+END
+$$ LANGUAGE plpgsql IMMUTABLE;
+
+
+CREATE OR REPLACE
+FUNCTION begin_staged_load( p_file_type VARCHAR(16) )
+RETURNS INT4 AS $$
+DECLARE
+	p_table TEXT;
+BEGIN
+	-- the staged copy is a plain table, swapping it in would undo partition_geoip().
+	IF p_file_type = 'blocks' AND EXISTS (SELECT 1 FROM public.geoip_partition) THEN
+		RAISE EXCEPTION 'geoip is partitioned, load it with geoimport --partitioned';
+	END IF;
+	
+	-- the staging schema is first on the search_path, so a table left by a failed load of
+	-- the other kind would shadow its public table (a Blocks load would check geoname_ids
+	-- against a stale geoname_location). One staged load at a time.
+	FOREACH p_table IN ARRAY staged_load_tables('blocks') || staged_load_tables('locations') LOOP
+		EXECUTE format('DROP TABLE IF EXISTS geoimport_staging.%I', p_table);
+	END LOOP;
+	
+	FOREACH p_table IN ARRAY staged_load_tables(p_file_type) LOOP
+		EXECUTE format('CREATE UNLOGGED TABLE geoimport_staging.%I (LIKE public.%I INCLUDING DEFAULTS)',
+					   p_table, p_table);
+	END LOOP;
+	
+	-- the Locations rows are added ON CONFLICT DO NOTHING, which needs their keys from the
+	-- start; the tables are small, only geoip's indexes are worth deferring.
+	IF p_file_type <> 'blocks' THEN
+		ALTER TABLE geoimport_staging.geoname_location ADD PRIMARY KEY (geoname_id);
+		ALTER TABLE geoimport_staging.country ADD PRIMARY KEY (iso2_code);
+		ALTER TABLE geoimport_staging.subdivision_1 ADD PRIMARY KEY (iso2_country_code,iso_code);
+		ALTER TABLE geoimport_staging.subdivision_2 ADD PRIMARY KEY (iso2_country_code,subdivision1_iso_code,iso_code);
+	END IF;
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE
+FUNCTION index_staged_load( p_file_type VARCHAR(16), p_workers INT4 )
+RETURNS INT4 AS $$
+DECLARE
+	p_table TEXT;
+BEGIN
+	PERFORM set_config('max_parallel_maintenance_workers', p_workers::TEXT, true);
+	
+	-- logged before indexing, so SET LOGGED does not rewrite the indexes as well.
+	FOREACH p_table IN ARRAY staged_load_tables(p_file_type) LOOP
+		EXECUTE format('ALTER TABLE geoimport_staging.%I SET LOGGED', p_table);
+	END LOOP;
+	
+	-- the Locations tables have had their keys since begin_staged_load().
+	IF p_file_type = 'blocks' THEN
+		ALTER TABLE geoimport_staging.geoip ADD PRIMARY KEY (network);
+		CREATE UNIQUE INDEX idx_netgeo ON geoimport_staging.geoip(geoname_id,network);
+		CREATE INDEX idx_geoip_ipv4_start ON geoimport_staging.geoip(lower(ip_range));
+		CREATE INDEX idx_geoip_ipv6_start ON geoimport_staging.geoip(ip6_start);
+	END IF;
+	
+	FOREACH p_table IN ARRAY staged_load_tables(p_file_type) LOOP
+		EXECUTE format('ANALYZE geoimport_staging.%I', p_table);
+	END LOOP;
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE
+FUNCTION swap_staged_load( p_file_type VARCHAR(16) )
+RETURNS INT4 AS $$
+DECLARE
+	p_table TEXT;
+BEGIN
+	FOREACH p_table IN ARRAY staged_load_tables(p_file_type) LOOP
+		EXECUTE format('DROP TABLE IF EXISTS public.%I CASCADE', p_table);
+		EXECUTE format('ALTER TABLE geoimport_staging.%I SET SCHEMA public', p_table);
+	END LOOP;
+	
+	-- the swapped in Locations are a whole release, none are retired from it
+	IF p_file_type <> 'blocks' THEN
+		DELETE FROM geoname_location_retired;
+	END IF;
+	
+	PERFORM create_geoip_views();
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+/*	-- Delta import (geoimport --delta)
+	geoimport loads a new release into geoip_delta / geoname_location_delta, then
+	apply_delta() compares it with the live table and only inserts, updates and
+	deletes the rows that differ, in one transaction.
+	The countries and subdivisions are added by geoimport as for a full import, before it.
+	Locations and Blocks are applied by separate runs, Locations first. So geoip never holds
+	a geoname_id that geoname_location does not, a removed location still referenced by a
+	network is kept in geoname_location_retired, and deleted by the Blocks delta.
+*/
+CREATE OR REPLACE
+FUNCTION begin_delta_load( p_file_type VARCHAR(16) )
+RETURNS INT4 AS $$
+BEGIN
+	IF p_file_type = 'blocks' THEN
+		DROP TABLE IF EXISTS public.geoip_delta;
+		CREATE UNLOGGED TABLE public.geoip_delta
+		(
+			network		inet,
+			geoname_id	INT4,
+			postal_code	VARCHAR(16),
+			ip_range	int8range,
+			ip6_start	bytea,
+			ip6_end		bytea
+		);
+	ELSE
+		-- column order matches the COPY rows, as geoname_location_load.
+		DROP TABLE IF EXISTS public.geoname_location_delta;
+		CREATE UNLOGGED TABLE public.geoname_location_delta
+		(
+			geoname_id				INT4,
+			continent_code			CHAR(2),
+			city_name				VARCHAR(256),
+			country_iso_code		CHAR(2),
+			subdivision_1_iso_code	VARCHAR(8),
+			subdivision_2_iso_code	VARCHAR(8)
+		);
+	END IF;
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE
+FUNCTION apply_delta( p_file_type VARCHAR(16),
+					  OUT added INT8,
+					  OUT changed INT8,
+					  OUT removed INT8 )
+AS $$
+DECLARE
+	p_missing_id INT4;
+	p_retired INT8;
+BEGIN
+	IF p_file_type = 'blocks' THEN
+		ANALYZE geoip_delta;
+		
+		-- Ensure every geoname_id exists, and is in the release's Locations
+		SELECT	d.geoname_id INTO p_missing_id
+		FROM	geoip_delta d
+		WHERE	NOT EXISTS (SELECT geoname_id FROM geoname_location WHERE geoname_id=d.geoname_id)
+		OR		EXISTS (SELECT geoname_id FROM geoname_location_retired WHERE geoname_id=d.geoname_id)
+		LIMIT 1;
+		IF p_missing_id IS NOT NULL THEN
+			RAISE EXCEPTION 'Geoname Id Not Found: %', p_missing_id;
+		END IF;
+		
+		DELETE FROM geoip g
+		WHERE NOT EXISTS (SELECT 1 FROM geoip_delta d WHERE d.network = g.network);
+		GET DIAGNOSTICS removed = ROW_COUNT;
+		
+		UPDATE	geoip g
+		SET		geoname_id = d.geoname_id,
+				postal_code = d.postal_code,
+				ip_range = d.ip_range,
+				ip6_start = d.ip6_start,
+				ip6_end = d.ip6_end
+		FROM	geoip_delta d
+		WHERE	d.network = g.network
+		AND		(g.geoname_id, g.postal_code, g.ip_range, g.ip6_start, g.ip6_end)
+				IS DISTINCT FROM
+				(d.geoname_id, d.postal_code, d.ip_range, d.ip6_start, d.ip6_end);
+		GET DIAGNOSTICS changed = ROW_COUNT;
+		
+		INSERT INTO geoip (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end)
+		SELECT	d.network, d.geoname_id, d.postal_code, d.ip_range, d.ip6_start, d.ip6_end
+		FROM	geoip_delta d
+		WHERE	NOT EXISTS (SELECT 1 FROM geoip g WHERE g.network = d.network);
+		GET DIAGNOSTICS added = ROW_COUNT;
+		
+		-- no network references the retired locations now
+		DELETE FROM geoname_location l
+		USING	geoname_location_retired r
+		WHERE	r.geoname_id = l.geoname_id;
+		DELETE FROM geoname_location_retired;
+		
+		DROP TABLE geoip_delta;
+	ELSE
+		ANALYZE geoname_location_delta;
+		
+		-- the networks still referencing a removed location go with the Blocks delta, and it with them
+		DELETE FROM geoname_location_retired;
+		INSERT INTO geoname_location_retired (geoname_id)
+		SELECT	l.geoname_id
+		FROM	geoname_location l
+		WHERE	NOT EXISTS (SELECT 1 FROM geoname_location_delta d WHERE d.geoname_id = l.geoname_id)
+		AND		EXISTS (SELECT 1 FROM geoip g WHERE g.geoname_id = l.geoname_id);
+		GET DIAGNOSTICS p_retired = ROW_COUNT;
+		
+		DELETE FROM geoname_location l
+		WHERE NOT EXISTS (SELECT 1 FROM geoname_location_delta d WHERE d.geoname_id = l.geoname_id)
+		AND NOT EXISTS (SELECT 1 FROM geoname_location_retired r WHERE r.geoname_id = l.geoname_id);
+		GET DIAGNOSTICS removed = ROW_COUNT;
+		removed := removed + p_retired;
+		
+		UPDATE	geoname_location l
+		SET		continent_code = d.continent_code,
+				country_iso_code = d.country_iso_code,
+				subdivision1_iso_code = d.subdivision_1_iso_code,
+				subdivision2_iso_code = d.subdivision_2_iso_code,
+				city_name = d.city_name
+		FROM	(SELECT DISTINCT ON (geoname_id) * FROM geoname_location_delta ORDER BY geoname_id) d
+		WHERE	d.geoname_id = l.geoname_id
+		AND		(l.continent_code, l.country_iso_code, l.subdivision1_iso_code, l.subdivision2_iso_code, l.city_name)
+				IS DISTINCT FROM
+				(d.continent_code, d.country_iso_code, d.subdivision_1_iso_code, d.subdivision_2_iso_code, d.city_name);
+		GET DIAGNOSTICS changed = ROW_COUNT;
+		
+		INSERT INTO geoname_location (
+			geoname_id,
+			continent_code,
+			country_iso_code,
+			subdivision1_iso_code,
+			subdivision2_iso_code,
+			city_name )
+		SELECT	DISTINCT ON (geoname_id)
+				geoname_id,
+				continent_code,
+				country_iso_code,
+				subdivision_1_iso_code,
+				subdivision_2_iso_code,
+				city_name
+		FROM	geoname_location_delta d
+		WHERE	NOT EXISTS (SELECT 1 FROM geoname_location l WHERE l.geoname_id = d.geoname_id)
+		ORDER BY geoname_id;
+		GET DIAGNOSTICS added = ROW_COUNT;
+		
+		DROP TABLE geoname_location_delta;
+	END IF;
+END
+$$ LANGUAGE plpgsql;
+
+
+/*	-- Extended Blocks (geoimport --extended)
+	The Blocks columns the basic schema skips, for distance and proxy checks. geoimport
+	calls begin_extended_load() first, which adds them to geoip if it does not have them
+	yet (a catalog change only, the rows are not rewritten); --swap stages them too.
+	The values are parsed by geoimport and sent in binary, so the server converts no text:
+	a prepared INSERT per row, or a binary COPY into geoip with -C. add_geoip_extended() is
+	kept for loading rows by hand; it checks the geoname_id itself.
+	--delta compares the basic columns only, so it is not used with --extended.
+*/
+CREATE OR REPLACE
+FUNCTION begin_extended_load( p_file_type VARCHAR(16) )
+RETURNS INT4 AS $$
+BEGIN
+	IF p_file_type <> 'blocks' OR EXISTS (SELECT 1 FROM information_schema.columns
+										  WHERE table_schema = 'public' AND table_name = 'geoip'
+										  AND column_name = 'accuracy_radius') THEN
+		RETURN 0;
+	END IF;
+	
+	ALTER TABLE public.geoip
+		ADD COLUMN IF NOT EXISTS registered_country_geoname_id INT4 NULL,
+		ADD COLUMN IF NOT EXISTS represented_country_geoname_id INT4 NULL,
+		ADD COLUMN IF NOT EXISTS is_anonymous_proxy BOOLEAN NULL,
+		ADD COLUMN IF NOT EXISTS is_satellite_provider BOOLEAN NULL,
+		ADD COLUMN IF NOT EXISTS latitude FLOAT8 NULL,
+		ADD COLUMN IF NOT EXISTS longitude FLOAT8 NULL,
+		ADD COLUMN IF NOT EXISTS accuracy_radius INT4 NULL;		-- km
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+CREATE OR REPLACE
+FUNCTION add_geoip_extended( p_network		inet,
+							 p_geoname_id	INT4,
+							 p_postal_code	VARCHAR(16),
+							 p_ip_range		int8range,
+							 p_ip6_start	bytea,
+							 p_ip6_end		bytea,
+							 p_registered_country_geoname_id	INT4,
+							 p_represented_country_geoname_id	INT4,
+							 p_is_anonymous_proxy		BOOLEAN,
+							 p_is_satellite_provider	BOOLEAN,
+							 p_latitude			FLOAT8,
+							 p_longitude		FLOAT8,
+							 p_accuracy_radius	INT4 )
+RETURNS INT4 AS $$
+BEGIN
+	-- Ensure geoname_id exists
+	IF NOT EXISTS (SELECT geoname_id FROM geoname_location WHERE geoname_id=p_geoname_id) THEN
+		RAISE EXCEPTION 'Geoname Id Not Found';
+	END IF;
+
+	INSERT INTO geoip (network,geoname_id,postal_code,ip_range,ip6_start,ip6_end,
+					   registered_country_geoname_id,represented_country_geoname_id,
+					   is_anonymous_proxy,is_satellite_provider,latitude,longitude,accuracy_radius)
+	VALUES (p_network,p_geoname_id,p_postal_code,p_ip_range,p_ip6_start,p_ip6_end,
+			p_registered_country_geoname_id,p_represented_country_geoname_id,
+			p_is_anonymous_proxy,p_is_satellite_provider,p_latitude,p_longitude,p_accuracy_radius);
+
+RETURN 0;
+END
+$$ LANGUAGE plpgsql;
+
+
+DROP FUNCTION IF EXISTS merge_geoip_extended_load();
+
+
+/*	-- Release (geoimport --release)
+	geoimport imports a release directory's Locations and Blocks files in one run, through
+	the same connections, so the Blocks rows are written into geoip unchecked, in any order
+	with the locations they reference. validate_release_load() then checks them once, with
+	one anti-join rather than a lookup per row, removing and returning those whose geoname_id
+	is not a location; geoimport writes them to its Blocks reject file.
+*/
+CREATE OR REPLACE
+FUNCTION validate_release_load()
+RETURNS TABLE ( network		inet,
+				geoname_id	INT4,
+				postal_code	VARCHAR(16) ) AS $$
+BEGIN
+	RETURN QUERY
+	DELETE FROM	geoip ip
+	WHERE	NOT EXISTS (SELECT 1 FROM geoname_location loc WHERE loc.geoname_id=ip.geoname_id)
+	RETURNING ip.network, ip.geoname_id, ip.postal_code;
+END
+$$ LANGUAGE plpgsql;
+
+
+/*	-- Partitioned geoip (geoimport --partitioned)
+	partition_geoip() recreates geoip partitioned by address, keeping its rows: the IPv4
+	networks by ranges of their first octet, on ip_range, into p_parts partitions, and the
+	IPv6 networks (ip_range NULL, so in the default partition) by ranges of their first 16
+	bits within 2000::/3, on ip6_start, into p_parts more. geoip_partition lists them.
+	Each partition has its own primary key and idx_netgeo, as a partitioned table's unique
+	indexes must hold the partition key; the key is derived from the network, so a network
+	is still unique in geoip. The first address indexes are geoip's, one per partition.
+	geoimport --partitioned copies each row straight into its partition, each connection
+	filling its own run of them in network order, so every index is appended to by one
+	connection and stays small enough to stay cached; each can be rebuilt on its own, e.g.
+	REINDEX TABLE geoip_ipv4_016, from as many sessions at once as there are cores.
+	A lookup probes each partition's index of the family, in one plan.
+	Requires Postgres 11 or later.
+*/
+CREATE OR REPLACE
+FUNCTION partition_geoip( p_parts INT4 DEFAULT 16 )
+RETURNS INT4 AS $$
+DECLARE
+	p_part		INT4;
+	p_first		INT8;
+	p_next		INT8;
+	p_name		TEXT;
+	p_from		TEXT;
+	p_to		TEXT;
+BEGIN
+	IF p_parts < 1 OR p_parts > 256 THEN
+		RAISE EXCEPTION 'p_parts must be 1 to 256';
+	END IF;
+	
+	-- the rows are set aside, so the new partitions can take the names of the old ones.
+	DROP TABLE IF EXISTS public.geoip_partitioned;
+	CREATE TABLE public.geoip_partitioned (LIKE public.geoip INCLUDING DEFAULTS) PARTITION BY RANGE (ip_range);
+	CREATE TEMP TABLE geoip_rows ON COMMIT DROP AS SELECT * FROM public.geoip;
+	DROP TABLE public.geoip CASCADE;
+	ALTER TABLE public.geoip_partitioned RENAME TO geoip;
+	DELETE FROM public.geoip_partition;
+	
+	FOR p_part IN 0 .. p_parts-1 LOOP
+		p_first := (256 * p_part / p_parts)::INT8 << 24;
+		p_next := (256 * (p_part+1) / p_parts)::INT8 << 24;
+		p_name := format('geoip_ipv4_%s', lpad((p_first >> 24)::TEXT, 3, '0'));
+		p_from := CASE WHEN p_part = 0 THEN 'MINVALUE' ELSE quote_literal(int8range(p_first, p_first, '[]')) END;
+		p_to := CASE WHEN p_part = p_parts-1 THEN 'MAXVALUE' ELSE quote_literal(int8range(p_next, p_next, '[]')) END;
+		EXECUTE format('CREATE TABLE public.%I PARTITION OF public.geoip FOR VALUES FROM (%s) TO (%s)',
+					   p_name, p_from, p_to);
+		INSERT INTO public.geoip_partition VALUES (p_name, '0.0.0.0'::inet + p_first);
+	END LOOP;
+	
+	CREATE TABLE public.geoip_ipv6 PARTITION OF public.geoip DEFAULT PARTITION BY RANGE (ip6_start);
+	FOR p_part IN 0 .. p_parts-1 LOOP
+		-- 8192 is 0x2000: 2000::/3 in the first 16 bits.
+		p_first := 8192 + 8192 * p_part / p_parts;
+		p_next := 8192 + 8192 * (p_part+1) / p_parts;
+		p_name := format('geoip_ipv6_%s', lpad(to_hex(p_first), 4, '0'));
+		p_from := CASE WHEN p_part = 0 THEN 'MINVALUE' ELSE quote_literal(decode(lpad(to_hex(p_first), 4, '0'), 'hex')) END;
+		p_to := CASE WHEN p_part = p_parts-1 THEN 'MAXVALUE' ELSE quote_literal(decode(lpad(to_hex(p_next), 4, '0'), 'hex')) END;
+		EXECUTE format('CREATE TABLE public.%I PARTITION OF public.geoip_ipv6 FOR VALUES FROM (%s) TO (%s)',
+					   p_name, p_from, p_to);
+		INSERT INTO public.geoip_partition
+		VALUES (p_name, CASE WHEN p_part = 0 THEN '::'::inet ELSE (to_hex(p_first) || '::')::inet END);
+	END LOOP;
+	
+	-- indexed once the rows are in, each partition's in one pass.
+	INSERT INTO public.geoip SELECT * FROM geoip_rows;
+	
+	FOR p_name IN SELECT partition_name FROM public.geoip_partition LOOP
+		EXECUTE format('ALTER TABLE public.%I ADD PRIMARY KEY (network)', p_name);
+		EXECUTE format('CREATE UNIQUE INDEX %I ON public.%I (geoname_id,network)', p_name || '_netgeo', p_name);
+	END LOOP;
+	CREATE INDEX idx_geoip_ipv4_start ON public.geoip(lower(ip_range));
+	CREATE INDEX idx_geoip_ipv6_start ON public.geoip(ip6_start);
+	ANALYZE public.geoip;
+	
+	PERFORM create_geoip_views();
+
+RETURN 2 * p_parts;
+END
+$$ LANGUAGE plpgsql;
+
+
+/*	-- Lookup
+	The location of an address, e.g. SELECT * FROM geoip_lookup('81.2.69.160');
+	Probes the first address indexes for the last network starting at or before the
+	address, and returns it if it holds the address. No row if no network does.
+*/
+CREATE OR REPLACE
+FUNCTION geoip_lookup( p_address inet )
+RETURNS TABLE ( network				inet,
+				postal_code			VARCHAR(16),
+				geoname_id			INT4,
+				continent_code		CHAR(2),
+				country_iso_code	CHAR(2),
+				name				VARCHAR(128),
+				subdivision1_code	VARCHAR(8),
+				subdivision1		VARCHAR(128),
+				subdivision2_code	VARCHAR(8),
+				subdivision2		VARCHAR(128),
+				city_name			VARCHAR(256) ) AS $$
+	SELECT	ip.network, ip.postal_code, loc.*
+	FROM	(	(SELECT	g.network, g.postal_code, g.geoname_id
+				 FROM	public.geoip g
+				 WHERE	family($1) = 4
+				 AND	lower(g.ip_range) <= ($1 - '0.0.0.0'::inet)
+				 ORDER BY lower(g.ip_range) DESC
+				 LIMIT 1)
+			UNION ALL
+				(SELECT	g.network, g.postal_code, g.geoname_id
+				 FROM	public.geoip g
+				 WHERE	family($1) = 6
+				 AND	g.ip6_start <= substring(inet_send($1) from 5)
+				 ORDER BY g.ip6_start DESC
+				 LIMIT 1) ) ip
+	 INNER JOIN public.GeonameLocation loc
+	  ON ip.geoname_id = loc.geoname_id
+	WHERE	ip.network >>= $1;
+$$ LANGUAGE sql STABLE;
+
+
+/*	Times p_count random IPv4 lookups through geoip_lookup(), and p_scan_count through
+	the GeoipNetwork view with network >>= address, which cannot use an index and reads
+	the whole table each time (keep it small).
+	SELECT * FROM geoip_lookup_benchmark(100000);
+*/
+CREATE OR REPLACE
+FUNCTION geoip_lookup_benchmark( p_count INT4, p_scan_count INT4 DEFAULT 20 )
+RETURNS TABLE ( method			TEXT,
+				lookups			INT4,
+				matched			INT4,
+				seconds			FLOAT8,
+				lookups_per_sec	FLOAT8 ) AS $$
+DECLARE
+	p_address inet;
+	p_matched INT4;
+	p_start TIMESTAMPTZ;
+BEGIN
+	CREATE TEMP TABLE IF NOT EXISTS geoip_benchmark_address (address inet) ON COMMIT DROP;
+	TRUNCATE geoip_benchmark_address;
+	INSERT INTO geoip_benchmark_address
+	SELECT	'0.0.0.0'::inet + floor(random() * 4294967296)::INT8
+	FROM	generate_series(1, GREATEST(p_count, p_scan_count));
+	
+	p_matched := 0;
+	p_start := clock_timestamp();
+	FOR p_address IN SELECT address FROM geoip_benchmark_address LIMIT p_count LOOP
+		IF EXISTS (SELECT 1 FROM geoip_lookup(p_address)) THEN
+			p_matched := p_matched + 1;
+		END IF;
+	END LOOP;
+	method := 'geoip_lookup';
+	lookups := p_count;
+	matched := p_matched;
+	seconds := extract(epoch FROM clock_timestamp() - p_start);
+	lookups_per_sec := p_count / NULLIF(seconds, 0);
+	RETURN NEXT;
+	
+	p_matched := 0;
+	p_start := clock_timestamp();
+	FOR p_address IN SELECT address FROM geoip_benchmark_address LIMIT p_scan_count LOOP
+		IF EXISTS (SELECT 1 FROM public.GeoipNetwork v WHERE v.network >>= p_address) THEN
+			p_matched := p_matched + 1;
+		END IF;
+	END LOOP;
+	method := 'network >>= scan';
+	lookups := p_scan_count;
+	matched := p_matched;
+	seconds := extract(epoch FROM clock_timestamp() - p_start);
+	lookups_per_sec := p_scan_count / NULLIF(seconds, 0);
+	RETURN NEXT;
+END
+$$ LANGUAGE plpgsql;